@@ -47,6 +47,7 @@ extern int _ParseRTF (const char *f, char *outBuf);
 
 - (id) initWithRTF:(NSData *)data documentAttributes:(NSDictionary **)dict
 {
+	NSString *s;
 	char *buf;
 	int rc, len;
 
@@ -58,17 +59,18 @@ extern int _ParseRTF (const char *f, char *outBuf);
 	if ((rc = _ParseRTF([data bytes], buf)) != 0)	// ecOK
 		NSLog(@"Error parsing RTF (%d)", rc);
 
-	_string = [[NSString alloc] initWithCStringNoCopy: buf
-								length: strlen(buf)
-								freeWhenDone: YES];
+	s = [[NSString alloc] initWithCStringNoCopy: buf
+						length: strlen(buf)
+						freeWhenDone: YES];
 #if 0
 	NSMutableDictionary *colorAttributes = [[[NSMutableDictionary alloc] init] autorelease];
 	[colorAttributes setObject:[NSColor redColor] forKey:NSForegroundColorAttributeName];
-	_attributes = [[NSMutableArray alloc] init];
-	_locations = [[NSMutableArray alloc] init];
-	[_attributes addObject:colorAttributes];
-	[_locations addObject:[NSNumber numberWithUnsignedInt:0]];
+	self = [self initWithString: s attributes: colorAttributes];
+#else
+	self = [self initWithString: s attributes: nil];
 #endif
+	[s release];
+
 	return self;
 }
 
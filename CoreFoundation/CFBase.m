@@ -125,6 +125,7 @@ CFSocketCreateWithNative(CFAllocatorRef a,
 		s->flags |= callBackTypes;					// add default reenable
 	s->callBackTypes = callBackTypes;
 	s->callout = callout;
+	s->fdGeneration = 0;
 	s->context = (void *)s + sizeof(CFSocket);
 	memcpy(s->context, context, sizeof(CFSocketContext));
 
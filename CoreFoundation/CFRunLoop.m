@@ -28,11 +28,19 @@
 #include <time.h>
 #include <sys/time.h>
 #include <fcntl.h>
+#include <poll.h>
+
+#ifdef HAVE_SYS_EPOLL_H
+  #include <sys/epoll.h>
+#endif
 
 #define CF_SOCKET_CALLBACK(TYPE)	(*(CFSocketCallBack)rs->action) \
 					(rs->socket, TYPE, NULL, INT2PTR(fd_index), rs->target)
 
 
+extern BOOL _RunLoopAwaitsIdle(void);
+
+
 const CFStringRef kCFRunLoopCommonModes = (CFStringRef)@"NSRunLoopCommonModes";
 const CFStringRef kCFRunLoopDefaultMode = (CFStringRef)@"NSDefaultRunLoopMode";
 
@@ -58,15 +66,23 @@ const CFStringRef kCFRunLoopDefaultMode = (CFStringRef)@"NSDefaultRunLoopMode";
 	CFRunLoopSourceContext context;
 	CFSocketRef socket;
 	CFIndex order;
+
+	void *pollSet;			// mode's poll set while registered
+	int *fds;				// sorted getFds:count: descriptors of target
+	int fdCount;
+	unsigned int generation;	// socket fdGeneration that fds reflects
 }
 
 @end
 
+static void RunLoopSourceDisable(RunLoopSource *rs);
+
+
 @implementation	RunLoopSource
 
 - (void) dealloc
 {
-	_isValid = NO;
+	RunLoopSourceDisable(self);
 	[limit release];
 	[target release];
 	[super dealloc];
@@ -96,9 +112,9 @@ RunLoopSourceRelease(RunLoopSource *rs)
 {
 	id target = rs->target;
 
+	RunLoopSourceDisable(rs);		// RunLoop will remove during next cycle
 	rs->target = nil;
 	rs->source = (void *)-1;
-	rs->_isValid = NO;				// RunLoop will remove during next cycle
 	[target release];
 }
 
@@ -166,7 +182,7 @@ _RunLoopSourceWriteReady(RunLoopSource *rs, int fd_index)
 				{
 				CFSocketDisableCallBacks (rs->socket, kCFSocketConnectCallBack);
 				if (!(f & kCFSocketDataCallBack))
-					rs->_isValid = NO;			// no read callbacks
+					RunLoopSourceDisable(rs);	// no read callbacks
 				fd_index = SocketConnectStatus (rs);
 				}
 			CF_SOCKET_CALLBACK((f & t));
@@ -189,7 +205,7 @@ _RunLoopSourceReadReady(RunLoopSource *rs, int fd_index)
 			if ((f & reenable) != (f & kCFSocketDataCallBack))
 				{
 				if (!(f & (kCFSocketWriteCallBack | kCFSocketConnectCallBack)))
-					rs->_isValid = NO;
+					RunLoopSourceDisable(rs);
 				CFSocketDisableCallBacks (rs->socket, (f & kCFSocketDataCallBack));
 				}
 
@@ -204,9 +220,444 @@ _RunLoopSourceReadReady(RunLoopSource *rs, int fd_index)
 
 int _RunLoopSourceHandle(RunLoopSource *rs)	 		{ return PTR2INT(rs->source); }
 id  _RunLoopSourceTarget(RunLoopSource *rs)			{ return rs->target; }
-void _RunLoopSourceInvalidate(RunLoopSource *rs)	{ rs->_isValid = NO; }
+void _RunLoopSourceInvalidate(RunLoopSource *rs)	{ RunLoopSourceDisable(rs); }
 NSDate *_RunLoopSourceLimitDate(RunLoopSource *rs)	{ return rs->limit; }
 
+/* ****************************************************************************
+
+	PollSet -- per mode descriptor multiplexer
+
+	A source's descriptors are registered with its mode's poll set when it
+	is added to the run loop and removed when it is invalidated, so each
+	pass waits on a set that is already built and dispatches only ready
+	descriptors.  Uses epoll where available and poll() otherwise or when
+	MGSTEP_RUNLOOP_POLL is set in the environment.  The descriptors of an
+	FdListening target are resynced when its socket's fdGeneration moves.
+
+** ***************************************************************************/
+
+#define POLL_READ		1
+#define POLL_WRITE		2
+#define POLL_BATCH		256					// max events per epoll_wait()
+
+typedef struct _PollEntry {
+	int fd;
+	int slot;						// index in pfds[] with poll() backend
+	unsigned int events;			// POLL_READ | POLL_WRITE armed in kernel
+	BOOL listening;					// fd is from the target's getFds:count:
+	RunLoopSource *rs;				// not retained, mode's watchers array is
+} PollEntry;
+
+typedef struct _PollSet {
+	int epfd;						// epoll descriptor, -1 with poll()
+	NSMapTable *entries;			// fd -> PollEntry
+	struct pollfd *pfds;			// poll() backend descriptor array
+	PollEntry **slots;				// entry of each pfds[] element
+	unsigned int count;
+	unsigned int size;
+	unsigned int armed;				// entries with events
+	RunLoopSource **listeners;		// sources with FdListening targets
+	unsigned int listenerCount;
+	unsigned int listenerSize;
+	BOOL purge;						// invalid sources await removal
+} PollSet;
+
+
+static PollSet *
+PollSetCreate(void)
+{
+	PollSet *ps = calloc(1, sizeof(PollSet));
+
+	ps->epfd = -1;
+	ps->entries = NSCreateMapTable(NSIntMapKeyCallBacks,
+								   NSNonOwnedPointerMapValueCallBacks, 0);
+#ifdef HAVE_SYS_EPOLL_H
+	if (!getenv("MGSTEP_RUNLOOP_POLL")
+			&& (ps->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		NSLog(@"NSRunLoop epoll_create1() failed, using poll() (%s)",
+				strerror(errno));
+#endif
+
+	return ps;
+}
+
+static void
+PollSetFree(PollSet *ps)
+{
+	NSMapEnumerator me = NSEnumerateMapTable(ps->entries);
+	PollEntry *e;
+	void *fd;
+	unsigned int i;
+
+	while (NSNextMapEnumeratorPair(&me, &fd, (void **)&e))
+		{
+		e->rs->pollSet = NULL;
+		free(e);
+		}
+	for (i = 0; i < ps->listenerCount; i++)
+		ps->listeners[i]->pollSet = NULL;
+	NSFreeMapTable(ps->entries);
+	if (ps->epfd >= 0)
+		close(ps->epfd);
+	free(ps->pfds);
+	free(ps->slots);
+	free(ps->listeners);
+	free(ps);
+}
+
+static unsigned int
+PollInterest(PollEntry *e)
+{
+	CFOptionFlags f = _RunLoopSourceGetCallbackTypes(e->rs);
+	unsigned int events = 0;
+
+	if (!e->rs->_isValid)
+		return 0;
+	if (e->listening)
+		return (f & (kCFSocketReadCallBack | kCFSocketAcceptCallBack))
+				? POLL_READ : 0;
+	if ((f & kCFSocketReadCallBack))
+		events |= POLL_READ;
+	if ((f & kCFSocketWriteCallBack) || (f & kCFSocketConnectCallBack))
+		events |= POLL_WRITE;
+
+	return events;
+}
+
+static void
+PollSetArm(PollSet *ps, PollEntry *e, unsigned int events)
+{
+	if (e->events == events)
+		return;
+
+#ifdef HAVE_SYS_EPOLL_H
+	if (ps->epfd >= 0)
+		{
+		struct epoll_event ev = {0};
+
+		ev.events = ((events & POLL_READ) ? EPOLLIN : 0)
+				  | ((events & POLL_WRITE) ? EPOLLOUT : 0);
+		ev.data.fd = e->fd;
+		if (events == 0)				// fd may already be closed, which
+			epoll_ctl(ps->epfd, EPOLL_CTL_DEL, e->fd, &ev);	// removes it
+		else if (e->events == 0)
+			{
+			if (epoll_ctl(ps->epfd, EPOLL_CTL_ADD, e->fd, &ev) < 0
+					&& errno == EEXIST)
+				epoll_ctl(ps->epfd, EPOLL_CTL_MOD, e->fd, &ev);
+			}
+		else if (epoll_ctl(ps->epfd, EPOLL_CTL_MOD, e->fd, &ev) < 0
+					&& errno == ENOENT)	// closed and reopened behind our back
+			epoll_ctl(ps->epfd, EPOLL_CTL_ADD, e->fd, &ev);
+		}
+	else
+#endif
+		{
+		ps->pfds[e->slot].fd = (events) ? e->fd : -1;	// poll() skips < 0
+		ps->pfds[e->slot].events = ((events & POLL_READ) ? POLLIN : 0)
+								 | ((events & POLL_WRITE) ? POLLOUT : 0);
+		}
+
+	if (e->events == 0)
+		ps->armed++;
+	else if (events == 0)
+		ps->armed--;
+	e->events = events;
+}
+
+static void
+PollSetAdd(PollSet *ps, RunLoopSource *rs, int fd, BOOL listening)
+{
+	PollEntry *e = NSMapGet(ps->entries, INT2PTR(fd));
+
+	if (e)								// fd reused or watched by another
+		PollSetArm(ps, e, 0);			// source, last one added wins
+	else
+		{
+		e = calloc(1, sizeof(PollEntry));
+		e->fd = fd;
+		e->slot = -1;
+		NSMapInsert(ps->entries, INT2PTR(fd), e);
+
+		if (ps->epfd < 0)
+			{
+			if (ps->count == ps->size)
+				{
+				ps->size = (ps->size) ? ps->size * 2 : 64;
+				ps->pfds = realloc(ps->pfds, ps->size * sizeof(struct pollfd));
+				ps->slots = realloc(ps->slots, ps->size * sizeof(PollEntry *));
+				}
+			e->slot = ps->count++;
+			ps->pfds[e->slot].fd = -1;
+			ps->pfds[e->slot].events = 0;
+			ps->pfds[e->slot].revents = 0;
+			ps->slots[e->slot] = e;
+		}	}
+
+	e->rs = rs;
+	e->listening = listening;
+	PollSetArm(ps, e, PollInterest(e));
+}
+
+static void
+PollSetRemove(PollSet *ps, RunLoopSource *rs, int fd)
+{
+	PollEntry *e = NSMapGet(ps->entries, INT2PTR(fd));
+
+	if (e == NULL || e->rs != rs)
+		return;
+
+	PollSetArm(ps, e, 0);
+	if (e->slot >= 0)					// move last poll() slot into hole
+		{
+		PollEntry *last = ps->slots[--ps->count];
+
+		ps->pfds[e->slot] = ps->pfds[ps->count];
+		ps->slots[e->slot] = last;
+		last->slot = e->slot;
+		}
+	NSMapRemove(ps->entries, INT2PTR(fd));
+	free(e);
+}
+
+static int
+CompareFds(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+static void
+RunLoopSourceSyncFds(PollSet *ps, RunLoopSource *rs)
+{
+	int size = MAX(rs->fdCount * 2, 128);
+	int *fds = NULL;
+	int count = 0;
+	int i = 0, j = 0;
+
+	if (rs->socket)
+		rs->generation = ((CFSocket *)rs->socket)->fdGeneration;
+	for (;;)							// getFds:count: sets count to the
+		{								// size required if fds is too small
+		fds = realloc(fds, (count = size) * sizeof(int));
+		[rs->target getFds:fds count:&count];
+		if (count <= size)
+			break;
+		size = count;
+		}
+	qsort(fds, count, sizeof(int), CompareFds);
+
+	while (i < rs->fdCount || j < count)	// merge old and new fd lists
+		{
+		if (j == count || (i < rs->fdCount && rs->fds[i] < fds[j]))
+			PollSetRemove(ps, rs, rs->fds[i++]);
+		else if (i == rs->fdCount || fds[j] < rs->fds[i])
+			PollSetAdd(ps, rs, fds[j++], YES);
+		else
+			i++, j++;
+		}
+
+	free(rs->fds);
+	rs->fds = fds;
+	rs->fdCount = count;
+}
+
+static void
+RunLoopSourceRegister(RunLoopSource *rs, PollSet *ps)
+{
+	int fd = PTR2INT(rs->source);
+
+	if (rs->pollSet || !rs->_isValid || fd < 0)
+		return;
+
+	rs->pollSet = ps;
+	PollSetAdd(ps, rs, fd, NO);
+
+	if ([rs->target respondsToSelector: @selector(getFds:count:)])
+		{
+		if (ps->listenerCount == ps->listenerSize)
+			{
+			ps->listenerSize = (ps->listenerSize) ? ps->listenerSize * 2 : 8;
+			ps->listeners = realloc(ps->listeners,
+									ps->listenerSize * sizeof(void *));
+			}
+		ps->listeners[ps->listenerCount++] = rs;
+		RunLoopSourceSyncFds(ps, rs);
+		}
+}
+
+static void
+RunLoopSourceDisable(RunLoopSource *rs)
+{
+	PollSet *ps = rs->pollSet;
+	unsigned int i;
+	int j;
+
+	rs->_isValid = NO;
+	if (ps)
+		{
+		rs->pollSet = NULL;
+		ps->purge = YES;
+		PollSetRemove(ps, rs, PTR2INT(rs->source));
+		for (j = 0; j < rs->fdCount; j++)
+			PollSetRemove(ps, rs, rs->fds[j]);
+
+		for (i = 0; i < ps->listenerCount; i++)
+			if (ps->listeners[i] == rs)
+				{
+				ps->listeners[i] = ps->listeners[--ps->listenerCount];
+				break;
+		}		}
+
+	free(rs->fds);
+	rs->fds = NULL;
+	rs->fdCount = 0;
+}
+
+static void
+PollSetDispatch(PollSet *ps, int fd, unsigned int ready)
+{
+	PollEntry *e = NSMapGet(ps->entries, INT2PTR(fd));
+	RunLoopSource *rs;
+
+	if (e == NULL || (rs = e->rs) == nil)
+		return;
+
+	if ((ready & POLL_WRITE) && (e->events & POLL_WRITE))
+		_RunLoopSourceWriteReady(rs, fd);
+										// callbacks may remove the entry
+	e = NSMapGet(ps->entries, INT2PTR(fd));
+	if (e && e->rs == rs && (ready & POLL_READ) && (e->events & POLL_READ))
+		_RunLoopSourceReadReady(rs, fd);
+
+	e = NSMapGet(ps->entries, INT2PTR(fd));
+	if (e && e->rs == rs)				// rearm if callbacks were disabled
+		PollSetArm(ps, e, PollInterest(e));		// while it was ready
+}
+
+static PollSet *
+RunLoopPollSet(CFRunLoop *rl, NSString *mode, BOOL create)
+{
+	PollSet *ps = NSMapGet(rl->_mode_2_pollset, mode);
+
+	if (ps == NULL && create)
+		{
+		ps = PollSetCreate();
+		NSMapInsert(rl->_mode_2_pollset, mode, ps);
+		}
+
+	return ps;
+}
+
+void
+_RunLoopFreePollSets(NSMapTable *pollSets)
+{
+	NSMapEnumerator me = NSEnumerateMapTable(pollSets);
+	PollSet *ps;
+	id mode;
+
+	while (NSNextMapEnumeratorPair(&me, (void **)&mode, (void **)&ps))
+		PollSetFree(ps);
+	NSFreeMapTable(pollSets);
+}
+
+/* ****************************************************************************
+
+	_RunLoopPollMode
+
+	Wait up to timeout ms (-1 forever) for descriptors registered in mode
+	and dispatch the ready ones.  Returns the number of ready descriptors.
+
+** ***************************************************************************/
+
+int
+_RunLoopPollMode(NSRunLoop *r, NSString *mode, int timeout)
+{
+	CFRunLoop *rl = (CFRunLoop *)r;
+	PollSet *ps = RunLoopPollSet(rl, mode, NO);
+	int i, n;
+
+	if (ps)
+		{
+		if (ps->purge)					// drop invalidated sources
+			{
+			NSMutableArray *watchers = NSMapGet(rl->_mode_2_watchers, mode);
+			int k = [watchers count];
+
+			ps->purge = NO;
+			while (k-- > 0)
+				if (!((RunLoopSource *)[watchers objectAtIndex: k])->_isValid)
+					[watchers removeObjectAtIndex: k];
+			}
+
+		for (i = 0; i < ps->listenerCount; i++)
+			{
+			RunLoopSource *rs = ps->listeners[i];
+
+			if (rs->socket
+					&& rs->generation != ((CFSocket *)rs->socket)->fdGeneration)
+				RunLoopSourceSyncFds(ps, rs);
+		}	}
+
+	if ((ps == NULL || ps->armed == 0) && _RunLoopAwaitsIdle())
+		timeout = 0;							// Detect if have idle in Q
+
+#ifdef HAVE_SYS_EPOLL_H
+	if (ps && ps->epfd >= 0)
+		{
+		struct epoll_event events[POLL_BATCH];
+
+		if ((n = epoll_wait(ps->epfd, events, POLL_BATCH, timeout)) > 0)
+			for (i = 0; i < n; i++)
+				{
+				unsigned int ready = 0;
+
+				if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+					ready |= POLL_READ;			// report errors to both
+				if (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+					ready |= POLL_WRITE;		// sides, dispatch skips
+				PollSetDispatch(ps, events[i].data.fd, ready);	// unarmed
+				}
+		}
+	else
+#endif
+	if ((n = poll(ps ? ps->pfds : NULL, ps ? ps->count : 0, timeout)) > 0)
+		{								// collect ready fds first as the
+		int fds[n];						// callbacks may reorder pfds[]
+		unsigned int ready[n];
+		int j = 0;
+
+		for (i = 0; i < ps->count && j < n; i++)
+			{
+			struct pollfd *p = &ps->pfds[i];
+
+			if (p->revents == 0 || p->fd < 0)
+				continue;
+			if (p->revents & POLLNVAL)	// closed without being removed
+				{
+				PollSetArm(ps, ps->slots[i], 0);
+				continue;
+				}
+			fds[j] = p->fd;
+			ready[j++] = ((p->revents & (POLLIN | POLLERR | POLLHUP))
+						 ? POLL_READ : 0)
+					   | ((p->revents & (POLLOUT | POLLERR | POLLHUP))
+						 ? POLL_WRITE : 0);
+			}
+
+		for (i = 0; i < j; i++)
+			PollSetDispatch(ps, fds[i], ready[i]);
+		}
+
+	if (n < 0)
+		{
+		if (errno != EINTR)						// a signal was caught
+			perror("*** NSRunLoop acceptInputForMode:beforeDate: poll");
+		n = 0;
+		}
+
+	return n;
+}
+
 /* ****************************************************************************
 
 		NSRunLoop  (mGSTEP extension)
@@ -226,19 +677,12 @@ NSDate *_RunLoopSourceLimitDate(RunLoopSource *rs)	{ return rs->limit; }
 
 - (RunLoopSource*) _getSource:(void*)source forMode:(NSString*)mode
 {
-	if (mode != nil)
-		{
-		NSArray *watchers = NSMapGet(_mode_2_watchers, mode);
-		NSUInteger i, count;
+	PollSet *ps;							// valid sources are registered
+	PollEntry *e;							// in their mode's poll set
 
-		if (watchers != nil && (count = [watchers count]))
-			for (i = 0; i < count; i++)
-				{
-				RunLoopSource *e = [watchers objectAtIndex: i];
-
-				if (e->source == source)
-					return e;
-		}		}
+	if (mode != nil && (ps = RunLoopPollSet((CFRunLoop *)self, mode, NO))
+			&& (e = NSMapGet(ps->entries, source)) && e->rs->source == source)
+		return e->rs;
 
 	return nil;
 }
@@ -296,6 +740,8 @@ NSDate *_RunLoopSourceLimitDate(RunLoopSource *rs)	{ return rs->limit; }
 		if (i == count)
 			[watchers addObject:rs];
 		}
+
+	RunLoopSourceRegister(rs, RunLoopPollSet((CFRunLoop *)self, mode, YES));
 }
 
 @end
@@ -518,6 +964,28 @@ CFRunLoopRemoveSource(CFRunLoopRef rl, CFRunLoopSourceRef src, CFStringRef mode)
 
 ** ***************************************************************************/
 
+static void
+RunLoopRearmSocket(CFRunLoop *rl, CFSocket *s)
+{
+	NSMapEnumerator me = NSEnumerateMapTable(rl->_mode_2_pollset);
+	PollSet *ps;							// callback types changed, update
+	id mode;								// the socket's poll interest in
+											// every mode it is watched in
+	while (NSNextMapEnumeratorPair(&me, (void **)&mode, (void **)&ps))
+		{
+		PollEntry *e = NSMapGet(ps->entries, INT2PTR(s->sd));
+
+		if (e && e->rs->socket == (CFSocketRef)s)
+			PollSetArm(ps, e, PollInterest(e));
+		}
+}
+
+void
+_CFSocketFdsChanged(CFSocketRef s)
+{
+	((CFSocket *)s)->fdGeneration++;
+}
+
 void
 CFSocketDisableCallBacks (CFSocketRef socket, CFOptionFlags callBackTypes)
 {
@@ -543,6 +1011,8 @@ CFSocketDisableCallBacks (CFSocketRef socket, CFOptionFlags callBackTypes)
 		if (e && e->target == watcher)
 			CFSocketSetSocketFlags(e->socket, s->callBackTypes);
 		}
+
+	RunLoopRearmSocket((CFRunLoop *)rl, s);
 }
 
 void
@@ -569,4 +1039,6 @@ CFSocketEnableCallBacks (CFSocketRef socket, CFOptionFlags callBackTypes)
 		if (e && e->target == watcher)
 			CFSocketSetSocketFlags(e->socket, s->callBackTypes);
 		}
+
+	RunLoopRearmSocket((CFRunLoop *)rl, s);
 }
@@ -141,8 +141,12 @@ typedef struct {							// Private struct, DO NOT use
 	CFSocketCallBack  	 callout;
 	CFSocketContext 	*context;
 	void *runLoopSource;
+	unsigned int fdGeneration;			// bumped when getFds:count: changes
 } CFSocket;
 
+									// info object's getFds:count: set has
+extern void _CFSocketFdsChanged(CFSocketRef s);	// changed, resync run loops
+
 
 #if 0										// Not Implemented in mGSTEP
 
@@ -20,11 +20,17 @@
 #include <AppKit/NSGraphics.h>
 #include <AppKit/NSColor.h>
 
+#include <stdlib.h>
+#include <string.h>
+
 
 #define CTX			((CGContext *)cx)
 											// Saturation arithmetic [0-255]
 #define SMUL(a,b)	(((a) * ((b) + ((b) >> 7))) >> 8)
 #define SRND(b)		((b) + ((b) >> 7))
+											// exact x / 255 rounded [0-65025]
+#define DIV255(x)	((((x) + 128) + (((x) + 128) >> 8)) >> 8)
+#define EMUL(a,b)	DIV255((a) * (b))
 
 
 static unsigned short __gtl[256];					// gamma to linear table
@@ -65,26 +71,13 @@ sover_c(unsigned char *src, _CGInk *ink, int len, unsigned char *dst)
 {
 	while (len--)
 		{									// color encoded in first 4 bytes
-		unsigned char alpha = dst[3];
+		unsigned short alpha = dst[3];		// full cov with opaque paint is
+		unsigned short ialpha = 255 - alpha;	// an exact copy of src
 
-		if (dst[3] == 255 && src[3] == 255)
-			{									// full cov wtih opaque paint
-			dst[0] = src[0];
-			dst[1] = src[1];
-			dst[2] = src[2];
-			}
-		else
-			{
-			unsigned char ialpha = 255 - alpha;
-			unsigned char r = dst[0];
-			unsigned char g = dst[1];
-			unsigned char b = dst[2];
-
-			dst[0] = ((r * ialpha) + (src[0] * alpha)) >> 8;
-			dst[1] = ((g * ialpha) + (src[1] * alpha)) >> 8;
-			dst[2] = ((b * ialpha) + (src[2] * alpha)) >> 8;
-//			dst[3] = alpha;
-			}
+		dst[0] = DIV255((dst[0] * ialpha) + (src[0] * alpha));
+		dst[1] = DIV255((dst[1] * ialpha) + (src[1] * alpha));
+		dst[2] = DIV255((dst[2] * ialpha) + (src[2] * alpha));
+//		dst[3] = alpha;
 
 		dst += 4;
 		}
@@ -114,15 +107,15 @@ blend_4a4(unsigned char *src, _CGInk *ink, int len, unsigned char *dst)
 		if (dst[3] > 0 && src[3] > 0)									// mask
 			{
 //			unsigned char alpha = 255;
-			unsigned char alpha = ((dst[3] * src[3] >> 8) * cov) >> 8;  // mask
-			unsigned char ialpha = 255 - alpha;
+			unsigned short alpha = EMUL(EMUL(dst[3], src[3]), cov);  // mask
+			unsigned short ialpha = 255 - alpha;
 			unsigned char r = dst[0];
 			unsigned char g = dst[1];
 			unsigned char b = dst[2];
 
-			dst[0] = ((r * ialpha) + (src[2] * alpha)) >> 8;
-			dst[1] = ((g * ialpha) + (src[1] * alpha)) >> 8;
-			dst[2] = ((b * ialpha) + (src[0] * alpha)) >> 8;
+			dst[0] = DIV255((r * ialpha) + (src[2] * alpha));
+			dst[1] = DIV255((g * ialpha) + (src[1] * alpha));
+			dst[2] = DIV255((b * ialpha) + (src[0] * alpha));
 			dst[3] = alpha;
 			}
 		dst += 4;
@@ -140,15 +133,15 @@ blend_4a4_bgr(unsigned char *src, _CGInk *ink, int len, unsigned char *dst)
 		if (dst[3] > 0 && src[3] > 0)									// mask
 			{
 //			unsigned char alpha = 255;
-			unsigned char alpha = ((dst[3] * src[3] >> 8) * cov) >> 8;  // mask
-			unsigned char ialpha = 255 - alpha;
+			unsigned short alpha = EMUL(EMUL(dst[3], src[3]), cov);  // mask
+			unsigned short ialpha = 255 - alpha;
 			unsigned char r = dst[0];
 			unsigned char g = dst[1];
 			unsigned char b = dst[2];
 
-			dst[0] = ((r * ialpha) + (src[0] * alpha)) >> 8;
-			dst[1] = ((g * ialpha) + (src[1] * alpha)) >> 8;
-			dst[2] = ((b * ialpha) + (src[2] * alpha)) >> 8;
+			dst[0] = DIV255((r * ialpha) + (src[0] * alpha));
+			dst[1] = DIV255((g * ialpha) + (src[1] * alpha));
+			dst[2] = DIV255((b * ialpha) + (src[2] * alpha));
 //			dst[0] = __ltg[((__gtl[r] >> 8) * ialpha) + (src[0] * alpha)];
 //			dst[1] = __ltg[((__gtl[g] >> 8) * ialpha) + (src[1] * alpha)];
 //			dst[2] = __ltg[((__gtl[b] >> 8) * ialpha) + (src[2] * alpha)];
@@ -354,12 +347,12 @@ din_p(unsigned char *src, _CGInk *ink, int len, unsigned char *dst)
 			unsigned short g = *(rgba + q + 1);
 			unsigned short b = *(rgba + q + 2);
 			unsigned short alpha = *(rgba + q + 3);
-			unsigned char ca = SMUL(cov, alpha);
+			unsigned char ca = EMUL(cov, alpha);
 
-			dst[3] = SMUL((short)dst[3], ca);
-			dst[2] = SMUL((short)dst[2], ca);
-			dst[1] = SMUL((short)dst[1], ca);
-			dst[0] = SMUL((short)dst[0], ca);
+			dst[3] = EMUL(dst[3], ca);
+			dst[2] = EMUL(dst[2], ca);
+			dst[1] = EMUL(dst[1], ca);
+			dst[0] = EMUL(dst[0], ca);
 			}
 		else
 			{
@@ -427,12 +420,12 @@ xor_p(unsigned char *src, _CGInk *ink, int len, unsigned char *dst)
 				unsigned short g = *(rgba + q + 1);
 				unsigned short b = *(rgba + q + 2);
 				unsigned short alpha = *(rgba + q + 3);
-				unsigned char ca = SMUL(cov, alpha);
+				unsigned char ca = EMUL(cov, alpha);
 
 				dst[3] = ca;
-				dst[2] = SMUL((short)r, ca);
-				dst[1] = SMUL((short)g, ca);
-				dst[0] = SMUL((short)b, ca);
+				dst[2] = EMUL(r, ca);
+				dst[1] = EMUL(g, ca);
+				dst[0] = EMUL(b, ca);
 			}	}
 
 		dst += 4;
@@ -655,14 +648,14 @@ sover_p(unsigned char *src, _CGInk *ink, int len, unsigned char *dst)
 				}
 			else
 				{
-				unsigned char sa = SMUL(cov, alpha);
-				unsigned char ca = SMUL(cov, dst[3]);
-				unsigned char ialpha = 255 - ca;
-
-				dst[0] = SMUL(ca, b) + SMUL(ialpha, dst[0]);
-				dst[1] = SMUL(ca, g) + SMUL(ialpha, dst[1]);
-				dst[2] = SMUL(ca, r) + SMUL(ialpha, dst[2]);
-				dst[3] = SMUL(ca, sa) + SMUL(ialpha, dst[3]);
+				unsigned short sa = EMUL(cov, alpha);
+				unsigned short ca = EMUL(cov, dst[3]);
+				unsigned short ialpha = 255 - ca;
+
+				dst[0] = DIV255((ca * b) + (ialpha * dst[0]));
+				dst[1] = DIV255((ca * g) + (ialpha * dst[1]));
+				dst[2] = DIV255((ca * r) + (ialpha * dst[2]));
+				dst[3] = DIV255((ca * sa) + (ialpha * dst[3]));
 				}
 			}
 
@@ -690,98 +683,986 @@ nop_0x0(unsigned char *src, _CGInk *ink, int len, unsigned char *dst)
 	NSLog(@"CGBlendMode: error NOP blend mode invoked");
 }
 
-void
-CGContextSetBlendMode( CGContextRef cx, CGBlendMode mode)
+/* ****************************************************************************
+
+	SIMD kernels
+
+	Vector versions of the hot blend routines, 4 (SSE2) or 8 (AVX2, NEON)
+	pixels per iteration.  Channels are widened to 16 bits and divided by
+	255 with the same rounding as DIV255 so that each is bit exact with the
+	scalar routine it replaces, which remains the reference.
+
+	Path blends carry the running coverage sum across the span.  A group's
+	coverage is prefix summed in-register and the span's tail is staged in
+	a zero padded group so that it sees the same sums as the scalar loop.
+
+** ***************************************************************************/
+
+#define SPAN_GROUPS(N, ...)		while (len > 0)								\
+	{																		\
+	unsigned char tc[N], td[4 * N];											\
+	unsigned char *cp = src, *dp = dst;										\
+	int n = (len < N) ? len : N;											\
+																			\
+	if (n < N)																\
+		{																	\
+		memset(tc, 0, N);													\
+		memset(td, 0, 4 * N);												\
+		memcpy((cp = tc), src, n);											\
+		memcpy((dp = td), dst, 4 * n);										\
+		}																	\
+	__VA_ARGS__;															\
+	if (n < N)																\
+		{																	\
+		memset(src, 0, n);													\
+		memcpy(dst, td, 4 * n);												\
+		}																	\
+	src += n;																\
+	dst += 4 * n;															\
+	len -= n;																\
+	}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+#define SSE2	__attribute__((target("sse2")))
+#define AVX2	__attribute__((target("avx2")))
+
+#define SHUF16(x, imm)	_mm_shufflehi_epi16(_mm_shufflelo_epi16(x, imm), imm)
+#define ALPHA16(x)		SHUF16(x, _MM_SHUFFLE(3,3,3,3))
+#define SWAP16(x)		SHUF16(x, _MM_SHUFFLE(3,0,1,2))
+
+SSE2 static inline __m128i
+div255_sse2(__m128i x)
 {
-	if (mode > kCGBlendModePlusLighter)
-		NSLog(@"CG error: invalid blend mode %d", mode);
+	x = _mm_add_epi16(x, _mm_set1_epi16(128));
+
+	return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+SSE2 static inline __m128i
+lerp_sse2(__m128i d, __m128i s, __m128i a)		// (d * (255 - a) + s * a) / 255
+{
+	__m128i ia = _mm_sub_epi16(_mm_set1_epi16(255), a);
+
+	return div255_sse2(_mm_add_epi16(_mm_mullo_epi16(d, ia),
+									 _mm_mullo_epi16(s, a)));
+}
+
+SSE2 static inline __m128i
+select_sse2(__m128i m, __m128i a, __m128i b)		// m ? a : b
+{
+	return _mm_or_si128(_mm_and_si128(m, a), _mm_andnot_si128(m, b));
+}
+
+SSE2 static inline __m128i
+coverage_sse2(unsigned char *cp, unsigned char *cov)
+{											// 4 running coverage sums, each
+	__m128i c;								// repeated for the 4 channels
+	int v;
+
+	memcpy(&v, cp, 4);
+	memset(cp, 0, 4);
+	c = _mm_cvtsi32_si128(v);
+	c = _mm_add_epi8(c, _mm_slli_si128(c, 1));
+	c = _mm_add_epi8(c, _mm_slli_si128(c, 2));
+	c = _mm_add_epi8(c, _mm_set1_epi8((char)*cov));
+	*cov = (unsigned char)(_mm_cvtsi128_si32(c) >> 24);
+	c = _mm_unpacklo_epi8(c, c);
+
+	return _mm_unpacklo_epi16(c, c);
+}
+
+SSE2 static void
+sover_c_sse2(unsigned char *src, _CGInk *ink, int len, unsigned char *dst)
+{
+	__m128i z = _mm_setzero_si128();
+	__m128i am = _mm_set1_epi32(0xff000000);
+	__m128i s;
+	int v;
+
+	memcpy(&v, src, 4);
+	s = _mm_unpacklo_epi8(_mm_set1_epi32(v), z);
+
+	for (; len >= 4; len -= 4, dst += 16)
+		{
+		__m128i d = _mm_loadu_si128((__m128i *)dst);
+		__m128i lo = _mm_unpacklo_epi8(d, z);
+		__m128i hi = _mm_unpackhi_epi8(d, z);
+
+		lo = lerp_sse2(lo, s, ALPHA16(lo));
+		hi = lerp_sse2(hi, s, ALPHA16(hi));
+		d = select_sse2(am, d, _mm_packus_epi16(lo, hi));
+		_mm_storeu_si128((__m128i *)dst, d);
+		}
+
+	sover_c(src, ink, len, dst);
+}
+
+SSE2 static inline __m128i
+blend_4a4_sse2x2(__m128i d, __m128i s, __m128i cov, BOOL swap)
+{
+	__m128i z = _mm_setzero_si128();
+	__m128i am = _mm_set_epi16(-1,0,0,0,-1,0,0,0);
+	__m128i da = ALPHA16(d);
+	__m128i sa = ALPHA16(s);
+	__m128i a = div255_sse2(_mm_mullo_epi16(div255_sse2(_mm_mullo_epi16(da, sa)), cov));
+	__m128i r = lerp_sse2(d, (swap) ? SWAP16(s) : s, a);
+	__m128i k = _mm_or_si128(_mm_cmpeq_epi16(da, z), _mm_cmpeq_epi16(sa, z));
+
+	return select_sse2(k, d, select_sse2(am, a, r));
+}
+
+SSE2 static inline void
+blend_4a4_sse2x4(unsigned char *src, _CGInk *ink, int len, unsigned char *dst,
+				 BOOL swap)
+{
+	__m128i z = _mm_setzero_si128();
+	__m128i cov = _mm_set1_epi16(ink->cov);
+
+	for (; len >= 4; len -= 4, dst += 16, src += 16)
+		{
+		__m128i d = _mm_loadu_si128((__m128i *)dst);
+		__m128i s = _mm_loadu_si128((__m128i *)src);
+		__m128i lo = blend_4a4_sse2x2(_mm_unpacklo_epi8(d, z),
+									  _mm_unpacklo_epi8(s, z), cov, swap);
+		__m128i hi = blend_4a4_sse2x2(_mm_unpackhi_epi8(d, z),
+									  _mm_unpackhi_epi8(s, z), cov, swap);
+
+		_mm_storeu_si128((__m128i *)dst, _mm_packus_epi16(lo, hi));
+		}
+
+	if (swap)
+		blend_4a4(src, ink, len, dst);
 	else
+		blend_4a4_bgr(src, ink, len, dst);
+}
+
+SSE2 static void
+blend_4a4_sse2(unsigned char *src, _CGInk *ink, int len, unsigned char *dst)
+{
+	blend_4a4_sse2x4(src, ink, len, dst, YES);
+}
+
+SSE2 static void
+blend_4a4_bgr_sse2(unsigned char *src, _CGInk *ink, int len, unsigned char *dst)
+{
+	blend_4a4_sse2x4(src, ink, len, dst, NO);
+}
+
+SSE2 static void
+copy_4a4_rgb_sse2(unsigned char *src, _CGInk *ink, int len, unsigned char *dst)
+{
+	for (; len >= 4; len -= 4, dst += 16, src += 16)
+		{									// swap words then bytes in words
+		__m128i s = _mm_loadu_si128((__m128i *)src);
+
+		s = SHUF16(s, _MM_SHUFFLE(2,3,0,1));
+		s = _mm_or_si128(_mm_slli_epi16(s, 8), _mm_srli_epi16(s, 8));
+		_mm_storeu_si128((__m128i *)dst, s);
+		}
+
+	copy_4a4_rgb(src, ink, len, dst);
+}
+
+SSE2 static void
+sover_p_sse2(unsigned char *src, _CGInk *ink, int len, unsigned char *dst)
+{
+	unsigned char *rgba = ink->rgba;
+	unsigned char cov = src[len];
+	__m128i z = _mm_setzero_si128();
+	__m128i ones = _mm_set1_epi32(-1);
+	__m128i am = _mm_set_epi16(-1,0,0,0,-1,0,0,0);
+	__m128i am8 = _mm_set1_epi32(0xff000000);
+	__m128i s = _mm_set_epi16(rgba[3], rgba[0], rgba[1], rgba[2],
+							  rgba[3], rgba[0], rgba[1], rgba[2]);
+	__m128i s8 = _mm_packus_epi16(s, s);
+	__m128i sa = _mm_set1_epi16(rgba[3]);
+	__m128i opaque = (rgba[3] == 255) ? ones : z;
+
+	if (ink->length != 1)
 		{
-		CTX->_gs->blendMode = mode;
-		CTX->_gs->pathBlend = sover_p;
-		CTX->_gs->textBlend = sover_t;
+		sover_p(src, ink, len, dst);
+		return;
+		}
 
-		switch (mode)
+	SPAN_GROUPS(4, {
+		__m128i c = coverage_sse2(cp, &cov);
+		__m128i d = _mm_loadu_si128((__m128i *)dp);
+		__m128i full = _mm_and_si128(opaque, _mm_cmpeq_epi32(c, ones));
+		__m128i r[2];
+		int i;
+
+		if (ink->mask)
+			full = _mm_and_si128(full, _mm_cmpeq_epi32(_mm_and_si128(d, am8), am8));
+		if (_mm_movemask_epi8(full) == 0xffff)				// opaque span
+			_mm_storeu_si128((__m128i *)dp, s8);
+		else if (_mm_movemask_epi8(_mm_cmpeq_epi32(c, z)) != 0xffff)
 			{
-			case kCGBlendModeClear:
-				CTX->_gs->pathBlend = clear_p;
-				break;
-			case kCGBlendModeCopy:
-				CTX->_gs->pathBlend = copy_p;
-				CTX->_gs->colorBlend = copy_c;
-				break;
-			case kCGBlendModeNormal:
-				CTX->_gs->colorBlend = sover_c;
-				break;
-			case kCGBlendModeDestinationOver:
-				CTX->_gs->pathBlend = dover_p;
-				break;
-			case kCGBlendModeDestinationAtop:
-				CTX->_gs->pathBlend = datop_p;
-				break;
-			case kCGBlendModeDestinationIn:
-				CTX->_gs->pathBlend = din_p;
-				break;
-			case kCGBlendModeDestinationOut:
-				CTX->_gs->pathBlend = dout_p;
-				break;
-			case kCGBlendModeSourceAtop:
-				CTX->_gs->pathBlend = satop_p;
-				break;
-			case kCGBlendModeSourceIn:
-				CTX->_gs->pathBlend = sin_p;
-				break;
-			case kCGBlendModeSourceOut:
-				CTX->_gs->pathBlend = sout_p;
-				break;
-			case kCGBlendModePlusDarker:
-				CTX->_gs->pathBlend = plusd_p;
-				break;
-			case kCGBlendModeDifference:
-				[[NSColor highlightColor] set];
-			case kCGBlendModePlusLighter:
-			case kCGBlendModeXOR:
-				CTX->_gs->colorBlend = xor_c;
-				CTX->_gs->pathBlend = xor_p;
-				break;
-			default:
-				CTX->_gs->colorBlend = nop_0x0;
-				break;
-		}	}
+			for (i = 0; i < 2; i++)
+				{
+				__m128i dc = (i) ? _mm_unpackhi_epi8(d, z) : _mm_unpacklo_epi8(d, z);
+				__m128i cc = (i) ? _mm_unpackhi_epi8(c, z) : _mm_unpacklo_epi8(c, z);
+				__m128i ca = div255_sse2(_mm_mullo_epi16(cc, ALPHA16(dc)));
+				__m128i sc = select_sse2(am, div255_sse2(_mm_mullo_epi16(cc, sa)), s);
+
+				r[i] = select_sse2(_mm_cmpeq_epi16(cc, z), dc,
+								   lerp_sse2(dc, sc, ca));
+				}
+			r[0] = select_sse2(full, s8, _mm_packus_epi16(r[0], r[1]));
+			_mm_storeu_si128((__m128i *)dp, r[0]);
+			}
+		});
 }
 
-void
-_CGContextSetImageBlendMode( CGContextRef cx, CGImage *a)
+SSE2 static void
+din_p_sse2(unsigned char *src, _CGInk *ink, int len, unsigned char *dst)
 {
-	unsigned nc = a->samplesPerPixel;
+	unsigned char *rgba = ink->rgba;
+	unsigned char cov = src[len];
+	__m128i z = _mm_setzero_si128();
+	__m128i am = _mm_set_epi16(-1,0,0,0,-1,0,0,0);
+	__m128i back = _mm_set_epi16(0, dst[6], dst[5], dst[4],
+								 0, dst[6], dst[5], dst[4]);
+	__m128i alpha = _mm_set1_epi16(rgba[3]);
 
-	switch (CTX->_gs->blendMode)		// FIX ME set src image colorspace ?
+	if (ink->length != 1)
+		{
+		din_p(src, ink, len, dst);
+		return;
+		}
+
+	SPAN_GROUPS(4, {
+		__m128i c = coverage_sse2(cp, &cov);
+		__m128i d = _mm_loadu_si128((__m128i *)dp);
+		__m128i r[2];
+		int i;
+
+		for (i = 0; i < 2; i++)
+			{
+			__m128i dc = (i) ? _mm_unpackhi_epi8(d, z) : _mm_unpacklo_epi8(d, z);
+			__m128i cc = (i) ? _mm_unpackhi_epi8(c, z) : _mm_unpacklo_epi8(c, z);
+			__m128i ca = div255_sse2(_mm_mullo_epi16(cc, alpha));
+			__m128i k = _mm_or_si128(_mm_cmpeq_epi16(ALPHA16(dc), z),
+									 _mm_cmpeq_epi16(cc, z));
+
+			r[i] = select_sse2(k, select_sse2(am, dc, back),
+							   div255_sse2(_mm_mullo_epi16(dc, ca)));
+			}
+		_mm_storeu_si128((__m128i *)dp, _mm_packus_epi16(r[0], r[1]));
+		});
+}
+
+SSE2 static void
+xor_p_sse2(unsigned char *src, _CGInk *ink, int len, unsigned char *dst)
+{
+	unsigned char *rgba = ink->rgba;
+	unsigned char cov = src[len];
+	__m128i z = _mm_setzero_si128();
+	__m128i am8 = _mm_set1_epi32(0xff000000);
+	__m128i back = _mm_set1_epi32(dst[4] | (dst[5] << 8) | (dst[6] << 16));
+	__m128i s = _mm_set_epi16(255, rgba[0], rgba[1], rgba[2],
+							  255, rgba[0], rgba[1], rgba[2]);
+	__m128i alpha = _mm_set1_epi16(rgba[3]);
+
+	if (ink->length != 1)
+		{
+		xor_p(src, ink, len, dst);
+		return;
+		}
+
+	SPAN_GROUPS(4, {
+		__m128i c = coverage_sse2(cp, &cov);
+		__m128i d = _mm_loadu_si128((__m128i *)dp);
+		__m128i none = _mm_cmpeq_epi32(c, z);
+		__m128i empty = _mm_cmpeq_epi32(_mm_and_si128(d, am8), z);
+		__m128i r = _mm_or_si128(_mm_and_si128(d, am8), back);
+
+		if (_mm_movemask_epi8(_mm_andnot_si128(none, empty)))
+			{									// draw on empty pixels
+			__m128i lo = _mm_unpacklo_epi8(c, z);
+			__m128i hi = _mm_unpackhi_epi8(c, z);
+
+			lo = div255_sse2(_mm_mullo_epi16(lo, alpha));
+			hi = div255_sse2(_mm_mullo_epi16(hi, alpha));
+			lo = div255_sse2(_mm_mullo_epi16(s, lo));
+			hi = div255_sse2(_mm_mullo_epi16(s, hi));
+			r = select_sse2(empty, _mm_packus_epi16(lo, hi), r);
+			}
+		_mm_storeu_si128((__m128i *)dp, select_sse2(none, d, r));
+		});
+}
+
+#define SHUF16X2(x, imm) _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(x, imm), imm)
+#define ALPHA16X2(x)	SHUF16X2(x, _MM_SHUFFLE(3,3,3,3))
+#define SWAP16X2(x)		SHUF16X2(x, _MM_SHUFFLE(3,0,1,2))
+
+AVX2 static inline __m256i
+div255_avx2(__m256i x)
+{
+	x = _mm256_add_epi16(x, _mm256_set1_epi16(128));
+
+	return _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8);
+}
+
+AVX2 static inline __m256i
+lerp_avx2(__m256i d, __m256i s, __m256i a)		// (d * (255 - a) + s * a) / 255
+{
+	__m256i ia = _mm256_sub_epi16(_mm256_set1_epi16(255), a);
+
+	return div255_avx2(_mm256_add_epi16(_mm256_mullo_epi16(d, ia),
+										_mm256_mullo_epi16(s, a)));
+}
+
+AVX2 static inline __m256i
+select_avx2(__m256i m, __m256i a, __m256i b)		// m ? a : b
+{
+	return _mm256_blendv_epi8(b, a, m);
+}
+
+AVX2 static inline __m256i
+load_avx2(unsigned char *p)						// 4 pixels widened to 16 bits
+{
+	return _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *)p));
+}
+
+AVX2 static inline __m256i
+pack_avx2(__m256i lo, __m256i hi)				// 8 pixels narrowed to 8 bits
+{
+	__m256i r = _mm256_packus_epi16(lo, hi);		// packs within 128 bit lanes
+
+	return _mm256_permute4x64_epi64(r, _MM_SHUFFLE(3,1,2,0));
+}
+
+AVX2 static inline void
+store_avx2(unsigned char *p, __m256i lo, __m256i hi)
+{
+	_mm256_storeu_si256((__m256i *)p, pack_avx2(lo, hi));
+}
+
+AVX2 static inline __m256i
+coverage_avx2(unsigned char *cp, unsigned char *cov)
+{											// 8 running coverage sums, each
+	__m128i c = _mm_loadl_epi64((__m128i *)cp);	// repeated for the 4 channels
+
+	memset(cp, 0, 8);
+	c = _mm_add_epi8(c, _mm_slli_si128(c, 1));
+	c = _mm_add_epi8(c, _mm_slli_si128(c, 2));
+	c = _mm_add_epi8(c, _mm_slli_si128(c, 4));
+	c = _mm_add_epi8(c, _mm_set1_epi8((char)*cov));
+	*cov = (unsigned char)(_mm_extract_epi16(c, 3) >> 8);
+	c = _mm_unpacklo_epi8(c, c);
+
+	return _mm256_inserti128_si256(_mm256_castsi128_si256(
+				_mm_unpacklo_epi16(c, c)), _mm_unpackhi_epi16(c, c), 1);
+}
+
+AVX2 static void
+sover_c_avx2(unsigned char *src, _CGInk *ink, int len, unsigned char *dst)
+{
+	__m256i am = _mm256_set1_epi64x((long long)0xffff000000000000ULL);
+	__m256i s;
+	int v;
+
+	memcpy(&v, src, 4);
+	s = _mm256_cvtepu8_epi16(_mm_set1_epi32(v));
+
+	for (; len >= 8; len -= 8, dst += 32)
+		{
+		__m256i lo = load_avx2(dst);
+		__m256i hi = load_avx2(dst + 16);
+
+		lo = select_avx2(am, lo, lerp_avx2(lo, s, ALPHA16X2(lo)));
+		hi = select_avx2(am, hi, lerp_avx2(hi, s, ALPHA16X2(hi)));
+		store_avx2(dst, lo, hi);
+		}
+
+	sover_c(src, ink, len, dst);
+}
+
+AVX2 static inline __m256i
+blend_4a4_avx2x4(__m256i d, __m256i s, __m256i cov, BOOL swap)
+{
+	__m256i z = _mm256_setzero_si256();
+	__m256i am = _mm256_set1_epi64x((long long)0xffff000000000000ULL);
+	__m256i da = ALPHA16X2(d);
+	__m256i sa = ALPHA16X2(s);
+	__m256i a = div255_avx2(_mm256_mullo_epi16(div255_avx2(
+						_mm256_mullo_epi16(da, sa)), cov));
+	__m256i r = lerp_avx2(d, (swap) ? SWAP16X2(s) : s, a);
+	__m256i k = _mm256_or_si256(_mm256_cmpeq_epi16(da, z),
+								_mm256_cmpeq_epi16(sa, z));
+
+	return select_avx2(k, d, select_avx2(am, a, r));
+}
+
+AVX2 static inline void
+blend_4a4_avx2x8(unsigned char *src, _CGInk *ink, int len, unsigned char *dst,
+				 BOOL swap)
+{
+	__m256i cov = _mm256_set1_epi16(ink->cov);
+
+	for (; len >= 8; len -= 8, dst += 32, src += 32)
+		{
+		__m256i lo = blend_4a4_avx2x4(load_avx2(dst), load_avx2(src), cov, swap);
+		__m256i hi = blend_4a4_avx2x4(load_avx2(dst + 16), load_avx2(src + 16),
+									  cov, swap);
+		store_avx2(dst, lo, hi);
+		}
+
+	if (swap)
+		blend_4a4(src, ink, len, dst);
+	else
+		blend_4a4_bgr(src, ink, len, dst);
+}
+
+AVX2 static void
+blend_4a4_avx2(unsigned char *src, _CGInk *ink, int len, unsigned char *dst)
+{
+	blend_4a4_avx2x8(src, ink, len, dst, YES);
+}
+
+AVX2 static void
+blend_4a4_bgr_avx2(unsigned char *src, _CGInk *ink, int len, unsigned char *dst)
+{
+	blend_4a4_avx2x8(src, ink, len, dst, NO);
+}
+
+AVX2 static void
+copy_4a4_rgb_avx2(unsigned char *src, _CGInk *ink, int len, unsigned char *dst)
+{
+	__m256i rev = _mm256_set_epi8(12,13,14,15, 8,9,10,11, 4,5,6,7, 0,1,2,3,
+								  12,13,14,15, 8,9,10,11, 4,5,6,7, 0,1,2,3);
+
+	for (; len >= 8; len -= 8, dst += 32, src += 32)
+		{
+		__m256i s = _mm256_loadu_si256((__m256i *)src);
+
+		_mm256_storeu_si256((__m256i *)dst, _mm256_shuffle_epi8(s, rev));
+		}
+
+	copy_4a4_rgb(src, ink, len, dst);
+}
+
+AVX2 static void
+sover_p_avx2(unsigned char *src, _CGInk *ink, int len, unsigned char *dst)
+{
+	unsigned char *rgba = ink->rgba;
+	unsigned char cov = src[len];
+	__m256i z = _mm256_setzero_si256();
+	__m256i ones = _mm256_set1_epi32(-1);
+	__m256i am = _mm256_set1_epi64x((long long)0xffff000000000000ULL);
+	__m256i am8 = _mm256_set1_epi32(0xff000000);
+	__m256i s = _mm256_set1_epi64x(((long long)rgba[3] << 48)
+			| ((long long)rgba[0] << 32) | (rgba[1] << 16) | rgba[2]);
+	__m256i s8 = _mm256_set1_epi32(((unsigned)rgba[3] << 24)
+			| (rgba[0] << 16) | (rgba[1] << 8) | rgba[2]);
+	__m256i sa = _mm256_set1_epi16(rgba[3]);
+	__m256i opaque = (rgba[3] == 255) ? ones : z;
+
+	if (ink->length != 1)
+		{
+		sover_p(src, ink, len, dst);
+		return;
+		}
+
+	SPAN_GROUPS(8, {
+		__m256i c = coverage_avx2(cp, &cov);
+		__m256i d = _mm256_loadu_si256((__m256i *)dp);
+		__m256i full = _mm256_and_si256(opaque, _mm256_cmpeq_epi32(c, ones));
+		__m256i r[2];
+		int i;
+
+		if (ink->mask)
+			full = _mm256_and_si256(full,
+						_mm256_cmpeq_epi32(_mm256_and_si256(d, am8), am8));
+		if (_mm256_movemask_epi8(full) == -1)				// opaque span
+			_mm256_storeu_si256((__m256i *)dp, s8);
+		else if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(c, z)) != -1)
+			{
+			for (i = 0; i < 2; i++)
+				{
+				__m256i dc = load_avx2(dp + 16 * i);
+				__m256i cc = _mm256_cvtepu8_epi16((i)
+									? _mm256_extracti128_si256(c, 1)
+									: _mm256_castsi256_si128(c));
+				__m256i ca = div255_avx2(_mm256_mullo_epi16(cc, ALPHA16X2(dc)));
+				__m256i sc = select_avx2(am, div255_avx2(
+										_mm256_mullo_epi16(cc, sa)), s);
+
+				r[i] = select_avx2(_mm256_cmpeq_epi16(cc, z), dc,
+								   lerp_avx2(dc, sc, ca));
+				}
+			r[0] = select_avx2(full, s8, pack_avx2(r[0], r[1]));
+			_mm256_storeu_si256((__m256i *)dp, r[0]);
+			}
+		});
+}
+
+AVX2 static void
+din_p_avx2(unsigned char *src, _CGInk *ink, int len, unsigned char *dst)
+{
+	unsigned char *rgba = ink->rgba;
+	unsigned char cov = src[len];
+	__m256i z = _mm256_setzero_si256();
+	__m256i am = _mm256_set1_epi64x((long long)0xffff000000000000ULL);
+	__m256i back = _mm256_set1_epi64x(((long long)dst[6] << 32)
+			| (dst[5] << 16) | dst[4]);
+	__m256i alpha = _mm256_set1_epi16(rgba[3]);
+
+	if (ink->length != 1)
+		{
+		din_p(src, ink, len, dst);
+		return;
+		}
+
+	SPAN_GROUPS(8, {
+		__m256i c = coverage_avx2(cp, &cov);
+		__m256i r[2];
+		int i;
+
+		for (i = 0; i < 2; i++)
+			{
+			__m256i dc = load_avx2(dp + 16 * i);
+			__m256i cc = _mm256_cvtepu8_epi16((i)
+								? _mm256_extracti128_si256(c, 1)
+								: _mm256_castsi256_si128(c));
+			__m256i ca = div255_avx2(_mm256_mullo_epi16(cc, alpha));
+			__m256i k = _mm256_or_si256(_mm256_cmpeq_epi16(ALPHA16X2(dc), z),
+										_mm256_cmpeq_epi16(cc, z));
+
+			r[i] = select_avx2(k, select_avx2(am, dc, back),
+							   div255_avx2(_mm256_mullo_epi16(dc, ca)));
+			}
+		store_avx2(dp, r[0], r[1]);
+		});
+}
+
+AVX2 static void
+xor_p_avx2(unsigned char *src, _CGInk *ink, int len, unsigned char *dst)
+{
+	unsigned char *rgba = ink->rgba;
+	unsigned char cov = src[len];
+	__m256i z = _mm256_setzero_si256();
+	__m256i am8 = _mm256_set1_epi32(0xff000000);
+	__m256i back = _mm256_set1_epi32(dst[4] | (dst[5] << 8) | (dst[6] << 16));
+	__m256i s = _mm256_set1_epi64x((255LL << 48)
+			| ((long long)rgba[0] << 32) | (rgba[1] << 16) | rgba[2]);
+	__m256i alpha = _mm256_set1_epi16(rgba[3]);
+
+	if (ink->length != 1)
+		{
+		xor_p(src, ink, len, dst);
+		return;
+		}
+
+	SPAN_GROUPS(8, {
+		__m256i c = coverage_avx2(cp, &cov);
+		__m256i d = _mm256_loadu_si256((__m256i *)dp);
+		__m256i none = _mm256_cmpeq_epi32(c, z);
+		__m256i empty = _mm256_cmpeq_epi32(_mm256_and_si256(d, am8), z);
+		__m256i r = _mm256_or_si256(_mm256_and_si256(d, am8), back);
+
+		if (_mm256_movemask_epi8(_mm256_andnot_si256(none, empty)))
+			{									// draw on empty pixels
+			__m256i lo = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(c));
+			__m256i hi = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(c, 1));
+
+			lo = div255_avx2(_mm256_mullo_epi16(lo, alpha));
+			hi = div255_avx2(_mm256_mullo_epi16(hi, alpha));
+			lo = div255_avx2(_mm256_mullo_epi16(s, lo));
+			hi = div255_avx2(_mm256_mullo_epi16(s, hi));
+			r = select_avx2(empty, pack_avx2(lo, hi), r);
+			}
+		_mm256_storeu_si256((__m256i *)dp, select_avx2(none, d, r));
+		});
+}
+
+static int
+cpu_sse2(void)
+{
+	__builtin_cpu_init();
+
+	return __builtin_cpu_supports("sse2");
+}
+
+static int
+cpu_avx2(void)
+{
+	__builtin_cpu_init();
+
+	return __builtin_cpu_supports("avx2");
+}
+
+#endif  /* __x86_64__ || __i386__ */
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+
+#include <arm_neon.h>
+
+static inline uint8x8_t
+div255_neon(uint16x8_t x)
+{
+	x = vaddq_u16(x, vdupq_n_u16(128));
+
+	return vshrn_n_u16(vsraq_n_u16(x, x, 8), 8);
+}
+
+static inline uint8x8_t
+lerp_neon(uint8x8_t d, uint8x8_t s, uint8x8_t a)	// (d * (255 - a) + s * a) / 255
+{
+	return div255_neon(vmlal_u8(vmull_u8(d, vmvn_u8(a)), s, a));
+}
+
+static inline uint8x8_t
+coverage_neon(unsigned char *cp, unsigned char *cov)
+{
+	uint8x8_t c = vld1_u8(cp);						// 8 running coverage sums
+	uint64x1_t u;
+
+	vst1_u8(cp, vdup_n_u8(0));
+	u = vreinterpret_u64_u8(c);
+	c = vadd_u8(c, vreinterpret_u8_u64(vshl_n_u64(u, 8)));
+	u = vreinterpret_u64_u8(c);
+	c = vadd_u8(c, vreinterpret_u8_u64(vshl_n_u64(u, 16)));
+	u = vreinterpret_u64_u8(c);
+	c = vadd_u8(c, vreinterpret_u8_u64(vshl_n_u64(u, 32)));
+	c = vadd_u8(c, vdup_n_u8(*cov));
+	*cov = vget_lane_u8(c, 7);
+
+	return c;
+}
+
+static void
+sover_c_neon(unsigned char *src, _CGInk *ink, int len, unsigned char *dst)
+{
+	uint8x8_t s0 = vdup_n_u8(src[0]);
+	uint8x8_t s1 = vdup_n_u8(src[1]);
+	uint8x8_t s2 = vdup_n_u8(src[2]);
+
+	for (; len >= 8; len -= 8, dst += 32)
+		{
+		uint8x8x4_t d = vld4_u8(dst);
+
+		d.val[0] = lerp_neon(d.val[0], s0, d.val[3]);
+		d.val[1] = lerp_neon(d.val[1], s1, d.val[3]);
+		d.val[2] = lerp_neon(d.val[2], s2, d.val[3]);
+		vst4_u8(dst, d);
+		}
+
+	sover_c(src, ink, len, dst);
+}
+
+static inline void
+blend_4a4_neonx8(unsigned char *src, _CGInk *ink, int len, unsigned char *dst,
+				 BOOL swap)
+{
+	uint8x8_t cov = vdup_n_u8(ink->cov);
+	uint8x8_t z = vdup_n_u8(0);
+
+	for (; len >= 8; len -= 8, dst += 32, src += 32)
+		{
+		uint8x8x4_t d = vld4_u8(dst);
+		uint8x8x4_t s = vld4_u8(src);
+		uint8x8_t a = div255_neon(vmull_u8(div255_neon(
+								vmull_u8(d.val[3], s.val[3])), cov));
+		uint8x8_t k = vorr_u8(vceq_u8(d.val[3], z), vceq_u8(s.val[3], z));
+		uint8x8_t s0 = (swap) ? s.val[2] : s.val[0];
+		uint8x8_t s2 = (swap) ? s.val[0] : s.val[2];
+
+		d.val[0] = vbsl_u8(k, d.val[0], lerp_neon(d.val[0], s0, a));
+		d.val[1] = vbsl_u8(k, d.val[1], lerp_neon(d.val[1], s.val[1], a));
+		d.val[2] = vbsl_u8(k, d.val[2], lerp_neon(d.val[2], s2, a));
+		d.val[3] = vbsl_u8(k, d.val[3], a);
+		vst4_u8(dst, d);
+		}
+
+	if (swap)
+		blend_4a4(src, ink, len, dst);
+	else
+		blend_4a4_bgr(src, ink, len, dst);
+}
+
+static void
+blend_4a4_neon(unsigned char *src, _CGInk *ink, int len, unsigned char *dst)
+{
+	blend_4a4_neonx8(src, ink, len, dst, YES);
+}
+
+static void
+blend_4a4_bgr_neon(unsigned char *src, _CGInk *ink, int len, unsigned char *dst)
+{
+	blend_4a4_neonx8(src, ink, len, dst, NO);
+}
+
+static void
+copy_4a4_rgb_neon(unsigned char *src, _CGInk *ink, int len, unsigned char *dst)
+{
+	for (; len >= 4; len -= 4, dst += 16, src += 16)
+		vst1q_u8(dst, vrev32q_u8(vld1q_u8(src)));
+
+	copy_4a4_rgb(src, ink, len, dst);
+}
+
+static void
+sover_p_neon(unsigned char *src, _CGInk *ink, int len, unsigned char *dst)
+{
+	unsigned char *rgba = ink->rgba;
+	unsigned char cov = src[len];
+	uint8x8_t z = vdup_n_u8(0);
+	uint8x8_t c255 = vdup_n_u8(255);
+	uint8x8_t s[4] = { vdup_n_u8(rgba[2]), vdup_n_u8(rgba[1]),
+					   vdup_n_u8(rgba[0]), vdup_n_u8(rgba[3]) };
+	uint8x8_t opaque = vdup_n_u8((rgba[3] == 255) ? 255 : 0);
+
+	if (ink->length != 1)
+		{
+		sover_p(src, ink, len, dst);
+		return;
+		}
+
+	SPAN_GROUPS(8, {
+		uint8x8_t c = coverage_neon(cp, &cov);
+		uint8x8x4_t d = vld4_u8(dp);
+		uint8x8_t ca = div255_neon(vmull_u8(c, d.val[3]));
+		uint8x8_t sa = div255_neon(vmull_u8(c, s[3]));
+		uint8x8_t k = vceq_u8(c, z);
+		uint8x8_t full = vand_u8(opaque, vceq_u8(c, c255));
+		int i;
+
+		if (ink->mask)
+			full = vand_u8(full, vceq_u8(d.val[3], c255));
+		for (i = 0; i < 4; i++)
+			{
+			uint8x8_t r = lerp_neon(d.val[i], (i == 3) ? sa : s[i], ca);
+
+			d.val[i] = vbsl_u8(k, d.val[i], vbsl_u8(full, s[i], r));
+			}
+		vst4_u8(dp, d);
+		});
+}
+
+static void
+din_p_neon(unsigned char *src, _CGInk *ink, int len, unsigned char *dst)
+{
+	unsigned char *rgba = ink->rgba;
+	unsigned char cov = src[len];
+	uint8x8_t z = vdup_n_u8(0);
+	uint8x8_t back[3] = { vdup_n_u8(dst[4]), vdup_n_u8(dst[5]),
+						  vdup_n_u8(dst[6]) };
+	uint8x8_t alpha = vdup_n_u8(rgba[3]);
+
+	if (ink->length != 1)
+		{
+		din_p(src, ink, len, dst);
+		return;
+		}
+
+	SPAN_GROUPS(8, {
+		uint8x8_t c = coverage_neon(cp, &cov);
+		uint8x8x4_t d = vld4_u8(dp);
+		uint8x8_t ca = div255_neon(vmull_u8(c, alpha));
+		uint8x8_t k = vorr_u8(vceq_u8(d.val[3], z), vceq_u8(c, z));
+		int i;
+
+		for (i = 0; i < 3; i++)
+			d.val[i] = vbsl_u8(k, back[i], div255_neon(vmull_u8(d.val[i], ca)));
+		d.val[3] = vbsl_u8(k, d.val[3], div255_neon(vmull_u8(d.val[3], ca)));
+		vst4_u8(dp, d);
+		});
+}
+
+static void
+xor_p_neon(unsigned char *src, _CGInk *ink, int len, unsigned char *dst)
+{
+	unsigned char *rgba = ink->rgba;
+	unsigned char cov = src[len];
+	uint8x8_t z = vdup_n_u8(0);
+	uint8x8_t back[3] = { vdup_n_u8(dst[4]), vdup_n_u8(dst[5]),
+						  vdup_n_u8(dst[6]) };
+	uint8x8_t s[3] = { vdup_n_u8(rgba[2]), vdup_n_u8(rgba[1]),
+					   vdup_n_u8(rgba[0]) };
+	uint8x8_t alpha = vdup_n_u8(rgba[3]);
+
+	if (ink->length != 1)
+		{
+		xor_p(src, ink, len, dst);
+		return;
+		}
+
+	SPAN_GROUPS(8, {
+		uint8x8_t c = coverage_neon(cp, &cov);
+		uint8x8x4_t d = vld4_u8(dp);
+		uint8x8_t ca = div255_neon(vmull_u8(c, alpha));
+		uint8x8_t k = vceq_u8(c, z);
+		uint8x8_t empty = vceq_u8(d.val[3], z);
+		int i;
+
+		for (i = 0; i < 3; i++)
+			d.val[i] = vbsl_u8(k, d.val[i], vbsl_u8(empty,
+								div255_neon(vmull_u8(s[i], ca)), back[i]));
+		d.val[3] = vbsl_u8(k, d.val[3], vbsl_u8(empty, ca, d.val[3]));
+		vst4_u8(dp, d);
+		});
+}
+
+#endif  /* __ARM_NEON */
+
+/* ****************************************************************************
+
+	Kernel dispatch
+
+	_CGContextInitBlendModes() selects the best kernels the CPU supports
+	unless MGSTEP_BLEND names a set (avx2, sse2, neon or scalar).
+
+** ***************************************************************************/
+
+typedef struct _CGBlendKernels {
+
+	const char *isa;
+	int (*supported)(void);
+	_CGBlendFunction sover_c;
+	_CGBlendFunction sover_p;
+	_CGBlendFunction din_p;
+	_CGBlendFunction xor_p;
+	_CGBlendFunction blend_4a4;
+	_CGBlendFunction blend_4a4_bgr;
+	_CGBlendFunction copy_4a4_rgb;
+
+} _CGBlendKernels;
+
+
+static const _CGBlendKernels __kernels[] = {			// best first
+
+#if defined(__x86_64__) || defined(__i386__)
+	{ "avx2", cpu_avx2, sover_c_avx2, sover_p_avx2, din_p_avx2, xor_p_avx2,
+	  blend_4a4_avx2, blend_4a4_bgr_avx2, copy_4a4_rgb_avx2 },
+	{ "sse2", cpu_sse2, sover_c_sse2, sover_p_sse2, din_p_sse2, xor_p_sse2,
+	  blend_4a4_sse2, blend_4a4_bgr_sse2, copy_4a4_rgb_sse2 },
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+	{ "neon", NULL, sover_c_neon, sover_p_neon, din_p_neon, xor_p_neon,
+	  blend_4a4_neon, blend_4a4_bgr_neon, copy_4a4_rgb_neon },
+#endif
+	{ "scalar", NULL, sover_c, sover_p, din_p, xor_p,
+	  blend_4a4, blend_4a4_bgr, copy_4a4_rgb }
+};
+
+#define KERNELS		(sizeof(__kernels) / sizeof(_CGBlendKernels))
+
+static const _CGBlendKernels *__blend = &__kernels[KERNELS - 1];
+
+
+const char *
+_CGBlendUseKernels(const char *isa)			// NULL selects the best supported
+{
+	int i;
+
+	for (i = 0; i < KERNELS; i++)
+		if ((!isa || strcmp(isa, __kernels[i].isa) == 0)
+				&& (!__kernels[i].supported || __kernels[i].supported()))
+			return (__blend = &__kernels[i])->isa;
+
+	return NULL;
+}
+
+_CGBlendFunction
+_CGBlendPathFunction(CGBlendMode mode)
+{
+	switch (mode)
+		{
+		case kCGBlendModeClear:				return clear_p;
+		case kCGBlendModeCopy:				return copy_p;
+		case kCGBlendModeDestinationOver:	return dover_p;
+		case kCGBlendModeDestinationAtop:	return datop_p;
+		case kCGBlendModeDestinationIn:		return __blend->din_p;
+		case kCGBlendModeDestinationOut:	return dout_p;
+		case kCGBlendModeSourceAtop:		return satop_p;
+		case kCGBlendModeSourceIn:			return sin_p;
+		case kCGBlendModeSourceOut:			return sout_p;
+		case kCGBlendModePlusDarker:		return plusd_p;
+		case kCGBlendModeDifference:
+		case kCGBlendModePlusLighter:
+		case kCGBlendModeXOR:				return __blend->xor_p;
+		default:							return __blend->sover_p;
+		}
+}
+
+_CGBlendFunction
+_CGBlendColorFunction(CGBlendMode mode)		// NULL if mode keeps the current
+{
+	switch (mode)
+		{
+		case kCGBlendModeCopy:				return copy_c;
+		case kCGBlendModeNormal:			return __blend->sover_c;
+		case kCGBlendModeDifference:
+		case kCGBlendModePlusLighter:
+		case kCGBlendModeXOR:				return xor_c;
+		case kCGBlendModeClear:
+		case kCGBlendModeDestinationOver:
+		case kCGBlendModeDestinationAtop:
+		case kCGBlendModeDestinationIn:
+		case kCGBlendModeDestinationOut:
+		case kCGBlendModeSourceAtop:
+		case kCGBlendModeSourceIn:
+		case kCGBlendModeSourceOut:
+		case kCGBlendModePlusDarker:		return NULL;
+		default:							return nop_0x0;
+		}
+}
+
+_CGBlendFunction
+_CGBlendImageFunction(CGBlendMode mode, unsigned nc, BOOL bgr)
+{
+	switch (mode)					// FIX ME set src image colorspace ?
 		{
 		case kCGBlendModeSourceAtop:
 			if (nc == 1)
-				CTX->_gs->imageBlend = copy_1a4;
-			else
-				CTX->_gs->imageBlend = (nc == 3) ? copy_3a4 : copy_4a4;
-			break;
+				return copy_1a4;
+			return (nc == 3) ? copy_3a4 : copy_4a4;
 		case kCGBlendModeCopy:
-			if ((a->_f.bitmapInfo & kCGBitmapByteOrderMask) == _kCGBitmapByteOrderBGR)
-				CTX->_gs->imageBlend = (nc == 3) ? copy_3a4 : copy_4a4_bgr;
-			else
-				CTX->_gs->imageBlend = (nc == 3) ? copy_3a4 : copy_4a4_rgb;
-			break;
+			if (bgr)
+				return (nc == 3) ? copy_3a4 : copy_4a4_bgr;
+			return (nc == 3) ? copy_3a4 : __blend->copy_4a4_rgb;
 		case kCGBlendModeNormal:
 		default:
-			if ((a->_f.bitmapInfo & kCGBitmapByteOrderMask) == _kCGBitmapByteOrderBGR)
-				CTX->_gs->imageBlend = blend_4a4_bgr;
-			else
-				CTX->_gs->imageBlend = blend_4a4;
-			break;
+			return (bgr) ? __blend->blend_4a4_bgr : __blend->blend_4a4;
 		}
 }
 
+void
+CGContextSetBlendMode( CGContextRef cx, CGBlendMode mode)
+{
+	if (mode > kCGBlendModePlusLighter)
+		NSLog(@"CG error: invalid blend mode %d", mode);
+	else
+		{
+		_CGBlendFunction colorBlend = _CGBlendColorFunction(mode);
+
+		CTX->_gs->blendMode = mode;
+		CTX->_gs->pathBlend = _CGBlendPathFunction(mode);
+		CTX->_gs->textBlend = sover_t;
+		if (colorBlend)
+			CTX->_gs->colorBlend = colorBlend;
+		if (mode == kCGBlendModeDifference)
+			[[NSColor highlightColor] set];
+		}
+}
+
+void
+_CGContextSetImageBlendMode( CGContextRef cx, CGImage *a)
+{
+	BOOL bgr = (a->_f.bitmapInfo & kCGBitmapByteOrderMask) == _kCGBitmapByteOrderBGR;
+
+	CTX->_gs->imageBlend = _CGBlendImageFunction(CTX->_gs->blendMode,
+												 a->samplesPerPixel, bgr);
+}
+
 void
 _CGContextInitBlendModes(CGContextRef cx)
 {
+	const char *isa;
 	int i;
 
 	for (i = 0; i < 256; i++)
@@ -789,6 +1670,9 @@ _CGContextInitBlendModes(CGContextRef cx)
 
 	for (i = 0; i < 65536; i++)
 		__ltg[i] = (unsigned char)(pow(i/65535.0, 1/GAMMA) * 255.0 + 0.5);
+
+	if (!(isa = getenv("MGSTEP_BLEND")) || !_CGBlendUseKernels(isa))
+		_CGBlendUseKernels(NULL);
 }
 
 void
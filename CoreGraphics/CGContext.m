@@ -287,6 +287,7 @@ CGBitmapContextCreateWithData( void *data,				// bytesPerRow * height
 #else			// XR uses XImage
   ((CGContext *)cx)->_bitmap = _CGContextCreateImage(cx, (CGSize){w,h});
 #endif
+	_clip_reset(cx);						// bitmap bounds, before any clip
 
 	return cx;
 }
@@ -327,6 +328,7 @@ CGContextSaveGState(CGContextRef cx)				// save graphics state
 	gs->current = (gs->context != CONTEXT) ? CONTEXT : nil;
 	gs->stroke.color = [GSTATE->stroke.color retain];
 	gs->fill.color   = [GSTATE->fill.color retain];
+	gs->clipMask     = _CGClipMaskRetain(GSTATE->clipMask);
 //	gs->font         = [GSTATE->font retain];
 
 #ifdef CAIRO_GRAPHICS
@@ -357,9 +359,10 @@ CGContextRestoreGState(CGContextRef cx)				// restore graphics state
 	[gs->fill.color release];
 //	[gs->font release];
 
-//	if (CTX->_gs->mask == YES)						// FIX ME reset clip mask
+	_CGClipMaskRelease(((CGContext *)CONTEXT)->_gs->clipMask);
 
 	memcpy(((CGContext *)CONTEXT)->_gs, gs, sizeof(_GState));
+	gs->clipMask = NULL;							// now owned by context
 
 	_clip_rect(gs->context, gs->clip);				// restore raster clip
 #ifdef CAIRO_GRAPHICS
@@ -451,18 +454,82 @@ CGContextClipToRects(CGContextRef cx, const CGRect rects[], size_t count)
 void
 CGContextClipToMask(CGContextRef cx, CGRect rect, CGImageRef mask)
 {
-	CGBlendMode mode = CTX->_gs->blendMode;
+	CGImage *a = (CGImage *)mask;
+	_CGClipMask *m;
+	NSPoint org;
+	int x, y;
+
+	if (!SURFACE || !a || !a->idata || rect.size.width < 1
+			|| rect.size.height < 1)
+		return;
+
+	rect = NSIntegralRect(rect);
+	org.y = CONVERT_Y(rect, XCANVAS, ISFLIPPED);
+	org.x = NSMinX(rect) + NSMinX(XCANVAS);
+	_clip_rect(cx, (NSRect){org, rect.size});
+
+	m = _CGClipMaskCreate(cx);					// sample mask image nearest
+	for (y = 0; y < m->height; y++)				// gray or alpha per pixel
+		{
+		unsigned char *row = m->data + y * m->width;
+		unsigned iy = (m->y + y - (int)org.y) * a->height / NSHeight(rect);
+		unsigned char *line = a->idata + iy * a->bytesPerRow;
+		int spp = a->samplesPerPixel;
+
+		for (x = 0; x < m->width; x++)
+			{
+			unsigned ix = (m->x + x - (int)org.x) * a->width / NSWidth(rect);
+
+			row[x] = (spp == 4) ? line[ix * 4 + 3] : line[ix * spp];
+			}
+		if (GSTATE->clipMask)					// intersect with prior mask
+			_CGClipMaskCoverage(cx, m->x, m->y + y, row, m->width);
+		}
+	_CGContextSetClipMask(cx, m);
+}
+
+static BOOL
+_path_is_rect(CGPath *p, NSRect *r)			// single pixel aligned rect
+{
+	CGPathElement *e = p->_pe;
+	CGFloat x0, y0, x1, y1;
+	int i, n = p->_count;
+
+	if (n > 1 && e[n-1].type == kCGPathElementCloseSubpath)
+		n--;
+	if (n > 4 && e[n-1].p1.x == e[0].p1.x && e[n-1].p1.y == e[0].p1.y)
+		n--;										// explicit return to start
+	if (n != 4 || e[0].type != kCGPathElementMoveToPoint)
+		return NO;
 
-	CGContextSetBlendMode(cx, kCGBlendModeClear);
-	_CGContextCompositeImage(cx, rect, mask);
-	CTX->_gs->mask = YES;							// FIX ME mask reset
-	CGContextSetBlendMode(cx, mode);
+	for (i = 1; i < p->_count; i++)
+		if (e[i].type != kCGPathElementAddLineToPoint
+				&& e[i].type != kCGPathElementCloseSubpath)
+			return NO;
+
+	for (i = 0; i < 4; i++)
+		if (e[i].p1.x != floor(e[i].p1.x) || e[i].p1.y != floor(e[i].p1.y))
+			return NO;
+												// edges alternate vert, horz
+	if (!(e[0].p1.x == e[1].p1.x && e[1].p1.y == e[2].p1.y
+			&& e[2].p1.x == e[3].p1.x && e[3].p1.y == e[0].p1.y)
+			&& !(e[0].p1.y == e[1].p1.y && e[1].p1.x == e[2].p1.x
+			&& e[2].p1.y == e[3].p1.y && e[3].p1.x == e[0].p1.x))
+		return NO;
+
+	x0 = MIN(e[0].p1.x, e[2].p1.x);
+	x1 = MAX(e[0].p1.x, e[2].p1.x);
+	y0 = MIN(e[0].p1.y, e[2].p1.y);
+	y1 = MAX(e[0].p1.y, e[2].p1.y);
+	*r = (NSRect){{x0, y0}, {x1 - x0, y1 - y0}};
+
+	return YES;
 }
 
 static void
 _clip_path( CGContextRef cx)
 {
-	CGBlendMode mode = CTX->_gs->blendMode;
+	NSRect r;
 
 #ifdef CAIRO_GRAPHICS
 	_cairo_clip(cx);
@@ -472,13 +539,17 @@ _clip_path( CGContextRef cx)
 	if (!SURFACE || !PATH || !PATH_COUNT)
 		return;
 
-	CTX->_f.pathClip = YES;
-	CGContextSetBlendMode(cx, kCGBlendModeClear);
-	_CGContextScanPath(cx);
-	_CGContextFillPath(cx);
-	CTX->_gs->mask = YES;							// FIX ME mask reset
-	CGContextSetBlendMode(cx, mode);
-	CTX->_f.pathClip = NO;
+	if (_path_is_rect(PATH, &r))				// fast path, no mask needed
+		_clip_rect(cx, r);
+	else
+		{
+		CTX->_f.pathClip = YES;
+		_CGContextScanPath(cx);					// clip rect to path bounds
+		CTX->_f.pathClip = NO;
+		_CGClipMaskPath(cx, PATH);
+		}
+
+	CGContextBeginPath(cx);
 }
 
 void
@@ -605,11 +676,15 @@ CGContextShowGlyphsAtPoint( CGContextRef cx,
 	y = CONVERT_Y(rx, XCANVAS, ISFLIPPED);			// convert to device coord
 	x += XCANVAS.origin.x;
 
-	_CGFontLoadGlyphs((CGFont *)nsfont, glyphs, nglyphs);
-
+	_CGGlyphAtlasLock();							// held until drawn so
+	_CGFontLoadGlyphs((CGFont *)nsfont, glyphs, nglyphs);	// no other pass
+													// evicts the glyphs
 	if ((nglyphs * sizeof (unsigned int)) > sizeof (char_local))
 		if (!(char32 = malloc (nglyphs * sizeof (unsigned int))))
+			{
+			_CGGlyphAtlasUnlock();
 			return;
+			}
 
 	for (i = 0; i < nglyphs; i++)
 		{
@@ -621,6 +696,7 @@ CGContextShowGlyphsAtPoint( CGContextRef cx,
 		}
 
 	_CGContextDrawGlyphs(cx, char32, nglyphs, x, y);
+	_CGGlyphAtlasUnlock();
 
 	if (char32 != char_local)
 		free (char32);
@@ -731,6 +807,8 @@ CGContextFillRect( CGContextRef cx, CGRect rect)
 	x = (int)c.origin.x;
 	w = (int)NSMaxX(c);
 	h = (int)NSMaxY(c);
+	if (w <= x || h <= (int)c.origin.y)
+		return;										// clipped to nothing
 
 	color[3] = GSTATE->fill.alpha;
 	color[2] = GSTATE->fill.red;
@@ -756,8 +834,22 @@ CGContextFillRect( CGContextRef cx, CGRect rect)
 		return;
 		}
 
-	for (y = (int)c.origin.y; y < h; y++)
-		CTX->_gs->colorBlend(color, NULL, w-x, _CGRasterLine(cx, x, y, w));
+	if (GSTATE->clipMask)
+		{
+		unsigned char keep[(w-x) * 4];
+
+		for (y = (int)c.origin.y; y < h; y++)
+			{
+			unsigned char *dst = _CGRasterLine(cx, x, y, w);
+
+			memcpy(keep, dst, sizeof(keep));
+			CTX->_gs->colorBlend(color, NULL, w-x, dst);
+			_CGClipMaskMix(cx, x, y, keep, dst, w-x);
+			}
+		}
+	else
+		for (y = (int)c.origin.y; y < h; y++)
+			CTX->_gs->colorBlend(color, NULL, w-x, _CGRasterLine(cx, x, y, w));
 	_CGContextFlushBitmap(cx, (int)c.origin.x, (int)c.origin.y, w, h);
 }
 
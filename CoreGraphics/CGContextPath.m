@@ -285,10 +285,10 @@ _CGContextScanPath (CGContextRef cx)
 			xFlushRect = NSUnionRect(xFlushRect, rect);
 			}
 
-		_CGContextRectNeedsFlush(cx, xFlushRect);
-
-		if (CTX->_f.pathClip)
+		if (CTX->_f.pathClip)						// clips draw nothing
 			_clip_rect( cx, xFlushRect);
+		else
+			_CGContextRectNeedsFlush(cx, xFlushRect);
 		}
 }
 
@@ -19,6 +19,8 @@
 
 #include <CoreGraphics/CoreGraphics.h>
 #include <CoreGraphics/Private/_CGFont.h>
+
+#include <limits.h>
 												// convert Y coord to device
 												// space per flipped state
 #define NO_FLIP_TO_X(a, b)  (NSHeight(b) - NSMinY(a) - NSMinY(b) - NSHeight(a))
@@ -73,7 +75,17 @@ _CGWritePixel(CGContextRef cx, int x, int y, union _CGColorState *cl)
 //	if (p && !CGPathContainsPoint(p, NULL, (CGPoint){x,y}, CTX->_f.eoClip))
 //		return;
 
-	CTX->_gs->colorBlend(color, NULL, 1, _CGRasterLine(cx, x, y, 1));
+	if (GSTATE->clipMask)
+		{
+		unsigned char *dst = _CGRasterLine(cx, x, y, 1);
+		unsigned char keep[4];
+
+		memcpy(keep, dst, 4);
+		CTX->_gs->colorBlend(color, NULL, 1, dst);
+		_CGClipMaskMix(cx, x, y, keep, dst, 1);
+		}
+	else
+		CTX->_gs->colorBlend(color, NULL, 1, _CGRasterLine(cx, x, y, 1));
 }
 
 static inline unsigned char *
@@ -214,13 +226,28 @@ _CGContextCompositeImage( CGContextRef cx, NSRect rect, CGImageRef img)
 	yd = org.y;
 	width = (int)NSWidth(c);
 	height = y + (int)NSHeight(c);
+	if (width <= 0 || height <= y)
+		return;										// clipped to nothing
 
 	if (!a->bytesPerRow || !a->samplesPerPixel || !_CGImageRect( a, (NSRect){x,y,width,height-y}))
 		NSLog(@"_CGContextCompositeImage: invalid src image ***");
 
 	_CGContextSetImageBlendMode( cx, a);
 
-	if (a != ds)	// FIX ME s/b an error but menu title shader does layer flush onto same ctx
+	if (a != ds && GSTATE->clipMask)				// mix result by clip mask
+		{
+		unsigned char keep[width * 4];
+
+		for (; y < height; y++, yd++)
+			{
+			unsigned char *dst = _CGImageLine(ds, xd, yd);
+
+			memcpy(keep, dst, sizeof(keep));
+			CTX->_gs->imageBlend(_CGImageLine(a, x, y), &ink, width, dst);
+			_CGClipMaskMix(cx, xd, yd, keep, dst, width);
+			}
+		}
+	else if (a != ds)	// FIX ME s/b an error but menu title shader does layer flush onto same ctx
 	  for (; y < height; y++, yd++)
 		CTX->_gs->imageBlend(_CGImageLine(a, x, y), &ink, width, _CGImageLine(ds, xd, yd));
 
@@ -303,71 +330,104 @@ _CGContextDrawOutlineGlyph(CGContextRef cx, XRGlyph *glyph, int xorg, int yorg)
 	for (y = yo; y < height; y++, k++)
 		{
 		memcpy(color+3, bitmap+offset+x, width-x);
+		if (GSTATE->clipMask)
+			_CGClipMaskCoverage(cx, xorg, yorg+k, color+3, width-x);
 
 		CTX->_gs->textBlend(color, 255, width-x, _CGRasterLine(cx, xorg, yorg+k, 1));
 		offset += pitch;
 		}
 }
 
+/* ****************************************************************************
+
+	Glyph runs -- the glyphs of a string are placed first and then blended
+	a device row at a time, the coverage of every glyph crossing the row is
+	merged into one span and the span is blended in a single call.
+
+** ***************************************************************************/
+
+void
+_CGGlyphRunCoverage(XRGlyphPosition *run, int count, BOOL mono,
+					int x, int y, unsigned char *cov, int len)
+{											// merge coverage of the glyphs
+	int i;									// in row y into cov[x..x+len]
+
+	for (i = 0; i < count; i++)
+		{
+		XRGlyph *g = run[i].glyph;
+		int gy = y - run[i].y;
+		int x0 = MAX(x, run[i].x);
+		int x1 = MIN(x + len, run[i].x + (int)g->metrics.width);
+		unsigned char *row = (unsigned char *)g->bitmap + gy * g->metrics.pitch;
+		unsigned char *c = cov + (x0 - x);
+		int gx;
+
+		if (gy < 0 || gy >= (int)g->metrics.height)
+			continue;
+
+		for (gx = x0 - run[i].x; gx < x1 - run[i].x; gx++, c++)
+			{
+			unsigned a = (!mono) ? row[gx]					// 1 bit or 8 bit
+					   : (row[gx >> 3] & (0x80 >> (gx & 7))) ? 255 : 0;
+
+			if (a)									// union of overlaps
+				*c = (*c) ? *c + a - (*c * a + 127) / 255 : a;
+		}	}
+}
+
 static void
-_CGContextDrawBitmapGlyph(CGContextRef cx, XRGlyph *glyph, int xorg, int yorg)
+_CGContextDrawGlyphRun(CGContextRef cx, XRGlyphPosition *run, int count, BOOL mono)
 {
-	unsigned char *bitmap = glyph->bitmap;
-	int width = glyph->metrics.width;
-	int height = glyph->metrics.height;
-	int pitch = glyph->metrics.pitch;
-	int x, y;
-	int offset;
-	int xo = 0;		
-	int yo = 0;		
+	int x0 = INT_MAX, y0 = INT_MAX;
+	int x1 = INT_MIN, y1 = INT_MIN;
+	int i, y, w;
 	NSRect c;
-	unsigned char color[4+width];
 
-	color[2] = GSTATE->fill.red;
-	color[1] = GSTATE->fill.green;
-	color[0] = GSTATE->fill.blue;
+	for (i = 0; i < count; i++)
+		{
+		x0 = MIN(x0, run[i].x);
+		y0 = MIN(y0, run[i].y);
+		x1 = MAX(x1, run[i].x + (int)run[i].glyph->metrics.width);
+		y1 = MAX(y1, run[i].y + (int)run[i].glyph->metrics.height);
+		}
 
-	c = _CGGetClipRect(cx, (NSRect){xorg,yorg,width,height});
-	if (c.size.width == 0 || c.size.height == 0)
+	if (count == 0 || x0 >= x1 || y0 >= y1)
+		return;
+	c = _CGGetClipRect(cx, (NSRect){x0, y0, x1 - x0, y1 - y0});
+	if (NSWidth(c) <= 0 || NSHeight(c) <= 0)
 		return;
-#if 0
-	fprintf(stderr,"FBDrawBitmapChar8 glyph clip rect %f %f %f %f\n", c.origin.x, c.origin.y, c.size.width, c.size.height);
-#endif
 
-	xo = ABS(xorg - NSMinX(c));
-	width = xo + NSWidth(c);
+	x0 = (int)NSMinX(c);
+	w = (int)NSWidth(c);
+	y1 = (int)NSMaxY(c);
 
-	yo = ABS(yorg - NSMinY(c));
-	height = yo + NSHeight(c);
+	{
+	union _CGColorState *cl = (mono) ? &GSTATE->fill : &GSTATE->stroke;
+	unsigned char color[3 + w];
 
-	offset = yo * pitch;
-	for (y = yo; y < height; y++)					// convert bitmap to bytes
+	for (y = (int)NSMinY(c); y < y1; y++)
 		{
-		unsigned char span[width];
-		unsigned char *sp = span;
-		int j, k;
+		int l = 0, r = w;
 
-		memset(span, 0, width);
+		memset(color+3, 0, w);
+		_CGGlyphRunCoverage(run, count, mono, x0, y, color+3, w);
 
-		for (x = xo; x < width;)
-			for (j = 0; j < pitch && x < width; j++)
-				{
-				unsigned char b = bitmap[offset+j];
-
-				if (b == 0)
-					sp += 8;						// one pitch increment
-				else
-					for (k = 7; k >= 0; k--)
-						*sp++ = ((b >> k) & 0x1) ? 255 : 0;
-				x += 8;
-				}
+		while (l < r && !color[3+l])				// trim span to coverage
+			l++;
+		while (r > l && !color[3+r-1])
+			r--;
+		if (l == r)
+			continue;
+		if (GSTATE->clipMask)
+			_CGClipMaskCoverage(cx, x0+l, y, color+3+l, r-l);
 
-		memcpy(color+3, span+xo, width-xo);
+		color[l+2] = cl->red;						// color precedes span
+		color[l+1] = cl->green;
+		color[l]   = cl->blue;
 
-		CTX->_gs->textBlend(color, 255, width-xo, _CGRasterLine(cx, xo+xorg, y+yorg, 1));
-
-		offset += pitch;
+		CTX->_gs->textBlend(color+l, 255, r-l, _CGRasterLine(cx, x0+l, y, 1));
 		}
+	}
 }
 
 /* ****************************************************************************
@@ -421,6 +481,9 @@ _CGContextDrawGlyphs( CGContextRef cx, int *char32, int nglyphs, CGFloat x, CGFl
 {
 	AXFontInt *font = (AXFontInt *) ((CGFont *)CTX->_gs->font)->_ftFont;
 	CGAffineTransform tx = (CGAffineTransform){1,0,0,1, -x, -y};
+	XRGlyphPosition run_local[NUM_LOCAL / 4];
+	XRGlyphPosition *run = run_local;
+	int count = 0;
 	NSRect bbx = NSZeroRect;
 	int bbxo = x;
 	int bby = 0;
@@ -433,15 +496,23 @@ _CGContextDrawGlyphs( CGContextRef cx, int *char32, int nglyphs, CGFloat x, CGFl
 
 	if (((CGContext *)cx)->_f.textMatrix)
 		tx = CGAffineTransformConcat( tx, ((CGContext *)cx)->_ttm);
+	if (nglyphs > NUM_LOCAL / 4)		// bitmap glyphs are run with a matrix
+		if (!(run = malloc(nglyphs * sizeof(XRGlyphPosition))))
+			return;
 
 	if (font->face->glyph->format == FT_GLYPH_FORMAT_OUTLINE)
 		{
 		for (i = 0; i < nglyphs; i++)
 			{
 			unsigned int c = char32[i];
-			CGFloat kd = _CGGetKern(font, 0, c);
-			int yy = font->glyphs[c]->metrics.yOff - font->glyphs[c]->metrics.height - font->glyphs[c]->metrics.descent;
-			int h = MAX(font->glyphs[c]->metrics.pitch, font->glyphs[c]->metrics.yOff + font->glyphs[c]->metrics.height);
+			CGFloat kd;
+			int yy, h;
+
+			if (!font->glyphs[c])
+				continue;
+			kd = _CGGetKern(font, 0, c);
+			yy = font->glyphs[c]->metrics.yOff - font->glyphs[c]->metrics.height - font->glyphs[c]->metrics.descent;
+			h = MAX(font->glyphs[c]->metrics.pitch, font->glyphs[c]->metrics.yOff + font->glyphs[c]->metrics.height);
 
 			if (font->glyphs[c]->metrics.y < 0)
 				yy += font->glyphs[c]->metrics.y + 1;	// adj baseline e.g. underscore (95)
@@ -468,7 +539,9 @@ _CGContextDrawGlyphs( CGContextRef cx, int *char32, int nglyphs, CGFloat x, CGFl
 				}
 			else
 				{
-				_CGContextDrawOutlineGlyph(cx, font->glyphs[c], x+kd, y+yy);
+				run[count].glyph = font->glyphs[c];
+				run[count].x = (int)(x+kd);
+				run[count++].y = (int)(y+yy);
 
 				x += font->glyphs[c]->metrics.xOff + GSTATE->spacing;
 				}
@@ -484,10 +557,16 @@ _CGContextDrawGlyphs( CGContextRef cx, int *char32, int nglyphs, CGFloat x, CGFl
 		for (i = 0; i < nglyphs; i++)
 			{
 			unsigned int c = char32[i];
-			int yy = font->glyphs[c]->metrics.yOff - font->glyphs[c]->metrics.height - font->glyphs[c]->metrics.descent;
-			int h = MAX(font->glyphs[c]->metrics.pitch, font->glyphs[c]->metrics.yOff + font->glyphs[c]->metrics.height);
+			int yy, h;
 
-			_CGContextDrawBitmapGlyph(cx, font->glyphs[c], x, y+yy);
+			if (!font->glyphs[c])
+				continue;
+			yy = font->glyphs[c]->metrics.yOff - font->glyphs[c]->metrics.height - font->glyphs[c]->metrics.descent;
+			h = MAX(font->glyphs[c]->metrics.pitch, font->glyphs[c]->metrics.yOff + font->glyphs[c]->metrics.height);
+
+			run[count].glyph = font->glyphs[c];
+			run[count].x = (int)x;
+			run[count++].y = (int)(y+yy);
 			x += font->glyphs[c]->metrics.xOff;
 
 			bby = (bby>0) ? MIN(bby, y+yy) : y+yy;
@@ -495,6 +574,12 @@ _CGContextDrawGlyphs( CGContextRef cx, int *char32, int nglyphs, CGFloat x, CGFl
 			bbh = MAX(h + ABS(font->glyphs[c]->metrics.descent), bbh );
 		}	}
 
+	if (count > 0)									// blend run row by row
+		_CGContextDrawGlyphRun(cx, run, count,
+				font->face->glyph->format != FT_GLYPH_FORMAT_OUTLINE);
+	if (run != run_local)
+		free(run);
+
 //	NSLog(@"FlushCanvas X rect (%d, %d), (%d, %d)", bbxo, bby, bbw, bbh);
 	if (((CGContext *)cx)->_f.textMatrix)
 		{
@@ -24,6 +24,7 @@
 #include <AppKit/NSWindow.h>
 
 #include <fcntl.h>
+#include <unistd.h>
 #include <sys/mman.h>
 
 
@@ -72,29 +73,147 @@ CGContextRef CGDisplayGetDrawingContext( CGDirectDisplayID d )
 @implementation _NSScreen
 @end
 
+/* ****************************************************************************
+
+	_fb_open_file  --  file backed fake frame buffer
+
+	MGSTEP_FRAMEBUFFER names a file used in place of /dev/fb0, sized and laid
+	out per MGSTEP_FRAMEBUFFER_MODE (WxHxBPP, default 640x480x32, 15 bpp is
+	RGB 555) so the FB backend can run without a display, e.g. in CI.
+
+** ***************************************************************************/
+
+static void
+_fb_open_file(CGDisplay *d, const char *path)
+{
+	const char *mode = getenv("MGSTEP_FRAMEBUFFER_MODE");
+	struct fb_var_screeninfo *v = &d->_vinfo;
+	int w = 640, h = 480, bpp = 32;
+
+	if (mode && sscanf(mode, "%dx%dx%d", &w, &h, &bpp) != 3)
+		NSLog(@"FB: bad MGSTEP_FRAMEBUFFER_MODE %s", mode);
+
+	memset(v, 0, sizeof(struct fb_var_screeninfo));
+	v->xres = v->xres_virtual = w;
+	v->yres = v->yres_virtual = h;
+	v->bits_per_pixel = (bpp == 15) ? 16 : bpp;
+	if (bpp == 15 || bpp == 16)
+		{
+		v->red   = (struct fb_bitfield){ (bpp == 15) ? 10 : 11, 5, 0 };
+		v->green = (struct fb_bitfield){ 5, (bpp == 15) ? 5 : 6, 0 };
+		v->blue  = (struct fb_bitfield){ 0, 5, 0 };
+		}
+	else										// BGR byte order
+		{
+		v->red   = (struct fb_bitfield){ 16, 8, 0 };
+		v->green = (struct fb_bitfield){ 8, 8, 0 };
+		v->blue  = (struct fb_bitfield){ 0, 8, 0 };
+		}
+
+	memset(&d->_finfo, 0, sizeof(struct fb_fix_screeninfo));
+	strncpy(d->_finfo.id, "mGSTEP file", sizeof(d->_finfo.id) - 1);
+	d->_finfo.line_length = w * v->bits_per_pixel / 8;
+	d->_finfo.ypanstep = 1;
+	d->_finfo.smem_len = d->_finfo.line_length * h * 2;	// room to flip
+
+	if ((d->_fbd = open(path, O_RDWR|O_CREAT, 0644)) == -1
+			|| ftruncate(d->_fbd, d->_finfo.smem_len) == -1)
+		[NSException raise: NSGenericException
+					 format:@"Unable to create frame buffer file %s.", path];
+	d->_isFile = YES;
+}
+
+/* ****************************************************************************
+
+	_fb_init_pages  --  MGSTEP_FB_PAGEFLIP enables double buffering when the
+	virtual resolution holds two pages and the driver can pan to the second.
+	The console's var screeninfo is saved to be restored on close.
+
+** ***************************************************************************/
+
+static void
+_fb_init_pages(CGDisplay *d)
+{
+	struct fb_var_screeninfo v = d->_vinfo;
+	int page;
+
+	d->_pages = 1;
+	d->_savedVinfo = d->_vinfo;
+	d->_vinfoChanged = NO;
+	if (!getenv("MGSTEP_FB_PAGEFLIP"))
+		return;
+
+	if (d->_isFile)
+		d->_vinfo.yres_virtual = d->_vinfo.yres * 2;
+	else if (v.yres_virtual < v.yres * 2)
+		{
+		v.yres_virtual = v.yres * 2;			// ask the driver for 2 pages
+		if (ioctl(d->_fbd, FBIOPUT_VSCREENINFO, &v) == 0)
+			{
+			d->_vinfoChanged = YES;				// line length and memory
+			ioctl(d->_fbd, FBIOGET_VSCREENINFO, &d->_vinfo);	// may change
+			if (ioctl(d->_fbd, FBIOGET_FSCREENINFO, &d->_finfo))
+				[NSException raise: NSGenericException
+					format:@"Error getting fixed Framebuffer screen info."];
+		}	}
+
+	page = d->_finfo.line_length * d->_vinfo.yres;
+	if (d->_vinfo.yres_virtual < d->_vinfo.yres * 2
+			|| d->_finfo.ypanstep == 0 || d->_finfo.smem_len < page * 2)
+		{
+		NSLog(@"FB: virtual resolution does not allow page flipping\n");
+		return;
+		}
+
+	d->_vinfo.yoffset = 0;
+	if (!d->_isFile && ioctl(d->_fbd, FBIOPAN_DISPLAY, &d->_vinfo))
+		{
+		NSLog(@"FB: FBIOPAN_DISPLAY failed, page flipping disabled\n");
+		return;
+		}
+
+	d->_vinfoChanged = !d->_isFile;
+	d->_pages = 2;
+	NSLog(@"FB: page flipping enabled\n");
+}
+
 CGDisplay *
 _CGInitDisplay( CGDisplay *d )
 {
-	if ((d->_fbd = open("/dev/fb0", O_RDWR)) == -1) 		// connect to fb
-		[NSException raise: NSGenericException
-					 format:@"Unable to open Linux Framebuffer /dev/fb0."];
+	const char *path = getenv("MGSTEP_FRAMEBUFFER");
 
-    if (ioctl(d->_fbd, FBIOGET_FSCREENINFO, &d->_finfo))
-		[NSException raise: NSGenericException
-					 format:@"Error getting fixed Framebuffer screen info."];
+	if (path)
+		_fb_open_file(d, path);
+	else
+		{
+		if ((d->_fbd = open("/dev/fb0", O_RDWR)) == -1) 	// connect to fb
+			[NSException raise: NSGenericException
+						 format:@"Unable to open Linux Framebuffer /dev/fb0."];
 
-    if (ioctl(d->_fbd, FBIOGET_VSCREENINFO, &d->_vinfo))
-		[NSException raise: NSGenericException
-					 format:@"Error getting variable Framebuffer screen info."];
+		if (ioctl(d->_fbd, FBIOGET_FSCREENINFO, &d->_finfo))
+			[NSException raise: NSGenericException
+						 format:@"Error getting fixed Framebuffer screen info."];
+
+		if (ioctl(d->_fbd, FBIOGET_VSCREENINFO, &d->_vinfo))
+			[NSException raise: NSGenericException
+						 format:@"Error getting variable Framebuffer screen info."];
+		}
 
+	_fb_init_pages(d);
 											// Determine screen size in bytes
     d->_bytesPerPixel = d->_vinfo.bits_per_pixel / 8;
-    d->_screensize = d->_vinfo.xres * d->_vinfo.yres * d->_bytesPerPixel;
+    d->_screensize = d->_finfo.line_length * d->_vinfo.yres;
+    d->_mapsize = d->_screensize * d->_pages;
 											// Memory map frame buffer device
-    d->_fbp = (char *)mmap(0, d->_screensize, PROT_READ|PROT_WRITE, MAP_SHARED, d->_fbd, 0);
-    if (PTR2INT(d->_fbp) == -1)
+    d->_fbmem = (char *)mmap(0, d->_mapsize, PROT_READ|PROT_WRITE, MAP_SHARED, d->_fbd, 0);
+    if (PTR2INT(d->_fbmem) == -1)
 		[NSException raise: NSGenericException
 					 format:@"Failed to memory map the framebuffer device."];
+	d->_fbp = d->_fbmem;
+	d->_page = 0;
+	d->_stale = NSZeroRect;
+	if (d->_pages > 1)						// back page starts as a copy
+		memcpy(d->_fbmem + d->_screensize, d->_fbmem, d->_screensize);
 
     NSLog(@"FB: Mapped framebuffer device to memory.\n");
 	NSLog(@"FB: Bits per pixel %d\n", d->_vinfo.bits_per_pixel);
@@ -112,9 +231,17 @@ _CGInitDisplay( CGDisplay *d )
 void
 _CGCloseDisplay(CGDisplay *d)
 {
-    munmap(d->_fbp, d->_screensize);
+    munmap(d->_fbmem, d->_mapsize);
+	if (d->_vinfoChanged)					// give the console back its
+		{									// resolution and first page
+		d->_savedVinfo.yoffset = 0;
+		if (ioctl(d->_fbd, FBIOPUT_VSCREENINFO, &d->_savedVinfo))
+			NSLog(@"FB: unable to restore variable screen info\n");
+		ioctl(d->_fbd, FBIOPAN_DISPLAY, &d->_savedVinfo);
+		d->_vinfoChanged = NO;
+		}
     close(d->_fbd);
-	d->_fbp = NULL;
+	d->_fbmem = d->_fbp = NULL;
 	d->_fbd = -1;
 }
 
@@ -253,6 +380,9 @@ _CGInitDisplay( CGDisplay *d )
 	if (XShapeQueryExtension(d->xDisplay, &eventp, &errorp))
 		d->_sf.hasShape = YES;
 
+	if (!getenv("MGSTEP_NO_SHM") && XShmQueryExtension(d->xDisplay))
+		d->_sf.hasShm = YES;					// MIT-SHM, may fail to attach
+
 	return d;
 }
 
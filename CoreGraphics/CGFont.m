@@ -22,8 +22,11 @@
 #include <CoreGraphics/Private/_CGFont.h>
 #include <CoreGraphics/Private/encoding.h>
 
+#include <pthread.h>
 
-#define FONT_MAX_GLYPH_MEMORY   (1024 * 1024)
+
+#define GLYPH_ATLAS_MEMORY		(4 * 1024 * 1024)	// all fonts, LRU trimmed
+#define GLYPH_ATLAS_BUCKETS		1024				// initial, power of 2
 
 #define X_SIZE(face,a)    ((face)->available_sizes[a].x_ppem)
 #define Y_SIZE(face,a)    ((face)->available_sizes[a].y_ppem)
@@ -94,18 +97,249 @@ _CGConfigureFace (AXFontInt *font)
 }
 
 static unsigned long
-_HashGlyphKeyPrefix(FT_Matrix *matrix)
+_HashGlyphTransform(AXFontInt *font)
 {
-	unsigned char *m = (unsigned char *)matrix;
-	unsigned long hash = m[0];
+	unsigned char *m = (unsigned char *)&font->matrix;
+	unsigned long hash = font->xsize + (font->ysize << 16);
 	unsigned int i;
 
-	for (i = 1; i < sizeof(FT_Matrix); i++)					// sdbm hash
+	for (i = 0; i < sizeof(FT_Matrix); i++)					// sdbm hash
 		hash = m[i] + (hash << 6) + (hash << 16) - hash;
 
 	return hash;
 }
 
+/* ****************************************************************************
+
+	Glyph atlas -- the rasterized glyphs of every font in one hash table
+	keyed by font, size, matrix, subpixel phase and render mode, kept in
+	least recently used order and trimmed to GLYPH_ATLAS_MEMORY.  A font's
+	glyphs array points into the atlas for its current matrix so drawing
+	needs no lookup.  Glyphs used by the current _CGFontLoadGlyphs() pass
+	are not evicted by it, a run of text is drawn whole even if it alone
+	exceeds the limit.  A glyph is entered once its bitmap is complete.
+	The atlas and the fonts' glyphs arrays are guarded by __atlasLock.  It
+	is recursive, callers that draw or measure loaded glyphs hold it from
+	the load until they are done with them so no other pass evicts them.
+
+** ***************************************************************************/
+
+static struct _GlyphAtlas {
+
+	XRGlyph **buckets;
+	unsigned long size;
+	unsigned long count;
+	unsigned long memory;
+	unsigned long stamp;					// current load pass
+	XRGlyph *newest;
+	XRGlyph *oldest;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+
+} __atlas = {0};
+
+static pthread_mutex_t __atlasLock;
+static pthread_once_t  __atlasOnce = PTHREAD_ONCE_INIT;
+
+
+static void
+_AtlasLockInit(void)
+{
+	pthread_mutexattr_t a;
+
+	pthread_mutexattr_init(&a);
+	pthread_mutexattr_settype(&a, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&__atlasLock, &a);
+	pthread_mutexattr_destroy(&a);
+}
+
+void
+_CGGlyphAtlasLock (void)
+{
+	pthread_once(&__atlasOnce, _AtlasLockInit);
+	pthread_mutex_lock(&__atlasLock);
+}
+
+void
+_CGGlyphAtlasUnlock (void)
+{
+	pthread_mutex_unlock(&__atlasLock);
+}
+
+
+static inline unsigned long
+_AtlasHash(XRGlyphKey *k)
+{
+	unsigned long h = (unsigned long)k->font;
+
+	h = (h ^ k->transform) * 0x9e3779b1;
+	h = (h ^ k->glyph) * 0x9e3779b1;
+	h = (h ^ (k->phase | (k->mode << 16))) * 0x9e3779b1;
+
+	return h ^ (h >> 15);
+}
+
+static inline BOOL
+_AtlasKeyEqual(XRGlyphKey *a, XRGlyphKey *b)
+{
+	return (a->font == b->font && a->transform == b->transform
+			&& a->glyph == b->glyph && a->phase == b->phase
+			&& a->mode == b->mode);
+}
+
+static void
+_AtlasTouch(XRGlyph *g)						// make newest of the load pass
+{
+	g->stamp = __atlas.stamp;
+	if (g == __atlas.newest)
+		return;
+
+	if (g->older)							// unlink
+		g->older->newer = g->newer;
+	else
+		__atlas.oldest = g->newer;
+	g->newer->older = g->older;
+
+	g->older = __atlas.newest;				// link as newest
+	g->newer = NULL;
+	__atlas.newest->newer = g;
+	__atlas.newest = g;
+}
+
+static void
+_AtlasRemove(XRGlyph *g)
+{
+	XRGlyph **b = &__atlas.buckets[_AtlasHash(&g->key) & (__atlas.size - 1)];
+	AXFontInt *font = g->key.font;
+
+	while (*b != g)
+		b = &(*b)->chain;
+	*b = g->chain;
+
+	if (g->older)
+		g->older->newer = g->newer;
+	else
+		__atlas.oldest = g->newer;
+	if (g->newer)
+		g->newer->older = g->older;
+	else
+		__atlas.newest = g->older;
+
+	if (font->hash == g->key.transform && font->glyphs[g->key.glyph] == g)
+		font->glyphs[g->key.glyph] = NULL;
+	font->glyph_memory -= g->glyph_memory;
+	__atlas.memory -= g->glyph_memory;
+	__atlas.count--;
+	free(g);
+}
+
+static XRGlyph *
+_AtlasFind(XRGlyphKey *k)
+{
+	XRGlyph *g = NULL;
+
+	if (__atlas.buckets)
+		for (g = __atlas.buckets[_AtlasHash(k) & (__atlas.size - 1)]; g; g = g->chain)
+			if (_AtlasKeyEqual(&g->key, k))
+				{
+				_AtlasTouch(g);
+				__atlas.hits++;
+				break;
+				}
+
+	return g;
+}
+
+static void
+_AtlasInsert(XRGlyph *g)
+{
+	unsigned long i;
+
+	if (__atlas.count >= __atlas.size)		// grow, rehash the chains
+		{
+		unsigned long size = (__atlas.size) ? __atlas.size * 2
+											: GLYPH_ATLAS_BUCKETS;
+		XRGlyph **buckets = calloc(size, sizeof(XRGlyph *));
+
+		if (buckets)
+			{
+			for (i = 0; i < __atlas.size; i++)
+				while (__atlas.buckets[i])
+					{
+					XRGlyph *c = __atlas.buckets[i];
+					XRGlyph **b = &buckets[_AtlasHash(&c->key) & (size - 1)];
+
+					__atlas.buckets[i] = c->chain;
+					c->chain = *b;
+					*b = c;
+					}
+			free(__atlas.buckets);
+			__atlas.buckets = buckets;
+			__atlas.size = size;
+		}	}
+
+	i = _AtlasHash(&g->key) & (__atlas.size - 1);
+	g->chain = __atlas.buckets[i];
+	__atlas.buckets[i] = g;
+
+	g->stamp = __atlas.stamp;
+	g->older = __atlas.newest;
+	g->newer = NULL;
+	if (__atlas.newest)
+		__atlas.newest->newer = g;
+	else
+		__atlas.oldest = g;
+	__atlas.newest = g;
+
+	((AXFontInt *)g->key.font)->glyph_memory += g->glyph_memory;
+	__atlas.memory += g->glyph_memory;
+	__atlas.count++;
+	__atlas.misses++;
+
+	while (__atlas.memory > GLYPH_ATLAS_MEMORY			// trim LRU glyphs not
+			&& __atlas.oldest->stamp != __atlas.stamp)	// used by this pass
+		{
+		_AtlasRemove(__atlas.oldest);
+		__atlas.evictions++;
+		}
+}
+
+void
+_CGGlyphAtlasPurge (CGFontRef f)					// drop glyphs of font
+{
+	AXFontInt *font = (AXFontInt *) ((CGFont *)f)->_ftFont;
+	XRGlyph *g;
+
+	_CGGlyphAtlasLock();
+	for (g = __atlas.oldest; g;)
+		{
+		XRGlyph *n = g->newer;
+
+		if (g->key.font == font)
+			_AtlasRemove(g);
+		g = n;
+		}
+	memset (font->glyphs, '\0', font->num_glyphs * sizeof(XRGlyph *));
+	_CGGlyphAtlasUnlock();
+}
+
+void
+_CGGlyphAtlasStatistics (unsigned long *glyphs,
+						 unsigned long *memory,
+						 unsigned long *hits,
+						 unsigned long *misses,
+						 unsigned long *evictions)
+{
+	_CGGlyphAtlasLock();
+	*glyphs = __atlas.count;
+	*memory = __atlas.memory;
+	*hits = __atlas.hits;
+	*misses = __atlas.misses;
+	*evictions = __atlas.evictions;
+	_CGGlyphAtlasUnlock();
+}
+
 BOOL
 _CGFontSetMatrix (CGFontRef f, CGAffineTransform *m)
 {
@@ -119,27 +353,12 @@ _CGFontSetMatrix (CGFontRef f, CGAffineTransform *m)
 	matrix.yy = (FT_Fixed)( m->d * 0x10000L );
 
     transform = (memcmp(m, &CGAffineTransformIdentity, sizeof(*m)) != 0);
-	if (transform && !font->glyphCache)
-		font->glyphCache = NSCreateMapTable( NSIntMapKeyCallBacks,
-											 NSNonOwnedPointerMapValueCallBacks,
-											 font->num_glyphs);
-	if (font->glyphCache && !((CGFont *)f)->_f.transform)
-		{
-		unsigned long hash = _HashGlyphKeyPrefix(&font->matrix);
-		int i;
-
-		for (i = 0; i < font->num_glyphs; i++)
-			{
-			XRGlyph *xrg = font->glyphs[i];
-
-			if (xrg)									// save glyphs to cache
-				NSMapInsert (font->glyphCache, (void *)hash + (i << 9), xrg);
-		}	}
-														// dump glyph array
+	_CGGlyphAtlasLock();								// glyphs of the old
 	memset (font->glyphs, '\0', font->num_glyphs * sizeof(XRGlyph *));
-	((CGFont *)f)->_f.transform = transform;
-	font->matrix = matrix;
-	font->hash = (void *)_HashGlyphKeyPrefix(&matrix);
+	((CGFont *)f)->_f.transform = transform;			// matrix stay in the
+	font->matrix = matrix;								// atlas
+	font->hash = _HashGlyphTransform(font);
+	_CGGlyphAtlasUnlock();
 
     return transform;
 }
@@ -371,10 +590,17 @@ _CGFontLoadGlyphs (CGFont *f, const FT_UInt *glyphs, int nglyph)
 	FT_Matrix matrix;
 	FT_Face face;
 	BOOL subpixel = NO;
+	XRGlyphKey key = { font, font->hash, 0, 0, 0 };
 
     if (!(face = _CGLockFace ( (CGFontRef)f)))
 		return;
 
+	_CGGlyphAtlasLock();
+	__atlas.stamp++;								// new load pass
+	key.phase = 0;									// text is laid out on
+	key.mode = f->_f.antialias | (f->_f.embolden << 1)	// whole pixels
+			 | (font->rgba << 2);
+
     matrix.xx = matrix.yy = 0x10000L;
     matrix.xy = matrix.yx = 0;
 
@@ -405,13 +631,17 @@ _CGFontLoadGlyphs (CGFont *f, const FT_UInt *glyphs, int nglyph)
 		FT_Bitmap bmp;
 		FT_GlyphSlot gs;
 		XRGlyph *xrg;		// Check if glyph was just loaded, occurs when
-							// drawing same glyph twice in a single string
-		if ((xrg = font->glyphs[glyphindex]))
+							// drawing same glyph twice in a single string,
+							// in the render mode of this pass
+		if ((xrg = font->glyphs[glyphindex]) && xrg->key.mode == key.mode)
+			{
+			_AtlasTouch(xrg);
 			continue;
-		if (((CGFont *)f)->_f.transform)
-		  if ((xrg = NSMapGet(font->glyphCache, font->hash + (glyphindex << 9))))
+			}
+		key.glyph = glyphindex;
+		if ((xrg = _AtlasFind(&key)))
 		  	{
-			font->glyphs[glyphindex] = xrg;		// restore cached to glyph array
+			font->glyphs[glyphindex] = xrg;		// atlas glyph to glyph array
 			continue;
 			}
 							// load glyph image into slot (erasing previous img)
@@ -491,9 +721,7 @@ _CGFontLoadGlyphs (CGFont *f, const FT_UInt *glyphs, int nglyph)
 		xrg->metrics.y = TRUNC(bbx.top);
 		xrg->metrics.pitch = pitch;			// FIX ME s/b pitchrgba w/subpixel
 		xrg->metrics.descent = TRUNC(bbx.bottom);
-		if (f->_f.transform)
-			NSMapInsert (font->glyphCache, font->hash + (glyphindex << 9), xrg);
-		font->glyphs[glyphindex] = xrg;
+		xrg->key = key;
 //	NSLog(@"FBFont xrg %d %d : %d %d\n", width, height, (int) xrg->metrics.x, (int) xrg->metrics.y);
 
 		if (font->spacing >= FC_MONO)
@@ -536,7 +764,12 @@ _CGFontLoadGlyphs (CGFont *f, const FT_UInt *glyphs, int nglyph)
 			if (bufBitmap != bufLocal)
 				free (bufBitmap);
 			if (!(bufBitmap = (unsigned char *) malloc(size)))
+				{
+				bufBitmap = bufLocal;
+				bufSize = sizeof (bufLocal);
+				free (xrg);
 				continue;
+				}
 			bufSize = size;
 			}
 		memset (bufBitmap, 0, size);
@@ -565,6 +798,7 @@ _CGFontLoadGlyphs (CGFont *f, const FT_UInt *glyphs, int nglyph)
 
 			default:
 				NSLog(@"glyph %d is not in a usable format", (int)glyphindex);
+				free (xrg);
 				continue;
 			}
 
@@ -575,10 +809,11 @@ _CGFontLoadGlyphs (CGFont *f, const FT_UInt *glyphs, int nglyph)
 						 width, height, pitch, hmul, vmul);
 		else
 			memcpy (xrg->bitmap, bufBitmap, size);
-
-		font->glyph_memory += xrg->glyph_memory;
 //		printf("Caching glyph 0x%x size %ld\n", glyphindex, xrg->glyph_memory);
+		_AtlasInsert(xrg);
+		font->glyphs[glyphindex] = xrg;
 		}
+	_CGGlyphAtlasUnlock();
 
 	if (bufBitmap != bufLocal)
 		free (bufBitmap);
@@ -595,7 +830,8 @@ _WidthOfGlyphs (CGFont *font, const FT_UInt *glyphs, int nglyphs)
 	XRGlyph *xrg = NULL;
 	float width;
 
-	_CGFontLoadGlyphs((CGFont *)font, glyphs, nglyphs);
+	_CGGlyphAtlasLock();								// until extents are
+	_CGFontLoadGlyphs((CGFont *)font, glyphs, nglyphs);	// summed
 
     while (nglyphs)
 		{
@@ -650,6 +886,7 @@ _WidthOfGlyphs (CGFont *font, const FT_UInt *glyphs, int nglyphs)
 		extents->xOff = x;
 		extents->yOff = y;
 		}
+	_CGGlyphAtlasUnlock();
 
 ///	width = (float)extents->width;
 	width = (float)extents->xOff;
@@ -796,28 +1033,7 @@ _CGTextWidth (CGFont *font, const char *bytes, int length)
 void
 _CGFontClose (CGFontRef f)
 {
-	AXFontInt *font = (AXFontInt *) ((CGFont *)f)->_ftFont;
-	XRGlyph *xrg;
-	int i;
-
-	if (font->glyphCache)							// sync array and cache
-		{
-		void *k, *v;				// FIX ME sync is inefficient, but some
-		NSMapEnumerator e;			// glyphs may be in cache, array may have
-									// both cached and uncached
-		for (i = 0; i < font->num_glyphs; i++)
-			if ((xrg = font->glyphs[i]))			// save glyphs to cache
-				NSMapInsert (font->glyphCache, font->hash + (i << 9), xrg);
-
-		e = NSEnumerateMapTable (font->glyphCache);
-		while (NSNextMapEnumeratorPair (&e, &k, &v))
-			free(v);
-  		NSFreeMapTable (font->glyphCache);
-		}
-	else											// no transformed glyphs
-		for (i = 0; i < font->num_glyphs; i++)
-			if ((xrg = font->glyphs[i]))
-				free(xrg);
+	_CGGlyphAtlasPurge(f);
 }
 
 AXFontInt *
@@ -848,11 +1064,11 @@ _CGOpenFont(const char *path, float fontSize)
 	memset (font->glyphs, '\0', n * sizeof (XRGlyph *));
 	font->num_glyphs = n;
 	font->glyph_memory = 0;						// glyph cache memory management
-	font->max_glyph_memory = FONT_MAX_GLYPH_MEMORY;
 	font->hint_style = FC_HINT_FULL;			// disable hinting if requested
 //	font->load_flags |= FT_LOAD_NO_HINTING;
 	font->matrix.xy = font->matrix.yx = 0;		// identity matrix
 	font->matrix.xx = font->matrix.yy = 0x10000;
+	font->hash = _HashGlyphTransform(font);
     font->load_flags = FT_LOAD_DEFAULT;			// Compute glyph load flags
 	font->rgba = FC_RGBA_UNKNOWN;				// rgba value
 	font->spacing = FC_PROPORTIONAL;
@@ -113,6 +113,7 @@ _CGLayerCreateContext( CGLayer *ly )
 		CTX->_bitmap = _CGContextCreateImage((CGContextRef)cx, ly->_size);
 
 	[CTX->_gs init];								// init gState
+	_clip_reset((CGContextRef)cx);					// to the bitmap bounds
 
 	return (CGContextRef)cx;
 }
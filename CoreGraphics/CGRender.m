@@ -13,13 +13,18 @@
 */
 
 #include <Foundation/NSString.h>
+#include <Foundation/NSArray.h>
 #include <Foundation/NSException.h>
+#include <Foundation/NSOperation.h>
+#include <Foundation/NSAutoreleasePool.h>
 
 #include <CoreGraphics/CoreGraphics.h>
 #include <CoreGraphics/Private/_CGPath.h>
 
 #include <AppKit/NSColor.h>
 
+#include <unistd.h>
+
 
 #define CTX				((CGContext *)cx)
 #define GSTATE			CTX->_gs
@@ -28,6 +33,9 @@
 
 #define floor_div(a,b)	(((a) < 0) ? ((a) - (b) + 1) / (b) : ((a) / (b)))
 
+#define DIV255(x)		((((x)+128)+(((x)+128)>>8))>>8)
+#define EMUL(a,b)		DIV255((a)*(b))
+
 
 struct _PolygonEdge
 {
@@ -343,10 +351,50 @@ evenOdd(gAET *aet, unsigned char *spans, int xoff)
 		}
 }
 
+typedef struct _RenderBand {
+	CGContextRef cx;
+	gGET *get;									// sorted edges of the path
+	void (*fillRule) (gAET *, unsigned char *, int);
+	_CGInk ink;
+	iRect clip;									// rows of band within clip
+	int xmin;
+	int xmax;
+	_CGClipMask *mask;							// clip mask applied to spans
+	_CGClipMask *plane;							// or clip mask being built
+} RenderBand;
+
+
 static inline void
-Blend( CGContextRef cx, _CGInk *ink, int x, int y, u8 *src, int len, int clipx)
+MaskRow(RenderBand *b, int y, u8 *src, int len, int clipx)
 {
+	_CGClipMask *m = b->plane;
+	UInt8 *row = m->data + (y - m->y) * m->width + (b->clip.x0 - m->x);
+	UInt8 cov = 0;
+	int i;
+
+	while (clipx--)
+		{
+		cov += *src;
+		*src++ = 0;
+		}
+
+	for (i = 0; i < len; i++)					// coverage of the new clip
+		{
+		cov += src[i];
+		src[i] = 0;
+		row[i] = cov;
+		}
+
+	if (b->mask)								// intersect with the old one
+		_CGClipMaskCoverage(b->cx, b->clip.x0, y, row, len);
+}
+
+static inline void
+Blend( RenderBand *b, _CGInk *ink, int y, u8 *src, int len, int clipx)
+{
+	CGContextRef cx = b->cx;
 	CGImage *bmp = (CGImage *)CTX->_bitmap;
+	int x = b->clip.x0;
 	UInt8 *dst = bmp->idata + ( y * bmp->width + x ) * bmp->samplesPerPixel;
 	UInt8 cov = 0;
 
@@ -365,55 +413,68 @@ Blend( CGContextRef cx, _CGInk *ink, int x, int y, u8 *src, int len, int clipx)
 		*src++ = 0;
 		}
 
+	if (b->mask)								// spans to coverage, apply
+		{										// the clip mask and back
+		int i;
+
+		for (i = 0; i < len; i++)
+			src[i] = (cov += src[i]);
+		_CGClipMaskCoverage(cx, x, y, src, len);
+		for (i = len - 1; i > 0; i--)
+			src[i] -= src[i-1];
+		cov = 0;
+		}
+
 	src[len] = cov;
 
 	CTX->_gs->pathBlend(src, ink, len, dst);
 }
 
+/* ****************************************************************************
+
+	RenderRows -- scan the edges of a GET row by row into a spans buffer and
+	blend each pixel row of the clip the edges cross.  A row's coverage is
+	the sum of the spans of its subpixel scanlines, which depend only on the
+	edges that cross them, so any cut of the GET into bands of whole rows
+	renders the same pixels.  Rows of a clip path are stored in the clip
+	mask being built instead of blended.
+
+** ***************************************************************************/
+
 static void
-_CGContextRenderGET( CGContextRef cx, iRect clip, bool fill)
+RenderRows(RenderBand *b, gGET *get, gAET *aet)
 {
-	void (*fillRule) (gAET *, unsigned char *, int);
-	gGET *get = (gGET *)CTX->_get;
-	gAET *aet = (gAET *)CTX->_aet;
-	int xmax = floor_div(get->bbox.x1, SUBXRES) + 1;
-	int xmin = floor_div(get->bbox.x0, SUBXRES);
-	int need = xmax - xmin + 1 + 4;
+	iRect clip = b->clip;
+	int need = b->xmax - b->xmin + 1 + 4;
 	int clen = clip.x1 - clip.x0;
-	int clipx = clip.x0 - xmin;
-	int xoff = xmin * SUBXRES;
+	int clipx = clip.x0 - b->xmin;
+	int xoff = b->xmin * SUBXRES;
 	unsigned char sbuf[1024];
 	unsigned char *spans;
+	_CGInk ink = b->ink;
 	int y, yn, yc;
-	_CGInk ink = {0,1,255, 0,0,0, GSTATE->mask};
-
-	NSAssert(clip.x0 >= xmin || clip.x1 <= xmax, @"invalid horizontal clip");
-
-	if (CTX->_f.draw == kCGPathEOFill || CTX->_f.draw == kCGPathEOFillStroke)
-		fillRule = evenOdd;
-	else
-		fillRule = nonZeroWinding;
 
 	spans = (need > sizeof(sbuf)) ? malloc(need) : sbuf;
 	memset(spans, 0, need);
 
-	ink.rgba = (fill) ? GSTATE->fill.rgba : GSTATE->stroke.rgba;
-	if ((ink.color = (fill) ? COLOR_FILL : COLOR_STROKE))
-		ink.pattern = ink.color->pattern;
-
 	y = get->edges[0].y;
-	yc = yn = ink.yb = floor_div(y, SUBYRES);
+	yc = yn = floor_div(y, SUBYRES);
 
 	while (aet->length > 0 || get->index < get->length)
 		{
 		if (yn != yc && yc >= clip.y0 && yc < clip.y1)
-			Blend(cx, &ink, xmin + clipx, yc, spans, clen, clipx);
+			{
+			if (b->plane)
+				MaskRow(b, yc, spans, clen, clipx);
+			else
+				Blend(b, &ink, yc, spans, clen, clipx);
+			}
 
 		insertAET(aet, get, y);
 
 		yc = yn;
 		if (yc >= clip.y0 && yc < clip.y1)
-			fillRule(aet, spans, xoff);
+			b->fillRule(aet, spans, xoff);
 
 		advanceAET(aet);
 
@@ -425,12 +486,176 @@ _CGContextRenderGET( CGContextRef cx, iRect clip, bool fill)
 		}
 
 	if (yc >= clip.y0 && yc < clip.y1)
-		Blend(cx, &ink, xmin + clipx, yc, spans, clen, clipx);
+		{
+		if (b->plane)
+			MaskRow(b, yc, spans, clen, clipx);
+		else
+			Blend(b, &ink, yc, spans, clen, clipx);
+		}
 
 	if (spans != sbuf)
 		free(spans);
+}
+
+/* ****************************************************************************
+
+	Banded rendering -- a fill whose clipped bounds cover RENDER_PARALLEL_MIN
+	pixels or more is cut into bands of whole pixel rows, a few per worker
+	of the NSOperation pool (MGSTEP_OPERATION_THREADS or the online CPUs).
+	Each band copies the shared GET's edges that cross it, moves those that
+	start above it to its first scanline in one step and cuts them off at
+	its last, then renders its rows with its own AET and spans buffer.
+	Bands write disjoint rows of the bitmap.
 
-	_CGContextBitmapNeedsFlush(xmin, clip.y0, xmax, clip.y1);
+** ***************************************************************************/
+
+#define RENDER_PARALLEL_MIN	65536
+#define RENDER_BAND_ROWS	16					// fewest rows in a band
+#define RENDER_BANDS_MAX	64
+
+
+@interface _CGRenderOperation : NSOperation
+{
+	RenderBand _band;
+}
+- (id) initWithBand:(RenderBand *)band;
+@end
+
+
+static void
+skipEdge(pEdge *edge, int n)					// n advanceAET() steps at once
+{
+	long long e = edge->e + (long long)n * edge->adjup;
+	long long m = (e > 0) ? (e + edge->adjdown - 1) / edge->adjdown : 0;
+
+	edge->x += n * edge->xinc + m * edge->xdir;	// m extra X steps bring the
+	edge->e = e - m * edge->adjdown;			// error term to (-adjdown, 0]
+	edge->y += n;
+	edge->h -= n;
+}
+
+static void
+RenderBandEdges(RenderBand *b)
+{
+	int s0 = b->clip.y0 * SUBYRES;				// band's subpixel scanlines
+	int s1 = b->clip.y1 * SUBYRES;
+	gGET get = {0};
+	gAET aet = {0};
+	NSUInteger i;
+
+	extendGET(&get);
+	extendAET(&aet);
+
+	for (i = 0; i < b->get->length && b->get->edges[i].y < s1; i++)
+		{
+		pEdge *edge = &b->get->edges[i];
+
+		if (edge->y + edge->h <= s0)			// ends above the band
+			continue;
+		if (get.length + 1 >= get.size)
+			extendGET(&get);
+		get.edges[get.length] = *edge;
+		edge = &get.edges[get.length++];
+		if (edge->y < s0)						// raised to the first line,
+			skipEdge(edge, s0 - edge->y);		// copies stay sorted by Y
+		if (edge->y + edge->h > s1)
+			edge->h = s1 - edge->y;
+		}
+
+	if (get.length > 0)
+		RenderRows(b, &get, &aet);
+
+	free(get.edges);
+	free(aet.edges);
+}
+
+@implementation _CGRenderOperation
+
+- (id) initWithBand:(RenderBand *)band
+{
+	if ((self = [super init]))
+		_band = *band;
+
+	return self;
+}
+
+- (void) main								{ RenderBandEdges(&_band); }
+
+@end
+
+
+static int
+_RenderParts(void)
+{
+	static int parts = 0;						// racing callers agree
+
+	if (parts == 0)
+		{
+		char *s = getenv("MGSTEP_OPERATION_THREADS");
+		long n = (s) ? atol(s) : sysconf(_SC_NPROCESSORS_ONLN);
+
+		parts = (int)MAX(1, MIN(n, RENDER_BANDS_MAX));
+		}
+
+	return parts;
+}
+
+static void
+RenderBands(RenderBand *b, int bands)
+{
+	NSAutoreleasePool *arp = [NSAutoreleasePool new];
+	NSOperationQueue *q = [[NSOperationQueue new] autorelease];
+	NSMutableArray *ops = [NSMutableArray arrayWithCapacity: bands];
+	int rows = b->clip.y1 - b->clip.y0;
+	int i;
+
+	for (i = 0; i < bands; i++)
+		{
+		RenderBand band = *b;
+
+		band.clip.y0 = b->clip.y0 + rows * i / bands;
+		band.clip.y1 = b->clip.y0 + rows * (i + 1) / bands;
+		[ops addObject: [[[_CGRenderOperation alloc] initWithBand: &band]
+							autorelease]];
+		}
+	[q addOperations: ops waitUntilFinished: YES];
+	[arp release];
+}
+
+static void
+_CGContextRenderGET( CGContextRef cx, iRect clip, bool fill, _CGClipMask *m)
+{
+	gGET *get = (gGET *)CTX->_get;
+	RenderBand b = { cx, get, nonZeroWinding, {0,1,255, 0,0,0, GSTATE->mask} };
+	int rows = clip.y1 - clip.y0;
+	int bands = 1;
+
+	b.clip = clip;
+	b.xmax = floor_div(get->bbox.x1, SUBXRES) + 1;
+	b.xmin = floor_div(get->bbox.x0, SUBXRES);
+
+	NSAssert(clip.x0 >= b.xmin || clip.x1 <= b.xmax, @"invalid horizontal clip");
+
+	if (CTX->_f.draw == kCGPathEOFill || CTX->_f.draw == kCGPathEOFillStroke)
+		b.fillRule = evenOdd;
+
+	b.ink.rgba = (fill) ? GSTATE->fill.rgba : GSTATE->stroke.rgba;
+	if ((b.ink.color = (fill) ? COLOR_FILL : COLOR_STROKE))
+		b.ink.pattern = b.ink.color->pattern;
+	b.ink.yb = floor_div(get->edges[0].y, SUBYRES);	// pattern origin row
+	b.mask = GSTATE->clipMask;
+	b.plane = m;
+
+	if (rows * (clip.x1 - clip.x0) >= RENDER_PARALLEL_MIN)
+		bands = MIN(rows / RENDER_BAND_ROWS, 4 * _RenderParts());
+
+	if (bands > 1 && _RenderParts() > 1)
+		RenderBands(&b, MIN(bands, RENDER_BANDS_MAX));
+	else
+		RenderRows(&b, get, (gAET *)CTX->_aet);
+
+	if (!m)
+		_CGContextBitmapNeedsFlush(b.xmin, clip.y0, b.xmax, clip.y1);
 }
 
 void _clip_rect( CGContextRef cx, NSRect rect)
@@ -447,6 +672,8 @@ void _clip_reset( CGContextRef cx)
 {
 	CGImage *a = (CGImage *)CTX->_bitmap;
 
+	_CGContextSetClipMask(cx, NULL);
+
 	CTX->clip.x0 = 0;
 	CTX->clip.x1 = a->width;
 	CTX->clip.y0 = 0;
@@ -454,14 +681,35 @@ void _clip_reset( CGContextRef cx)
 	GSTATE->clip = (NSRect){0, 0, 65535, 65535};
 }
 
-void
-_CGRenderPath(CGContextRef cx, CGPath *p, CGAffineTransform *m, bool fill)
+static void
+_CGContextInitRender( CGContextRef cx, int w, int h)	// GET and AET only, the
+{														// clip is the context's
+	gGET *get = calloc(1, sizeof(gGET));
+	gAET *aet = calloc(1, sizeof(gAET));
+
+	if (!get || !aet)
+		[NSException raise: NSMallocException format:@"malloc failed"];
+	CTX->_get = extendGET(get);
+	CTX->_aet = extendAET(aet);
+	((gGET *)CTX->_get)->bbox.x1 = w;
+	((gGET *)CTX->_get)->bbox.y1 = h;
+}
+
+static void
+RenderPath(CGContextRef cx, CGPath *p, CGAffineTransform *m, bool fill,
+		   _CGClipMask *plane)
 {
 	CGFloat determinant = sqrt(fabs(m->a * m->d - m->b * m->c));
 	CGFloat flatness = MAX(.1, .3 / determinant);	// m vol scale constraint
 	iRect gbox;
 	iRect clip;
 
+	if (!CTX->_get)							// bitmap context, its clip was
+		{									// set as it was created
+		CGImage *a = (CGImage *)CTX->_bitmap;
+
+		_CGContextInitRender(cx, a->width, a->height);
+		}
 	resetGET(((gGET *)CTX->_get), CTX->clip);
 
 	if (p->_count > 0 && p->_pe[0].type != kCGPathElementMoveToPoint)
@@ -505,7 +753,131 @@ _CGRenderPath(CGContextRef cx, CGPath *p, CGAffineTransform *m, bool fill)
 	clip = iRectIntersection(CTX->clip, gbox);
 
 	if (clip.x0 != clip.x1 && ((gGET *)CTX->_get)->length > 0)
-		_CGContextRenderGET(cx, clip, fill);		// get not empty
+		_CGContextRenderGET(cx, clip, fill, plane);	// get not empty
+}
+
+void
+_CGRenderPath(CGContextRef cx, CGPath *p, CGAffineTransform *m, bool fill)
+{
+	RenderPath(cx, p, m, fill, NULL);
+}
+
+/* ****************************************************************************
+
+	Clip masks -- a clip path that is not a pixel aligned rectangle is
+	rendered once into an 8-bit coverage plane the size of the clip rect,
+	multiplied by the plane of any clip it is nested in.  Path spans are
+	scaled by the plane as they are blended, other drawing is mixed back
+	toward the pixels it replaced.  Planes are shared by reference count
+	between saved and current gStates and never written after they are
+	built, so saving a gState costs a retain.
+
+** ***************************************************************************/
+
+_CGClipMask *
+_CGClipMaskCreate(CGContextRef cx)				// empty plane over clip rect
+{
+	_CGClipMask *m = calloc(1, sizeof(_CGClipMask));
+	int w = MAX(0, CTX->clip.x1 - CTX->clip.x0);
+	int h = MAX(0, CTX->clip.y1 - CTX->clip.y0);
+
+	if (!m || (w * h > 0 && !(m->data = calloc(1, w * h))))
+		[NSException raise: NSMallocException format:@"malloc failed"];
+	m->refCount = 1;
+	m->x = CTX->clip.x0;
+	m->y = CTX->clip.y0;
+	m->width = w;
+	m->height = h;
+
+	return m;
+}
+
+_CGClipMask *
+_CGClipMaskRetain(_CGClipMask *m)
+{
+	if (m)
+		m->refCount++;
+
+	return m;
+}
+
+void
+_CGClipMaskRelease(_CGClipMask *m)
+{
+	if (m && --m->refCount == 0)
+		free(m->data), free(m);
+}
+
+void
+_CGContextSetClipMask(CGContextRef cx, _CGClipMask *m)		// takes m
+{
+	_CGClipMaskRelease(GSTATE->clipMask);
+	GSTATE->clipMask = m;
+}
+
+void
+_CGClipMaskPath(CGContextRef cx, CGPath *p)		// intersect clip with path
+{
+	CGAffineTransform m = CGAffineTransformIdentity;
+	_CGClipMask *plane = _CGClipMaskCreate(cx);
+
+	if (plane->data)
+		RenderPath(cx, p, &m, YES, plane);
+	_CGContextSetClipMask(cx, plane);
+}
+
+void											// scale coverage c of len
+_CGClipMaskCoverage(CGContextRef cx, int x, int y, unsigned char *c, int len)
+{												// pixels at x,y by the mask
+	_CGClipMask *m = GSTATE->clipMask;
+	unsigned char *row;
+	int i, n;
+
+	if (!m)
+		return;
+	if (y < m->y || y >= m->y + m->height || x >= m->x + m->width
+			|| x + len <= m->x)
+		{
+		memset(c, 0, len);
+		return;
+		}
+
+	if (x < m->x)
+		{
+		memset(c, 0, m->x - x);
+		c += m->x - x;
+		len -= m->x - x;
+		x = m->x;
+		}
+	if ((n = m->x + m->width - x) < len)
+		{
+		memset(c + n, 0, len - n);
+		len = n;
+		}
+
+	row = m->data + (y - m->y) * m->width + (x - m->x);
+	for (i = 0; i < len; i++)
+		if (row[i] != 255)
+			c[i] = EMUL(c[i], row[i]);
+}
+
+void
+_CGClipMaskMix( CGContextRef cx, int x, int y,
+				unsigned char *before,
+				unsigned char *after, int len)
+{
+	unsigned char m[len];
+	int i, j;
+
+	memset(m, 255, len);
+	_CGClipMaskCoverage(cx, x, y, m, len);
+
+	for (i = 0; i < len; i++, before += 4, after += 4)
+		if (m[i] == 0)
+			memcpy(after, before, 4);
+		else if (m[i] != 255)						// lerp from before to
+			for (j = 0; j < 4; j++)					// after by mask value
+				after[j] = DIV255(before[j] * (255 - m[i]) + after[j] * m[i]);
 }
 
 void
@@ -526,16 +898,14 @@ _CGContextSetWindowCanvas( CGContextRef cx, NSWindow *window )
 
 	if (!CTX->_bitmap)
 		{
-		gGET *get = calloc(1, sizeof(gGET));
-		gAET *aet = calloc(1, sizeof(gAET));
-
-		if (!get || !aet)
-			[NSException raise: NSMallocException format:@"malloc failed"];
-		CTX->_get = extendGET(get);
-		CTX->_aet = extendAET(aet);
-		CTX->clip.x1 = ((gGET *)CTX->_get)->bbox.x1 = w;
-		CTX->clip.y1 = ((gGET *)CTX->_get)->bbox.y1 = h;
+		_CGContextInitRender(cx, w, h);
+		CTX->clip.x1 = w;
+		CTX->clip.y1 = h;
+#ifdef FB_GRAPHICS
 		CTX->_bitmap = (CGImage *)_CGContextCreateImage( cx, (CGSize){w,h} );
+#else
+		CTX->_bitmap = (CGImage *)_CGContextCreateSharedImage( cx, (CGSize){w,h});
+#endif
 		}
 	else
 		CTX->_bitmap = (CGImage *)_CGContextResizeBitmap( cx, (CGSize){w,h});
@@ -67,6 +67,15 @@ typedef struct _CGInkContext {
 
 } _CGInk;
 
+typedef struct _CGClipMask {			// 8-bit coverage of a non-rect clip
+
+	int refCount;							// shared by saved gStates, a
+	int x, y;								// mask is never changed once
+	int width, height;						// built, a new clip makes a new
+	unsigned char *data;					// one (copy on write)
+
+} _CGClipMask;
+
 union _CGColorState {
 
 	struct {
@@ -127,6 +136,7 @@ union _CGColorState {
 
 	NSRect clip;
 	bool mask;
+	_CGClipMask *clipMask;					// device coords alpha plane
 
 #ifndef FB_GRAPHICS
 
@@ -180,6 +190,18 @@ typedef struct _GraphicsContextMeta {
 } _GCMeta;
 
 
+#ifndef FB_GRAPHICS
+
+#define DAMAGE_RECTS  16
+
+typedef struct _CGDamage {				// bitmap rects not yet in the Pixmap
+	int count;
+	XRectangle rects[DAMAGE_RECTS];
+} _CGDamage;
+
+#endif
+
+
 @interface _NSGraphicsContext : NSGraphicsContext
 {
 	_GState *_gs;
@@ -222,6 +244,8 @@ typedef struct _GraphicsContextMeta {
 	Drawable xPixmap;						// xWin backstor canvas (Pixmap)
 	Drawable xDrawable;						// default Drawable (xWin or Pixmap)
 
+	_CGDamage xDamage;						// presented once per flush
+
  #ifdef CAIRO_GRAPHICS
 	void *_cairoContext;					// cairo_t *
 	void *_surface;							// cairo_surface_t * or AGG surface
@@ -243,7 +267,8 @@ typedef struct _GraphicsContextMeta {
 		unsigned int dirtyBitmap:1;
 		unsigned int disableBitmapFlush:1;
 		unsigned int disableWindowFlush:1;
-		unsigned int reserved:15;
+		unsigned int sharedBitmap:1;		// bitmap is an MIT-SHM XImage
+		unsigned int reserved:14;
 	} _f;
 }
 
@@ -274,6 +299,13 @@ extern CGContextRef _CGContext(void);
 extern void _CGContextInitDisplay(CGContextRef cx);
 extern void _CGContextInitBlendModes(CGContextRef cx);
 
+typedef void (*_CGBlendFunction)(unsigned char *, _CGInk *, int, unsigned char *);
+
+extern const char * _CGBlendUseKernels(const char *isa);
+extern _CGBlendFunction _CGBlendPathFunction(CGBlendMode mode);
+extern _CGBlendFunction _CGBlendColorFunction(CGBlendMode mode);
+extern _CGBlendFunction _CGBlendImageFunction(CGBlendMode m, unsigned nc, BOOL bgr);
+
 extern CGContextRef _CGBitmapContextCreate( CGContextRef c, CGSize z);
 
 extern NSInteger _CGContextAllocGState(CGContextRef cx);
@@ -292,6 +324,16 @@ extern void _CGContextDrawShadow(CGContextRef c, CGRect r);
 
 extern NSRect _CGGetClipRect(CGContextRef cx, NSRect r);
 
+extern _CGClipMask * _CGClipMaskCreate(CGContextRef cx);
+extern _CGClipMask * _CGClipMaskRetain(_CGClipMask *m);
+extern void _CGClipMaskPath(CGContextRef cx, CGPath *p);
+extern void _CGContextSetClipMask(CGContextRef cx, _CGClipMask *m);
+extern void _CGClipMaskRelease(_CGClipMask *m);
+extern void _CGClipMaskCoverage(CGContextRef cx, int x, int y, unsigned char *c, int len);
+extern void _CGClipMaskMix( CGContextRef cx, int x, int y,
+							unsigned char *before,
+							unsigned char *after, int len);
+
 extern CGLayer * _CGContextWindowBackingLayer( CGContextRef cx, CGSize z);
 
 extern  void _CGDrawMenuTitleBar( CGContextRef gc, NSRect bounds);
@@ -339,6 +381,11 @@ extern void FBRestoreCursorRect(CGContextRef cx, NSRect rect);
 
 extern void FBDrawImage(CGContextRef cx, CGImage *c, NSPoint src, NSRect rect);
 
+extern void FBFlushRows(CGDisplay *d, const unsigned char *src, int stride,
+						int x, int y, int w, int h);
+extern void FBPageFlip(CGDisplay *d);
+extern void FBStaleRect(CGDisplay *d, NSRect r);
+
 
 #else  /* !FB_GRAPHICS  **************************************** XR Graphics */
 
@@ -368,6 +415,9 @@ extern XImage *XRGetXImageFromRootWindow(CGContextRef cx, NSRect r);
 
 extern void _CGContextDisableBitmapFlush(CGContextRef cx);
 
+extern CGImageRef _CGContextCreateSharedImage(CGContextRef cx, CGSize z);
+extern void       _CGContextPresentDamage(CGContextRef cx);
+
 #endif
 
 #endif /* _H_CGContext */
@@ -27,13 +27,23 @@
 
 @interface _NSScreen : NSScreen
 {
-	char *_fbp;
+	char *_fbp;								// visible page
+	char *_fbmem;							// mapped frame buffer, all pages
+	int _mapsize;
 	int _bytesPerPixel;
-	int _screensize;
+	int _screensize;						// bytes in a page
 	int _fbd;
 
+	int _pages;								// 2 if page flipping
+	int _page;								// visible page
+	NSRect _flushed;						// rows written to the back page
+	NSRect _stale;							// visible page rows back page lacks
+	BOOL _isFile;							// file backed fake frame buffer
+	BOOL _vinfoChanged;						// restore _savedVinfo on close
+
 	struct fb_var_screeninfo _vinfo;
 	struct fb_fix_screeninfo _finfo;
+	struct fb_var_screeninfo _savedVinfo;	// as the console had it
 
 	NSWindow *_visibleWindowList;
 }
@@ -67,7 +77,8 @@
 		unsigned int hasRender:1;
 		unsigned int hasShape:1;
 		unsigned int hasLuzWM:1;
-		unsigned int reserved:27;
+		unsigned int hasShm:1;
+		unsigned int reserved:26;
 	} _sf;
 }
 
@@ -53,15 +53,40 @@ typedef struct _XRGlyphInfo {
 } XRGlyphInfo;
 
 
+typedef struct _XRGlyphKey {
+
+	void *font;						// AXFontInt of face and size
+	unsigned long transform;		// hash of size and glyph matrix
+	unsigned int glyph;				// glyph index
+	unsigned short phase;			// subpixel X offset in 1/4 pixels
+	unsigned short mode;			// antialias, embolden, subpixel order
+
+} XRGlyphKey;
+
+
 typedef struct _XRGlyph {		// Glyphs are stored in this structure
 
     XRGlyphInfo metrics;
     void *bitmap;
     unsigned long glyph_memory;
 
+	XRGlyphKey key;					// glyph atlas entry
+	struct _XRGlyph *chain;			// next in atlas hash bucket
+	struct _XRGlyph *newer;			// LRU order
+	struct _XRGlyph *older;
+	unsigned long stamp;			// atlas load pass that last used it
+
 } XRGlyph;
 
 
+typedef struct _XRGlyphPosition {	// glyph of a run placed in device space
+
+	XRGlyph *glyph;
+	int x, y;
+
+} XRGlyphPosition;
+
+
 typedef struct _GlyphBoundsIntegerRect {
 
 	int left, right;
@@ -106,14 +131,12 @@ typedef struct _AXFontInt {
 	FT_Matrix	matrix;				// glyph transformation matrix
 	FT_Int		load_flags;			// glyph load flags
 
-	NSMapTable *glyphCache;			// tranformed glyphs cache
-    void *hash;						// glyph cache seed
+	unsigned long hash;				// glyph atlas key of size and matrix
 
-    XRGlyph **glyphs;				// glyph cache plain, indexed by glyph ID
+    XRGlyph **glyphs;				// atlas glyphs of matrix, by glyph ID
     int num_glyphs;					// size of glyph bitmap array
 
-    unsigned long  glyph_memory;	// glyph cache mem management
-    unsigned long  max_glyph_memory;
+    unsigned long  glyph_memory;	// font's share of the glyph atlas
 
 } AXFontInt;
 
@@ -131,6 +154,18 @@ extern float _CGTextWidth (CGFont *f, const char *string, int length);
 
 extern BOOL _CGFontSetMatrix (CGFontRef f, CGAffineTransform *m);
 
+extern void _CGGlyphAtlasLock (void);		// held from loading glyphs
+extern void _CGGlyphAtlasUnlock (void);		// until done drawing them
+extern void _CGGlyphAtlasPurge (CGFontRef f);
+extern void _CGGlyphAtlasStatistics (unsigned long *glyphs,
+									 unsigned long *memory,
+									 unsigned long *hits,
+									 unsigned long *misses,
+									 unsigned long *evictions);
+
+extern void _CGGlyphRunCoverage (XRGlyphPosition *run, int count, BOOL mono,
+								 int x, int y, unsigned char *cov, int len);
+
 /* ****************************************************************************
 
   X Logical Font Description pattern
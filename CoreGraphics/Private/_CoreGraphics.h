@@ -21,6 +21,7 @@
 	#include <X11/keysym.h>
 	#include <X11/Xatom.h>
 	#include <X11/extensions/shape.h>
+	#include <X11/extensions/XShm.h>
   #define BOOL XWINDOWSBOOL						// prevent X windows BOOL
 	#include <X11/Xlibint.h>
 	#include <X11/Xmd.h>						// warning
@@ -231,77 +231,270 @@ FBEraseScreen(CGContextRef cx, NSRect rect)
 	CGContextSetBlendMode(cx, kCGBlendModeCopy);
 	CGContextFillRect(cx, rect);
 	CGContextRestoreGState(cx);
+
+	if (CLAYER == &CTX->_fb)
+		FBStaleRect(CTX->_display, NSOffsetRect(rect, CTX->_fb._origin.x,
+													  CTX->_fb._origin.y));
 }
 
+/* ****************************************************************************
+
+	Pixel formats
+
+	Window backing stores are 32 bpp BGRA.  Rows are flushed to the frame
+	buffer by a conversion function selected once for its pixel format, a
+	plain memcpy when it is 32 bpp BGR.  Other layouts are packed from the
+	bitfields reported by the driver.
+
+** ***************************************************************************/
+
+typedef void (*_FBRowFunction)(const unsigned char *, int, unsigned char *);
+
+static _FBRowFunction __flushRow = NULL;
+static struct fb_var_screeninfo *__vinfo = NULL;		// of __flushRow
+
 static void
-putRGBPixel(CGLayer *ly, int x, int y, unsigned char pixel[3])
+bgra_bgrx(const unsigned char *src, int len, unsigned char *dst)
 {
-	CGContextRef cx = ly->context;
-	long location;
-	unsigned char r, g, b, a;
+	memcpy(dst, src, len * 4);
+}
 
-	location = (x+SXOFF) * FBBYTES_PX + (y+SYOFF) * SLINELEN;
-	if (location >= SSIZE || y+SYOFF < 0)
+static void
+bgra_rgbx(const unsigned char *src, int len, unsigned char *dst)
+{
+	for (; len-- > 0; src += 4, dst += 4)
 		{
-		_CGOutOfBoundsAccess(__FUNCTION__, ly, x, y, location);
-		return;
+		dst[0] = src[2];
+		dst[1] = src[1];
+		dst[2] = src[0];
+		dst[3] = src[3];
 		}
+}
 
-//printf("putRGBPixel x y %d %d  %d %d %d\n",(x+XOFF), (y+YOFF), pixel[2],pixel[1],pixel[0]);
-	*(SBASE + location++) = pixel[2];
-	*(SBASE + location++) = pixel[1];
-	*(SBASE + location++) = pixel[0];
-//	*(FBBASE + location) = color[3];
+static void
+bgra_bgr(const unsigned char *src, int len, unsigned char *dst)
+{
+	for (; len-- > 0; src += 4, dst += 3)
+		{
+		dst[0] = src[0];
+		dst[1] = src[1];
+		dst[2] = src[2];
+		}
 }
 
 static void
-getRGBPixel(CGLayer *ly, int x, int y, unsigned char pixel[3])
+bgra_rgb(const unsigned char *src, int len, unsigned char *dst)
 {
-	CGContextRef cx = ly->context;
-	long location;
-	unsigned char r, g, b, a;
+	for (; len-- > 0; src += 4, dst += 3)
+		{
+		dst[0] = src[2];
+		dst[1] = src[1];
+		dst[2] = src[0];
+		}
+}
 
-	location = (x+SXOFF) * FBBYTES_PX + (y+SYOFF) * SLINELEN;
-	if (location >= SSIZE || y+SYOFF < 0)
+static void
+bgra_565(const unsigned char *src, int len, unsigned char *dst)
+{
+	unsigned short *d = (unsigned short *)dst;
+
+	for (; len-- > 0; src += 4)
+		*d++ = ((src[2] & 0xf8) << 8) | ((src[1] & 0xfc) << 3) | (src[0] >> 3);
+}
+
+static void
+bgra_555(const unsigned char *src, int len, unsigned char *dst)
+{
+	unsigned short *d = (unsigned short *)dst;
+
+	for (; len-- > 0; src += 4)
+		*d++ = ((src[2] & 0xf8) << 7) | ((src[1] & 0xf8) << 2) | (src[0] >> 3);
+}
+
+static void
+bgra_bitfield(const unsigned char *src, int len, unsigned char *dst)
+{
+	struct fb_var_screeninfo *v = __vinfo;
+	int n = v->bits_per_pixel / 8;
+
+	for (; len-- > 0; src += 4)
 		{
-		_CGOutOfBoundsAccess(__FUNCTION__, ly, x, y, location);
+		unsigned int p = ((src[2] >> (8 - v->red.length)) << v->red.offset)
+					| ((src[1] >> (8 - v->green.length)) << v->green.offset)
+					| ((src[0] >> (8 - v->blue.length)) << v->blue.offset);
+		int i;
+
+		for (i = 0; i < n; i++, p >>= 8)		// little endian
+			*dst++ = p;
+		}
+}
+
+static _FBRowFunction
+FBRowFunction(CGDisplay *d)
+{
+	struct fb_var_screeninfo *v = &d->_vinfo;
+	int bpp = v->bits_per_pixel;
+	BOOL bgr = (v->red.offset == 16 && v->green.offset == 8 && v->blue.offset == 0);
+	BOOL rgb = (v->red.offset == 0 && v->green.offset == 8 && v->blue.offset == 16);
+	BOOL b8 = (v->red.length == 8 && v->green.length == 8 && v->blue.length == 8);
+
+	__vinfo = v;
+
+	if (bpp == 32 && b8 && bgr)
+		return bgra_bgrx;
+	if (bpp == 32 && b8 && rgb)
+		return bgra_rgbx;
+	if (bpp == 24 && b8 && bgr)
+		return bgra_bgr;
+	if (bpp == 24 && b8 && rgb)
+		return bgra_rgb;
+	if (bpp == 16 && v->red.offset == 11 && v->green.length == 6)
+		return bgra_565;
+	if (bpp == 16 && v->red.offset == 10 && v->green.length == 5)
+		return bgra_555;
+	if (bpp < 8 || bpp > 32 || bpp % 8 || !v->red.length || v->red.length > 8
+			|| !v->green.length || v->green.length > 8
+			|| !v->blue.length || v->blue.length > 8)
+		NSLog(@"FB: unsupported pixel format %d bpp\n", bpp);
+
+	return bgra_bitfield;
+}
+
+/* ****************************************************************************
+
+	Frame buffer rows
+
+	FBFlushRows		convert rows of BGRA pixels into the screen, the back
+					page when page flipping so the update shows in one pan
+	FBPageFlip		pan to the back page, it becomes the visible page
+
+	Rows drawn straight to the visible page are noted as stale in the back
+	page and copied to it before the next flush.
+
+** ***************************************************************************/
+
+static void
+FBCopyPageRect(CGDisplay *d, char *src, char *dst, NSRect r)
+{
+	int x = MAX(0, (int)NSMinX(r));
+	int y = MAX(0, (int)NSMinY(r));
+	int mx = MIN((int)d->_vinfo.xres, (int)NSMaxX(r));
+	int my = MIN((int)d->_vinfo.yres, (int)NSMaxY(r));
+	int line = d->_finfo.line_length;
+	int n = (mx - x) * d->_bytesPerPixel;
+
+	if (n > 0)
+		for (; y < my; y++)
+			memcpy(dst + y * line + x * d->_bytesPerPixel,
+				   src + y * line + x * d->_bytesPerPixel, n);
+}
+
+void
+FBStaleRect(CGDisplay *d, NSRect r)
+{
+	if (d->_pages > 1 && !NSIsEmptyRect(r))
+		d->_stale = NSUnionRect(d->_stale, r);
+}
+
+void
+FBFlushRows(CGDisplay *d, const unsigned char *src, int stride,
+			int x, int y, int w, int h)
+{
+	int line = d->_finfo.line_length;
+	char *page = d->_fbp;
+	int i;
+
+	if (__vinfo != &d->_vinfo)
+		__flushRow = FBRowFunction(d);
+
+	if (x < 0)									// clip to screen
+		src -= x * 4, w += x, x = 0;
+	if (y < 0)
+		src -= y * stride, h += y, y = 0;
+	w = MIN(w, (int)d->_vinfo.xres - x);
+	h = MIN(h, (int)d->_vinfo.yres - y);
+	if (w <= 0 || h <= 0)
 		return;
+
+	if (d->_pages > 1)
+		{
+		page = d->_fbmem + (1 - d->_page) * d->_screensize;
+		if (!NSIsEmptyRect(d->_stale))
+			FBCopyPageRect(d, d->_fbp, page, d->_stale);
+		d->_stale = NSZeroRect;
+		d->_flushed = NSUnionRect(d->_flushed, (NSRect){x, y, w, h});
 		}
 
-	pixel[2] = *(SBASE + location);
-	pixel[1] = *(SBASE + location+1);
-	pixel[0] = *(SBASE + location+2);
-//printf("getRGBPixel x y %d %d  %d %d %d\n",(x+XOFF), (y+YOFF), pixel[2],pixel[1],pixel[0]);
+	page += y * line + x * d->_bytesPerPixel;
+	for (i = 0; i < h; i++, src += stride, page += line)
+		__flushRow(src, w, (unsigned char *)page);
+}
+
+void
+FBPageFlip(CGDisplay *d)
+{
+	char *back;
+
+	if (d->_pages < 2 || NSIsEmptyRect(d->_flushed))
+		return;
+
+	back = d->_fbmem + (1 - d->_page) * d->_screensize;
+	d->_vinfo.yoffset = (1 - d->_page) * d->_vinfo.yres;
+	if (!d->_isFile && ioctl(d->_fbd, FBIOPAN_DISPLAY, &d->_vinfo))
+		{
+		NSLog(@"FB: FBIOPAN_DISPLAY failed, page flipping disabled\n");
+		d->_vinfo.yoffset = d->_page * d->_vinfo.yres;
+		FBCopyPageRect(d, back, d->_fbp, d->_flushed);
+		d->_pages = 1;
+		}
+	else
+		{
+		d->_page = 1 - d->_page;
+		d->_stale = d->_flushed;				// old page lacks the update
+		d->_fbp = back;
+		}
+	d->_flushed = NSZeroRect;
 }
 
 void
 FBFlushRect(CGContext *cx, NSRect srcRect, NSPoint destPoint)
 {
-	int i = (int)srcRect.origin.x;
-	int j = (int)srcRect.origin.y;
-	int mx = (int)MIN(NSMaxX(srcRect), i + cx->_gs->xCanvas.size.width);
-	int my = (int)MIN(NSMaxY(srcRect), j + cx->_gs->xCanvas.size.height);
-	int x = (int)destPoint.x;
-	int y = (int)destPoint.y;
+	CGDisplay *d = cx->_display;
+	CGLayer *ly = cx->_layer;
+	CGImage *img;
+	int x = (int)srcRect.origin.x;
+	int y = (int)srcRect.origin.y;
+	int mx = (int)MIN(NSMaxX(srcRect), x + cx->_gs->xCanvas.size.width);
+	int my = (int)MIN(NSMaxY(srcRect), y + cx->_gs->xCanvas.size.height);
 
 #if 0
   printf("######### FBFlushRect rect %f %f %f %f\n",
 		srcRect.origin.x, srcRect.origin.y,
 		srcRect.size.width, srcRect.size.height);
-  printf("FBFlushRect  %d %d %d %d\n",i, j, mx, my);
+  printf("FBFlushRect  %d %d %d %d\n", x, y, mx, my);
 #endif
 
-	FBFlushCursor((CGContextRef)cx);
-
-	for (j = (int)srcRect.origin.y, y = (int)destPoint.y; j < my; j++, y++)
-		for (i = (int)srcRect.origin.x, x = (int)destPoint.x; i < mx; i++, x++)
-			{
-			unsigned char pixel[3];
+	if (!ly || ly == &(cx->_fb))				// drawn straight to screen
+		return;
 
-			getRGBPixel(cx->_layer, i, j, pixel);  // get px from backing with 0,0 offset
-			putRGBPixel(&(cx->_fb), x, y, pixel);  // put px in fb at window frame offset
-			}
+	img = (CGImage *)((CGContext *)ly->context)->_bitmap;
+	x = MAX(x, -SXOFF);							// clip to backing store
+	y = MAX(y, -SYOFF);
+	mx = MIN(mx, (int)img->width - SXOFF);
+	my = MIN(my, (int)img->height - SYOFF);
+	if (mx <= x || my <= y)
+		return;
 
+	FBFlushCursor((CGContextRef)cx);			// backing has no cursor
+	FBFlushRows(d, SBASE + (y+SYOFF) * SLINELEN + (x+SXOFF) * 4, SLINELEN,
+				(int)destPoint.x + (x - (int)srcRect.origin.x) + (int)cx->_fb._origin.x,
+				(int)destPoint.y + (y - (int)srcRect.origin.y) + (int)cx->_fb._origin.y,
+				mx - x, my - y);
+	if (d->_pages > 1)
+		{
+		FBPageFlip(d);							// screen contexts share the
+		((CGImage *)((CGContext *)cx->_fb.context)->_bitmap)->idata = d->_fbp;
+		}										// root context's bitmap
 	FBDrawCursor((CGContextRef)cx);
 }
 
@@ -309,23 +502,74 @@ FBFlushRect(CGContext *cx, NSRect srcRect, NSPoint destPoint)
 
 	Draw image directly to FB
 
+	Image rows are RGB or RGBA.  They are swapped to BGR in the layer's
+	bitmap, or converted to the frame buffer's format when the layer is the
+	screen.
+
 ** ***************************************************************************/
 
 void
 FBDrawImage(CGContextRef cx, CGImage *c, NSPoint src, NSRect rect)
 {
-	int x, y, i, j;
-	int mx = (int)NSMaxX(rect);
-	int my = (int)NSMaxY(rect);
+	CGLayer *ly = CLAYER;
+	CGImage *dst = (CGImage *)((CGContext *)ly->context)->_bitmap;
+	BOOL screen = (dst->idata == (unsigned char *)FBBASE);
 	int s = MAX(3, c->samplesPerPixel);
 	int stride = c->width * s;
+	int d = (screen) ? FBBYTES_PX : dst->samplesPerPixel;
+	int sx = MAX(0, (int)src.x);
+	int w = MIN((int)NSWidth(rect), (int)c->width - sx);
+	int i = (int)rect.origin.x;
+	int j = (int)rect.origin.y;
+	int my = (int)NSMaxY(rect);
+	int y = (int)src.y;
+	unsigned char row[MAX(0, w) * 4 + 4];
 
 #if 0
-	printf("FBDrawImage s stride mx my %d %d %d %d\n",s, stride, mx, my);
+	printf("FBDrawImage s stride w my %d %d %d %d\n",s, stride, w, my);
 #endif
-	for (i = (int)rect.origin.x, x = (int)src.x; i < mx; i++, x++)
-		for (j = (int)rect.origin.y, y = (int)src.y; j < my; j++, y++)
-			putRGBPixel(CLAYER, i, j, c->idata + ((y * stride) + (x*s)));
+	if (w <= 0)
+		return;
+	if (screen && __vinfo != &CTX->_display->_vinfo)
+		__flushRow = FBRowFunction(CTX->_display);
+
+	for (; j < my && y < (int)c->height; j++, y++)
+		{
+		unsigned char *sp = c->idata + (y * stride) + (sx * s);
+		long location = (i+SXOFF) * d + (j+SYOFF) * SLINELEN;
+		unsigned char *dp = SBASE + location;
+		int k;
+
+		if (y < 0)
+			continue;
+		if (location + w * d > SSIZE || j+SYOFF < 0 || i+SXOFF < 0)
+			{
+			_CGOutOfBoundsAccess(__FUNCTION__, ly, i, j, location);
+			continue;
+			}
+
+		if (!screen)
+			for (k = 0; k < w; k++, sp += s, dp += d)
+				{
+				dp[0] = sp[2];
+				dp[1] = sp[1];
+				dp[2] = sp[0];
+				}
+		else
+			{
+			for (k = 0; k < w; k++, sp += s)
+				{
+				row[k*4]   = sp[2];
+				row[k*4+1] = sp[1];
+				row[k*4+2] = sp[0];
+				row[k*4+3] = 0xff;
+				}
+			__flushRow(row, w, dp);
+		}	}
+
+	if (screen)
+		FBStaleRect(CTX->_display, (NSRect){i+SXOFF, (int)rect.origin.y+SYOFF,
+											w, j - (int)rect.origin.y});
 }
 
 /* ****************************************************************************
@@ -465,6 +709,7 @@ printf("######### FB ClipToRect clip %f %f %f %f\n",
 	if (NSMaxY(rect) > SCREEN_HEIGHT)
 		NSHeight(rect) = SCREEN_HEIGHT - NSMinY(rect);
 	CLIP_RECT = rect;
+	_CGContextSetClipMask(cx, NULL);				// replaces any clip path
 
 	_clip_rect(cx, CLIP_RECT);
 }
@@ -496,7 +741,7 @@ void CGContextClipToRect(CGContextRef cx, CGRect rect)
 
 	r = NSIntersectionRect((NSRect){org, rect.size}, CLIP_RECT);
 
-	_CGContextSetClipRect(cx, r);
+	_clip_rect(cx, r);								// keeps clip mask
 
 #if 0
   printf("######### CGContextClipToRect device clip %f %f %f %f\n",
@@ -513,6 +758,10 @@ void _CGContextRectNeedsFlush(CGContextRef cx, CGRect rect)
 	rect = NSIntersectionRect(rect, (NSRect){0,0, CTX->_gs->xCanvas.size});
 	FLUSH_ME = NSUnionRect(FLUSH_ME, rect);
 
+	if (CLAYER == &CTX->_fb)						// drawn to visible page
+		FBStaleRect(CTX->_display, NSOffsetRect(rect, CTX->_fb._origin.x,
+													  CTX->_fb._origin.y));
+
 	if (FLUSH_ME.origin.y < 0 || FLUSH_ME.origin.x < 0)
 		{
 		NSLog (@"_rectNeedsFlush (%f, %f) (%f, %f)\n",
@@ -563,6 +812,7 @@ void  CGContextSynchronize(CGContextRef cx)									{ }
 
 - (void) dealloc
 {
+	_CGClipMaskRelease(clipMask),	clipMask = NULL;
 	if (_line.dash.lengths)
 		free(_line.dash.lengths),	_line.dash.lengths = NULL;
 
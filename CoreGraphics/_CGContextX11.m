@@ -21,6 +21,10 @@
 #include <AppKit/NSWindow.h>
 #include <AppKit/NSView.h>
 
+#include <limits.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
 
 #ifndef FB_GRAPHICS
 
@@ -49,6 +53,8 @@
 #define	CONVERT_Y(a, b, f)	((f) ? NSMinY(a) + NSMinY(b) : NO_FLIP_TO_X(a, b))
 
 
+static void _shm_release_bitmap(CGContextRef cx);
+
 
 void _CGContextInitDisplay(CGContextRef cx)
 {
@@ -90,6 +96,8 @@ _x11_release_context(CGContextRef cx)
 	Window w = CTX->xWindow;
 	Pixmap p = CTX->xPixmap;
 
+	_shm_release_bitmap(cx);
+	CTX->xDamage.count = 0;
 	CTX->xPixmap = CTX->xWindow = CTX->xDrawable = None;
 	if (w)
 		XDestroyWindow(XDISPLAY, w);				// Destroy the X Window
@@ -315,6 +323,124 @@ XRGetXImageFromRootWindow(CGContextRef cx, NSRect r)
 					 AllPlanes, ZPixmap);
 }
 
+/* ****************************************************************************
+
+	MIT-SHM bitmaps
+
+	A window's bitmap canvas is an XImage in a shared memory segment when the
+	display supports it so XShmPutImage presents damage without copying the
+	pixels through the X socket.  Attach fails on a remote display, which
+	turns SHM off for the session and falls back to XPutImage.
+
+** ***************************************************************************/
+
+static BOOL __shmError = NO;
+
+static int
+_shm_error_handler(Display *d, XErrorEvent *e)
+{
+	__shmError = YES;
+
+	return 0;
+}
+
+static XImage *
+_shm_create_image(CGContextRef cx, int w, int h)
+{
+	XShmSegmentInfo *shm = calloc(1, sizeof(XShmSegmentInfo));
+	XImage *xi;
+	int (*handler)(Display *, XErrorEvent *);
+
+	if (!(xi = XShmCreateImage(XDISPLAY, XVISUAL, XDEPTH, ZPixmap, NULL,
+							   shm, w, h)))
+		return free(shm), NULL;
+
+	if (xi->bits_per_pixel != 32 || xi->bytes_per_line != w * 4)
+		{										// bitmap is packed 32 bpp
+		xi->obdata = NULL;
+		XDestroyImage(xi);
+
+		return free(shm), NULL;
+		}
+
+	shm->shmid = shmget(IPC_PRIVATE, xi->bytes_per_line * h, IPC_CREAT|0600);
+	shm->shmaddr = (shm->shmid < 0) ? (void *)-1 : shmat(shm->shmid, NULL, 0);
+	shm->readOnly = False;
+	xi->data = shm->shmaddr;
+
+	if (shm->shmaddr != (void *)-1)
+		{
+		__shmError = NO;
+		XSync(XDISPLAY, False);
+		handler = XSetErrorHandler(_shm_error_handler);
+		XShmAttach(XDISPLAY, shm);
+		XSync(XDISPLAY, False);
+		XSetErrorHandler(handler);
+		}
+	if (shm->shmid >= 0)						// freed on last detach
+		shmctl(shm->shmid, IPC_RMID, NULL);
+
+	if (shm->shmaddr == (void *)-1 || __shmError)
+		{
+		NSLog(@"MIT-SHM unavailable, using XPutImage");
+		CTX->_display->_sf.hasShm = NO;
+		if (shm->shmaddr != (void *)-1)
+			shmdt(shm->shmaddr);
+		xi->data = NULL;
+		xi->obdata = NULL;
+		XDestroyImage(xi);
+
+		return free(shm), NULL;
+		}
+
+	return xi;
+}
+
+static void
+_shm_release_bitmap(CGContextRef cx)
+{
+	CGImage *img = (CGImage *)CTX->_bitmap;
+	XImage *xi;
+	XShmSegmentInfo *shm;
+
+	if (!CTX->_f.sharedBitmap || !img || !(xi = img->ximage))
+		return;
+
+	shm = (XShmSegmentInfo *)xi->obdata;
+	XShmDetach(XDISPLAY, shm);
+	shmdt(shm->shmaddr);
+	free(shm);
+	xi->obdata = NULL;							// image no longer owns data
+	xi->data = NULL;
+	img->idata = NULL;
+	img->size = 0;
+	CTX->_f.sharedBitmap = NO;
+}
+
+CGImageRef _CGContextCreateSharedImage(CGContextRef cx, CGSize z)
+{
+	int w = z.width;
+	int h = z.height;
+	CGImage *img;
+	XImage *xi;
+
+	if (!CTX->_display->_sf.hasShm || !(xi = _shm_create_image(cx, w, h)))
+		return _CGContextCreateImage(cx, z);
+
+	img = (CGImage *)CGImageCreate(1, 1, 8, 32, 0, NULL, 0, NULL, NULL, 0, 0);
+	img->width = w;
+	img->height = h;
+	img->bytesPerRow = xi->bytes_per_line;
+	img->size = img->bytesPerRow * h;
+	img->idata = (unsigned char *)xi->data;
+	img->ximage = xi;
+	img->_f.externalData = YES;
+	memset (img->idata, 0xff, img->size);
+	CTX->_f.sharedBitmap = YES;
+
+	return (CGImageRef)img;
+}
+
 CGImageRef _CGContextCreateImage(CGContextRef cx, CGSize z)
 {
 	int w = z.width;
@@ -346,6 +472,15 @@ CGImageRef _CGContextResizeBitmap(CGContextRef cx, CGSize z)
 	CGImageRef img = CTX->_bitmap;
 	XImage *xi = ((CGImage *)img)->ximage;
 
+	CTX->xDamage.count = 0;						// old content is discarded
+	if (CTX->_f.sharedBitmap)
+		{
+		_shm_release_bitmap(cx);
+		CGImageRelease(img);
+
+		return _CGContextCreateSharedImage(cx, z);
+		}
+
 	img = _CGImageResize( img, w, h);
 	xi->width = img->width;
 	xi->height = img->height;
@@ -371,6 +506,7 @@ XRUpdateBitmap(CGContextRef cx, NSRect rect, CGImageRef ci)
 	if (rect.size.width <= 0 || rect.size.height <= 0)
 		return;
 
+	_CGContextPresentDamage(cx);					// reads the Drawable
 	org.y = CONVERT_Y(rect, XCANVAS, ISFLIPPED);
 	org.x = NSMinX(rect) + NSMinX(XCANVAS);
 
@@ -407,6 +543,9 @@ XRContextCopyRect( CGContextRef srcGC, NSRect srcRect, NSPoint destPoint )
 		return;
 		}									// FIX ME  validate src rect
 
+	_CGContextPresentDamage(srcGC);				// copy current pixels
+	if (cx != srcGC)
+		_CGContextPresentDamage(cx);
 	XCopyArea(XDISPLAY, ((CGContext *)srcGC)->xDrawable, XDRAWABLE, XGC,
 				srcRect.origin.x, srcRect.origin.y,
 				srcRect.size.width, srcRect.size.height,
@@ -480,6 +619,105 @@ void _CGContextRectNeedsFlush(CGContextRef cx, CGRect r)
 		[CTX->_window _needsFlush];
 }
 
+/* ****************************************************************************
+
+	Damage
+
+	Bitmap rects drawn since the last flush collect in a short list per
+	context and are presented to the Pixmap once per display cycle.  A rect
+	that overlaps or nearly touches a listed one is merged with it, as is any
+	rect once the list is full.  Readers of the Pixmap present first.
+
+** ***************************************************************************/
+
+#define DAMAGE_SLACK  4096						// px a merge may overdraw
+
+static void
+_damage_add(CGContextRef cx, int x, int y, int xm, int ym)
+{
+	CGImage *img = (CGImage *)CTX->_bitmap;
+	_CGDamage *d = &CTX->xDamage;
+	long waste = LONG_MAX;
+	int i, best = 0;
+
+	x = MAX(x, 0);
+	y = MAX(y, 0);
+	xm = MIN(xm, (int)img->width);
+	ym = MIN(ym, (int)img->height);
+	if (xm <= x || ym <= y)
+		return;
+
+	for (i = 0; i < d->count; i++)			// find cheapest rect to grow
+		{
+		XRectangle *r = &d->rects[i];
+		int ux = MIN(x, r->x);
+		int uy = MIN(y, r->y);
+		int uxm = MAX(xm, r->x + r->width);
+		int uym = MAX(ym, r->y + r->height);
+		long grow = (long)(uxm - ux) * (uym - uy)
+				  - (long)r->width * r->height - (long)(xm - x) * (ym - y);
+
+		if (grow < waste)
+			waste = grow, best = i;
+		}
+
+	if (d->count < DAMAGE_RECTS && waste > DAMAGE_SLACK)
+		{
+		d->rects[d->count++] = (XRectangle){x, y, xm - x, ym - y};
+		return;
+		}
+
+	x = MIN(x, d->rects[best].x);
+	y = MIN(y, d->rects[best].y);
+	xm = MAX(xm, d->rects[best].x + d->rects[best].width);
+	ym = MAX(ym, d->rects[best].y + d->rects[best].height);
+	d->rects[best] = (XRectangle){x, y, xm - x, ym - y};
+
+	for (i = d->count; i-- > 0;)			// drop rects the merge covers
+		{
+		XRectangle *r = &d->rects[i];
+
+		if (i != best && r->x >= x && r->y >= y
+				&& r->x + r->width <= xm && r->y + r->height <= ym)
+			{
+			*r = d->rects[--d->count];
+			if (best == d->count)
+				best = i;
+		}	}
+}
+
+void
+_CGContextPresentDamage(CGContextRef cx)
+{
+	CGImage *img = (CGImage *)CTX->_bitmap;
+	_CGDamage *d = &CTX->xDamage;
+	int i;
+
+	if (d->count > 0 && img && XPIXMAP)
+		{
+		XImage *xImage = img->ximage;
+
+		for (i = 0; i < d->count; i++)
+			{
+			XRectangle *r = &d->rects[i];
+
+			DBLog(@"PresentDamage X rect (%d, %d), (%d, %d)",
+					r->x, r->y, r->width, r->height);
+
+			if (CTX->_f.sharedBitmap)
+				XShmPutImage(XDISPLAY, XPIXMAP, XRGC, xImage, r->x, r->y,
+							 r->x, r->y, r->width, r->height, False);
+			else
+				XPutImage(XDISPLAY, XPIXMAP, XRGC, xImage, r->x, r->y,
+						  r->x, r->y, r->width, r->height);
+			}
+		if (CTX->_f.sharedBitmap)			// server must read the segment
+			XSync(XDISPLAY, False);			// before the next frame's draw
+		}
+
+	d->count = 0;
+}
+
 void CGContextFlush( CGContextRef cx)
 {
 	int x = FLUSH_ME.origin.x;				// width/height requires
@@ -494,16 +732,12 @@ void CGContextFlush( CGContextRef cx)
 
 	if (CTX->_f.dirtyBitmap)
 		{
-		CGImage *img = (CGImage *)((CGContext *)cx)->_bitmap;
-
 		CTX->_f.disableBitmapFlush = NO;
 		CTX->_f.dirtyBitmap = NO;
-		if (img && x >= 0 && y >= 0 && width > 0 && height > 0)
-			{
-			XImage *xImage = img->ximage;
-
-			XPutImage(XDISPLAY, XPIXMAP, XRGC, xImage, x, y, x, y, width, height);
-		}	}
+		if (CTX->_bitmap && x >= 0 && y >= 0 && width > 0 && height > 0)
+			_damage_add(cx, x, y, x + width, y + height);
+		}
+	_CGContextPresentDamage(cx);
 
 	XCopyArea(XDISPLAY, XPIXMAP, XWINDOW, XRGC, x, y, width, height, x, y);
 
@@ -513,10 +747,6 @@ void CGContextFlush( CGContextRef cx)
 void
 _CGContextFlushBitmap(CGContextRef cx, int x, int y, int xm, int ym)
 {
-	int width = xm - x;
-	int height = ym - y;
-	CGImage *img = (CGImage *)((CGContext *)cx)->_bitmap;
-
 	DBLog (@"FlushBitmap canvas (%f, %f) (%f, %f)\n",
 			FLUSH_ME.origin.x, FLUSH_ME.origin.y,
 			FLUSH_ME.size.width, FLUSH_ME.size.height);
@@ -527,14 +757,10 @@ _CGContextFlushBitmap(CGContextRef cx, int x, int y, int xm, int ym)
 		return;
 		}
 
-	DBLog(@"FlushBitmap X rect (%d, %d), (%d, %d)", x, y, width, height);
+	DBLog(@"FlushBitmap X rect (%d, %d), (%d, %d)", x, y, xm - x, ym - y);
 
-	if (img && x >= 0 && y >= 0 && width > 0 && height > 0 && XPIXMAP)
-		{
-		XImage *xImage = img->ximage;
-
-		XPutImage(XDISPLAY, XPIXMAP, XRGC, xImage, x, y, x, y, width, height);
-		}
+	if (CTX->_bitmap && XPIXMAP)
+		_damage_add(cx, x, y, xm, ym);
 }
 
 void
@@ -581,6 +807,7 @@ void _CGContextDisableBitmapFlush(CGContextRef cx)
 	else if (xGC && XFreeGC(XDISPLAY, xGC) == BadGC)
 		NSLog(@"_GState -- XFreeGC(): BadGC");
 
+	_CGClipMaskRelease(clipMask),	clipMask = NULL;
 	if (_line.dash.lengths)
 		free(_line.dash.lengths),	_line.dash.lengths = NULL;
 
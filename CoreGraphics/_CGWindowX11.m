@@ -369,6 +369,7 @@ NSLog(@"set as X transient of %@ with id %lu", [w title], [w xWindow]);
 		PSgsave();
 
 		[_backgroundColor set];
+		_CGContextPresentDamage((CGContextRef)_context);
 													// copy exposed rect
 		XCopyArea(XDISPLAY, XPIXMAP, XWINDOW, XGC,	// from pixmap backing
 					r.x, r.y, r.width, r.height, r.x, r.y);
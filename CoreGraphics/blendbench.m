@@ -0,0 +1,123 @@
+/*
+   blendbench.m
+
+   Blend throughput in megapixels per second of each kernel set the CPU
+   supports against the scalar reference: Normal, DestinationIn and XOR
+   path spans with a solid ink, a Normal color fill and Normal and Copy
+   image rows.
+
+   usage:  blendbench [span width] [spans]
+*/
+
+#include <AppKit/AppKit.h>
+#include <CoreGraphics/CoreGraphics.h>
+
+#include <sys/time.h>
+
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* ****************************************************************************
+
+	bench -- blend a span of width pixels n times
+
+	Each pass restores dst and, for path blends, lays down a span with an
+	antialiased edge at each end as the rasterizer would.
+
+** ***************************************************************************/
+
+static void
+bench(const char *name, _CGBlendFunction f, int kind, int width, int n)
+{
+	unsigned char *cov = calloc(width + 1, 1);
+	unsigned char *src = malloc(4 * (width + 1));
+	unsigned char *back = malloc(4 * (width + 1));
+	unsigned char *dst = malloc(4 * (width + 1));
+	unsigned char rgba[4] = {200, 120, 40, 180};
+	_CGInk ink = {rgba, 1, 230, 0, 0, 0, 0};
+	double t;
+	int i;
+
+	for (i = 0; i < 4 * (width + 1); i++)
+		{
+		src[i] = (i & 3) == 3 ? 255 - (i & 0x7f) : i * 7;
+		back[i] = (i & 3) == 3 ? ((i & 0x40) ? 255 : i) : i * 13;
+		}
+
+	t = now();
+	for (i = 0; i < n; i++)
+		{
+		memcpy(dst, back, 4 * (width + 1));
+		if (kind == 0)
+			{
+			cov[0] = 96;
+			cov[1] = 159;
+			cov[width - 2] = 160;
+			cov[width - 1] = 97;
+			cov[width] = 0;
+			f(cov, &ink, width, dst);
+			}
+		else
+			f((kind == 1) ? rgba : src, &ink, width, dst);
+		}
+	t = now() - t;
+
+	printf("  %-24s %8.1f Mpixels/s\n", name, (double)width * n / t / 1000000.0);
+
+	free(cov);
+	free(src);
+	free(back);
+	free(dst);
+}
+
+/* ****************************************************************************
+
+	Benchmark driver
+
+** ***************************************************************************/
+
+int
+main(int argc, char **argv)
+{
+	const char *isa[] = { "scalar", "sse2", "avx2", "neon" };
+	int width = (argc > 1) ? atoi(argv[1]) : 1024;
+	int n = (argc > 2) ? atoi(argv[2]) : 20000;
+	int i;
+
+	if (width < 4)
+		width = 4;
+	printf("blendbench: %d spans of %d pixels\n", n, width);
+
+	for (i = 0; i < sizeof(isa) / sizeof(char *); i++)
+		{
+		if (!_CGBlendUseKernels(isa[i]))
+			continue;
+
+		printf("%s\n", isa[i]);
+		bench("path Normal", _CGBlendPathFunction(kCGBlendModeNormal),
+			  0, width, n);
+		bench("path DestinationIn",
+			  _CGBlendPathFunction(kCGBlendModeDestinationIn), 0, width, n);
+		bench("path XOR", _CGBlendPathFunction(kCGBlendModeXOR), 0, width, n);
+		bench("color Normal", _CGBlendColorFunction(kCGBlendModeNormal),
+			  1, width, n);
+		bench("image Normal", _CGBlendImageFunction(kCGBlendModeNormal,
+			  4, NO), 2, width, n);
+		bench("image Normal BGR", _CGBlendImageFunction(kCGBlendModeNormal,
+			  4, YES), 2, width, n);
+		bench("image Copy", _CGBlendImageFunction(kCGBlendModeCopy,
+			  4, NO), 2, width, n);
+		}
+
+	printf("blendbench complete\n");
+
+	exit (0);
+}
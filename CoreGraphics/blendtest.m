@@ -0,0 +1,146 @@
+/*
+   blendtest.m
+
+   Bit exactness of the SIMD blend kernels against the scalar reference,
+   for the path, color and image blends of every CGBlendMode.
+
+   usage:  make blendtest; ./blendtest
+*/
+
+#include <AppKit/AppKit.h>
+#include <CoreGraphics/CoreGraphics.h>
+
+#define MAX_SPAN	67						// not a multiple of any group
+#define ROUNDS		2000
+
+#define NONE        "\033[0m"
+#define FRED        "\033[31;40m"
+
+
+static unsigned int seed = 2463534242U;
+
+static unsigned char
+rnd(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+
+	return (unsigned char)(seed >> 8);
+}
+
+static unsigned char
+rnd_level(void)							// favour 0 and 255 as in real spans
+{
+	switch (rnd() & 3)
+		{
+		case 0:		return 0;
+		case 1:		return 255;
+		default:	return rnd();
+		}
+}
+
+/* ****************************************************************************
+
+	compare -- run a scalar and a SIMD blend on the same span
+
+	src is a coverage span (plus the carried coverage at src[len]) for path
+	blends, a color for color blends and an RGBA row for image blends.  dst
+	has a pixel past the span which path blends read as the back color.
+
+** ***************************************************************************/
+
+static BOOL
+compare(_CGBlendFunction ref, _CGBlendFunction f, int kind)
+{
+	unsigned char src[2][4 * (MAX_SPAN + 2)];
+	unsigned char dst[2][4 * (MAX_SPAN + 2)];
+	unsigned char rgba[4];
+	_CGInk ink = {rgba, 1, 255, 0, 0, 0, 0};
+	int i, round;
+
+	for (round = 0; round < ROUNDS; round++)
+		{
+		int len = 1 + round % MAX_SPAN;
+
+		for (i = 0; i < 4; i++)
+			rgba[i] = (i == 3) ? rnd_level() : rnd();
+		ink.cov = rnd_level();
+		ink.mask = rnd() & 1;
+
+		for (i = 0; i < 4 * (MAX_SPAN + 2); i++)
+			{
+			src[0][i] = ((i & 3) == 3) ? rnd_level() : rnd();
+			dst[0][i] = ((i & 3) == 3) ? rnd_level() : rnd();
+			}
+		if (kind == 0)						// coverage deltas, mostly none
+			for (i = 0; i <= len; i++)
+				src[0][i] = (rnd() & 1) ? 0 : rnd_level();
+		else if (kind == 1)
+			memcpy(src[0], rgba, 4);
+		memcpy(src[1], src[0], sizeof(src[0]));
+		memcpy(dst[1], dst[0], sizeof(dst[0]));
+
+		ref(src[0], &ink, len, dst[0]);
+		f(src[1], &ink, len, dst[1]);
+
+		if (memcmp(dst[0], dst[1], sizeof(dst[0])) != 0
+				|| memcmp(src[0], src[1], sizeof(src[0])) != 0)
+			return NO;
+		}
+
+	return YES;
+}
+
+int
+main()
+{
+	const char *isa[] = { "sse2", "avx2", "neon" };
+	int i, mode, failures = 0;
+
+	printf("CGBlend SIMD kernel tests\n");
+
+	for (i = 0; i < sizeof(isa) / sizeof(char *); i++)
+		{
+		if (!_CGBlendUseKernels(isa[i]))
+			{
+			printf("%s kernels not supported on this CPU\n", isa[i]);
+			continue;
+			}
+
+		for (mode = 0; mode <= kCGBlendModePlusLighter; mode++)
+			{
+			_CGBlendFunction f[4], ref[4];
+			BOOL ok = YES;
+			int k;
+
+			f[0] = _CGBlendPathFunction(mode);
+			f[1] = _CGBlendColorFunction(mode);
+			f[2] = _CGBlendImageFunction(mode, 4, NO);
+			f[3] = _CGBlendImageFunction(mode, 4, YES);
+			_CGBlendUseKernels("scalar");
+			ref[0] = _CGBlendPathFunction(mode);
+			ref[1] = _CGBlendColorFunction(mode);
+			ref[2] = _CGBlendImageFunction(mode, 4, NO);
+			ref[3] = _CGBlendImageFunction(mode, 4, YES);
+			_CGBlendUseKernels(isa[i]);
+
+			for (k = 0; k < 4; k++)				// shared kernels are exact
+				if (f[k] != ref[k] && !compare(ref[k], f[k], (k < 2) ? k : 2))
+					ok = NO;
+
+			if (ok)
+				printf("PASS:  %s blend mode %d\n", isa[i], mode);
+			else
+				{
+				printf(FRED "FAIL:  %s blend mode %d differs from scalar\n"
+					   NONE, isa[i], mode);
+				failures++;
+			}	}
+		}
+
+	printf("%d failures\n", failures);
+	printf("blendtest complete\n");
+
+	exit (failures ? 1 : 0);
+}
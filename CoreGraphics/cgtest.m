@@ -91,6 +91,65 @@ gauss_convolution_kernel_test()
 		printf("FAIL:  _CGBuildConvolutionKernel invalid kernel size is OK ?\n");
 }
 
+static unsigned char
+alpha_at(CGContextRef cx, int x, int y)
+{
+	CGImage *a = (CGImage *)((CGContext *)cx)->_bitmap;
+
+	return a->idata[y * a->bytesPerRow + x * a->samplesPerPixel + 3];
+}
+
+void
+clip_mask_test()
+{
+	CGContextRef cx = CGBitmapContextCreateWithData(NULL, 64, 64, 8, 0, NULL,
+													0, NULL, NULL);
+	_GState *gs = ((CGContext *)cx)->_gs;
+
+	printf("Clip mask tests\n");
+	CGContextSetRGBFillColor(cx, 1, 0, 0, 1);
+
+	CGContextSaveGState(cx);
+	CGContextClipToRect(cx, (CGRect){{8,8},{48,48}});
+	CGContextAddRect(cx, (CGRect){{16,16},{32,32}});
+	CGContextClip(cx);
+	if (gs->clipMask)
+		printf("FAIL:  pixel aligned rect clip built a mask\n");
+
+	CGContextAddEllipseInRect(cx, (CGRect){{16,16},{32,32}});
+	CGContextClip(cx);								// nested in rect clip
+	if (!gs->clipMask)
+		printf("FAIL:  ellipse clip did not build a mask\n");
+
+	CGContextSaveGState(cx);
+	CGContextAddEllipseInRect(cx, (CGRect){{-16,-16},{64,64}});
+	CGContextEOClip(cx);							// nested in ellipse
+	CGContextFillRect(cx, (CGRect){{0,0},{64,64}});
+	CGContextRestoreGState(cx);
+
+	if (alpha_at(cx, 24, 40) != 255 || alpha_at(cx, 24, 24) != 255)
+		printf("FAIL:  interior of nested clips not painted\n");
+	if (alpha_at(cx, 17, 17) || alpha_at(cx, 46, 46) || alpha_at(cx, 4, 4))
+		printf("FAIL:  painted outside of clip\n");
+
+	CGContextFillRect(cx, (CGRect){{0,0},{64,64}});
+	if (alpha_at(cx, 32, 32) != 255 || alpha_at(cx, 17, 17))
+		printf("FAIL:  ellipse clip not restored\n");
+	else
+		printf("PASS: ellipse clip masks rect fill\n");
+	if (alpha_at(cx, 20, 20) == 0 || alpha_at(cx, 20, 20) == 255)
+		printf("FAIL:  ellipse clip edge is not anti-aliased\n");
+
+	CGContextRestoreGState(cx);
+	if (gs->clipMask)
+		printf("FAIL:  clip mask not released by restore\n");
+	CGContextFillRect(cx, (CGRect){{0,0},{64,64}});
+	if (alpha_at(cx, 4, 4) != 255)
+		printf("FAIL:  clip not reset by restore\n");
+
+	CGContextRelease(cx);
+}
+
 
 int
 main()
@@ -141,6 +200,7 @@ main()
 	path_test0();
 	gauss_convolution_kernel_test();
 	path_test1();
+	clip_mask_test();
 
 	exit (0);
 }
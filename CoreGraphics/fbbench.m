@@ -0,0 +1,169 @@
+/*
+   fbbench.m
+
+   Row transfer throughput of the frame buffer backend without a display,
+   console or mouse.  A file backed fake frame buffer (MGSTEP_FRAMEBUFFER)
+   is opened in each common pixel format and a 32 bpp BGRA backing store
+   is flushed to it full screen, both a pixel at a time as the backend once
+   did and a row at a time through FBFlushRows.  The frame buffer is then
+   checked against the source pixels, fbbench exits 1 on any mismatch.  A
+   last pass flips pages with MGSTEP_FB_PAGEFLIP set.
+
+   usage:  fbbench [file] [WxH] [rounds]
+*/
+
+#include <AppKit/AppKit.h>
+#include <CoreGraphics/CoreGraphics.h>
+
+#include <sys/time.h>
+#include <unistd.h>
+
+
+#ifdef FB_GRAPHICS
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void
+put_pixel(CGDisplay *d, int x, int y, unsigned char *p)
+{
+	long location = x * d->_bytesPerPixel + y * d->_finfo.line_length;
+
+	if (location >= d->_screensize || y < 0)
+		return;
+
+	*(d->_fbp + location++) = p[0];					// 24/32 bpp only
+	*(d->_fbp + location++) = p[1];
+	*(d->_fbp + location) = p[2];
+}
+
+static int
+check(CGDisplay *d, unsigned char *src, int w, int h)
+{
+	struct fb_var_screeninfo *v = &d->_vinfo;
+	int x, y, i, bad = 0;
+
+	for (y = 0; y < h; y += 7)
+		for (x = 0; x < w; x += 3)
+			{
+			unsigned char *s = src + (y * w + x) * 4;
+			unsigned char *p = (unsigned char *)d->_fbp
+							 + y * d->_finfo.line_length + x * d->_bytesPerPixel;
+			unsigned int e = ((s[2] >> (8 - v->red.length)) << v->red.offset)
+						   | ((s[1] >> (8 - v->green.length)) << v->green.offset)
+						   | ((s[0] >> (8 - v->blue.length)) << v->blue.offset);
+			unsigned int a = 0;
+
+			for (i = d->_bytesPerPixel; i-- > 0;)
+				a = (a << 8) | p[i];
+			if (v->bits_per_pixel == 32)
+				a &= 0xffffff;
+			if (a != e)
+				bad++;
+			}
+
+	return bad;
+}
+
+static int
+run(const char *mode, int w, int h, int rounds, unsigned char *src)
+{
+	CGDisplay *d = (CGDisplay *)[_NSScreen alloc];
+	int frame = w * h;
+	char buf[64];
+	double t;
+	int r, x, y, bad;
+
+	snprintf(buf, sizeof(buf), "%dx%dx%s", w, h, mode);
+	setenv("MGSTEP_FRAMEBUFFER_MODE", buf, 1);
+	_CGInitDisplay(d);
+
+	printf("  %-16s", buf);
+	if (d->_bytesPerPixel >= 3 && d->_pages == 1)
+		{
+		t = now();
+		for (r = 0; r < rounds; r++)
+			for (y = 0; y < h; y++)
+				for (x = 0; x < w; x++)
+					put_pixel(d, x, y, src + (y * w + x) * 4);
+		printf(" per pixel %8.1f fps", rounds / (now() - t));
+		}
+	else
+		printf(" %23s", "");
+
+	t = now();
+	for (r = 0; r < rounds; r++)
+		{
+		FBFlushRows(d, src, w * 4, 0, 0, w, h);
+		FBPageFlip(d);
+		}
+	t = now() - t;
+	printf("   rows %8.1f fps %8.1f Mpx/s", rounds / t, frame * rounds / t / 1e6);
+
+	if (d->_pages > 1)
+		printf("   page %d yoffset %d", d->_page, d->_vinfo.yoffset);
+	bad = check(d, src, w, h);
+	printf("   %s\n", (bad) ? "MISMATCH" : "ok");
+
+	_CGCloseDisplay(d);
+
+	return bad;
+}
+
+/* ****************************************************************************
+
+	Benchmark driver
+
+** ***************************************************************************/
+
+int
+main(int argc, char **argv)
+{
+	const char *file = (argc > 1) ? argv[1] : "/tmp/fbbench.fb";
+	int w = 800, h = 480;
+	int rounds = (argc > 3) ? atoi(argv[3]) : 100;
+	const char *modes[] = { "32", "24", "16", "15" };
+	unsigned char *src;
+	int i, bad = 0;
+
+	if (argc > 2)
+		sscanf(argv[2], "%dx%d", &w, &h);
+
+	src = malloc(w * h * 4);
+	for (i = 0; i < w * h * 4; i++)
+		src[i] = (i * 2654435761u) >> 13;
+
+	setenv("MGSTEP_FRAMEBUFFER", file, 1);
+	printf("fbbench: %s %dx%d, %d rounds\n", file, w, h, rounds);
+
+	for (i = 0; i < sizeof(modes) / sizeof(char *); i++)
+		bad += run(modes[i], w, h, rounds, src);
+
+	setenv("MGSTEP_FB_PAGEFLIP", "1", 1);
+	bad += run("32", w, h, rounds + 1, src);
+
+	unlink(file);
+	free(src);
+	printf("fbbench %s\n", (bad) ? "FAILED" : "complete");
+
+	exit ((bad) ? 1 : 0);
+}
+
+#else
+
+int
+main(int argc, char **argv)
+{
+	printf("fbbench: frame buffer backend only (FB_GRAPHICS)\n");
+
+	exit (0);
+}
+
+#endif  /* FB_GRAPHICS */
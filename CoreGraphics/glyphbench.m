@@ -0,0 +1,200 @@
+/*
+   glyphbench.m
+
+   Glyph throughput of the FreeType glyph atlas and of glyph run drawing,
+   without a display.  A paragraph of text is mapped to glyphs of a font
+   opened directly with the bundled FreeType and loaded three ways: each
+   round rasterized anew, found in the atlas after the font's glyph array
+   is dropped as a text matrix change does, and found in the glyph array.
+   The placed glyphs are then blended into a memory bitmap a glyph at a
+   time and as a run a row at a time.  Atlas statistics are printed last.
+
+   usage:  glyphbench [font file] [size] [rounds]
+*/
+
+#include <AppKit/AppKit.h>
+#include <CoreGraphics/CoreGraphics.h>
+#include <CoreGraphics/Private/_CGFont.h>
+
+#include <sys/time.h>
+
+
+#define FONT	"/usr/X11/share/fonts/TrueType/liberation/LiberationSans-Regular.ttf"
+#define WIDTH	800
+
+static const char *__text =
+	"The quick brown fox jumps over the lazy dog.  Pack my box with five "
+	"dozen liquor jugs!  0123456789 (){}[]<>;:'\"?/|\\~`@#$%^&*-_=+ "
+	"Sphinx of black quartz, judge my vow; how vexingly quick daft zebras "
+	"jump.  THE FIVE BOXING WIZARDS JUMP QUICKLY, WALTZ, BAD NYMPH.";
+
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void
+blend(unsigned char *cl, unsigned char *cov, int len, unsigned char *dst)
+{
+	while (len--)								// source over, as sover_t
+		{
+		unsigned char a = *cov++;
+
+		if (a > 0)
+			{
+			dst[0] = ((dst[0] * (255 - a)) + (cl[0] * a)) >> 8;
+			dst[1] = ((dst[1] * (255 - a)) + (cl[1] * a)) >> 8;
+			dst[2] = ((dst[2] * (255 - a)) + (cl[2] * a)) >> 8;
+			dst[3] = a;
+			}
+		dst += 4;
+		}
+}
+
+static int
+place(AXFontInt *font, FT_UInt *glyphs, int n, XRGlyphPosition *run, int *h)
+{
+	int x = 2, y = 0, i, count = 0;
+	int top = 0, bottom = 0;
+
+	for (i = 0; i < n; i++)						// as _CGContextDrawGlyphs
+		{
+		XRGlyph *g = font->glyphs[glyphs[i]];
+
+		if (!g)
+			continue;
+		if (x + g->metrics.width >= WIDTH)
+			x = 2, y += font->height;
+		run[count].glyph = g;
+		run[count].x = x;
+		run[count++].y = y + g->metrics.yOff - g->metrics.height
+					   - g->metrics.descent;
+		top = MIN(top, run[count-1].y);
+		bottom = MAX(bottom, run[count-1].y + (int)g->metrics.height);
+		x += g->metrics.xOff;
+		}
+
+	for (i = 0; i < count; i++)
+		run[i].y -= top;
+	*h = bottom - top;
+
+	return count;
+}
+
+static void
+draw(XRGlyphPosition *run, int count, int h, unsigned char *bmp, BOOL batch)
+{
+	unsigned char cl[3] = {40, 40, 40};
+	unsigned char cov[WIDTH];
+	int i, y;
+
+	if (batch)
+		for (y = 0; y < h; y++)					// one span per row
+			{
+			memset(cov, 0, WIDTH);
+			_CGGlyphRunCoverage(run, count, NO, 0, y, cov, WIDTH);
+			blend(cl, cov, WIDTH, bmp + y * WIDTH * 4);
+			}
+	else
+		for (i = 0; i < count; i++)				// each glyph's rows
+			{
+			int w = run[i].glyph->metrics.width;
+
+			for (y = run[i].y; y < run[i].y + run[i].glyph->metrics.height; y++)
+				{
+				memset(cov, 0, w);
+				_CGGlyphRunCoverage(&run[i], 1, NO, run[i].x, y, cov, w);
+				blend(cl, cov, w, bmp + (y * WIDTH + run[i].x) * 4);
+		}	}	}
+}
+
+static void
+report(const char *name, int n, int rounds, double t)
+{
+	printf("  %-22s %12.0f glyphs/s\n", name, n * rounds / t);
+}
+
+/* ****************************************************************************
+
+	Benchmark driver
+
+** ***************************************************************************/
+
+int
+main(int argc, char **argv)
+{
+	const char *path = (argc > 1) ? argv[1] : FONT;
+	float size = (argc > 2) ? atof(argv[2]) : 12;
+	int rounds = (argc > 3) ? atoi(argv[3]) : 200;
+	int len = strlen(__text) * 4;
+	FT_UInt glyphs[len];
+	XRGlyphPosition run[len];
+	unsigned long count, memory, hits, misses, evictions;
+	AXFontInt *font;
+	CGFontRef f;
+	unsigned char *bmp;
+	int i, r, n, h;
+	double t;
+
+	if (!(font = _CGOpenFont(path, size)))
+		{
+		printf("glyphbench: unable to open font %s\n", path);
+		exit (1);
+		}
+	f = CGFontCreateWithPlatformFont(font);
+	_CGLockFace(f);
+
+	for (i = 0; i < len; i++)
+		glyphs[i] = _CGGlyphIndex(f, __text[i % (len / 4)]);
+	printf("glyphbench: %s %.1f pt, %d glyphs, %d rounds\n",
+			path, size, len, rounds);
+
+	t = now();
+	for (r = 0; r < rounds; r++)
+		{
+		_CGGlyphAtlasPurge(f);
+		_CGFontLoadGlyphs((CGFont *)f, glyphs, len);
+		}
+	report("load, rasterize", len, rounds, now() - t);
+
+	t = now();
+	for (r = 0; r < rounds; r++)
+		{
+		_CGFontSetMatrix(f, (CGAffineTransform *)&CGAffineTransformIdentity);
+		_CGFontLoadGlyphs((CGFont *)f, glyphs, len);
+		}
+	report("load, atlas", len, rounds, now() - t);
+
+	t = now();
+	for (r = 0; r < rounds; r++)
+		_CGFontLoadGlyphs((CGFont *)f, glyphs, len);
+	report("load, glyph array", len, rounds, now() - t);
+
+	n = place(font, glyphs, len, run, &h);
+	bmp = calloc(1, WIDTH * 4 * (h + 1));
+
+	t = now();
+	for (r = 0; r < rounds; r++)
+		draw(run, n, h, bmp, NO);
+	report("draw, per glyph", n, rounds, now() - t);
+
+	t = now();
+	for (r = 0; r < rounds; r++)
+		draw(run, n, h, bmp, YES);
+	report("draw, glyph run", n, rounds, now() - t);
+
+	_CGGlyphAtlasStatistics(&count, &memory, &hits, &misses, &evictions);
+	printf("  atlas %lu glyphs %lu bytes, %lu hits %lu misses %lu evictions\n",
+			count, memory, hits, misses, evictions);
+
+	free(bmp);
+	printf("glyphbench complete\n");
+
+	exit (0);
+}
@@ -0,0 +1,203 @@
+/*
+   rasterbench.m
+
+   Path fill throughput of the scanline rasterizer against path complexity
+   and the number of threads that render its bands.  Stars of a growing
+   number of points and clusters of many small ellipses are filled into a
+   bitmap context with the nonzero and even-odd rules.  Each thread count
+   runs in a child process started with MGSTEP_OPERATION_THREADS set.  A
+   checksum of every bitmap is printed and passed back to the driver, which
+   exits 1 if any differs from the single threaded one.
+
+   usage:  rasterbench [size] [rounds]
+*/
+
+#include <AppKit/AppKit.h>
+#include <CoreGraphics/CoreGraphics.h>
+
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+
+#define FILLS	12								// bitmaps checked per run
+
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static CGMutablePathRef
+star(int points, int size)
+{
+	CGMutablePathRef p = CGPathCreateMutable();
+	int step = points / 2;						// points is odd, a single
+	int i;										// self-intersecting loop
+
+	CGPathMoveToPoint(p, NULL, size - 1, size / 2);
+	for (i = 1; i < points; i++)
+		{
+		double a = 2 * M_PI * i * step / points;
+
+		CGPathAddLineToPoint(p, NULL, size / 2 + (size / 2 - 1) * cos(a),
+									  size / 2 + (size / 2 - 1) * sin(a));
+		}
+	CGPathCloseSubpath(p);
+
+	return p;
+}
+
+static CGMutablePathRef
+ellipses(int count, int size)
+{
+	CGMutablePathRef p = CGPathCreateMutable();
+	unsigned int seed = 1;
+	int i;
+
+	for (i = 0; i < count; i++)
+		{
+		CGFloat w = 4 + rand_r(&seed) % (size / 8);
+		CGFloat h = 4 + rand_r(&seed) % (size / 8);
+		CGFloat x = rand_r(&seed) % (int)(size - w);
+		CGFloat y = rand_r(&seed) % (int)(size - h);
+
+		CGPathAddEllipseInRect(p, NULL, (CGRect){{x, y}, {w, h}});
+		}
+
+	return p;
+}
+
+static unsigned long
+checksum(CGContextRef cx)
+{
+	CGImage *a = (CGImage *)((CGContext *)cx)->_bitmap;
+	unsigned long h = 5381;
+	unsigned int i;
+
+	for (i = 0; i < a->height * a->bytesPerRow; i++)
+		h = h * 33 + a->idata[i];
+
+	return h;
+}
+
+static unsigned long
+bench(CGContextRef cx, const char *name, CGMutablePathRef p, int size, int n)
+{
+	CGAffineTransform m = CGAffineTransformIdentity;
+	CGImage *a = (CGImage *)((CGContext *)cx)->_bitmap;
+	unsigned long sum;
+	double t;
+	int i;
+
+	memset(a->idata, 0, a->height * a->bytesPerRow);
+	t = now();
+	for (i = 0; i < n; i++)
+		_CGRenderPath(cx, (CGPath *)p, &m, YES);
+	t = now() - t;
+	sum = checksum(cx);
+
+	printf("  %-18s %8.1f fills/s %8.1f Mpixels/s  %016lx\n", name, n / t,
+			(double)size * size * n / t / 1000000.0, sum);
+	CGPathRelease(p);
+
+	return sum;
+}
+
+static void
+run(int size, int rounds, unsigned long *sums)
+{
+	CGContextRef cx;
+	int rule, i = 0;
+
+	cx = CGBitmapContextCreateWithData(NULL, size, size, 8, 0, NULL, 0,
+									   NULL, NULL);
+	CGContextSetBlendMode(cx, kCGBlendModeNormal);
+	CGContextSetRGBFillColor(cx, .2, .4, .8, .75);
+
+	for (rule = 0; rule < 2; rule++)
+		{
+		((CGContext *)cx)->_f.draw = (rule) ? kCGPathEOFill : kCGPathFill;
+		printf(" %s\n", (rule) ? "even-odd" : "nonzero winding");
+		sums[i++] = bench(cx, "star 5", star(5, size), size, rounds);
+		sums[i++] = bench(cx, "star 65", star(65, size), size, rounds);
+		sums[i++] = bench(cx, "star 513", star(513, size), size, rounds/2 + 1);
+		sums[i++] = bench(cx, "star 4097", star(4097, size), size, rounds/8 + 1);
+		sums[i++] = bench(cx, "ellipses 64", ellipses(64, size), size, rounds);
+		sums[i++] = bench(cx, "ellipses 1024", ellipses(1024, size), size,
+						  rounds / 4 + 1);
+		}
+}
+
+static long
+next(long threads, long cpus)					// powers of 2, then all CPUs
+{
+	return (threads < cpus && threads * 2 > cpus) ? cpus : threads * 2;
+}
+
+/* ****************************************************************************
+
+	Benchmark driver
+
+** ***************************************************************************/
+
+int
+main(int argc, char **argv)
+{
+	int size = (argc > 1) ? atoi(argv[1]) : 1024;
+	int rounds = (argc > 2) ? atoi(argv[2]) : 64;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned long one[FILLS], sums[FILLS];
+	long threads;
+	int bad = 0;
+
+	if (size < 64)
+		size = 64;
+	printf("rasterbench: %dx%d bitmap, %d rounds\n", size, size, rounds);
+
+	for (threads = 1; threads <= cpus; threads = next(threads, cpus))
+		{
+		int fd[2], status = 1;
+		pid_t pid;
+
+		if (pipe(fd) < 0)
+			exit (1);
+		fflush(stdout);
+		if ((pid = fork()) == 0)				// the pool sizes itself once
+			{
+			char n[16];
+
+			close(fd[0]);
+			sprintf(n, "%ld", threads);
+			setenv("MGSTEP_OPERATION_THREADS", n, 1);
+			printf("%ld thread%s\n", threads, (threads > 1) ? "s" : "");
+			run(size, rounds, sums);
+			fflush(stdout);
+			write(fd[1], sums, sizeof(sums));
+			exit (0);
+			}
+		close(fd[1]);
+		if (read(fd[0], sums, sizeof(sums)) != sizeof(sums))
+			bad++;								// child failed
+		else if (threads == 1)
+			memcpy(one, sums, sizeof(sums));
+		else if (memcmp(one, sums, sizeof(sums)))
+			{
+			printf("  MISMATCH: %ld threads differ from 1 thread\n", threads);
+			bad++;
+			}
+		close(fd[0]);
+		waitpid(pid, &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			bad++;
+		}
+
+	printf("rasterbench %s\n", (bad) ? "FAILED" : "complete");
+
+	exit ((bad) ? 1 : 0);
+}
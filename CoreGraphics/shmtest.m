@@ -0,0 +1,194 @@
+/*
+   shmtest.m
+
+   Presenting a window's bitmap through MIT-SHM must leave the same pixels
+   in its Pixmap as XPutImage does.  Two frames, the second overdrawing
+   part of the first as an update would, are drawn into a buffered window
+   that is never mapped and flushed after each.  The Pixmap is read back
+   with XGetImage and checksummed.  Each mode runs in a child process, the
+   second with MGSTEP_NO_SHM set, and shmtest exits 1 if the checksums
+   differ.  A display without MIT-SHM runs both modes through XPutImage.
+
+   usage:  shmtest [WxH]
+*/
+
+#include <AppKit/AppKit.h>
+#include <CoreGraphics/CoreGraphics.h>
+
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+
+#if !defined(FB_GRAPHICS) && !defined(CAIRO_GRAPHICS)
+
+typedef struct { unsigned long sum; int shared; double t; } _result;
+
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void
+frame(CGContextRef cx, int w, int h, int n)
+{
+	unsigned int seed = n + 1;
+	int i;
+
+	if (n == 0)
+		{
+		CGContextSetRGBFillColor(cx, 1, 1, 1, 1);
+		CGContextFillRect(cx, (CGRect){{0, 0}, {w, h}});
+		}
+
+	for (i = 0; i < 48; i++)					// scattered damage rects
+		{
+		CGFloat rw = 4 + rand_r(&seed) % (w / 6);
+		CGFloat rh = 4 + rand_r(&seed) % (h / 6);
+		CGFloat x = rand_r(&seed) % (int)(w - rw);
+		CGFloat y = rand_r(&seed) % (int)(h - rh);
+
+		CGContextSetRGBFillColor(cx, (i % 3) / 2.0, (i % 5) / 4.0,
+									 (i % 7) / 6.0, (i & 1) ? .5 : 1);
+		if (i & 2)
+			CGContextFillEllipseInRect(cx, (CGRect){{x, y}, {rw, rh}});
+		else
+			CGContextFillRect(cx, (CGRect){{x, y}, {rw, rh}});
+		}
+
+	CGContextFlush(cx);							// presents the damage
+}
+
+static unsigned long
+checksum(XImage *xi, int w, int h)
+{
+	unsigned long sum = 5381;
+	int x, y;
+
+	for (y = 0; y < h; y++)						// depth bits only, the pad
+		for (x = 0; x < w; x++)					// byte is undefined
+			sum = sum * 33 + (XGetPixel(xi, x, y) & 0xffffff);
+
+	return sum;
+}
+
+static void
+run(int w, int h, _result *r)
+{
+	NSRect rect = {{0, 0}, {w, h}};
+	NSWindow *window;
+	CGContext *cx;
+	XImage *xi;
+	int n;
+
+	[NSApplication sharedApplication];
+	window = [[NSWindow alloc] initWithContentRect:rect
+							   styleMask:NSBorderlessWindowMask
+							   backing:NSBackingStoreBuffered
+							   defer:NO];
+	[[window contentView] lockFocus];			// creates Pixmap and bitmap
+	cx = (CGContext *)[[NSGraphicsContext currentContext] graphicsPort];
+
+	r->t = now();
+	for (n = 0; n < 2; n++)
+		frame((CGContextRef)cx, w, h, n);
+	CGContextSynchronize((CGContextRef)cx);
+	r->t = now() - r->t;
+	r->shared = cx->_f.sharedBitmap;
+
+	[[window contentView] unlockFocus];
+
+	xi = XGetImage(cx->_display->xDisplay, cx->xPixmap, 0, 0, w, h,
+				   AllPlanes, ZPixmap);
+	r->sum = (xi) ? checksum(xi, w, h) : 0;
+	if (xi)
+		XDestroyImage(xi);
+
+	printf("  %-12s %8.2f ms  %016lx\n", (r->shared) ? "XShmPutImage"
+			: "XPutImage", r->t * 1000, r->sum);
+}
+
+/* ****************************************************************************
+
+	Test driver
+
+** ***************************************************************************/
+
+int
+main(int argc, char **argv)
+{
+	int w = 640, h = 480;
+	_result r[2];
+	int i, bad = 0;
+
+	if (argc > 1)
+		sscanf(argv[1], "%dx%d", &w, &h);
+	if (w < 64 || h < 64)
+		w = h = 64;
+	printf("shmtest: %dx%d window, 2 frames\n", w, h);
+
+	for (i = 0; i < 2; i++)
+		{
+		int fd[2], status = 1;
+		pid_t pid;
+
+		if (pipe(fd) < 0)
+			exit (1);
+		fflush(stdout);
+		if ((pid = fork()) == 0)				// display reads env once
+			{
+			close(fd[0]);
+			if (i)
+				setenv("MGSTEP_NO_SHM", "1", 1);
+			else
+				unsetenv("MGSTEP_NO_SHM");
+			run(w, h, &r[i]);
+			fflush(stdout);
+			write(fd[1], &r[i], sizeof(_result));
+			exit (0);
+			}
+		close(fd[1]);
+		if (read(fd[0], &r[i], sizeof(_result)) != sizeof(_result)
+				|| r[i].sum == 0)
+			bad++;								// child failed
+		close(fd[0]);
+		waitpid(pid, &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			bad++;
+		}
+
+	if (!bad && r[1].shared)
+		{
+		printf("  MGSTEP_NO_SHM ignored, bitmap is still shared\n");
+		bad++;
+		}
+	if (!bad && !r[0].shared)
+		printf("  display has no MIT-SHM, compared XPutImage only\n");
+	if (!bad && r[0].sum != r[1].sum)
+		{
+		printf("  MISMATCH: MIT-SHM Pixmap differs from XPutImage\n");
+		bad++;
+		}
+
+	printf("shmtest %s\n", (bad) ? "FAILED" : "complete");
+
+	exit ((bad) ? 1 : 0);
+}
+
+#else
+
+int
+main(int argc, char **argv)
+{
+	printf("shmtest: X11 bitmap backend only\n");
+
+	exit (0);
+}
+
+#endif  /* !FB_GRAPHICS && !CAIRO_GRAPHICS */
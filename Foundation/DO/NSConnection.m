@@ -14,7 +14,6 @@
    under the terms of the GNU Library General Public License.
 */
 
-// To do: Make it thread-safe.
 // RMC == Remote Method Coder, or Remote Method Call.
 //   It's an instance of PortEncoder or PortDecoder.
 
@@ -39,12 +38,17 @@
 #include <Foundation/NSNotification.h>
 #include <Foundation/NSMethodSignature.h>
 #include <Foundation/NSInvocation.h>
+#include <Foundation/NSOperation.h>
 
 #include <Foundation/NSRunLoop.h>
 #include <CoreFoundation/CFRunLoop.h>
 
-#define PROXIES_HASH_GATE		nil
-#define SEQUENCE_NUMBER_GATE	nil
+#include <pthread.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define PROXIES_HASH_GATE		proxies_hash_gate
 
 #define ENCODED_RETNAME  __enc_retname
 
@@ -68,13 +72,9 @@ static NSMapTable *all_connections_local_objects = NULL;
 static NSMapTable *all_connections_local_targets = NULL;
 static NSMapTable *all_connections_local_cached = NULL;
 
-// rmc handling
-static NSMutableArray *received_request_rmc_queue;
-static NSLock *received_request_rmc_queue_gate;
-static NSMutableArray *received_reply_rmc_queue;
-static NSLock *received_reply_rmc_queue_gate;
+static NSRecursiveLock *proxies_hash_gate;
 
-static int messages_received_count;
+static int messages_received_count;			// atomic, requests serviced
 
 //
 //  Keys for the NSDictionary returned by [NSConnection -statistics]
@@ -186,14 +186,127 @@ static NSString *__enc_retname = @"return value";
 
 @end
 
+/* ****************************************************************************
+
+	RmcQueues -- per connection request and reply queues
+
+	Requests held back while a reply is awaited and replies that have not
+	yet been claimed are kept by each connection rather than in a process
+	wide queue, so connections serviced on different threads do not
+	contend with each other.  A thread other than the one running the
+	receive port waits for its reply on the condition, which is broadcast
+	by the receiving thread each time a reply is queued.  Only the
+	receiving thread reads the port, so a request sent from another
+	thread gets its reply only while the receiving thread runs its run
+	loop, otherwise it waits until reply_timeout and raises.  reply_depth
+	and the message counters are updated atomically, requests are
+	serviced on pool threads when multiple threads are enabled.
+
+	Outgoing oneway messages are encoded one after the other into a single
+	ONEWAY_BATCH rmc, which is sent when it grows past batch_size bytes,
+	when the flush timer fires or before any other rmc, so a request, proxy
+	retain or release never passes the oneway messages sent before it.  The
+	timer is on the sending thread's run loop, a thread not running its
+	loop sends each oneway message at once.  The sending lock serializes
+	the batch and method type interning.
+
+** ***************************************************************************/
+
+#define ONEWAY_BATCH_SIZE	4096
+#define ONEWAY_BATCH_DELAY	0.005
+
+typedef struct _RmcQueues {
+	pthread_mutex_t lock;
+	pthread_cond_t replied;
+	NSMutableArray *requests;
+	NSMutableArray *replies;
+
+	pthread_mutex_t sending;
+	PortEncoder *batch;						// oneway messages not yet sent
+	unsigned batched;
+	unsigned batch_size;
+	NSTimeInterval batch_delay;
+	NSTimer *flush;
+} RmcQueues;
+
+
+static RmcQueues *
+RmcQueuesCreate(void)
+{
+	RmcQueues *q = calloc(1, sizeof(RmcQueues));
+	pthread_mutexattr_t a;
+
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->replied, NULL);
+	q->requests = [[NSMutableArray alloc] initWithCapacity:8];
+	q->replies = [[NSMutableArray alloc] initWithCapacity:8];
+						// Recursive, a send that fails invalidates the
+	pthread_mutexattr_init(&a);			// connection, which flushes the batch
+	pthread_mutexattr_settype(&a, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&q->sending, &a);
+	pthread_mutexattr_destroy(&a);
+	q->batch_size = ONEWAY_BATCH_SIZE;
+	q->batch_delay = ONEWAY_BATCH_DELAY;
+
+	return q;
+}
+
+static void
+RmcQueuesFree(RmcQueues *q)
+{
+	[q->requests release];
+	[q->replies release];
+	pthread_cond_destroy(&q->replied);
+	pthread_mutex_destroy(&q->lock);
+	pthread_mutex_destroy(&q->sending);
+	free(q);
+}
+
+static void
+RmcQueuesAddReply(RmcQueues *q, id rmc)
+{
+	pthread_mutex_lock(&q->lock);
+	[q->replies addObject: rmc];
+	pthread_cond_broadcast(&q->replied);
+	pthread_mutex_unlock(&q->lock);
+}
+
+static id
+RmcQueuesTakeReply(RmcQueues *q, int sn)		// caller holds q->lock
+{
+	unsigned i, count = [q->replies count];
+
+	for (i = 0; i < count; i++)
+		{
+		id rmc = [q->replies objectAtIndex: i];
+
+		if ([rmc sequenceNumber] == sn)			// still owned by its decoder
+			{									// until the caller dismisses it
+			[q->replies removeObjectAtIndex: i];
+
+			return rmc;
+		}	}
+
+	return nil;
+}
+
 
 @interface NSConnection (GettingCoderInterface)
 - (void) _handleRmc:rmc;
 - (void) _handleQueuedRmcRequests;
 - (id) _getReceivedReplyRmcWithSequenceNumber:(int)n;
+- (id) _waitForReplyRmcWithSequenceNumber:(int)n;
 - (id) newSendingRequestRmc;
 - (id) newSendingReplyRmcWithSequenceNumber:(int)n;
 - (int) _newMsgNumber;
+- (void) _runInNewThread:(id)arg;
+- (void) _setReceiveThread:(NSThread *)t;
+- (void) _flushBatch;
+- (int) _referenceForMethodType:(const char *)type;
+- (const char *) _methodTypeAtReference:(int)xref;
+- (int) _sendInvocation:(NSInvocation*)anInvocation;
+- (void) _receiveReplyForInvocation:(NSInvocation*)anInvocation
+					 sequenceNumber:(int)sn;
 @end
 
 
@@ -211,10 +324,7 @@ static NSString *__enc_retname = @"return value";
 										NSNonOwnedPointerMapValueCallBacks, 0);
 	all_connections_local_cached = NSCreateMapTable (NSIntMapKeyCallBacks,
 										NSObjectMapValueCallBacks, 0);
-	received_request_rmc_queue = [[NSMutableArray alloc] initWithCapacity:32];
-	received_request_rmc_queue_gate = [NSLock new];
-	received_reply_rmc_queue = [[NSMutableArray alloc] initWithCapacity:32];
-	received_reply_rmc_queue_gate = [NSLock new];
+	proxies_hash_gate = [NSRecursiveLock new];
 	root_object_dictionary = [[NSMutableDictionary alloc] initWithCapacity:8];
 	root_object_dictionary_gate = [NSLock new];
 	receive_port_2_ancestor =NSCreateMapTable(NSNonOwnedPointerMapKeyCallBacks,
@@ -345,15 +455,12 @@ static NSString *__enc_retname = @"return value";
 - (void) setRequestTimeout:(NSTimeInterval)to		{ request_timeout = to; }
 - (NSPort*) receivePort								{ return receive_port; }
 - (NSPort*) sendPort								{ return send_port; }
-- (void) runInNewThread								{ NIMP }
 - (void) handlePortMessage:(NSPortMessage*)msg		{ NIMP }
-- (void) enableMultipleThreads						{ NIMP }
-- (void) removeRunLoop:(NSRunLoop *)runloop			{ NIMP }
 - (NSTimeInterval) replyTimeout						{ return reply_timeout; }
 - (NSTimeInterval) requestTimeout					{ return request_timeout; }
 - (NSArray *) remoteObjects							{ NIMP return nil; }
 + (void) _setDebug:(int)val							{ debug_connection = val; }
-- (BOOL) multipleThreadsEnabled						{ NIMP return NO; }
+- (BOOL) multipleThreadsEnabled						{ return _multipleThreads; }
 - (BOOL) isValid									{ return is_valid; }
 
 - (BOOL) independentConversationQueueing
@@ -365,6 +472,79 @@ static NSString *__enc_retname = @"return value";
 {
 	independant_queueing = flag;
 }
+			// Service incoming requests on the worker pool rather than on the
+			// thread running the receive port.  Requests are run concurrently
+			// and each worker sends its own reply, so a slow method no longer
+			// holds up the connection's other callers.  Connections later
+			// accepted on the same receive port inherit the setting.
+- (void) enableMultipleThreads
+{
+	if (_multipleThreads == NO)
+		{
+		_workers = [NSOperationQueue new];
+		_multipleThreads = YES;
+		}
+}
+			// Move the receive port from the current thread's run loop to that
+			// of a new thread.  Callers on any other thread, this one included,
+			// wait for their replies on the connection's reply queue.
+- (void) runInNewThread
+{
+	[self removeRunLoop: [NSRunLoop currentRunLoop]];
+	[self _setReceiveThread: nil];			// until the new thread runs it
+	[NSThread detachNewThreadSelector: @selector(_runInNewThread:)
+			  toTarget: self
+			  withObject: nil];
+}
+
+- (void) _runInNewThread:(id)arg
+{
+	NSAutoreleasePool *arp = [NSAutoreleasePool new];
+	NSRunLoop *rl = [NSRunLoop currentRunLoop];
+	unsigned i, count = [request_modes count];
+	BOOL more = YES;
+
+	for (i = 0; i < count; i++)
+		[receive_port scheduleInRunLoop: rl
+					  forMode: [request_modes objectAtIndex: i]];
+	[self _setReceiveThread: [NSThread currentThread]];
+
+	while (is_valid && more)
+		{
+		NSAutoreleasePool *pool = [NSAutoreleasePool new];
+		NSDate *d = [[NSDate alloc] initWithTimeIntervalSinceNow: 1.0];
+
+		more = [rl runMode: NSDefaultRunLoopMode beforeDate: d];
+		[d release];
+		[pool release];
+		}
+
+	[arp release];
+}
+
+- (void) _setReceiveThread:(NSThread *)t
+{
+	NSHashEnumerator e;						// every connection sharing our
+	NSConnection *o;						// receive port is run by t
+
+	[connection_table_gate lock];
+	e = NSEnumerateHashTable(connection_table);
+	while ((o = (NSConnection*)NSNextHashEnumeratorItem(&e)) != nil)
+		if (o->receive_port == receive_port)
+			o->_receiveThread = t;
+	[connection_table_gate unlock];
+}
+
+- (void) removeRunLoop:(NSRunLoop *)runloop
+{
+	CFSocket *cfs = receive_port->_cfSocket;
+	unsigned i = [request_modes count];
+
+	if (cfs && cfs->runLoopSource)
+		while (i-- > 0)
+			CFRunLoopRemoveSource((CFRunLoopRef)runloop, cfs->runLoopSource,
+						(CFStringRef)[request_modes objectAtIndex: i]);
+}
 
 - (BOOL) registerName:(NSString*)name
 {
@@ -377,14 +557,30 @@ static NSString *__enc_retname = @"return value";
 {
 	if (is_valid == NO)
 		return;
+											// Send any oneway messages held
+	if (_queues)							// back before the ports go away
+		{
+		pthread_mutex_lock(&((RmcQueues *)_queues)->sending);
+		[self _flushBatch];
+		pthread_mutex_unlock(&((RmcQueues *)_queues)->sending);
+		}
 
 	is_valid = NO;
 			// Don't need notifications any more - so remove self as observer.
 	[[NSNotificationCenter defaultCenter] removeObserver: self];
 
 					// We can't be the ancestor of anything if we are invalid.
+	[connection_table_gate lock];
 	if (self == NSMapGet(receive_port_2_ancestor, receive_port))
 		NSMapRemove(receive_port_2_ancestor, receive_port);
+	[connection_table_gate unlock];
+								// Wake threads waiting on a reply that will
+	if (_queues)				// now never come, they raise a timeout.
+		{
+		pthread_mutex_lock(&((RmcQueues *)_queues)->lock);
+		pthread_cond_broadcast(&((RmcQueues *)_queues)->replied);
+		pthread_mutex_unlock(&((RmcQueues *)_queues)->lock);
+		}
 
 				// If we have been invalidated, we don't need to retain proxies
 				// for local objects any more.  In fact, we want to get rid of
@@ -520,9 +716,9 @@ static NSString *__enc_retname = @"return value";
 	[d setObject: o forKey: NSConnectionLocalCount];
 	o = [NSNumber numberWithUnsignedInt: NSCountMapTable(remote_proxies)];
 	[d setObject: o forKey: NSConnectionProxyCount];
-	[received_request_rmc_queue_gate lock];
-	o = [NSNumber numberWithUnsignedInt: [received_request_rmc_queue count]];
-	[received_request_rmc_queue_gate unlock];
+	pthread_mutex_lock(&((RmcQueues *)_queues)->lock);
+	o = [NSNumber numberWithUnsignedInt: [((RmcQueues *)_queues)->requests count]];
+	pthread_mutex_unlock(&((RmcQueues *)_queues)->lock);
 	[d setObject: o forKey: @"Pending packets"];
 	
 	return d;
@@ -566,7 +762,21 @@ static NSString *__enc_retname = @"return value";
 	NSFreeMapTable (local_targets);
 	NSFreeMapTable (incoming_xref_2_const_ptr);
 	NSFreeMapTable (outgoing_const_ptr_2_xref);
+	{
+	NSMapEnumerator e = NSEnumerateMapTable(_outgoingTypes);
+	void *type, *xref;
+
+	while (NSNextMapEnumeratorPair(&e, &type, &xref))
+		free(type);
+	NSFreeMapTable (_outgoingTypes);
+	NSFreeMapTable (_incomingTypes);
+	}
 	[PROXIES_HASH_GATE unlock];
+
+	[_workers release];
+	_workers = nil;
+	RmcQueuesFree(_queues);
+	_queues = NULL;
 	
 	[pool release];
 }
@@ -620,7 +830,10 @@ static NSString *__enc_retname = @"return value";
 	return nil;
 }
 										// Class-wide stats and collections.
-+ (int) messagesReceived				{ return messages_received_count; }
++ (int) messagesReceived
+{
+	return __atomic_load_n(&messages_received_count, __ATOMIC_RELAXED);
+}
 
 + (unsigned) connectionsCount
 {
@@ -714,10 +927,18 @@ static NSString *__enc_retname = @"return value";
 	newConn->outgoing_const_ptr_2_xref = NSCreateMapTable ( 
 								NSIntMapKeyCallBacks,
 								NSNonOwnedPointerMapValueCallBacks, 0);
+						// Method type strings, by content, to the xref sent
+						// in their place and back.  Both own the strings.
+	newConn->_outgoingTypes = NSCreateMapTable (
+								NSNonOwnedCStringMapKeyCallBacks,
+								NSIntMapValueCallBacks, 0);
+	newConn->_incomingTypes = NSCreateMapTable (NSIntMapKeyCallBacks,
+								NSOwnedPointerMapValueCallBacks, 0);
 
 	newConn->reply_timeout = CONNECTION_TIMEOUT;
 	newConn->request_timeout = CONNECTION_TIMEOUT;
 	newConn->_encodingClass = [NSPortCoder class];
+	newConn->_queues = RmcQueuesCreate();
 
 							// FIX ME ANCESTOR argument was ignored; 
 							// in the future it will be removed.
@@ -739,11 +960,15 @@ static NSString *__enc_retname = @"return value";
 		{
 		newConn->receive_port_class = [ancestor receivePortClass];
 		newConn->send_port_class = [ancestor sendPortClass];
+		newConn->_receiveThread = ancestor->_receiveThread;
+		if (ancestor->_multipleThreads)
+			[newConn enableMultipleThreads];
 		}
 	else
 		{
 		newConn->receive_port_class = [NSPort _inPortClass];
 		newConn->send_port_class = [NSPort _outPortClass];
+		newConn->_receiveThread = [NSThread currentThread];
 		}
 						// Set up request modes array and make sure the 
 						// receiving port is added to the run loop to get data.
@@ -816,21 +1041,58 @@ static NSString *__enc_retname = @"return value";
 
 - (void) forwardInvocation:(NSInvocation*)anInvocation
 {									// NSDistantObject's -forward: method calls
-	NSPortCoder <Encoding> *op;		// this to send the message over the wire.
-    BOOL out_parameters;
-    const char *type;
-    int seq_num;
-	SEL sel = [anInvocation selector];
+	int seq_num;					// this to send the message over the wire.
 
-	NSPortCoder <Decoding>*ip = nil;
-	BOOL is_exception = NO;
-	char *forward_type = NULL;			// NSConnection calls this to service
+	if ((seq_num = [self _sendInvocation: anInvocation]) >= 0)
+		[self _receiveReplyForInvocation: anInvocation sequenceNumber: seq_num];
+}
 
-    NSParameterAssert (is_valid);
+- (void) sendInvocations:(NSArray*)invocations
+{
+	unsigned i, count = [invocations count];
+	NSMutableData *d = [NSMutableData dataWithLength: count * sizeof(int)];
+	int *seq_num = [d mutableBytes];
+	id exception = nil;
+											// Send every request, then take
+	for (i = 0; i < count; i++)				// the replies as they come back
+		{
+		NSInvocation *inv = [invocations objectAtIndex: i];
 
-    type = sel_get_type(sel);
+		NSParameterAssert([[inv target] connectionForProxy] == self);
+		seq_num[i] = [self _sendInvocation: inv];
+		}
 
-    if (type == 0 || *type == '\0') 
+	for (i = 0; i < count; i++)
+		{
+		if (seq_num[i] < 0)
+			continue;
+		NS_DURING
+			[self _receiveReplyForInvocation: [invocations objectAtIndex: i]
+				  sequenceNumber: seq_num[i]];
+		NS_HANDLER
+			if ([[localException name] isEqual: NSPortTimeoutException])
+				[localException raise];
+			if (exception == nil)			// remote exceptions are raised
+				exception = localException;	// once every reply is taken
+		NS_ENDHANDLER
+		}
+
+	[exception raise];
+}
+
+- (int) _sendInvocation:(NSInvocation*)anInvocation
+{									// Encode a request and send it, returning
+	RmcQueues *q = _queues;			// its sequence number, or -1 if it is a
+	NSPortCoder <Encoding> *op;		// oneway message added to the batch.
+	SEL sel = [anInvocation selector];
+	const char *type;
+	int xref;
+
+	NSParameterAssert (is_valid);
+
+	type = sel_get_type(sel);
+
+	if (type == 0 || *type == '\0') 
 		{
 		type = [[anInvocation methodSignatureForSelector: sel] methodType];
 
@@ -839,75 +1101,220 @@ static NSString *__enc_retname = @"return value";
 		}
 	NSParameterAssert(type);
 	NSParameterAssert(*type);
-									// get the method types from the selector
-    op = [self newSendingRequestRmc];
-    seq_num = [op sequenceNumber];
-	if (debug_connection > 4)
-		NSLog(@"building packet seq %d\n", seq_num);
-
 				// Send the types that we're using, so that the performer knows
-				// exactly what qualifiers we're using. If all selectors 
-				// included qualifiers, and if I could make sel_types_match() 
-				// work the way I wanted, we wouldn't need to do this.
-    [op encodeValueOfCType: @encode(char*)
-		at: &type
-		withName: @"selector type"];
-
-///	[op encodeObject: anInvocation withName: @"forward invocation"];
-	[anInvocation encodeWithCoder: op];
-
-//  out_parameters = mframe_dissect_call (argframe, type, encoder);
-    [op dismiss];												// Send the rmc
-    if (debug_connection > 1)
+				// exactly what qualifiers we're using.  After the first use on
+				// this connection only the type's xref is sent.  A peer older
+				// than the compact format is sent the type string every time,
+				// and oneway messages as requests that wait for its reply.
+	pthread_mutex_lock(&q->sending);
+	NS_DURING
+		{
+		if ((objc_get_type_qualifiers(type) & _F_ONEWAY)
+				&& [self _peerReadsCompactFormat])
+			{
+			xref = [self _referenceForMethodType: type];
+			if (!q->batch)
+				q->batch = [_encodingClass newForWritingWithConnection: self
+										   sequenceNumber: [self _newMsgNumber]
+										   identifier: ONEWAY_BATCH];
+			[q->batch encodeValueOfCType: @encode(int)
+					  at: &xref
+					  withName: @"selector type"];
+			[anInvocation encodeWithCoder: q->batch];
+			q->batched++;
+			if ([q->batch _packetLength] >= q->batch_size
+					|| ![[NSRunLoop currentRunLoop] currentMode])
+				[self _flushBatch];		// no loop running here to fire a timer
+			else if (!q->flush && q->batch_delay > 0)
+				q->flush = [NSTimer scheduledTimerWithTimeInterval:
+											q->batch_delay
+									target: self
+									selector: @selector(flushOnewayMessages)
+									userInfo: nil
+									repeats: NO];
+			op = nil;
+			}
+		else
+			{						// Oneway messages queued by this thread
+			[self _flushBatch];		// go out before the request, the lock
+									// ends before this one blocks on a reply
+			op = [self newSendingRequestRmc];
+			if ([op _isCompact])
+				{
+				xref = [self _referenceForMethodType: type];
+				[op encodeValueOfCType: @encode(int)
+					at: &xref
+					withName: @"selector type"];
+				}
+			else
+				[op encodeValueOfCType: @encode(char*)
+					at: &type
+					withName: @"selector type"];
+			[anInvocation encodeWithCoder: op];
+			}
+		}
+	NS_HANDLER
+		{							// A half encoded batch can't be sent, the
+		[q->batch release];			// oneway messages in it are dropped.
+		q->batch = nil;
+		q->batched = 0;
+		[q->flush invalidate];
+		q->flush = nil;
+		pthread_mutex_unlock(&q->sending);
+		[localException raise];
+		}
+	NS_ENDHANDLER
+	pthread_mutex_unlock(&q->sending);
+
+	if (op == nil)
+		return -1;
+
+	xref = [op sequenceNumber];
+	if (debug_connection > 4)
+		NSLog(@"building packet seq %d\n", xref);
+	[op dismiss];												// Send the rmc
+	if (debug_connection > 1)
 		NSLog(@"Sent message to 0x%x\n", self);
-    req_out_count++;											// Sent request
-	
-	if (!ip)		// Get the reply rmc and decode it.
-		{			// If we didn't get the reply packet yet, get it now.
-		BOOL result;
+	__atomic_add_fetch(&req_out_count, 1, __ATOMIC_RELAXED);	// Sent request
 
-		if (!is_valid)
-			[NSException raise: NSGenericException
-				format: @"connection waiting for request was shut down"];
+	return xref;
+}
+
+- (void) _receiveReplyForInvocation:(NSInvocation*)anInvocation
+					 sequenceNumber:(int)sn
+{
+	NSPortCoder <Decoding> *ip;
+	BOOL is_exception = NO;
+
+	if (!is_valid)
+		[NSException raise: NSGenericException
+					 format: @"connection waiting for request was shut down"];
 
-				// FIX ME Why do we get the reply packet in here and not
-				// just before calling dissect_method_return() below?
-		ip = [self _getReceivedReplyRmcWithSequenceNumber:seq_num];
+	ip = [self _getReceivedReplyRmcWithSequenceNumber: sn];
+	__atomic_add_fetch(&rep_in_count, 1, __ATOMIC_RELAXED);	// got a reply
 								// Find out if the server is returning an 
 								// exception instead of the return values.
-		[ip decodeValueOfCType:@encode(BOOL) 
-			at:&is_exception 
-			withName:NULL];
-		if (is_exception)
-			{					// Decode the exception object, and raise it.
-			id exc;
-
-			[ip decodeObjectAt: &exc withName: NULL];
-			[ip dismiss];
-			ip = (id)-1;
-								// FIX ME Is there anything else to clean 
-			[exc raise];		// up in dissect_method_return()
-			}
-		else
-			{
-			[ip decodeValueOfCType:@encode(char*)
-				at:&forward_type 
-				withName:NULL];
+	[ip decodeValueOfCType:@encode(BOOL) at:&is_exception withName:NULL];
+	if (is_exception)
+		{						// Decode the exception object, and raise it.
+		id exc;
+
+		[ip decodeObjectAt: &exc withName: NULL];
+		[ip dismiss];
+		[exc raise];
+		}
+	if (![ip _isCompact])					// older peers send the types back
+		{
+		char *forward_type = NULL;
+
+		[ip decodeValueOfCType:@encode(char*) at:&forward_type withName:NULL];
+		free (forward_type);
+		}
 										// re-init invocation with reply packet
-			[anInvocation initWithCoder: ip];
-			}
+	[anInvocation initWithCoder: ip];
+	[ip dismiss];
+}
+
+- (void) flushOnewayMessages
+{
+	RmcQueues *q = _queues;
+
+	pthread_mutex_lock(&q->sending);
+	[self _flushBatch];
+	pthread_mutex_unlock(&q->sending);
+}
+
+- (void) _flushBatch								// caller holds q->sending
+{
+	RmcQueues *q = _queues;
+	PortEncoder *op = q->batch;
+	int end = 0;
+
+	if (q->flush)
+		{
+		[q->flush invalidate];
+		q->flush = nil;
 		}
+	if (op)
+		{
+		q->batch = nil;
+		__atomic_add_fetch(&req_out_count, q->batched, __ATOMIC_RELAXED);
+		q->batched = 0;
+		[op encodeValueOfCType: @encode(int)
+			at: &end
+			withName: @"end of batch"];
+		[op dismiss];
+		}
+}
+
+- (void) setOnewayBatchSize:(unsigned)bytes
+{
+	((RmcQueues *)_queues)->batch_size = bytes;
+}
+
+- (void) setOnewayBatchDelay:(NSTimeInterval)seconds
+{
+	((RmcQueues *)_queues)->batch_delay = seconds;
+}
+
+- (int) _referenceForMethodType:(const char *)type	// caller holds q->sending
+{
+	int xref = PTR2INT(NSMapGet(_outgoingTypes, type));
+
+	if (xref == 0)
+		{		// A new type is sent on its own before the rmc that uses it.
+		id op;	// The peer services it as it arrives, in packet order, so it
+				// is known before any request or batch naming it is decoded
+				// even when those are serviced by worker threads.
+		char *t = malloc(strlen(type) + 1);
+
+		strcpy(t, type);
+		xref = NSCountMapTable(_outgoingTypes) + 1;
+		NSMapInsert(_outgoingTypes, t, INT2PTR(xref));
+		op = [_encodingClass newForWritingWithConnection: self
+							 sequenceNumber: [self _newMsgNumber]
+							 identifier: METHODTYPE_DEFINE];
+		[op encodeValueOfCType: @encode(int) at: &xref withName: NULL];
+		[op encodeValueOfCType: @encode(char*) at: &type withName: NULL];
+		[op dismiss];
+		}
+
+	return xref;
+}
+
+- (const char *) _methodTypeAtReference:(int)xref
+{
+	const char *type;
+
+	[PROXIES_HASH_GATE lock];
+	type = NSMapGet(_incomingTypes, INT2PTR(xref));
+	[PROXIES_HASH_GATE unlock];
+	if (type == NULL)
+		[NSException raise: NSInternalInconsistencyException
+					 format: @"undefined method type reference %d", xref];
+
+	return type;
+}
+
+- (void) _service_defineType:rmc
+{
+	char *type = NULL;
+	int xref;
 
-	NSAssert(ip == (id)-1 || ip == nil, NSInternalInconsistencyException);
-	if (ip)
-		rep_in_count++;											// received a reply
+	[rmc decodeValueOfCType:@encode(int) at:&xref withName:NULL];
+	[rmc decodeValueOfCType:@encode(char*) at:&type withName:NULL];
+	[PROXIES_HASH_GATE lock];
+	NSMapInsert(_incomingTypes, INT2PTR(xref), type);
+	[PROXIES_HASH_GATE unlock];
+	[rmc dismiss];
 }
 				// Methods for handling client and server, requests and replies
 - (void) _service_forwardForProxy:aRmc
 {
-	char *forward_type = NULL;			// NSConnection calls this to service
+	const char *forward_type;			// NSConnection calls this to service
 	id op = nil;						// the incoming method request.
 	int reply_sequence_number;
+	int xref;
 
 #ifndef __USE_LIBOBJC2__
 	void decoder (int argnum, void *datum, const char *type)
@@ -947,16 +1354,14 @@ static NSString *__enc_retname = @"return value";
 				at: &is_exception
 				withName: @"Exceptional reply flag"];
 			}
-				// Send the types that we're using, so that the performer knows
-				// exactly what qualifiers we're using. If all selectors 
-				// included qualifiers, and if I could make sel_types_match() 
-				// work the way I wanted, we wouldn't need to do this.
-//    [op encodeValueOfCType: @encode(char*)
-//		at: &type
-//		withName: @"selector type"];
-
 		switch (*type)
 			{
+			case _C_CHARPTR:			// the types, only older requesters
+				if (![op _isCompact])	// expect them back
+					[op encodeValueOfObjCType:type 
+						at:&datum 
+						withName:ENCODED_RETNAME];
+				break;
 			case _C_ID:
 				[(NSInvocation *)datum encodeWithCoder: op];
 				break;
@@ -977,20 +1382,31 @@ static NSString *__enc_retname = @"return value";
 								// used.  If all selectors included qualifiers 
 								// and I could make sel_types_match() work the 
 								// way I wanted, we wouldn't need to do this.
-		[aRmc decodeValueOfCType:@encode(char*) 
-			  at:&forward_type 
-			  withName:NULL];
+		if ([aRmc _isCompact])
+			{
+			[aRmc decodeValueOfCType:@encode(int) at:&xref withName:NULL];
+			forward_type = [self _methodTypeAtReference: xref];
+			}
+		else
+			{						// freed with the autorelease pool, as the
+			char *type;				// decoder below does with char* arguments
+
+			[aRmc decodeValueOfCType:@encode(char*) at:&type withName:NULL];
+			[NSData dataWithBytesNoCopy: type length: 1];
+			forward_type = type;
+			}
 		{
      	NSInvocation *invocation = nil;
 
 		if (debug_connection > 1)
 			NSLog(@"Handling message from 0x%x\n", self);
-		req_in_count++;	/* Handling an incoming request. */
+		__atomic_add_fetch(&req_in_count, 1, __ATOMIC_RELAXED);	/* Handling */
+		__atomic_add_fetch(&messages_received_count, 1, __ATOMIC_RELAXED);
 		mframe_do_call (forward_type, decoder, encoder);
 		}
 
 		[op dismiss];									// Send back a reply
-		rep_out_count++;
+		__atomic_add_fetch(&rep_out_count, 1, __ATOMIC_RELAXED);
 		}
 	NS_HANDLER		
 		{			// Make sure we pass all exceptions back to the requestor.
@@ -1012,9 +1428,68 @@ static NSString *__enc_retname = @"return value";
 			}
 		}
 	NS_ENDHANDLER;
+#endif
+}
 
-	if (forward_type)
-		free (forward_type);
+- (void) _service_onewayBatch:aRmc
+{
+#ifndef __USE_LIBOBJC2__
+	BOOL decoded;
+	int xref;
+
+	void decoder (int argnum, void *datum, const char *type)
+		{							// The batch is dismissed after the last
+		if (argnum == -1 && datum == 0 && type == 0)	// message is decoded
+			{
+			decoded = YES;
+			return;
+			}
+
+		[aRmc decodeValueOfObjCType:type at:datum withName:NULL];
+		if (*type == _C_CHARPTR)
+			[NSData dataWithBytesNoCopy: *(void**)datum length: 1];
+		else 
+			if (*type == _C_ID)
+				[*(id*)datum autorelease];
+		}
+
+	void encoder (int argnum, const void *datum, const char *type, int flags)
+		{
+		}							// oneway, nothing is sent back
+
+	NS_DURING
+		[aRmc decodeValueOfCType:@encode(int) at:&xref withName:NULL];
+	NS_HANDLER
+		xref = 0;
+	NS_ENDHANDLER
+
+	while (xref != 0 && is_valid)
+		{
+		NSAutoreleasePool *pool = [NSAutoreleasePool new];
+
+		decoded = NO;
+		NS_DURING
+			{
+			if (debug_connection > 1)
+				NSLog(@"Handling oneway message from 0x%x\n", self);
+			__atomic_add_fetch(&req_in_count, 1, __ATOMIC_RELAXED);
+			__atomic_add_fetch(&messages_received_count, 1, __ATOMIC_RELAXED);
+			mframe_do_call ([self _methodTypeAtReference: xref], decoder, encoder);
+			[aRmc decodeValueOfCType:@encode(int) at:&xref withName:NULL];
+			}
+		NS_HANDLER
+			{		// No one to pass it back to.  The next message can still
+					// be found if this one was decoded before it raised.
+			NSLog(@"NSConnection: oneway message raised %@", localException);
+			xref = 0;
+			if (decoded)
+				[aRmc decodeValueOfCType:@encode(int) at:&xref withName:NULL];
+			}
+		NS_ENDHANDLER
+		[pool release];
+		}
+
+	[aRmc dismiss];
 #endif
 }
 
@@ -1165,6 +1640,7 @@ static NSString *__enc_retname = @"return value";
 
 	NSParameterAssert(receive_port);
 	NSParameterAssert (is_valid);
+	[self flushOnewayMessages];
 	op = [_encodingClass newForWritingWithConnection: self
 						 sequenceNumber: [self _newMsgNumber]
 						 identifier: CONNECTION_SHUTDOWN];
@@ -1278,35 +1754,61 @@ static NSString *__enc_retname = @"return value";
 			it, even if we are waiting for a reply. */
 			[conn _service_typeForSelector: rmc];
 			break;
+		case METHODTYPE_DEFINE:
+			/* Always serviced as it arrives so that the type is known to
+			the requests after it, wherever they are serviced. */
+			[conn _service_defineType: rmc];
+			break;
+		case ONEWAY_BATCH:
 		case METHOD_REQUEST:
 			/* We just got a new request; we need to decide whether to queue
-			it or service it now.
+			it or service it now.  A batch of oneway messages is serviced
+			like a request, its messages in the order they were sent.
+			If multiple threads are enabled, hand it to a pool worker which
+			services it and sends the reply while we go on receiving.
 			If the REPLY_DEPTH is 0, then we aren't in the middle of waiting
 			for a reply, we are waiting for requests---so service it now.
 			If REPLY_DEPTH is non-zero, we may still want to service it now
 			if independant_queuing is NO. */
-			if (reply_depth == 0 || independant_queueing == NO)
+			{
+			SEL service = (ident == METHOD_REQUEST)
+						? @selector(_service_forwardForProxy:)
+						: @selector(_service_onewayBatch:);
+
+			if (conn->_multipleThreads)
 				{
-				[conn _service_forwardForProxy: rmc];
+				NSOperation *op = [[NSInvocationOperation alloc]
+								initWithTarget: conn
+								selector: service
+								object: rmc];
+
+				[conn->_workers addOperation: op];
+				[op release];
+				}
+			else if (__atomic_load_n(&reply_depth, __ATOMIC_ACQUIRE) == 0
+					|| independant_queueing == NO)
+				{
+				[conn performSelector: service withObject: rmc];
 				// Service any requests that were queued while we were waiting
 				// for replies. Is this the right place for this check?
-				if (reply_depth == 0)
+				if (__atomic_load_n(&reply_depth, __ATOMIC_ACQUIRE) == 0)
 					[self _handleQueuedRmcRequests];
 				}
 			else
 				{
-				[received_request_rmc_queue_gate lock];
-				[received_request_rmc_queue addObject: rmc];
-				[received_request_rmc_queue_gate unlock];
+				RmcQueues *q = conn->_queues;
+
+				pthread_mutex_lock(&q->lock);
+				[q->requests addObject: rmc];
+				pthread_mutex_unlock(&q->lock);
 				}
 			break;
-		case ROOTPROXY_REPLY:
-		case METHOD_REPLY:
-		case METHODTYPE_REPLY:			// Remember multi-threaded callbacks
-		case RETAIN_REPLY:				// will have to be handled specially
-			[received_reply_rmc_queue_gate lock];
-			[received_reply_rmc_queue addObject: rmc];
-			[received_reply_rmc_queue_gate unlock];
+			}
+		case ROOTPROXY_REPLY:			// Wakes any thread waiting on the
+		case METHOD_REPLY:				// connection's replies, if it is not
+		case METHODTYPE_REPLY:			// this one it will claim its reply
+		case RETAIN_REPLY:				// by sequence number.
+			RmcQueuesAddReply(conn->_queues, rmc);
 			break;
 		case CONNECTION_SHUTDOWN:
 			{
@@ -1332,20 +1834,21 @@ static NSString *__enc_retname = @"return value";
 
 - (void) _handleQueuedRmcRequests
 {
+	RmcQueues *q = _queues;
 	id rmc;
 
-	[received_request_rmc_queue_gate lock];
+	pthread_mutex_lock(&q->lock);
 	[self retain];
-	while (is_valid && ([received_request_rmc_queue count] > 0))
+	while (is_valid && ([q->requests count] > 0))
 		{
-		rmc = [received_request_rmc_queue objectAtIndex: 0];
-		[received_request_rmc_queue removeObjectAtIndex: 0];
-		[received_request_rmc_queue_gate unlock];
+		rmc = [q->requests objectAtIndex: 0];
+		[q->requests removeObjectAtIndex: 0];
+		pthread_mutex_unlock(&q->lock);
 		[self _handleRmc: rmc];
-		[received_request_rmc_queue_gate lock];
+		pthread_mutex_lock(&q->lock);
 		}
 	[self release];
-	[received_request_rmc_queue_gate unlock];
+	pthread_mutex_unlock(&q->lock);
 }
 
 /* Deal with an RMC, either by queuing it for later service, or
@@ -1355,31 +1858,49 @@ static NSString *__enc_retname = @"return value";
 /* Look for it on the queue, if it is not there, return nil. */
 - _getReceivedReplyRmcFromQueueWithSequenceNumber:(int)sn
 {
-	id the_rmc = nil;
-	unsigned count, i;
+	RmcQueues *q = _queues;
+	id the_rmc;
 
-	[received_reply_rmc_queue_gate lock];
-	
-	count = [received_reply_rmc_queue count];
-	/* xxx There should be a per-thread queue of rmcs so we can do
-		callbacks when multi-threaded. */
-	for (i = 0; i < count; i++)
+	pthread_mutex_lock(&q->lock);
+	the_rmc = RmcQueuesTakeReply(q, sn);
+	pthread_mutex_unlock(&q->lock);
+	if (the_rmc && debug_connection)
+		NSLog(@"Getting received reply from queue\n");
+
+	return the_rmc;
+}
+
+/* Block a thread that is not running the receive port until the receiving
+   thread queues the reply, or raise an exception on timing out.  The
+   receiving thread must be running its run loop to read the reply. */
+- _waitForReplyRmcWithSequenceNumber:(int)sn
+{
+	RmcQueues *q = _queues;
+	struct timeval tv;
+	struct timespec ts;
+	id rmc;
+	int e = 0;
+
+	gettimeofday(&tv, NULL);
+	ts.tv_sec = tv.tv_sec + (time_t)reply_timeout;
+	ts.tv_nsec = tv.tv_usec * 1000
+				+ (long)((reply_timeout - (time_t)reply_timeout) * 1e9);
+	if (ts.tv_nsec >= 1000000000)
 		{
-		id a_rmc = [received_reply_rmc_queue objectAtIndex: i];
-		if ([a_rmc connection] == self && [a_rmc sequenceNumber] == sn)
-			{
-			if (debug_connection)
-				NSLog(@"Getting received reply from queue\n");
-			[received_reply_rmc_queue removeObjectAtIndex: i];
-			the_rmc = a_rmc;
-			break;
-			}
-		/* xxx Make sure that there isn't a higher sequenceNumber, meaning
-		that we somehow dropped a packet. */
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
 		}
-	[received_reply_rmc_queue_gate unlock];
-	
-	return the_rmc;
+
+	pthread_mutex_lock(&q->lock);
+	while (!(rmc = RmcQueuesTakeReply(q, sn)) && is_valid && e != ETIMEDOUT)
+		e = pthread_cond_timedwait(&q->replied, &q->lock, &ts);
+	pthread_mutex_unlock(&q->lock);
+
+	if (rmc == nil)
+		[NSException raise: NSPortTimeoutException
+					 format: @"timed out waiting for reply"];
+
+	return rmc;
 }
 
 /* Check the queue, then try to get it from the network by waiting
@@ -1390,7 +1911,10 @@ static NSString *__enc_retname = @"return value";
 	id rmc;
 	id timeout_date = nil;
 
-	reply_depth++;
+	if ([NSThread currentThread] != _receiveThread)
+		return [self _waitForReplyRmcWithSequenceNumber: sn];
+
+	__atomic_add_fetch(&reply_depth, 1, __ATOMIC_ACQ_REL);
 	while (!(rmc = [self _getReceivedReplyRmcFromQueueWithSequenceNumber: sn]))
 		{
 		if (!timeout_date)
@@ -1402,7 +1926,7 @@ static NSString *__enc_retname = @"return value";
 		}
 	if (timeout_date)
 		[timeout_date release];
-	reply_depth--;
+	__atomic_sub_fetch(&reply_depth, 1, __ATOMIC_ACQ_REL);
 	if (rmc == nil)
 		[NSException raise: NSPortTimeoutException
 					 format: @"timed out waiting for reply"];
@@ -1420,7 +1944,9 @@ static NSString *__enc_retname = @"return value";
 	if (debug_connection > 3)
 		NSLog(@"packet arrived on %@", [[packet receivingInPort] description]);
 
+	[connection_table_gate lock];
 	connection = NSMapGet(receive_port_2_ancestor, [packet receivingInPort]);
+	[connection_table_gate unlock];
 	if (connection && [connection isValid])
 		{
 		rmc = [PortDecoder newDecodingWithPacket:packet connection:connection];
@@ -1435,9 +1961,7 @@ static NSString *__enc_retname = @"return value";
 	int n;
 
 	NSParameterAssert (is_valid);
-	[SEQUENCE_NUMBER_GATE lock];
-	n = message_count++;
-	[SEQUENCE_NUMBER_GATE unlock];
+	n = __atomic_fetch_add(&message_count, 1, __ATOMIC_RELAXED);
 	
 	return n;
 }
@@ -1555,6 +2079,9 @@ static NSString *__enc_retname = @"return value";
 
 - (void) _release_targets:(NSUInteger*)list count:(unsigned)number
 {
+	RmcQueues *q = _queues;
+
+	pthread_mutex_lock(&q->sending);
 	NS_DURING
 		{			// Tell the remote app that it can release its local 
 					// objects for the targets in the specified list since we 
@@ -1562,10 +2089,12 @@ static NSString *__enc_retname = @"return value";
 		if (receive_port && is_valid && number > 0) 
 			{
 			unsigned i;
-			id op = [_encodingClass newForWritingWithConnection: self
-									sequenceNumber: [self _newMsgNumber]
-									identifier: PROXY_RELEASE];
+			id op;
 
+			[self _flushBatch];			// after oneway messages that use them
+			op = [_encodingClass newForWritingWithConnection: self
+								 sequenceNumber: [self _newMsgNumber]
+								 identifier: PROXY_RELEASE];
 			[op encodeValueOfCType:@encode(unsigned) at:&number withName:NULL];
 		
 			for (i = 0; i < number; i++)
@@ -1586,33 +2115,53 @@ static NSString *__enc_retname = @"return value";
 			NSLog(@"failed to release targets - %@\n", [localException name]);
 		}
 	NS_ENDHANDLER
+	pthread_mutex_unlock(&q->sending);
 }
 
 - (void) retainTarget:(NSUInteger)target
 {
+	RmcQueues *q = _queues;
+	volatile BOOL sent = NO;
+	volatile int seq_num = 0;
+
+	pthread_mutex_lock(&q->sending);
 	NS_DURING
 		{
 		if (receive_port && is_valid)
-			{
-			id ip;			// Tell the remote app that it must retain the
-			id result;		// local object for the target on this connection.
-			unsigned int i;
-			int seq_num = [self _newMsgNumber];
-			id op = [_encodingClass newForWritingWithConnection: self
-									sequenceNumber: seq_num
-									identifier: PROXY_RETAIN];
-
+			{				// Tell the remote app that it must retain the
+			id op;			// local object for the target on this connection.
+
+			[self _flushBatch];
+			seq_num = [self _newMsgNumber];
+			op = [_encodingClass newForWritingWithConnection: self
+								 sequenceNumber: seq_num
+								 identifier: PROXY_RETAIN];
 			[op encodeValueOfCType: @encode(typeof(target))
 				at: &target
 				withName: NULL];
-	
 			[op dismiss];
-			ip = [self _getReceivedReplyRmcWithSequenceNumber: seq_num];
-			[ip decodeObjectAt: &result withName: NULL];
-			if (result != nil)
-				NSLog(@"failed to retain target - %@\n", result);
-			[ip dismiss];
+			sent = YES;
 		}	}
+	NS_HANDLER
+		{
+		NSLog(@"failed to retain target - %@\n", [localException name]);
+		}
+	NS_ENDHANDLER
+	pthread_mutex_unlock(&q->sending);
+
+	if (!sent)
+		return;
+
+	NS_DURING						// the lock ends before we wait on a reply
+		{
+		id ip = [self _getReceivedReplyRmcWithSequenceNumber: seq_num];
+		id result;
+
+		[ip decodeObjectAt: &result withName: NULL];
+		if (result != nil)
+			NSLog(@"failed to retain target - %@\n", result);
+		[ip dismiss];
+		}
 	NS_HANDLER
 		NSLog(@"failed to retain target - %@\n", [localException name]);
 	NS_ENDHANDLER
@@ -1749,6 +2298,17 @@ static NSString *__enc_retname = @"return value";
 	send_port_class = aPortClass;
 }
 
+- (void) _setPeerFormatVersion:(int)version
+{											// Messages are coded for the
+	if (version > _peerFormatVersion)		// newest version the peer has
+		_peerFormatVersion = version;		// shown it speaks
+}
+
+- (BOOL) _peerReadsCompactFormat
+{
+	return (_peerFormatVersion >= PORT_CODER_COMPACT_VERSION);
+}
+
 - (NSUInteger) _encoderCreateReferenceForConstPtr:(const void*)ptr
 {
 	NSUInteger xref;			// Support for cross-connection const-ptr cache
@@ -14,6 +14,10 @@
    under the terms of the GNU Library General Public License.
 */
 
+#ifdef __linux__
+  #define _GNU_SOURCE								// struct ucred
+#endif
+
 #include <Foundation/NSPort.h>
 #include <Foundation/NSArray.h>
 #include <Foundation/NSConnection.h>
@@ -24,6 +28,7 @@
 #include <Foundation/NSMapTable.h>
 #include <Foundation/NSPortMessage.h>
 #include <Foundation/NSException.h>
+#include <Foundation/NSLock.h>
 #include <Foundation/NSString.h>
 #include <Foundation/NSNotificationQueue.h>
 #include <Foundation/NSAutoreleasePool.h>
@@ -43,8 +48,15 @@
   #include <fcntl.h>
   #include <sys/socket.h>
   #include <sys/file.h>
+  #include <sys/stat.h>
+  #include <sys/un.h>
+  #include <netinet/tcp.h>
+  #include <ifaddrs.h>
 #endif /* !__WIN32__ */
 
+#include <stddef.h>
+#include <pthread.h>
+
 #include <signal.h>
 #include <resolv.h>
 
@@ -57,6 +69,7 @@ extern struct __res_state _res;				// defined in resolv.h
 
 // Class variables
 static int debug_tcp_port = 0;
+static BOOL local_transport = YES;			// AF_UNIX between local ports
 static NSMapTable *out_port_bag = NULL;
 static NSMapTable *socket_2_port = NULL;	// Both TcpInPort's + TcpOutPort's 
 											// are entered in this maptable
@@ -69,6 +82,7 @@ static NSMapTable *port_number_2_port;		// This map table is used to make
 {											// concrete implementation of a 
 	int _port_socket;						// Port object implemented on top 
 	struct sockaddr_in _listening_address;	// of SOCK_STREAM connections.
+	int _local_socket;						// AF_UNIX twin of _port_socket
 	NSMapTable *_client_sock_2_out_port;
 	NSMapTable *_client_sock_2_packet;
 	id _packet_invocation;
@@ -95,7 +109,9 @@ static NSMapTable *port_number_2_port;		// This map table is used to make
 	struct sockaddr_in _peer_address;	// address of our remote peer socket
 
 	id _polling_in_port;				// TcpInPort that is polling our 
-}										// _port_socket with select()
+										// _port_socket with select()
+	NSLock *_send_gate;					// keeps packets sent from several
+}										// threads from interleaving
 
 + (id) newForSendingToSockaddr:(struct sockaddr_in*)sockaddr 
 			withAcceptedSocket:(int)sock
@@ -143,6 +159,7 @@ _PortCallback( CFSocketRef s,
 
 + (NSPort*) port						{ return [[NSPort new] autorelease]; }
 + (void) _setDebug:(int)val				{ debug_tcp_port = val; }
++ (void) _setLocalTransport:(BOOL)flag	{ local_transport = flag; }
 + (Class) _outPortClass					{ return [TcpOutPort class]; }
 + (Class) _inPortClass					{ return [TcpInPort class]; }
 
@@ -292,6 +309,174 @@ _PortCallback( CFSocketRef s,
 
 @end
 
+/* ****************************************************************************
+
+	Local transport
+
+	Every TcpInPort also listens on an AF_UNIX socket named after its TCP
+	port number.  A TcpOutPort whose destination is an address of this
+	host connects to that socket instead, so same host DO skips the TCP
+	stack.  Ports keep their sockaddr_in identity in packets and in the
+	name server, which is all the peer ever sees of the transport.
+
+** ***************************************************************************/
+
+static struct in_addr *__hostAddresses = NULL;
+static int __hostAddressCount = 0;
+static pthread_once_t __hostAddressesOnce = PTHREAD_ONCE_INIT;
+
+
+static void
+HostAddressesInit(void)
+{
+	struct ifaddrs *ifa, *i;
+	int n = 0;
+
+	if (getifaddrs(&ifa) < 0)
+		return;
+	for (i = ifa; i; i = i->ifa_next)
+		if (i->ifa_addr && i->ifa_addr->sa_family == AF_INET)
+			n++;
+	__hostAddresses = malloc(MAX(n, 1) * sizeof(struct in_addr));
+	for (i = ifa; i; i = i->ifa_next)
+		if (i->ifa_addr && i->ifa_addr->sa_family == AF_INET)
+			__hostAddresses[__hostAddressCount++]
+					= ((struct sockaddr_in *)i->ifa_addr)->sin_addr;
+	freeifaddrs(ifa);
+}
+
+static BOOL
+IsHostAddress(struct in_addr a)
+{
+	int i;
+
+	if ((NSSwapBigIntToHost(a.s_addr) >> 24) == 127)		// loopback net
+		return YES;
+
+	pthread_once(&__hostAddressesOnce, HostAddressesInit);
+	for (i = 0; i < __hostAddressCount; i++)
+		if (__hostAddresses[i].s_addr == a.s_addr)
+			return YES;
+
+	return NO;
+}
+
+static socklen_t
+LocalSockaddr(struct sockaddr_un *sun, unsigned short n)
+{
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+#ifdef __linux__						// abstract namespace, the name goes
+	snprintf(sun->sun_path + 1,			// with the socket, nothing to unlink
+			 sizeof(sun->sun_path) - 1, "mGSTEP-DO-%u-%hu",
+			 (unsigned)getuid(), n);
+	return offsetof(struct sockaddr_un, sun_path) + 1 + strlen(sun->sun_path+1);
+#else									// in a directory only we can write
+	snprintf(sun->sun_path, sizeof(sun->sun_path), "/tmp/.mGSTEP-DO-%u/%hu",
+			 (unsigned)getuid(), n);
+	return sizeof(*sun);
+#endif
+}
+
+#ifndef __linux__
+static BOOL
+LocalDirectory(void)
+{
+	char path[64];
+	struct stat st;
+
+	snprintf(path, sizeof(path), "/tmp/.mGSTEP-DO-%u", (unsigned)getuid());
+	if (mkdir(path, 0700) < 0 && errno != EEXIST)
+		return NO;
+	if (lstat(path, &st) < 0 || !S_ISDIR(st.st_mode))
+		return NO;					// not a symlink planted by someone else
+
+	return (st.st_uid == getuid() && (st.st_mode & 077) == 0);
+}
+#endif
+
+static BOOL
+LocalPeerIsUser(int s)				// the abstract namespace has no owner,
+{									// so ask who is at the other end
+#ifdef __linux__
+	struct ucred cr;
+	socklen_t len = sizeof(cr);
+
+	if (getsockopt(s, SOL_SOCKET, SO_PEERCRED, &cr, &len) < 0)
+		return NO;
+
+	return (cr.uid == getuid());
+#else
+	uid_t uid;
+	gid_t gid;
+
+	if (getpeereid(s, &uid, &gid) < 0)
+		return NO;
+
+	return (uid == getuid());
+#endif
+}
+
+static int
+LocalListen(unsigned short n)
+{
+	struct sockaddr_un sun;
+	socklen_t len = LocalSockaddr(&sun, n);
+	int s;
+
+#ifndef __linux__
+	if (!LocalDirectory())
+		{
+		errno = EACCES;
+		return -1;
+		}
+#endif
+	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return -1;
+#ifndef __linux__						// We hold TCP port n so a socket
+	unlink(sun.sun_path);				// file by its name in our own dir
+#endif									// is a dead port's
+	if (bind(s, (struct sockaddr*)&sun, len) < 0 || listen(s, 10) < 0)
+		{								// name taken, the port is TCP only
+		int e = errno;
+
+		close(s);
+		errno = e;
+		return -1;
+		}
+
+	return s;
+}
+
+static int
+LocalConnect(struct sockaddr_in *sin)
+{
+	struct sockaddr_un sun;
+	socklen_t len;
+	int s;
+
+	if (!local_transport || !IsHostAddress(sin->sin_addr))
+		return -1;
+	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return -1;
+	len = LocalSockaddr(&sun, NSSwapBigShortToHost(sin->sin_port));
+	if (connect(s, (struct sockaddr*)&sun, len) < 0 || !LocalPeerIsUser(s))
+		{						// no local socket or one that is not ours,
+		close(s);				// use TCP
+		return -1;
+		}
+
+	return s;
+}
+
+static void
+TcpNoDelay(int s)					// packets are written whole, don't let
+{									// Nagle hold back a request or reply
+	int r = 1;
+
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (char*)&r, sizeof(r));
+}
+
 /* ****************************************************************************
 
 	TcpInPort
@@ -316,6 +501,7 @@ _PortCallback( CFSocketRef s,
 		}
 									// There isn't already a TcpInPort for this
 	p = [[TcpInPort alloc] init];	// port number, so create a new port object
+	p->_local_socket = -1;
 	p->_port_socket = socket (AF_INET, SOCK_STREAM, 0);	   // Create the socket
 
 	if (p->_port_socket < 0)
@@ -439,7 +625,11 @@ _PortCallback( CFSocketRef s,
 		[NSException raise: NSInternalInconsistencyException
 		format: @"[TcpInPort +newForReceivingFromPortNumber:] listen(): %s",
 			strerror(errno)];
-		}						// Initialize the tables for matching socket's 
+		}
+	if ((p->_local_socket = LocalListen(n)) < 0 && local_transport)
+		NSLog(@"TcpInPort %hu has no local socket, TCP only: %s",
+				n, strerror(errno));
+								// Initialize the tables for matching socket's 
 								// to out ports and packets.
 	p->_client_sock_2_out_port = NSCreateMapTable(NSIntMapKeyCallBacks,
 												  NSObjectMapValueCallBacks,0);
@@ -492,13 +682,13 @@ _PortCallback( CFSocketRef s,
 	// packet.  Otherwise, keep partially read packet in _CLIENT_SOCK_2_PACKET
 - (id) _tryToGetPacketFromReadableFD:(int)fd_index
 {
-	if (fd_index == _port_socket)
+	if (fd_index == _port_socket || fd_index == _local_socket)
 		{								// This is a connection request on the 
-		int rval;						// original listen()'ing socket
-		volatile id op;
-		struct sockaddr_in clientname;
+		int rval;						// original listen()'ing socket or on
+		volatile id op;					// its local twin, whose addresses
+		struct sockaddr_in clientname;	// are truncated, they are not used
 		int size = sizeof (clientname);
-		int new = accept (_port_socket, (struct sockaddr*)&clientname, &size);
+		int new = accept (fd_index, (struct sockaddr*)&clientname, &size);
 
 		if (new < 0)
 			{
@@ -524,6 +714,13 @@ _PortCallback( CFSocketRef s,
 			format: @"[TcpInPort receivePacketWithTimeout:] fcntl(GET): %s",
 				strerror(errno)];
 			}
+		if (fd_index == _port_socket)
+			TcpNoDelay(new);
+		else if (!LocalPeerIsUser(new))
+			{
+			close(new);					// local clients are our own user's
+			return nil;
+			}
 
 		op = [TcpOutPort _newWithAcceptedSocket: new 
 						 peeraddr: &clientname
@@ -604,19 +801,25 @@ _PortCallback( CFSocketRef s,
 
 	return nil;
 }
-								// NSRunLoop will send this message just before 
-- (void) getFds:(int*)fds 		// it's about to call select().  It is asking
-		  count:(int*)count		// us to fill fds[] in with the sockets on
-{								// which it should listen. *count should be set
-	NSMapEnumerator me;			// to the number of sockets we put in the array
-	long sock;
-	id out_port;							// Make sure there is enough room
-											// in the provided array.
-	NSAssert(*count > NSCountMapTable (_client_sock_2_out_port), 	
-				NSInternalInconsistencyException);
+								// NSRunLoop sends this message when the source
+- (void) getFds:(int*)fds 		// is added and after _CFSocketFdsChanged().
+		  count:(int*)count		// It is asking us to fill fds[] in with the
+{								// sockets on which it should listen. *count
+	NSMapEnumerator me;			// should be set to the number of sockets we
+	long sock;					// put in the array.
+	id out_port;
+	int needed = NSCountMapTable (_client_sock_2_out_port) + 2;
+
+	if (*count < needed)					// If the provided array is too
+		{									// small report the size needed
+		*count = needed;
+		return;
+		}
 
 	*count = 0;									// Put in our listening socket.
 	fds[(*count)++] = _port_socket;
+	if (_local_socket >= 0)
+		fds[(*count)++] = _local_socket;
 						// Enumerate all our client sockets, and put them in.
 	me = NSEnumerateMapTable (_client_sock_2_out_port);
 	while (NSNextMapEnumeratorPair (&me, (void*)&sock, (void*)&out_port))
@@ -656,6 +859,7 @@ _PortCallback( CFSocketRef s,
 									// Add it, and put its socket in the set of 
 									// file descriptors we poll.
 	NSMapInsert (_client_sock_2_out_port, INT2PTR(s), p);
+	_CFSocketFdsChanged(_cfSocket);
 }
 
 - (void) _connectedOutPortInvalidated:(id)p
@@ -674,6 +878,7 @@ _PortCallback( CFSocketRef s,
 		[packet release];
 		}
 	NSMapRemove (_client_sock_2_out_port, INT2PTR(s));
+	_CFSocketFdsChanged(_cfSocket);
 }
 
 - (int) _portSocket					{ return _port_socket; }
@@ -718,6 +923,17 @@ _PortCallback( CFSocketRef s,
 #else
 			close (_port_socket);
 #endif /* __WIN32__ */
+			}
+		if (_local_socket >= 0)
+			{
+#ifndef __linux__
+			struct sockaddr_un sun;
+
+			LocalSockaddr(&sun, NSSwapBigShortToHost(_listening_address.sin_port));
+			unlink(sun.sun_path);
+#endif
+			close (_local_socket);
+			_local_socket = -1;
 			}			// This also posts NSPortDidBecomeInvalidNotification
 		[super invalidate];
 		}
@@ -871,6 +1087,7 @@ _PortCallback( CFSocketRef s,
 		}					// There isn't already an in port for this sockaddr 
 							// or sock, so create a new port.
 	p = [[self alloc] init];
+	p->_send_gate = [NSLock new];
 
 	if (sock)										// Set its socket.
 		p->_port_socket = sock;
@@ -904,12 +1121,17 @@ _PortCallback( CFSocketRef s,
 
 	if (!sock) 						// Connect the socket to its destination,  
 		{							// (if it hasn't been done already by a 
-		int rval;					// previous accept() call.
+		int rval, ls;				// previous accept() call.
 
 		NSAssert(p->_remote_in_port_address.sin_family, 
 					NSInternalInconsistencyException);
 
-		if (connect (p->_port_socket,
+		if ((ls = LocalConnect(&p->_remote_in_port_address)) >= 0)
+			{									// same host, use the in port's
+			close (p->_port_socket);			// local twin
+			p->_port_socket = ls;
+			}
+		else if (connect (p->_port_socket,
 			(struct sockaddr*)&(p->_remote_in_port_address), 
 			sizeof(p->_remote_in_port_address)) < 0)
 			{
@@ -918,6 +1140,8 @@ _PortCallback( CFSocketRef s,
 			format: @"[TcpInPort newForSendingToSockaddr:...] connect(): %s",
 					strerror(errno)];
 			}
+		else
+			TcpNoDelay(p->_port_socket);
 										// Ensure the socket is non-blocking.
 		if ((rval = fcntl(p->_port_socket, F_GETFL, 0)) >= 0) 
 			{
@@ -1007,10 +1231,19 @@ _PortCallback( CFSocketRef s,
 			// port addresses.  If REPLY_PORT is nil, the third argument to 
 			// this call will be NULL, and __writeToSocket: withSendPort: 
 			// withReceivePort:timeout: will know that there is no reply port. 
-	[packet _writeToSocket: _port_socket 
-			withSendPort: self
-			withReceivePort: reply_port
-			timeout: timeout];
+	[_send_gate lock];
+	NS_DURING
+		[packet _writeToSocket: _port_socket 
+				withSendPort: self
+				withReceivePort: reply_port
+				timeout: timeout];
+	NS_HANDLER
+		{
+		[_send_gate unlock];
+		[localException raise];
+		}
+	NS_ENDHANDLER
+	[_send_gate unlock];
 
 	return YES;
 }
@@ -1064,6 +1297,7 @@ _PortCallback( CFSocketRef s,
 - (void) dealloc
 {
 	[self invalidate];
+	[_send_gate release];
 	[super dealloc];
 }									// Make sure Connection's always send us 
 									// bycopy. as own class, not a Proxy class
@@ -31,6 +31,8 @@
 #define DEFAULT_SIZE	256
 #define DEFAULT_FORMAT_VERSION	0
 #define DOING_ROOT_OBJECT	(interconnect_stack_height != 0)
+							// C types a CStream can code as an array at once
+#define IS_C_SCALAR(t)		((t) && strchr("cCsSiIlLqQfd", (t)))
 
 // Class variables
 static id _dummyObject;
@@ -134,6 +136,11 @@ static id default_cstream_class;
 - (BOOL) isByref							{ NIMP return NO; }
 - (NSPort*) replyPort						{ NIMP return nil; }
 
+- (BOOL) _isCompact
+{
+	return [(id)cstream isKindOfClass: [CompactCStream class]];
+}
+
 - (void) encodeValueOfObjCType:(const char*)type				// core methods
 							at:(const void*)address;
 {
@@ -381,12 +388,30 @@ my_object_is_class(id object)
 								// separately for each created PortCoder.
 - (NSUInteger) _coderReferenceForConstPtr:(const void*)ptr
 {
-	return [connection _encoderReferenceForConstPtr: ptr];
-}
+	if (connection)
+		return [connection _encoderReferenceForConstPtr: ptr];
+	if (const_ptr_2_xref)
+		return PTR2UINT( NSMapGet (const_ptr_2_xref, ptr));
 
+	return 0;
+}
+									// Without a connection a compact coder
 - (NSUInteger) _coderCreateReferenceForConstPtr:(const void*)ptr
-{
-	return [connection _encoderCreateReferenceForConstPtr: ptr];
+{									// keeps them for the one message, the
+	NSUInteger xref;				// BinaryCStream format never repeats
+
+	if (connection)
+		return [connection _encoderCreateReferenceForConstPtr: ptr];
+	if (![self _isCompact])
+		return 0;
+
+	if (!const_ptr_2_xref)
+		const_ptr_2_xref = NSCreateMapTable(NSNonOwnedPointerMapKeyCallBacks,
+											NSIntMapValueCallBacks, 0);
+	xref = NSCountMapTable (const_ptr_2_xref) + 1;
+	NSMapInsert (const_ptr_2_xref, ptr, UINT2PTR(xref));
+
+	return xref;
 }
 											// Methods for forward references
 - (NSUInteger) _coderCreateForwardReferenceForObject:(id)anObject
@@ -880,6 +905,12 @@ my_object_is_class(id object)
 	const char *where = d;
 
   [self encodeName:name];
+	if (IS_C_SCALAR(*type) && [cstream respondsToSelector: @selector(
+									encodeArrayOfCType:count:at:)])
+		{
+		[(id)cstream encodeArrayOfCType:type count:c at:d];
+		return;
+		}
   for (i = 0; i < c; i++)
 		{
 		[self encodeValueOfObjCType:type
@@ -897,6 +928,12 @@ my_object_is_class(id object)
 	int offset = objc_sizeof_type(type);
 	const char *where = d;
 
+	if (IS_C_SCALAR(*type) && [cstream respondsToSelector: @selector(
+									encodeArrayOfCType:count:at:)])
+		{
+		[(id)cstream encodeArrayOfCType:type count:c at:d];
+		return;
+		}
   for (i = 0; i < c; i++)
 		{
 		[self encodeValueOfObjCType:type
@@ -936,12 +973,17 @@ my_object_is_class(id object)
 					  identifier:(int)i
 {
 	NSPortMessage *packet;
+	Class cStreamClass = [[self class] defaultCStreamClass];
 
 	packet = [NSPortMessage _portMessageWithSendPort: [c receivePort]
 							receivePort: nil
 							capacity: DEFAULT_SIZE];
-
-	[self initForWritingToStream: packet];
+	if ([c _peerReadsCompactFormat])		// the peer's signature showed it
+		cStreamClass = [CompactCStream class];	// reads the compact format
+	[self initForWritingToStream: packet
+		  withFormatVersion: DEFAULT_FORMAT_VERSION
+		  cStreamClass: cStreamClass
+		  cStreamFormatVersion: [cStreamClass defaultFormatVersion]];
 	[packet release];
 	connection = c;
 	sequence_number = n;
@@ -984,6 +1026,11 @@ my_object_is_class(id object)
 - (BOOL) isBycopy					{ return _is_by_copy; }
 - (BOOL) isByref					{ return _is_by_ref; }
 
+- (unsigned) _packetLength
+{
+	return [(NSPortMessage *)[cstream stream] streamEofPosition];
+}
+
 @end  /* PortEncoder */
 
 /* ****************************************************************************
@@ -997,12 +1044,12 @@ my_object_is_class(id object)
 + (void) readSignatureFromCStream:(id <CStreaming>)cs
 					 getClassname:(char *) name
 					 formatVersion:(int*) version
+					 majorVersion:(int*) major
 {
 	char package_name[64];
-	int major_version;
 	int got = [[cs stream] readFormat: SIGNATURE_FORMAT_STRING,
 										&package_name, 
-										&major_version,
+										major,
 										name, version];
 	if (got != 4)
 		[NSException raise: @"CoderSignatureMalformedException"
@@ -1013,13 +1060,17 @@ my_object_is_class(id object)
 {													// designated initializer.
 	id cs = [CStream cStreamReadingFromStream: stream];
 	char name[128];										// Max classname length.
-	int ver;
+	int ver, major;
 	PortDecoder *new_coder;
 
-	[self readSignatureFromCStream:cs getClassname:name formatVersion:&ver];
+	[self readSignatureFromCStream: cs
+		  getClassname: name
+		  formatVersion: &ver
+		  majorVersion: &major];
 	
 	new_coder = [[objc_lookup_class(name) alloc] _initWithCStream: cs
 												 formatVersion: ver];
+	new_coder->major_version = major;
 	new_coder->xref_2_object = NULL;
 	new_coder->xref_2_object_root = NULL;
 	new_coder->fref_2_object = NULL;
@@ -1115,12 +1166,28 @@ my_object_is_class(id object)
 							// separately for each created PortCoder.
 - (NSUInteger) _coderCreateReferenceForConstPtr:(const void*)ptr
 {
-	return [connection _decoderCreateReferenceForConstPtr: ptr];
+	NSUInteger xref;
+
+	if (connection)
+		return [connection _decoderCreateReferenceForConstPtr: ptr];
+
+	if (!xref_2_const_ptr)
+		xref_2_const_ptr = NSCreateMapTable(NSIntMapKeyCallBacks,
+											NSNonOwnedPointerMapValueCallBacks, 0);
+	xref = NSCountMapTable (xref_2_const_ptr) + 1;
+	NSMapInsert (xref_2_const_ptr, UINT2PTR(xref), ptr);
+
+	return xref;
 }
 
 - (const void*) _coderConstPtrAtReference:(NSUInteger)xref
 {
-	return [connection _decoderConstPtrAtReference: xref];
+	if (connection)
+		return [connection _decoderConstPtrAtReference: xref];
+	if (xref_2_const_ptr)
+		return NSMapGet (xref_2_const_ptr, UINT2PTR(xref));
+
+	return NULL;
 }
 						// Here are the methods for forward object references.
 - (void) _coderPushForwardObjectTable
@@ -1654,6 +1721,12 @@ my_object_is_class(id object)
 	char *where = d;
 
 	[self decodeName:name];
+	if (IS_C_SCALAR(*type) && [cstream respondsToSelector: @selector(
+									decodeArrayOfCType:count:at:)])
+		{
+		[(id)cstream decodeArrayOfCType:type count:c at:d];
+		return;
+		}
 	for (i = 0; i < c; i++)
 		{
 		[self decodeValueOfObjCType:type at:where withName:NULL];
@@ -1669,6 +1742,12 @@ my_object_is_class(id object)
 	int offset = objc_sizeof_type(type);
 	char *where = d;
 
+	if (IS_C_SCALAR(*type) && [cstream respondsToSelector: @selector(
+									decodeArrayOfCType:count:at:)])
+		{
+		[(id)cstream decodeArrayOfCType:type count:c at:d];
+		return;
+		}
 	for (i = 0; i < c; i++)
 		{
 		[self decodeValueOfObjCType:type at:where withName:NULL];
@@ -1720,6 +1799,7 @@ my_object_is_class(id object)
 	reply_port = [packet replyPort];
 	cd->connection = [NSConnection _connectionWithReceivePort: in_port
 								   sendPort: reply_port];
+	[cd->connection _setPeerFormatVersion: cd->major_version];
 													// Decode PortDecoder ivars
 	[cd decodeValueOfCType: @encode(typeof(cd->sequence_number))
 		at: &(cd->sequence_number)
@@ -1744,6 +1824,7 @@ my_object_is_class(id object)
 	reply_port = [packet replyOutPort];
 	cd->connection = [NSConnection _connectionWithReceivePort: in_port
 								   sendPort: reply_port];
+	[cd->connection _setPeerFormatVersion: cd->major_version];
 											// Decode the PortDecoder's ivars
 	[cd decodeValueOfCType: @encode(typeof(cd->sequence_number))
 		at: &(cd->sequence_number)
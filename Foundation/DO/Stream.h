@@ -165,6 +165,29 @@
 
 @end
 
+/* ****************************************************************************
+
+	CompactCStream
+
+** ***************************************************************************/
+
+@interface CompactCStream : CStream			// untagged varint values, byte
+{											// arrays as a single run
+	int (*_write)(id, SEL, const void*, int);
+	int (*_read)(id, SEL, void*, int);
+}
+
+- (void) encodeTag:(unsigned char)t;
+- (unsigned char) decodeTag;
+
+- (void) encodeArrayOfCType:(const char*)type
+					  count:(unsigned)c
+					  at:(const void*)d;
+- (void) decodeArrayOfCType:(const char*)type
+					  count:(unsigned)c
+					  at:(void*)d;
+@end
+
 /* ****************************************************************************
 
 	InPacket, OutPacket
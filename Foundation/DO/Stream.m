@@ -1583,3 +1583,374 @@ id CStreamSignatureMismatchException  = @"CStreamSignatureMismatchException";
 }
 
 @end /* BinaryCStream */
+
+/* ****************************************************************************
+
+	CompactCStream
+
+	Integers are written as varints, seven bits to a byte, low bits first
+	and the high bit set on every byte but the last.  Signed integers are
+	zigzag mapped so that small negative values stay short.  Floats and
+	doubles are their IEEE bits in network order, a char* is its length
+	plus one (0 for NULL) followed by its bytes.  No type tag is written,
+	the reader must decode the types that were encoded, and an array of
+	char or unsigned char is copied to the stream as a single run.
+
+** ***************************************************************************/
+
+#include <stdint.h>
+
+#define VARINT_MAX		10					// bytes in a 64 bit varint
+#define ARRAY_BUFFER	512
+
+
+static inline int
+put_varint(unsigned char *b, unsigned long long v)
+{
+	int n = 0;
+
+	while (v >= 0x80)
+		{
+		b[n++] = (unsigned char)v | 0x80;
+		v >>= 7;
+		}
+	b[n++] = (unsigned char)v;
+
+	return n;
+}
+
+static inline unsigned long long
+zigzag(long long v)
+{
+	return ((unsigned long long)v << 1) ^ (unsigned long long)(v >> 63);
+}
+
+static inline long long
+unzigzag(unsigned long long u)
+{
+	return (long long)(u >> 1) ^ -(long long)(u & 1);
+}
+
+static int
+put_value(unsigned char *b, const char *type, const void *d)
+{										// encode a scalar into b, returns
+	uint64_t u;							// its length or 0 if type is not
+	int i;								// a scalar
+
+	switch (*type)
+		{
+		case _C_CHR:
+		case _C_UCHR:
+			*b = *(unsigned char*)d;
+			return 1;
+		case _C_SHT:		return put_varint(b, zigzag(*(short*)d));
+		case _C_USHT:		return put_varint(b, *(unsigned short*)d);
+		case _C_INT:		return put_varint(b, zigzag(*(int*)d));
+		case _C_UINT:		return put_varint(b, *(unsigned int*)d);
+		case _C_LNG:		return put_varint(b, zigzag(*(long*)d));
+		case _C_ULNG:		return put_varint(b, *(unsigned long*)d);
+		case _C_LNG_LNG:	return put_varint(b, zigzag(*(long long*)d));
+		case _C_ULNG_LNG:	return put_varint(b, *(unsigned long long*)d);
+		case _C_FLT:
+			{
+			uint32_t f;
+
+			memcpy(&f, d, sizeof(float));
+			f = htonl(f);
+			memcpy(b, &f, sizeof(float));
+			return sizeof(float);
+			}
+		case _C_DBL:
+			memcpy(&u, d, sizeof(double));
+			for (i = 0; i < 8; i++)
+				b[i] = (unsigned char)(u >> (56 - 8 * i));
+			return sizeof(double);
+		}
+
+	return 0;
+}
+
+
+@implementation CompactCStream
+
++ (int) defaultFormatVersion			{ return PORT_CODER_FORMAT_VERSION; }
+
+- (id) _initForReadingFromPostSignatureStream:(id <Streaming>)s
+							withFormatVersion:(int)version
+{
+	[super _initForReadingFromPostSignatureStream: s withFormatVersion: version];
+	_read = (int (*)(id, SEL, void*, int))
+				[(id)s methodForSelector: @selector(readBytes:length:)];
+
+	return self;
+}
+
+- (id) initForWritingToStream:(id <Streaming>)s withFormatVersion:(int)version
+{
+	[super initForWritingToStream: s withFormatVersion: version];
+	_write = (int (*)(id, SEL, const void*, int))
+				[(id)s methodForSelector: @selector(writeBytes:length:)];
+
+	return self;
+}
+
+static void
+get_bytes(CompactCStream *s, void *b, int l)
+{
+	if ((*s->_read)(s->_stream, @selector(readBytes:length:), b, l) != l)
+		[NSException raise: NSGenericException
+					 format: @"CompactCStream expected %d bytes of input", l];
+}
+
+static unsigned long long
+get_varint(CompactCStream *s)
+{
+	unsigned long long v = 0;
+	unsigned char b;
+	int shift = 0;
+
+	do	{
+		get_bytes(s, &b, 1);
+		v |= (unsigned long long)(b & 0x7f) << shift;
+		shift += 7;
+		} while ((b & 0x80) && shift < 7 * VARINT_MAX);
+
+	return v;
+}
+
+static BOOL
+get_value(CompactCStream *s, const char *type, void *d)
+{
+	unsigned char b[8];
+	uint64_t u = 0;
+	int i;
+
+	switch (*type)
+		{
+		case _C_CHR:
+		case _C_UCHR:		get_bytes(s, d, 1);								break;
+		case _C_SHT:		*(short*)d = unzigzag(get_varint(s));			break;
+		case _C_USHT:		*(unsigned short*)d = get_varint(s);			break;
+		case _C_INT:		*(int*)d = unzigzag(get_varint(s));				break;
+		case _C_UINT:		*(unsigned int*)d = get_varint(s);				break;
+		case _C_LNG:		*(long*)d = unzigzag(get_varint(s));			break;
+		case _C_ULNG:		*(unsigned long*)d = get_varint(s);				break;
+		case _C_LNG_LNG:	*(long long*)d = unzigzag(get_varint(s));		break;
+		case _C_ULNG_LNG:	*(unsigned long long*)d = get_varint(s);		break;
+		case _C_FLT:
+			{
+			uint32_t f;
+
+			get_bytes(s, &f, sizeof(float));
+			f = ntohl(f);
+			memcpy(d, &f, sizeof(float));
+			break;
+			}
+		case _C_DBL:
+			get_bytes(s, b, sizeof(double));
+			for (i = 0; i < 8; i++)
+				u = (u << 8) | b[i];
+			memcpy(d, &u, sizeof(double));
+			break;
+		default:
+			return NO;
+		}
+
+	return YES;
+}
+
+- (void) encodeValueOfCType:(const char*)type
+						 at:(const void*)d
+						 withName:(NSString*)name
+{
+	unsigned char b[VARINT_MAX];
+	int n;
+
+	if (!type)
+		[NSException raise:NSInvalidArgumentException format:@"type is NULL"];
+
+	NSAssert(*type != '@', @"tried to encode an \"ObjC\" type");
+	NSAssert(*type != '^', @"tried to encode an \"ObjC\" type");
+	NSAssert(*type != ':', @"tried to encode an \"ObjC\" type");
+
+	if ((n = put_value(b, type, d)))
+		{
+		(*_write)(_stream, @selector(writeBytes:length:), b, n);
+		return;
+		}
+
+	switch (*type)
+		{
+		case _C_CHARPTR:
+			{
+			const char *s = *(char**)d;
+			unsigned length = (s) ? strlen(s) : 0;
+
+			n = put_varint(b, (s) ? length + 1 : 0);
+			(*_write)(_stream, @selector(writeBytes:length:), b, n);
+			if (length)
+				(*_write)(_stream, @selector(writeBytes:length:), s, length);
+			break;
+			}
+
+		case _C_ARY_B:
+			{
+			int len = atoi (type+1);
+
+			while (isdigit(*++type));
+			[self encodeArrayOfCType:type count:len at:d];
+			break;
+			}
+
+		case _C_STRUCT_B:
+			{
+			int acc_size = 0;
+
+			while (*type != _C_STRUCT_E && *type++ != '=');	// skip "<name>="
+			while (*type != _C_STRUCT_E)
+				{
+				acc_size = ROUND (acc_size, objc_alignof_type (type));
+				[self encodeValueOfCType:type
+					  at:((char*)d)+acc_size
+					  withName:NULL];
+				acc_size += objc_sizeof_type (type);
+				type = objc_skip_typespec (type);
+				}
+			break;
+			}
+
+		default:
+			[NSException raise: NSGenericException 
+						 format: @"Unrecognized type %s", type];
+		}
+}
+
+- (void) decodeValueOfCType:(const char*)type
+						 at:(void*)d 
+						 withName:(NSString **)namePtr
+{
+	if (!type)
+		[NSException raise:NSInvalidArgumentException format:@"type is NULL"];
+
+	NSAssert(*type != '@', @"tried to decode an \"ObjC\" type");
+	NSAssert(*type != '^', @"tried to decode an \"ObjC\" type");
+	NSAssert(*type != ':', @"tried to decode an \"ObjC\" type");
+
+	if (get_value(self, type, d))
+		return;
+
+	switch (*type)
+		{
+		case _C_CHARPTR:
+			{
+			unsigned length = get_varint(self);
+
+			if (length == 0)
+				*(char**)d = NULL;
+			else
+				{
+				*(char**)d = malloc (length);
+				get_bytes(self, *(char**)d, length - 1);
+				(*(char**)d)[length - 1] = '\0';
+				}
+			break;
+			}
+
+		case _C_ARY_B:
+			{
+			int len = atoi (type+1);
+
+			while (isdigit(*++type));
+			[self decodeArrayOfCType:type count:len at:d];
+			break;
+			}
+
+		case _C_STRUCT_B:
+			{
+			int acc_size = 0;
+
+			while (*type != _C_STRUCT_E && *type++ != '=');	// skip "<name>="
+			while (*type != _C_STRUCT_E)
+				{
+				acc_size = ROUND (acc_size, objc_alignof_type (type));
+				[self decodeValueOfCType:type
+					  at:((char*)d)+acc_size
+					  withName:namePtr];
+				acc_size += objc_sizeof_type (type);
+				type = objc_skip_typespec (type);
+				}
+			break;
+			}
+
+		default:
+			[NSException raise: NSGenericException 
+						 format: @"Unrecognized Type %s", type];
+		}
+}
+
+- (void) encodeArrayOfCType:(const char*)type
+					  count:(unsigned)c
+					  at:(const void*)d
+{
+	unsigned char b[ARRAY_BUFFER];
+	int size = objc_sizeof_type(type);
+	const char *p = d;
+	int n = 0;
+
+	if (*type == _C_CHR || *type == _C_UCHR)
+		{
+		(*_write)(_stream, @selector(writeBytes:length:), d, c);
+		return;
+		}
+										// scalars are collected into one
+	for (; c > 0; c--, p += size)		// write per ARRAY_BUFFER bytes
+		{
+		int l = put_value(b + n, type, p);
+
+		if (l == 0)
+			{
+			if (n)
+				(*_write)(_stream, @selector(writeBytes:length:), b, n);
+			n = 0;
+			[self encodeValueOfCType:type at:p withName:NULL];
+			}
+		else if ((n += l) > ARRAY_BUFFER - VARINT_MAX)
+			{
+			(*_write)(_stream, @selector(writeBytes:length:), b, n);
+			n = 0;
+		}	}
+
+	if (n)
+		(*_write)(_stream, @selector(writeBytes:length:), b, n);
+}
+
+- (void) decodeArrayOfCType:(const char*)type
+					  count:(unsigned)c
+					  at:(void*)d
+{
+	int size = objc_sizeof_type(type);
+	char *p = d;
+
+	if (*type == _C_CHR || *type == _C_UCHR)
+		get_bytes(self, d, c);
+	else
+		for (; c > 0; c--, p += size)
+			if (!get_value(self, type, p))
+				[self decodeValueOfCType:type at:p withName:NULL];
+}
+
+- (void) encodeTag:(unsigned char)t
+{
+	(*_write)(_stream, @selector(writeBytes:length:), &t, 1);
+}
+
+- (unsigned char) decodeTag
+{
+	unsigned char t;
+
+	get_bytes(self, &t, 1);
+
+	return t;
+}
+
+@end /* CompactCStream */
@@ -26,7 +26,11 @@
 						[self defaultDecoderClassname], \
 						format_version
 
-#define PORT_CODER_FORMAT_VERSION 	((int) (mGSTEP_VERSION * 100000))
+#define PORT_CODER_FORMAT_VERSION 	((int) (mGSTEP_VERSION * 100000) + 1)
+
+		// Peers whose signature carries this version or later read and
+		// write CompactCStream, older ones are sent BinaryCStream messages
+#define PORT_CODER_COMPACT_VERSION	PORT_CODER_FORMAT_VERSION
 
 @class NSPort;
 @class NSConnection;
@@ -137,6 +141,7 @@
 
 - (id) _initWithCStream:(id <CStreaming>)cs formatVersion:(int)version;
 - (NSUInteger) _coderReferenceForObject:(id)anObject;
+- (BOOL) _isCompact;						// coding with a CompactCStream
 
 @end
 
@@ -179,6 +184,8 @@
 				 sequenceNumber:(int)n
 				 identifier:(int)i;
 
+- (unsigned) _packetLength;					// bytes encoded so far
+
 @end
 
 
@@ -189,6 +196,7 @@
 	NSMapTable *xref_2_const_ptr;   // const pointers already written
 	NSMapTable *fref_2_object;      // table of forward references
 	NSMapTable *address_2_fref;     // table of forward references
+	int major_version;				// PORT_CODER_FORMAT_VERSION of the writer
 }
 			// These are class methods (and not instance methods) because the
 			// header of the file or stream determines which subclass of 
@@ -0,0 +1,139 @@
+/*
+   doload.m
+
+   Distributed Objects load test.  Client threads sharing one connection
+   call -serviceFor: on the test server, the thread count doubling each
+   round, and the requests per second of each round are reported.  Start
+   the server with -mt to have it service requests on its worker pool,
+   without it requests are serviced one at a time by its run loop.
+
+	server -mt &
+	doload [max threads] [requests per thread] [service usec] [host]
+*/
+
+#include <Foundation/NSObject.h>
+#include <Foundation/NSConnection.h>
+#include <Foundation/NSDistantObject.h>
+#include <Foundation/NSString.h>
+#include <Foundation/NSThread.h>
+#include <Foundation/NSAutoreleasePool.h>
+
+#include "server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+
+@interface	NSConnection (debug)
++ (void) _setDebug:(int)debugLevel;
+@end
+
+
+static id <ServerProtocol> server = nil;
+static int requests = 1000;
+static int usec = 100;
+static int running = 0;
+static int errors = 0;
+
+
+@interface Load : NSObject
+@end
+
+@implementation Load
+
+- (void) run:(id)arg
+{
+	NSAutoreleasePool *arp = [NSAutoreleasePool new];
+	int i;
+
+	for (i = 0; i < requests; i++)
+		{
+		NSAutoreleasePool *pool = [NSAutoreleasePool new];
+
+		NS_DURING
+			if ([server serviceFor: usec] != usec)
+				__atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+		NS_HANDLER
+			__atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+		NS_ENDHANDLER
+		[pool release];
+		}
+
+	[arp release];
+	__atomic_sub_fetch(&running, 1, __ATOMIC_RELEASE);
+}
+
+@end
+
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+int
+main(int argc, char **argv)
+{
+	NSAutoreleasePool *arp = [NSAutoreleasePool new];
+	int max = (argc > 1) ? atoi(argv[1]) : 16;
+	NSString *host = (argc > 4) ? [NSString stringWithCString: argv[4]] : nil;
+	Load *load = [Load new];
+	NSConnection *c;
+	int threads, i;
+	double t;
+
+	if (argc > 2)
+		requests = atoi(argv[2]);
+	if (argc > 3)
+		usec = atoi(argv[3]);
+
+	[NSConnection _setDebug: 0];
+	server = (id)[NSConnection rootProxyAtName: @"test2server" onHost: host];
+	if (server == nil)
+		{
+		fprintf(stderr, "doload: no test2server, start server first\n");
+		exit (1);
+		}
+	[(NSDistantObject *)server setProtocolForProxy: @protocol(ServerProtocol)];
+	[server serviceFor: 0];					// resolve method types up front
+
+	c = [(NSDistantObject *)server connectionForProxy];
+	[c setReplyTimeout: 60.0];
+	[c enableMultipleThreads];				// receive replies on a thread of
+	[c runInNewThread];						// their own for all the callers
+
+	printf("doload: %d requests per thread, %d us of service each\n",
+			requests, usec);
+
+	for (threads = 1; threads <= max; threads *= 2)
+		{
+		running = threads;
+		errors = 0;
+		t = now();
+		for (i = 0; i < threads; i++)
+			[NSThread detachNewThreadSelector: @selector(run:)
+					  toTarget: load
+					  withObject: nil];
+		while (__atomic_load_n(&running, __ATOMIC_ACQUIRE) > 0)
+			usleep(1000);
+		t = now() - t;
+
+		printf("  %3d threads %10.0f requests/s  %8.1f us/request  %d errors\n",
+				threads, (threads * requests) / t,
+				t * 1000000.0 / (threads * requests), errors);
+		}
+
+	[c invalidate];
+	[load release];
+	[arp release];
+	printf("doload complete\n");
+
+	exit (0);
+}
@@ -0,0 +1,207 @@
+/*
+   dopingpong.m
+
+   Distributed Objects round trip latency between two processes on this
+   host, over the AF_UNIX local transport and over loopback TCP.  The
+   server runs in this process and a client is started for each transport,
+   each reports the time and client CPU per call, the server its CPU.
+
+   usage:  dopingpong [calls]
+*/
+
+#include <Foundation/NSObject.h>
+#include <Foundation/NSConnection.h>
+#include <Foundation/NSDistantObject.h>
+#include <Foundation/NSPort.h>
+#include <Foundation/NSString.h>
+#include <Foundation/NSRunLoop.h>
+#include <Foundation/NSDate.h>
+#include <Foundation/NSAutoreleasePool.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define PAYLOAD		4096
+
+
+@interface	NSConnection (debug)
++ (void) _setDebug:(int)debugLevel;
+@end
+
+
+@protocol PingPong
+- (int) ping: (int)n;
+- (int) lengthOf: (const char *)s;
+@end
+
+@interface Pong : NSObject <PingPong>
+@end
+
+@implementation Pong
+- (int) ping: (int)n						{ return n; }
+- (int) lengthOf: (const char *)s			{ return strlen(s); }
+@end
+
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static double
+cpu(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1000000.0
+		 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1000000.0;
+}
+
+/* ****************************************************************************
+
+	client -- run in a child process, once per transport
+
+** ***************************************************************************/
+
+static int
+client(unsigned short port, BOOL local, int calls)
+{
+	NSAutoreleasePool *arp = [NSAutoreleasePool new];
+	const char *transport = (local) ? "unix" : "tcp";
+	char *payload = malloc(PAYLOAD);
+	struct in_addr lo;
+	NSConnection *c;
+	id ip, op, p;
+	double t, u;
+	int i, sum = 0;
+
+	[NSConnection _setDebug: 0];
+	[NSPort _setLocalTransport: local];
+
+	lo.s_addr = inet_addr("127.0.0.1");
+	op = [NSPort _newOutPortWithPortNumber: port andAddress: lo];
+	ip = [[[NSPort _inPortClass] newForReceiving] autorelease];
+	c = [NSConnection connectionWithReceivePort: ip sendPort: op];
+	p = [c rootProxy];
+	[p setProtocolForProxy: @protocol(PingPong)];
+	[p ping: 0];							// resolve method types up front
+
+	t = now();
+	u = cpu();
+	for (i = 0; i < calls; i++)
+		sum += [p ping: i];
+	u = cpu() - u;
+	t = now() - t;
+	printf("  %-5s %-14s %8.2f us/call  %8.2f us client cpu/call\n",
+			transport, "ping", t * 1000000.0 / calls, u * 1000000.0 / calls);
+
+	memset(payload, 'x', PAYLOAD - 1);
+	payload[PAYLOAD - 1] = '\0';
+	t = now();
+	u = cpu();
+	for (i = 0; i < calls; i++)
+		sum += [p lengthOf: payload];
+	u = cpu() - u;
+	t = now() - t;
+	printf("  %-5s %-14s %8.2f us/call  %8.2f us client cpu/call\n",
+			transport, "4k string", t * 1000000.0 / calls,
+			u * 1000000.0 / calls);
+
+	[c invalidate];
+	free(payload);
+	[arp release];
+
+	return (sum != 0) ? 0 : 1;
+}
+
+/* ****************************************************************************
+
+	Benchmark driver
+
+** ***************************************************************************/
+
+int
+main(int argc, char **argv)
+{
+	NSAutoreleasePool *arp;
+	NSRunLoop *rl;
+	NSConnection *c;
+	NSPort *ip;
+	Pong *pong;
+	const char *transports[] = { "unix", "tcp" };
+	char calls[16], port[16];
+	int i, n = 10000;
+
+	if (argc > 4 && strcmp(argv[1], "-client") == 0)
+		return client(atoi(argv[2]), strcmp(argv[3], "unix") == 0,
+					  atoi(argv[4]));
+	if (argc > 1)
+		n = atoi(argv[1]);
+
+	arp = [NSAutoreleasePool new];
+	rl = [NSRunLoop currentRunLoop];
+	pong = [Pong new];
+	[NSConnection _setDebug: 0];
+	ip = [[[NSPort _inPortClass] newForReceiving] autorelease];
+	c = [NSConnection connectionWithReceivePort: ip sendPort: nil];
+	[c setRootObject: pong];
+
+	sprintf(calls, "%d", n);
+	sprintf(port, "%d", [ip portNumber]);
+	printf("dopingpong: %d calls per test\n", n);
+	fflush(stdout);
+
+	for (i = 0; i < 2; i++)
+		{
+		char *args[] = { argv[0], "-client", port, (char *)transports[i],
+						 calls, NULL };
+		double u = cpu();
+		pid_t pid;
+		int status;
+
+		if ((pid = fork()) == 0)
+			{
+			execvp(argv[0], args);
+			perror("dopingpong: exec");
+			_exit(1);
+			}
+		if (pid < 0)
+			{
+			perror("dopingpong: fork");
+			exit (1);
+			}
+
+		while (waitpid(pid, &status, WNOHANG) == 0)
+			{
+			NSAutoreleasePool *pool = [NSAutoreleasePool new];
+
+			[rl runMode: NSDefaultRunLoopMode
+				beforeDate: [NSDate dateWithTimeIntervalSinceNow: 0.1]];
+			[pool release];
+			}
+		printf("  %-5s %-14s %8.2f us server cpu/call (both tests)\n",
+				transports[i], "", (cpu() - u) * 1000000.0 / (2 * n));
+		fflush(stdout);
+		}
+
+	[c invalidate];
+	[pong release];
+	[arp release];
+	printf("dopingpong complete\n");
+
+	exit (0);
+}
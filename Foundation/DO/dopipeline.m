@@ -0,0 +1,239 @@
+/*
+   dopipeline.m
+
+   Distributed Objects calls per second over the AF_UNIX local transport.
+   The server runs in this process and a client started in a child calls
+   it one request at a time, then with a window of requests in flight
+   through -sendInvocations:, then sends oneway messages one per packet
+   and batched.  A oneway test ends with a request for the count of the
+   messages the server received, so it times their delivery as well.
+
+   usage:  dopipeline [calls] [window]
+*/
+
+#include <Foundation/NSObject.h>
+#include <Foundation/NSConnection.h>
+#include <Foundation/NSDistantObject.h>
+#include <Foundation/NSPort.h>
+#include <Foundation/NSArray.h>
+#include <Foundation/NSInvocation.h>
+#include <Foundation/NSMethodSignature.h>
+#include <Foundation/NSString.h>
+#include <Foundation/NSRunLoop.h>
+#include <Foundation/NSDate.h>
+#include <Foundation/NSAutoreleasePool.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+
+@interface	NSConnection (debug)
++ (void) _setDebug:(int)debugLevel;
+@end
+
+
+@protocol Pipeline
+- (int) ping: (int)n;
+- (oneway void) tick: (int)n;
+- (int) ticks;
+@end
+
+@interface Counter : NSObject <Pipeline>
+{
+	int _ticks;
+}
+@end
+
+@implementation Counter
+- (int) ping: (int)n						{ return n; }
+- (oneway void) tick: (int)n				{ _ticks++; }
+
+- (int) ticks
+{
+	int n = _ticks;
+
+	_ticks = 0;
+
+	return n;
+}
+@end
+
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void
+report(const char *test, int calls, double t)
+{
+	printf("  %-16s %10.0f calls/s  %8.2f us/call\n", test,
+			calls / t, t * 1000000.0 / calls);
+}
+
+/* ****************************************************************************
+
+	client -- run in a child process
+
+** ***************************************************************************/
+
+static int
+client(unsigned short port, int calls, int window)
+{
+	NSAutoreleasePool *arp = [NSAutoreleasePool new];
+	NSMutableArray *invocations = [NSMutableArray arrayWithCapacity: window];
+	NSMethodSignature *sig;
+	struct in_addr lo;
+	NSConnection *c;
+	id ip, op, p;
+	double t;
+	int i, j, n, sum = 0, errors = 0;
+
+	[NSConnection _setDebug: 0];
+	[NSPort _setLocalTransport: YES];
+
+	lo.s_addr = inet_addr("127.0.0.1");
+	op = [NSPort _newOutPortWithPortNumber: port andAddress: lo];
+	ip = [[[NSPort _inPortClass] newForReceiving] autorelease];
+	c = [NSConnection connectionWithReceivePort: ip sendPort: op];
+	p = [c rootProxy];
+	[p setProtocolForProxy: @protocol(Pipeline)];
+	[p ping: 0];							// resolve method types up front
+	[p tick: 0];
+	[p ticks];
+
+	t = now();
+	for (i = 0; i < calls; i++)
+		sum += [p ping: i];
+	report("request", calls, now() - t);
+
+	sig = [p methodSignatureForSelector: @selector(ping:)];
+	for (i = 0; i < window; i++)
+		{
+		NSInvocation *inv = [NSInvocation invocationWithMethodSignature: sig];
+
+		[inv setTarget: p];
+		[inv setSelector: @selector(ping:)];
+		[invocations addObject: inv];
+		}
+	t = now();
+	for (i = 0; i < calls; i += window)
+		{
+		for (j = 0; j < window; j++)
+			{
+			n = i + j;
+			[[invocations objectAtIndex: j] setArgument: &n atIndex: 2];
+			}
+		[c sendInvocations: invocations];
+		for (j = 0; j < window; j++)
+			{
+			[[invocations objectAtIndex: j] getReturnValue: &n];
+			if (n != i + j)
+				errors++;
+		}	}
+	t = now() - t;
+	report("pipelined", i, t);
+
+	[c setOnewayBatchSize: 0];
+	t = now();
+	for (i = 0; i < calls; i++)
+		[p tick: i];
+	if ([p ticks] != calls)
+		errors++;
+	report("oneway", calls, now() - t);
+
+	[c setOnewayBatchSize: 4096];
+	t = now();
+	for (i = 0; i < calls; i++)
+		[p tick: i];
+	if ([p ticks] != calls)
+		errors++;
+	report("oneway batched", calls, now() - t);
+
+	[c invalidate];
+	[arp release];
+	if (errors)
+		fprintf(stderr, "dopipeline: %d tests returned wrong results\n", errors);
+
+	return (sum != 0 && errors == 0) ? 0 : 1;
+}
+
+/* ****************************************************************************
+
+	Benchmark driver
+
+** ***************************************************************************/
+
+int
+main(int argc, char **argv)
+{
+	NSAutoreleasePool *arp;
+	NSRunLoop *rl;
+	NSConnection *c;
+	NSPort *ip;
+	Counter *counter;
+	char calls[16], window[16], port[16];
+	char *args[] = { argv[0], "-client", port, calls, window, NULL };
+	int n = 100000, w = 32, status;
+	pid_t pid;
+
+	if (argc > 4 && strcmp(argv[1], "-client") == 0)
+		return client(atoi(argv[2]), atoi(argv[3]), atoi(argv[4]));
+	if (argc > 1)
+		n = atoi(argv[1]);
+	if (argc > 2)
+		w = atoi(argv[2]);
+
+	arp = [NSAutoreleasePool new];
+	rl = [NSRunLoop currentRunLoop];
+	counter = [Counter new];
+	[NSConnection _setDebug: 0];
+	ip = [[[NSPort _inPortClass] newForReceiving] autorelease];
+	c = [NSConnection connectionWithReceivePort: ip sendPort: nil];
+	[c setRootObject: counter];
+
+	sprintf(calls, "%d", n);
+	sprintf(window, "%d", w);
+	sprintf(port, "%d", [ip portNumber]);
+	printf("dopipeline: %d calls per test, window of %d\n", n, w);
+	fflush(stdout);
+
+	if ((pid = fork()) == 0)
+		{
+		execvp(argv[0], args);
+		perror("dopipeline: exec");
+		_exit(1);
+		}
+	if (pid < 0)
+		{
+		perror("dopipeline: fork");
+		exit (1);
+		}
+
+	while (waitpid(pid, &status, WNOHANG) == 0)
+		{
+		NSAutoreleasePool *pool = [NSAutoreleasePool new];
+
+		[rl runMode: NSDefaultRunLoopMode
+			beforeDate: [NSDate dateWithTimeIntervalSinceNow: 0.1]];
+		[pool release];
+		}
+
+	[c invalidate];
+	[counter release];
+	[arp release];
+	printf("dopipeline complete\n");
+
+	exit (WEXITSTATUS(status));
+}
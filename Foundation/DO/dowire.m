@@ -0,0 +1,152 @@
+/*
+   dowire.m
+
+   Size and coding speed of a Distributed Objects message body.  A typical
+   payload, an array of dictionaries holding strings, numbers, an array of
+   short strings and a small NSData, is encoded bycopy into a memory stream
+   the way NSConnection encodes it into a packet, once with BinaryCStream,
+   the format sent to older peers, and once with CompactCStream.  The size
+   of each message is reported with the rate it is encoded and decoded at.
+
+   usage:  dowire [records] [rounds]
+*/
+
+#include <Foundation/NSObject.h>
+#include <Foundation/NSArray.h>
+#include <Foundation/NSData.h>
+#include <Foundation/NSDictionary.h>
+#include <Foundation/NSString.h>
+#include <Foundation/NSValue.h>
+#include <Foundation/NSAutoreleasePool.h>
+
+#include "_NSPortCoder.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static NSArray *
+payload(int records)
+{
+	NSMutableArray *a = [NSMutableArray arrayWithCapacity: records];
+	NSArray *tags = [NSArray arrayWithObjects: @"a", @"bb", @"ccc", nil];
+	unsigned char bytes[64];
+	int i;
+
+	for (i = 0; i < sizeof(bytes); i++)
+		bytes[i] = i;
+
+	for (i = 0; i < records; i++)
+		{
+		NSMutableDictionary *d = [NSMutableDictionary dictionaryWithCapacity:6];
+
+		[d setObject: [NSNumber numberWithInt: i] forKey: @"id"];
+		[d setObject: [NSString stringWithFormat: @"item%d", i] forKey: @"name"];
+		[d setObject: tags forKey: @"tags"];
+		[d setObject: [NSNumber numberWithInt: i % 100] forKey: @"count"];
+		[d setObject: @"a note long enough to need a heap buffer" forKey:@"note"];
+		[d setObject: [NSData dataWithBytes: bytes length: sizeof(bytes)]
+		   forKey: @"data"];
+		[a addObject: d];
+		}
+
+	return a;
+}
+
+static NSData *
+encode(Class cStreamClass, id object)
+{
+	NSMutableData *d = [NSMutableData dataWithCapacity: 4096];
+	MemoryStream *s = [[MemoryStream alloc] initWithData: d];
+	PortEncoder *e = [[PortEncoder alloc] initForWritingToStream: s
+							withFormatVersion: 0
+							cStreamClass: cStreamClass
+							cStreamFormatVersion: [cStreamClass defaultFormatVersion]];
+
+	[e encodeBycopyObject: object withName: NULL];
+	[e release];
+	[s release];
+
+	return d;
+}
+
+static id
+decode(NSData *d)
+{
+	return [PortDecoder decodeObjectWithName: NULL
+						fromStream: [MemoryStream streamWithData: d]];
+}
+
+static void
+bench(const char *name, Class cStreamClass, id object, int rounds)
+{
+	NSData *d = encode(cStreamClass, object);
+	double te = 0, td = 0;
+	int r;
+
+	if (![decode(d) isEqual: object])
+		printf("  %-16s decoded payload differs\n", name);
+
+	for (r = 0; r < rounds; r++)
+		{
+		NSAutoreleasePool *pool = [NSAutoreleasePool new];
+
+		te -= now();
+		d = encode(cStreamClass, object);
+		te += now();
+
+		td -= now();
+		decode(d);
+		td += now();
+		[pool release];
+		}
+
+	printf("  %-16s %9lu bytes  encode %8.1f MB/s  decode %8.1f MB/s\n", name,
+			(unsigned long)[d length], [d length] * rounds / te / 1000000.0,
+			[d length] * rounds / td / 1000000.0);
+}
+
+/* ****************************************************************************
+
+	Benchmark driver
+
+** ***************************************************************************/
+
+int
+main(int argc, char **argv)
+{
+	NSAutoreleasePool *arp = [NSAutoreleasePool new];
+	int records = (argc > 1) ? atoi(argv[1]) : 1000;
+	int rounds = (argc > 2) ? atoi(argv[2]) : 20;
+	NSArray *a = payload(records);
+	NSData *b = encode([BinaryCStream class], a);
+	NSData *c = encode([CompactCStream class], a);
+
+	printf("dowire: %d records, %d rounds\n", records, rounds);
+
+	bench("BinaryCStream", [BinaryCStream class], a, rounds);
+	bench("CompactCStream", [CompactCStream class], a, rounds);
+	printf("  compact message is %.1f%% of the binary one\n",
+			100.0 * [c length] / [b length]);
+
+	a = payload(1);
+	printf("  one record per message\n");
+	bench("BinaryCStream", [BinaryCStream class], a, rounds * records);
+	bench("CompactCStream", [CompactCStream class], a, rounds * records);
+
+	[arp release];
+	printf("dowire complete\n");
+
+	exit (0);
+}
@@ -52,6 +52,7 @@ struct myarray {
 : (int)i7 : (int)i8 : (int)i9 : (int)i10 : (int)i11 : (int)i12;
 - (float) returnFloat;
 - (double) returnDouble;
+- (int) serviceFor: (int)usec;
 @end
 
 @interface Server : NSObject <ServerProtocol>
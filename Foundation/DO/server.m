@@ -8,6 +8,9 @@
 #include <Foundation/NSRunLoop.h>
 #include <Foundation/NSAutoreleasePool.h>
 
+#include <unistd.h>
+#include <string.h>
+
 #include "Stream.h"
 #include "server.h"
 
@@ -207,6 +210,13 @@ int j;
   return d;
 }
 
+- (int) serviceFor: (int)usec		// stands in for real work in doload
+{
+  if (usec > 0)
+    usleep(usec);
+  return usec;
+}
+
 - (id) connectionBecameInvalid:(NSNotification*)notification
 {
 id anObj = [notification object];
@@ -250,16 +260,20 @@ int main(int argc, char *argv[])
 	NSConnection *c;
 	NSAutoreleasePool *arp = [NSAutoreleasePool new];
 	NSNotificationCenter *nc = [NSNotificationCenter defaultCenter];
-	NSString *n;
-
-	[BinaryCStream _setDebugging:YES];
+	NSString *n = @"test2server";
+	BOOL mt = NO;
+	int i;
 
 //	[NSDistantObject setProtocolForProxy:@protocol(ServerProtocol)];
 
-	if (argc > 1)
-		n = [NSString stringWithCString: argv[1]];
-	else
-		n = @"test2server";
+	for (i = 1; i < argc; i++)				// server [-mt] [name]
+		if (strcmp(argv[i], "-mt") == 0)
+			mt = YES;
+		else
+			n = [NSString stringWithCString: argv[i]];
+
+	if (!mt)								// keep load tests quiet
+		[BinaryCStream _setDebugging:YES];
 
 	[nc addObserver: s
 		selector: @selector(connectionDidInit:)
@@ -276,6 +290,8 @@ int main(int argc, char *argv[])
 		object: nil];
 
 	[c setDelegate:s];
+	if (mt)									// service requests on the
+		[c enableMultipleThreads];			// worker pool
 	[s addObject: o];
 	d = [s returnDouble];
 	printf("got double %f\n", d);
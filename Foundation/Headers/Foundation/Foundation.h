@@ -45,6 +45,7 @@
 #include <Foundation/NSNotification.h>
 #include <Foundation/NSNotificationQueue.h>
 #include <Foundation/NSNull.h>
+#include <Foundation/NSOperation.h>
 #include <Foundation/NSPathUtilities.h>
 #include <Foundation/NSPointerArray.h>
 #include <Foundation/NSProcessInfo.h>
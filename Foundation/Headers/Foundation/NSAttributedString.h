@@ -28,8 +28,7 @@
 @interface NSAttributedString : NSObject  <NSCoding,NSCopying,NSMutableCopying>
 {
 	id _string;
-	NSMutableArray *_attributes;
-	NSMutableArray *_locations;
+	struct _NSAttributeRun *_runs;				// tree of attribute runs
 }
 
 - (id) initWithString:(NSString*)aString;
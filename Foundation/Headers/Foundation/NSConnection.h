@@ -29,6 +29,8 @@
 @class NSDistantObject;
 @class NSPort;
 @class NSData;
+@class NSThread;
+@class NSOperationQueue;
 
 		//	Keys for the NSDictionary returned by [NSConnection -statistics]
 extern NSString *NSConnectionRepliesReceived;			// OPENSTEP 4.2
@@ -67,9 +69,17 @@ extern NSString *NSConnectionDidInitializeNotification;	// OPENSTEP
 	Class _encodingClass;
 	NSMapTable *incoming_xref_2_const_ptr;
 	NSMapTable *outgoing_const_ptr_2_xref;
+	NSMapTable *_outgoingTypes;				// method type strings interned
+	NSMapTable *_incomingTypes;				// by either end, to their xref
+	int _peerFormatVersion;					// highest coder version received
 	id delegate;
 	NSMutableArray *request_modes;
 
+	void *_queues;							// per connection rmc queues
+	NSOperationQueue *_workers;				// services requests when multi-
+	NSThread *_receiveThread;				// threaded, thread running port
+	BOOL _multipleThreads;
+
 //    id _rootObject;
 }
 
@@ -166,6 +176,18 @@ extern NSString *NSConnectionDidInitializeNotification;	// OPENSTEP
 - (NSUInteger) _decoderCreateReferenceForConstPtr:(const void*)ptr;
 - (const void*) _decoderConstPtrAtReference:(NSUInteger)xref;
 
+	// Send each invocation to its proxy's remote object without waiting,
+	// then wait for all the replies, raising the first exception returned.
+- (void) sendInvocations:(NSArray*)invocations;
+
+	// Oneway messages are batched until BYTES are queued, SECONDS have
+	// passed (the timer runs in the sending thread's run loop) or a request
+	// that waits for its reply is sent.  A size of 0 sends each one at once,
+	// a delay of 0 leaves the rest to -flushOnewayMessages.
+- (void) flushOnewayMessages;
+- (void) setOnewayBatchSize:(unsigned)bytes;
+- (void) setOnewayBatchDelay:(NSTimeInterval)seconds;
+
 @end
 
 
@@ -179,7 +201,9 @@ enum {
 	METHODTYPE_REPLY,
 	PROXY_RELEASE,
 	PROXY_RETAIN,
-	RETAIN_REPLY
+	RETAIN_REPLY,
+	METHODTYPE_DEFINE,
+	ONEWAY_BATCH
 };
 		//	Catagory containing the methods by which the public interface to
 		//	NSConnection must be extended in order to allow it's use by
@@ -195,6 +219,9 @@ enum {
 - (NSDistantObject*) proxyForTarget:(NSUInteger)target;
 - (void) retainTarget:(NSUInteger)target;
 
+- (void) _setPeerFormatVersion:(int)version;
+- (BOOL) _peerReadsCompactFormat;
+
 @end
 
 #endif /* _mGSTEP_H_NSConnection */
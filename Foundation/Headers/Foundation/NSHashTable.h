@@ -28,22 +28,17 @@ typedef struct _NSHashTableCallBacks {
     NSString *(*describe)(struct _NSHashTable *table, const void *anObject);
 } NSHashTableCallBacks;
 
-struct _NSHashNode {
-    void *key;
-    struct _NSHashNode *next;
-};
-
 typedef struct _NSHashTable {
-    struct _NSHashNode **nodes;
-    NSUInteger hashSize;
+    NSUInteger *hashes;					// open addressed slots, a zero
+    void **keys;						// hash marks an empty slot
+    NSUInteger hashSize;				// slot count, a power of two
     NSUInteger itemsCount;
     NSHashTableCallBacks callbacks;
 } NSHashTable;
 
 typedef struct _NSHashEnumerator {
     struct _NSHashTable *table;
-    struct _NSHashNode *node;
-    int bucket;
+    NSUInteger bucket;
 } NSHashEnumerator;
 
 													// Predefined callback sets
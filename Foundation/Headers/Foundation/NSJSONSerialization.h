@@ -19,6 +19,9 @@
 
 @class NSData;
 @class NSError;
+@class NSInputStream;
+@class NSOutputStream;
+@class NSFileHandle;
 
 
 typedef enum _NSJSONReadingOptions {
@@ -58,16 +61,29 @@ typedef enum _NSJSONWritingOptions {
 
 + (BOOL) isValidJSONObject:(id)object;
 
+/* ****************************************************************************
+
+	JSONObjectWithStream:  JSONObjectWithFileHandle:
+
+	Parse JSON read incrementally through a fixed size buffer, memory use
+	is bounded by the objects returned rather than by the input size.
+	The stream must already be open.  Reads until end of input.
+
+** ***************************************************************************/
+
++ (id) JSONObjectWithStream:(NSInputStream *)stream
+					options:(NSJSONReadingOptions)options
+					error:(NSError **)error;
+
++ (id) JSONObjectWithFileHandle:(NSFileHandle *)fh			// mGSTEP extension
+						options:(NSJSONReadingOptions)options
+						error:(NSError **)error;
 
 #if 0  /* not implemented */
 + (NSInteger) writeJSONObject:(id)object
 					 toStream:(NSOutputStream *)stream
 					 options:(NSJSONWritingOptions)options
 					 error:(NSError **)error;
-
-+ (id) JSONObjectWithStream:(NSInputStream *)stream
-					options:(NSJSONReadingOptions)options
-					error:(NSError **)error;
 #endif
 
 @end
@@ -23,12 +23,6 @@
 
 struct _NSMapTable;
 
-struct _NSMapNode {
-    void *key;
-    void *value;
-    struct _NSMapNode *next;
-};
-
 typedef struct _NSMapTableKeyCallBacks {
     NSUInteger (*hash)(struct _NSMapTable *t, const void *anObject);
     BOOL (*isEqual)(struct _NSMapTable *t, const void *obj1, const void *obj2);
@@ -46,8 +40,10 @@ typedef struct _NSMapTableValueCallBacks {
 
 
 typedef struct _NSMapTable {
-	struct _NSMapNode **nodes;
-	NSUInteger hashSize;
+	NSUInteger *hashes;					// open addressed slots, a zero
+	void **keys;						// hash marks an empty slot
+	void **values;
+	NSUInteger hashSize;				// slot count, a power of two
 	NSUInteger itemsCount;
 	NSMapTableKeyCallBacks keyCallbacks;
 	NSMapTableValueCallBacks valueCallbacks;
@@ -55,8 +51,7 @@ typedef struct _NSMapTable {
 
 typedef struct NSMapEnumerator {
     struct _NSMapTable *table;
-    struct _NSMapNode *node;
-    int bucket;
+    NSUInteger bucket;
 } NSMapEnumerator;
 
 														// Predefined callbacks
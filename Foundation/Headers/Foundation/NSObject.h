@@ -139,6 +139,7 @@
 
 
 extern id NSAllocateObject(Class aClass);
+extern id _NSAllocateObjectExtra(Class aClass, NSUInteger extraBytes);
 extern id NSCopyObject(NSObject *object);
 extern void NSDeallocateObject(NSObject *object);
 
@@ -0,0 +1,157 @@
+/*
+   NSOperation.h
+
+   Units of work and the queues that run them on a shared thread pool
+
+   Copyright (C) 2026 Free Software Foundation, Inc.
+
+   This file is part of the mGSTEP Library and is provided
+   under the terms of the GNU Library General Public License.
+*/
+
+#ifndef _mGSTEP_H_NSOperation
+#define _mGSTEP_H_NSOperation
+
+#include <Foundation/NSObject.h>
+
+@class NSArray;
+@class NSMutableArray;
+@class NSString;
+@class NSInvocation;
+@class NSRunLoop;
+@class NSOperationQueue;
+
+
+typedef enum _NSOperationQueuePriority {
+	NSOperationQueuePriorityVeryLow  = -8,
+	NSOperationQueuePriorityLow      = -4,
+	NSOperationQueuePriorityNormal   =  0,
+	NSOperationQueuePriorityHigh     =  4,
+	NSOperationQueuePriorityVeryHigh =  8
+} NSOperationQueuePriority;
+
+enum {							// as many operations at once as pool threads
+	NSOperationQueueDefaultMaxConcurrentOperationCount = -1
+};
+
+
+@interface NSOperation : NSObject
+{
+	NSMutableArray *_dependencies;
+	NSOperationQueuePriority _priority;
+	id _completionBlock;
+	id _completionTarget;
+	SEL _completionAction;
+	id _completionChannel;
+
+@public
+	volatile unsigned int _state;			// cancelled, executing, finished
+	int _pendingDependencies;				// unfinished dependencies
+	NSOperation **_dependents;				// operations waiting on us
+	unsigned int _dependentCount;
+	unsigned int _dependentSize;
+
+	NSOperationQueue *_queue;				// queue that owns us, if any
+	NSOperation *_prev;						// queue's operation list
+	NSOperation *_next;
+	NSOperation *_nextReady;				// queue's ready list or run loop
+}											// completion list
+
+- (void) start;								// runs -main on caller's thread
+- (void) main;								// subclasses override
+
+- (void) cancel;
+- (BOOL) isCancelled;
+- (BOOL) isExecuting;
+- (BOOL) isFinished;
+- (BOOL) isReady;
+- (BOOL) isConcurrent;
+- (BOOL) isAsynchronous;
+
+- (void) addDependency:(NSOperation *)op;
+- (void) removeDependency:(NSOperation *)op;
+- (NSArray *) dependencies;
+
+- (NSOperationQueuePriority) queuePriority;
+- (void) setQueuePriority:(NSOperationQueuePriority)p;
+
+- (void) waitUntilFinished;
+
+#ifdef __BLOCKS__
+- (void (^)(void)) completionBlock;
+- (void) setCompletionBlock:(void (^)(void))block;
+#endif
+
+@end
+
+
+@interface NSOperation  (mGSTEP)
+											// Send action to target with the
+- (void) setCompletionTarget:(id)target		// finished operation from a
+					  action:(SEL)action	// run loop source in runLoop's
+					  runLoop:(NSRunLoop *)runLoop;		// common modes.
+@end
+
+
+@interface NSInvocationOperation : NSOperation
+{
+	NSInvocation *_invocation;
+}
+
+- (id) initWithTarget:(id)target selector:(SEL)sel object:(id)arg;
+- (id) initWithInvocation:(NSInvocation *)inv;
+
+- (NSInvocation *) invocation;
+- (id) result;
+
+@end
+
+
+#ifdef __BLOCKS__
+
+@interface NSBlockOperation : NSOperation
+{
+	NSMutableArray *_executionBlocks;
+}
+
++ (id) blockOperationWithBlock:(void (^)(void))block;
+
+- (void) addExecutionBlock:(void (^)(void))block;
+- (NSArray *) executionBlocks;
+
+@end
+
+#endif  /* __BLOCKS__ */
+
+
+@interface NSOperationQueue : NSObject
+{
+	NSString *_name;
+	NSInteger _maxConcurrent;
+	BOOL _suspended;
+	void *_private;
+}
+
++ (NSOperationQueue *) currentQueue;		// queue of the running operation
+
+- (void) addOperation:(NSOperation *)op;
+- (void) addOperations:(NSArray *)ops waitUntilFinished:(BOOL)wait;
+
+- (NSArray *) operations;
+- (NSUInteger) operationCount;
+
+- (NSInteger) maxConcurrentOperationCount;
+- (void) setMaxConcurrentOperationCount:(NSInteger)count;
+
+- (void) setSuspended:(BOOL)flag;
+- (BOOL) isSuspended;
+
+- (void) setName:(NSString *)name;
+- (NSString *) name;
+
+- (void) cancelAllOperations;
+- (void) waitUntilAllOperationsAreFinished;
+
+@end
+
+#endif /* _mGSTEP_H_NSOperation */
@@ -86,6 +86,8 @@ extern NSString *InPortAcceptedClientNotification;
 
 - (int) portNumber;
 - (void) close;
+												// same host out ports connect
++ (void) _setLocalTransport:(BOOL)flag;			// over AF_UNIX, default YES
 
 + (id) newForReceiving;											// InPort
 + (id) newForReceivingFromRegisteredName:(NSString*)name;
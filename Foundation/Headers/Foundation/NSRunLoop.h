@@ -39,8 +39,7 @@ extern const id  NSRunLoopCommonModes;
 	NSMapTable *_mode_2_watchers;
 	NSMutableArray *_performers;
 	NSMutableArray *_timedPerformers;
-	NSMapTable *_rfd_2_object;
-	NSMapTable *_wfd_2_object;
+	NSMapTable *_mode_2_pollset;
 }
 
 + (NSRunLoop*) currentRunLoop;
@@ -91,7 +91,8 @@ typedef unsigned char   uint8_t;
 	struct __StreamFlags {
 		unsigned int sendEvents:1;
 		unsigned int closesNativeSocket:1;
-		unsigned int reserved:30;
+		unsigned int ownsDescriptor:1;			// file stream, closed by us
+		unsigned int reserved:29;
 	} _sm;
 }
 
@@ -313,6 +313,9 @@ typedef enum _NSStringEncoding				// encoding type 0 is undefined
 	BOOL _dontFree;
 	NSUInteger _hash;
 }
+
++ (id) _newWithCString:(const char*)bytes length:(NSUInteger)length;
+
 @end
 
 
@@ -34,6 +34,7 @@
 
 @public
 	BOOL _is_valid;
+	NSTimeInterval _fireTime;		// _fireDate since the reference date
 }
 
 + (NSTimer*) scheduledTimerWithTimeInterval:(NSTimeInterval)interval
@@ -25,11 +25,13 @@
 @class NSRunLoop;
 @class NSDictionary;
 @class NSMutableDictionary;
+@class NSRecursiveLock;
 @class NSURLProtocol;
 @class NSURLCredential;
 @class NSURLProtectionSpace;
 @class NSURLAuthenticationChallenge;
 @class NSMutableData;
+@class NSInputStream;
 
 extern NSString *NSURLErrorDomain;
 extern NSString *NSErrorFailingURLStringKey;
@@ -144,6 +146,8 @@ typedef enum {
 	NSString *_method;
 	NSTimeInterval _timeout;
 	NSMutableDictionary	*_headerFields;
+	NSData *_body;
+	NSInputStream *_bodyStream;
 
 	struct __URLRequestFlags {
 		NSURLRequestCachePolicy policy:3;
@@ -165,6 +169,8 @@ typedef enum {
 - (NSURL *) URL;
 - (NSString *) HTTPMethod;
 - (NSDictionary *) allHTTPHeaderFields;
+- (NSData *) HTTPBody;
+- (NSInputStream *) HTTPBodyStream;
 - (NSURLRequestCachePolicy) cachePolicy;
 - (BOOL) HTTPShouldHandleCookies;
 - (NSTimeInterval) interval;
@@ -175,10 +181,11 @@ typedef enum {
 @interface NSMutableURLRequest : NSURLRequest  <NSCoding, NSCopying>
 
 //- (void) setMainDocumentURL:(NSURL *)url;
-//- (void) setHTTPBodyStream:(NSInputStream *)stream;
 
 - (void) setHTTPMethod:(NSString *)method;
 - (void) setHTTPBody:(NSData *)data;
+- (void) setHTTPBodyStream:(NSInputStream *)stream;		// chunked if no
+															// Content-Length
 
 @end  /* NSMutableURLRequest */
 
@@ -229,7 +236,7 @@ typedef enum {
 
 /* ****************************************************************************
 
-	NSURLCache / NSCachedURLResponse	(Not Implemented)
+	NSURLCache / NSCachedURLResponse
 
 ** ***************************************************************************/
 
@@ -246,6 +253,8 @@ typedef enum _NSURLCacheStoragePolicy {
 	NSURLResponse *_response;
 	NSDictionary *_userInfo;
 	NSURLCacheStoragePolicy _storagePolicy;
+	NSTimeInterval _date;					// stored or last validated
+	BOOL _revalidated;						// headers refreshed by a 304
 }
 
 - (id) initWithResponse:(NSURLResponse *)response data:(NSData *)data;
@@ -261,20 +270,47 @@ typedef enum _NSURLCacheStoragePolicy {
 @end  /* NSCachedURLResponse */
 
 
+typedef struct _NSURLCacheStatistics {		// mGSTEP extension
+	NSUInteger requests;					// cachedResponseForRequest: calls
+	NSUInteger memoryHits;					// responses found in memory
+	NSUInteger diskHits;					// responses mapped in from disk
+	NSUInteger validated;					// stale ones confirmed by a 304
+	unsigned long long bytesServed;			// body bytes from the cache
+	unsigned long long bytesStored;			// body bytes added to the cache
+} NSURLCacheStatistics;
+
+
 @interface NSURLCache : NSObject
 {
+	NSString *_diskPath;
+	void *_memory;							// LRU tiers
+	void *_disk;
+	NSURLCacheStatistics _stats;
+	NSRecursiveLock *_lock;					// guards tiers and statistics
 }
 
 + (NSURLCache *) sharedURLCache;
 
 + (void) setSharedURLCache:(NSURLCache *)cache;
 
+- (id) initWithMemoryCapacity:(NSUInteger)memoryCapacity
+				 diskCapacity:(NSUInteger)diskCapacity
+				 diskPath:(NSString *)path;
+
 - (NSCachedURLResponse *) cachedResponseForRequest:(NSURLRequest *)request;
 - (void) storeCachedResponse:(NSCachedURLResponse *)cachedResponse
 				  forRequest:(NSURLRequest *)request;
 - (void) removeCachedResponseForRequest:(NSURLRequest *)request;
 - (void) removeAllCachedResponses;
-// ...
+
+- (NSUInteger) memoryCapacity;
+- (NSUInteger) diskCapacity;
+- (void) setMemoryCapacity:(NSUInteger)memoryCapacity;
+- (void) setDiskCapacity:(NSUInteger)diskCapacity;
+- (NSUInteger) currentMemoryUsage;
+- (NSUInteger) currentDiskUsage;
+
+- (void) getStatistics:(NSURLCacheStatistics *)statistics;	// mGSTEP
 
 @end  /* NSURLCache */
 
@@ -366,7 +402,15 @@ typedef enum _NSURLCacheStoragePolicy {
 	id _client;
 
 	NSMutableData *_data;
-	NSInteger _length;
+	NSInteger _length;						// body or chunk bytes to come,
+	int _chunkState;						// -1 if body ends at close
+	void *_inflate;							// gzip body z_stream
+
+	NSData *_out;							// request bytes being sent
+	NSUInteger _outOffset;
+	NSInteger _outBody;						// body bytes in _out
+	long long _bodySent;
+	int _sendState;
 
 	struct __URLProtocolFlags {
 		unsigned int authenticated:1;
@@ -375,7 +419,9 @@ typedef enum _NSURLCacheStoragePolicy {
 		unsigned int chunked:1;
 		unsigned int decompressed:1;
 		unsigned int gzip:1;
-		unsigned int reserved:2;
+		unsigned int keepAlive:1;
+		unsigned int finished:1;
+		unsigned int sent:1;
 	} _up;
 }
 
@@ -420,11 +466,15 @@ typedef enum _NSURLCacheStoragePolicy {
 	NSURLProtocol *_protocol;
 	void *_socket;
 	id _delegate;
+	NSURLResponse *_response;
+	NSMutableData *_cacheData;				// body for NSURLCache
 
 	struct __URLConnectionFlags {
 		unsigned int connected:1;
 		unsigned int done:1;
-		unsigned int reserved:6;
+		unsigned int reused:1;
+		NSURLCacheStoragePolicy storage:2;
+		unsigned int reserved:3;
 	} _uc;
 }
 
@@ -479,6 +529,11 @@ typedef enum _NSURLCacheStoragePolicy {
 - (void) connection:(NSURLConnection *)c didReceiveData:(NSData *)d;
 - (void) connectionDidFinishLoading:(NSURLConnection *)c;
 
+- (void) connection:(NSURLConnection *)c
+		 didSendBodyData:(NSInteger)bytesWritten
+		 totalBytesWritten:(NSInteger)totalBytesWritten
+		 totalBytesExpectedToWrite:(NSInteger)totalBytesExpectedToWrite;
+
 @end  /* NSURLConnectionDataDelegate  <NSURLConnectionDelegate> */
 
 
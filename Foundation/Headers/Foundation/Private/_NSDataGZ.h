@@ -0,0 +1,76 @@
+/*
+   _NSDataGZ.h
+
+   zlib compression plugin (GZ.bundle) interface.  The methods exist once
+   the bundle is loaded from Foundation/Plugins.
+
+   Copyright (C) 2020 Free Software Foundation, Inc.
+
+   Author:  Felipe A. Rodriguez <far@illumenos.com>
+   Date:	November 2020
+
+   This file is part of the mGSTEP Library and is provided
+   under the terms of the GNU Library General Public License.
+*/
+
+#ifndef _mGSTEP_H__NSDataGZ
+#define _mGSTEP_H__NSDataGZ
+
+#include <Foundation/NSData.h>
+#include <Foundation/NSStream.h>
+
+typedef enum {
+	NSDataGZFormatRaw  = 0,					// deflate data only   RFC 1951
+	NSDataGZFormatZlib = 1,					// zlib and adler32    RFC 1950
+	NSDataGZFormatGZip = 2,					// gzip and crc32      RFC 1952
+	NSDataGZFormatAuto = 3					// zlib or gzip, decompress only
+} NSDataGZFormat;
+
+#define NSDataGZDefaultLevel	-1			// zlib's, 6 of 0 (store) to 9
+
+
+@interface NSData  (_NSDataGZ)
+
+- (id) decompressGZ;											// retained
+
+- (NSData *) compressedDataWithLevel:(int)level format:(NSDataGZFormat)f;
+- (NSData *) decompressedDataWithFormat:(NSDataGZFormat)f;
+
+@end
+
+
+@interface NSMutableData  (_NSDataInflateGZ)
+
++ (void) inflateGZEnd:(void **)stream;
+- (int) inflateGZBytes:(const void *)b length:(NSUInteger)l stream:(void **)s;
+
+@end
+
+/* ****************************************************************************
+
+	Stream filters, (de)compress what is read from or written to another
+	stream a buffer at a time.  Closing a filter closes its stream and
+	ends a compressed output stream.
+
+** ***************************************************************************/
+
+@interface NSInputStream  (_NSStreamGZ)
+
++ (id) compressingStreamWithInputStream:(NSInputStream *)s
+								  level:(int)level
+								  format:(NSDataGZFormat)f;
++ (id) decompressingStreamWithInputStream:(NSInputStream *)s
+								   format:(NSDataGZFormat)f;
+@end
+
+
+@interface NSOutputStream  (_NSStreamGZ)
+
++ (id) compressingStreamWithOutputStream:(NSOutputStream *)s
+								   level:(int)level
+								   format:(NSDataGZFormat)f;
++ (id) decompressingStreamWithOutputStream:(NSOutputStream *)s
+									format:(NSDataGZFormat)f;
+@end
+
+#endif /* _mGSTEP_H__NSDataGZ */
@@ -0,0 +1,97 @@
+/*
+   _NSObject.h
+
+   NSObject header word and inline reference counting
+
+   Copyright (C) 2015 Free Software Foundation, Inc.
+
+   Author:  Felipe A. Rodriguez <far@illumenos.com>
+   Date: 	October 2015
+
+   This file is part of the mGSTEP Library and is provided
+   under the terms of the GNU Library General Public License.
+*/
+
+#ifndef _mGSTEP_H__NSObject
+#define _mGSTEP_H__NSObject
+
+/* ****************************************************************************
+
+	Define a wrapper structure around each NSObject to store the reference
+	count locally.  Required for legacy runtime compatibility.
+
+** ***************************************************************************/
+
+#define	UNP    sizeof(unp)
+#define	ALIGN  __alignof__(double)
+
+typedef struct obj_layout_unpadded
+{									// Define a structure to hold data locally
+    unsigned int retained;			// before the start of each object
+    unsigned int sizeClass;			// slab size class + 1, 0 if malloc'd
+} unp;
+
+									// Now wrap the other version to determine
+struct obj_layout 					// what padding if any is required to get
+{									// the alignment of the structure correct.
+    unsigned int retained;
+    unsigned int sizeClass;
+    char padding[ALIGN - ((UNP % ALIGN) ? (UNP % ALIGN) : ALIGN)];
+};
+
+typedef	struct obj_layout *obj_t;
+
+/* ****************************************************************************
+
+	Reference counts are plain increments until the process spawns its
+	first thread, from then on they are atomic.  Increments are relaxed,
+	the decrement that takes the count to zero is a release that pairs
+	with an acquire so the deallocating thread sees all prior writes.
+	Configure with ATOMIC_REFCOUNT to always use the atomic path.
+
+** ***************************************************************************/
+
+#ifdef ATOMIC_REFCOUNT
+  #define _NSRefCountIsAtomic()		1
+#else
+  extern BOOL __NSAtomicRefCount;
+  #define _NSRefCountIsAtomic()		__builtin_expect(__NSAtomicRefCount, 0)
+#endif
+
+static inline void
+_NSIncrementRefCount(id object)
+{
+	obj_t o = &((obj_t)(object))[-1];
+
+	if (_NSRefCountIsAtomic())
+		__atomic_fetch_add(&o->retained, 1, __ATOMIC_RELAXED);
+	else
+		o->retained++;
+}
+
+static inline BOOL
+_NSDecrementRefCountWasZero(id object)
+{
+	obj_t o = &((obj_t)(object))[-1];
+
+	if (_NSRefCountIsAtomic())
+		{
+		if (__atomic_fetch_sub(&o->retained, 1, __ATOMIC_RELEASE) != 0)
+			return NO;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		return YES;
+		}
+
+	return (o->retained-- == 0 ? YES : NO);
+}
+
+static inline NSUInteger
+_NSRefCount(id object)
+{
+	obj_t o = &((obj_t)(object))[-1];
+
+	return __atomic_load_n(&o->retained, __ATOMIC_RELAXED) + 1;
+}
+
+#endif /* _mGSTEP_H__NSObject */
@@ -12,70 +12,522 @@
 
 #include <Foundation/NSString.h>
 #include <Foundation/NSData.h>
+#include <Foundation/NSError.h>
+#include <Foundation/NSStream.h>
+#include <Foundation/Private/_NSDataGZ.h>
 
 #include <zlib.h>
-#include <assert.h>
+#include <errno.h>
 
 
+#define CHUNK			16384
+#define STREAM_CHUNK	65536				// filter stream buffer
+#define SLICE			(1U << 30)			// zlib counts bytes in 32 bits
+#define MAX_RATIO		1032				// deflate's best, bounds a bogus
+											// gzip trailer length
+
+static int
+WindowBits(NSDataGZFormat f)
+{
+	switch (f)
+		{
+		case NSDataGZFormatRaw:		return -MAX_WBITS;
+		case NSDataGZFormatZlib:	return MAX_WBITS;
+		case NSDataGZFormatGZip:	return 16 + MAX_WBITS;
+		default:					return 32 + MAX_WBITS;	// auto detect
+		}
+}
+
+static int
+FilterInit(z_stream *s, BOOL compress, int level, NSDataGZFormat f)
+{
+	memset(s, 0, sizeof(z_stream));
+	if (compress)
+		return deflateInit2(s, level, Z_DEFLATED,
+							WindowBits((f == NSDataGZFormatAuto)
+									   ? NSDataGZFormatGZip : f),
+							8, Z_DEFAULT_STRATEGY);
+
+	return inflateInit2(s, WindowBits(f));
+}
+
 /* ****************************************************************************
 
-		_NSDataDecompressGZ
+		_NSDataGZ
 
-** ***************************************************************************/
+		Whole buffer (de)compression into one malloc'd buffer sized up front,
+		deflateBound() when compressing, the gzip trailer's length or four
+		times the input when decompressing, and doubled if that is short.
 
-#define CHUNK 16384
+** ***************************************************************************/
 
-static int
-DecompressGZ(NSData *source, NSMutableData *dest)
+static NSData *
+Filter(z_stream *s, NSData *source, BOOL compress, NSUInteger reserve)
 {
-    int r;
-    z_stream s = {0};
-    unsigned char obuf[CHUNK];
-
-    if ((r = inflateInit2(&s, 16)) != Z_OK)				// gzip format
-        return r;
+	NSUInteger left = [source length];
+	NSUInteger capacity = MAX(reserve, CHUNK);
+	unsigned char *b = malloc(capacity);
+	int r = Z_OK;
 
-	s.next_in = (unsigned char *)[source bytes];
-	if (s.next_in && (s.avail_in = [source length]) > 0)
+	s->next_in = (unsigned char *)[source bytes];
+	s->avail_in = 0;
+	while (b && r == Z_OK)
 		{
-        do {							// decompress until deflate stream ends
-            s.avail_out = CHUNK;
-            s.next_out = obuf;
-
-            r = inflate(&s, Z_NO_FLUSH);				// inflate() input
+		if (s->avail_in == 0 && left > 0)
+			{
+			s->avail_in = MIN(left, SLICE);
+			left -= s->avail_in;
+			}
+		if (s->total_out == capacity)
+			{
+			unsigned char *n = realloc(b, capacity * 2);
 
-            assert(r != Z_STREAM_ERROR);
- 			if (r < 0 || r == Z_NEED_DICT)
+			if (!n)
 				{
-				inflateEnd(&s);
-				return r;
+				r = Z_MEM_ERROR;
+				break;
 				}
+			b = n;
+			capacity *= 2;
+			}
+		s->next_out = b + s->total_out;
+		s->avail_out = MIN(capacity - s->total_out, SLICE);
 
-			[dest appendBytes:obuf length: (CHUNK - s.avail_out)];
-			}											// if out buf consumed
-		while (s.avail_out == 0 && r != Z_STREAM_END);	// but not inflate end
+		if (compress)
+			r = deflate(s, (left) ? Z_NO_FLUSH : Z_FINISH);
+		else if ((r = inflate(s, Z_NO_FLUSH)) == Z_BUF_ERROR && s->avail_out)
+			r = Z_DATA_ERROR;					// truncated, needs more input
+		if (r == Z_BUF_ERROR)
+			r = Z_OK;							// output is full
 		}
 
-	inflateEnd(&s);										// clean up zlib
+	if (!b || r != Z_STREAM_END)
+		{
+		NSLog(@"ZLIB: %s failed (%d)", (compress) ? "deflate" : "inflate", r);
+		free(b);
+
+		return nil;
+		}
+
+	if (s->total_out < capacity)				// shrink, keep b if it can't
+		{
+		unsigned char *n = realloc(b, MAX(s->total_out, 1));
 
-    return r == Z_STREAM_END ? Z_OK : r;
+		if (n)
+			b = n;
+		}
+
+	return [NSData dataWithBytesNoCopy:b length:s->total_out];
 }
 
 
-@implementation NSData  (_NSDataDecompressGZ)
+@implementation NSData  (_NSDataGZ)
 
 - (id) decompressGZ
 {
-	NSMutableData *d = [NSMutableData new];
+	return [[self decompressedDataWithFormat: NSDataGZFormatGZip] retain];
+}
+
+- (NSData *) compressedDataWithLevel:(int)level format:(NSDataGZFormat)f
+{
+	NSData *d;
+	z_stream s;
+
+	if (FilterInit(&s, YES, level, f) != Z_OK)
+		return nil;
+	d = Filter(&s, self, YES, deflateBound(&s, [self length]));
+	deflateEnd(&s);
+
+	return d;
+}
+
+- (NSData *) decompressedDataWithFormat:(NSDataGZFormat)f
+{
+	const unsigned char *b = [self bytes];
+	NSUInteger l = [self length];
+	NSUInteger reserve = l * 4;
+	NSData *d;
+	z_stream s;
+
+	if (l >= 18 && b[0] == 0x1f && b[1] == 0x8b)		// gzip ISIZE trailer,
+		{												// length modulo 2^32
+		b += l - 4;
+		reserve = b[0] | (b[1] << 8) | (b[2] << 16) | ((NSUInteger)b[3] << 24);
+		reserve = MIN(MAX(reserve, l), l * MAX_RATIO);
+		}
+
+	if (FilterInit(&s, NO, 0, f) != Z_OK)
+		return nil;
+	d = Filter(&s, self, NO, reserve);
+	inflateEnd(&s);
+
+	return d;
+}
+
+@end
+
+/* ****************************************************************************
+
+		_NSDataInflateGZ
+
+		Incremental gzip inflate of a body as it arrives.  The z_stream is
+		kept by the caller in *stream, allocated by the first call and freed
+		at the end of the gzip stream, on error or by -inflateGZEnd:.
+		Returns 1 at the end of the stream, 0 when it needs more input or a
+		negative zlib error.
+
+** ***************************************************************************/
+
+@implementation NSMutableData  (_NSDataInflateGZ)
+
++ (void) inflateGZEnd:(void **)stream
+{
+	if (*stream)
+		{
+		inflateEnd((z_stream *)*stream);
+		free(*stream);
+		*stream = NULL;
+		}
+}
+
+- (int) inflateGZBytes:(const void *)bytes
+				length:(NSUInteger)length
+				stream:(void **)stream
+{
+	z_stream *s = (z_stream *)*stream;
+	NSUInteger l = [self length];
+	int r = Z_OK;
+
+	if (!s)
+		{
+		if (!(s = calloc(1, sizeof(z_stream))))
+			return Z_MEM_ERROR;
+		if ((r = inflateInit2(s, 16 + MAX_WBITS)) != Z_OK)	// gzip format
+			{
+			free(s);
+			return r;
+			}
+		*stream = s;
+		}
+
+	s->next_in = (unsigned char *)bytes;
+	s->avail_in = length;
+
+	do {								// inflate into the tail of self, the
+		if ([self _capacity] < l + CHUNK)	// output is usually several
+			[self _setCapacity: MAX([self _capacity] * 2, l + CHUNK)];
+		[self setLength: l + CHUNK];	// times the input
+		s->next_out = (unsigned char *)[self mutableBytes] + l;
+		s->avail_out = CHUNK;
+
+		r = inflate(s, Z_NO_FLUSH);
+		l += CHUNK - s->avail_out;
+		if (r == Z_BUF_ERROR)
+			r = Z_OK;							// no progress, needs input
+		}
+	while (r == Z_OK && s->avail_out == 0);
+	[self setLength: l];
+
+	if (r == Z_OK)
+		return 0;
+
+	[NSMutableData inflateGZEnd: stream];
+	if (r != Z_STREAM_END)
+		NSLog(@"ZLIB: inflate failed (%d)", r);
+
+	return r == Z_STREAM_END ? 1 : (r < 0 ? r : Z_DATA_ERROR);
+}
+
+@end
+
+/* ****************************************************************************
+
+		_NSGZInputStream, _NSGZOutputStream
+
+		Filters that hold one STREAM_CHUNK buffer and a z_stream, so memory
+		is bounded whatever the size of the data passing through.
+
+** ***************************************************************************/
+
+@interface _NSGZInputStream : NSInputStream
+{
+	NSInputStream *_source;
+	z_stream _z;
+	unsigned char *_in;
+	BOOL _compress;
+	BOOL _sourceEnd;
+	BOOL _finished;
+}
+
+- (id) initWithInputStream:(NSInputStream *)source
+				  compress:(BOOL)compress
+				  level:(int)level
+				  format:(NSDataGZFormat)f;
+@end
+
+@interface _NSGZOutputStream : NSOutputStream
+{
+	NSOutputStream *_dest;
+	z_stream _z;
+	unsigned char *_out;
+	BOOL _compress;
+	BOOL _finished;
+}
+
+- (id) initWithOutputStream:(NSOutputStream *)dest
+				   compress:(BOOL)compress
+				   level:(int)level
+				   format:(NSDataGZFormat)f;
+@end
+
+
+@implementation _NSGZInputStream
+
+- (id) initWithInputStream:(NSInputStream *)source
+				  compress:(BOOL)compress
+				  level:(int)level
+				  format:(NSDataGZFormat)f
+{
+	if ((self = [self init]))
+		{
+		_compress = compress;
+		if (FilterInit(&_z, compress, level, f) != Z_OK)
+			return _NSInitError(self, @"ZLIB: stream init failed");
+		_source = [source retain];
+		_in = malloc(STREAM_CHUNK);
+		}
+
+	return self;
+}
+
+- (void) dealloc
+{
+	if (_compress)
+		deflateEnd(&_z);
+	else
+		inflateEnd(&_z);
+	free(_in);
+	[_source release];
+	[super dealloc];
+}
+
+- (void) open
+{
+	[_source open];
+	[super open];
+}
+
+- (void) close
+{
+	[_source close];
+	[super close];
+}
+
+- (BOOL) hasBytesAvailable						{ return !_finished; }
+
+- (NSInteger) _fail:(int)r
+{
+	_streamStatus = NSStreamStatusError;
+	ASSIGN(_streamError, _NSError(NSPOSIXErrorDomain, EIO, @"zlib error"));
+	NSLog(@"ZLIB: stream %s failed (%d)", (_compress) ? "deflate" : "inflate", r);
+
+	return -1;
+}
+
+- (NSInteger) read:(uint8_t *)buf maxLength:(NSUInteger)len
+{
+	int r;
+
+	if (_streamStatus == NSStreamStatusError)
+		return -1;
+	_streamStatus = NSStreamStatusReading;
+	_z.next_out = buf;
+	_z.avail_out = MIN(len, SLICE);
+
+	while (_z.avail_out > 0 && !_finished)
+		{
+		if (_z.avail_in == 0 && !_sourceEnd)
+			{
+			NSInteger n = [_source read:_in maxLength:STREAM_CHUNK];
+
+			if (n < 0 || [_source streamStatus] == NSStreamStatusError)
+				return [self _fail: Z_ERRNO];
+			_sourceEnd = (n == 0);
+			_z.next_in = _in;
+			_z.avail_in = n;
+			}
+
+		if (_compress)
+			r = deflate(&_z, (_sourceEnd) ? Z_FINISH : Z_NO_FLUSH);
+		else if ((r = inflate(&_z, Z_NO_FLUSH)) == Z_BUF_ERROR && _sourceEnd)
+			r = Z_DATA_ERROR;					// truncated
+		if (r == Z_STREAM_END)
+			_finished = YES;
+		else if (r != Z_OK && r != Z_BUF_ERROR)
+			return [self _fail: r];
+		}
+
+	len = MIN(len, SLICE) - _z.avail_out;
+	if (_finished && len == 0)
+		_streamStatus = NSStreamStatusAtEnd;
+
+	return len;
+}
+
+@end
+
+
+@implementation _NSGZOutputStream
+
+- (id) initWithOutputStream:(NSOutputStream *)dest
+				   compress:(BOOL)compress
+				   level:(int)level
+				   format:(NSDataGZFormat)f
+{
+	if ((self = [self init]))
+		{
+		_compress = compress;
+		if (FilterInit(&_z, compress, level, f) != Z_OK)
+			return _NSInitError(self, @"ZLIB: stream init failed");
+		_dest = [dest retain];
+		_out = malloc(STREAM_CHUNK);
+		}
+
+	return self;
+}
+
+- (void) dealloc
+{
+	if (_compress)
+		deflateEnd(&_z);
+	else
+		inflateEnd(&_z);
+	free(_out);
+	[_dest release];
+	[super dealloc];
+}
+
+- (void) open
+{
+	[_dest open];
+	[super open];
+}
+
+- (int) _filter:(int)flush					// run zlib over the input and
+{											// write all output to _dest
+	int r = Z_OK;
+
+	do {
+		unsigned char *b = _out;
+		NSInteger n;
+
+		_z.next_out = _out;
+		_z.avail_out = STREAM_CHUNK;
+		r = (_compress) ? deflate(&_z, flush) : inflate(&_z, Z_NO_FLUSH);
+		if (r == Z_STREAM_END)
+			_finished = YES;
+		else if (r != Z_OK && r != Z_BUF_ERROR)
+			return r;
+
+		for (; b < _z.next_out; b += n)
+			if ((n = [_dest write:b maxLength:_z.next_out - b]) <= 0)
+				return Z_ERRNO;
+		}
+	while (_z.avail_out == 0 && !_finished);
+
+	return Z_OK;
+}
+
+- (NSInteger) write:(const uint8_t *)buf maxLength:(NSUInteger)len
+{
+	NSUInteger done = 0;
 	int r;
 
-	if ((r = DecompressGZ(self, d)) != Z_OK)
+	if (_streamStatus == NSStreamStatusError)
+		return -1;
+	if (_finished)
+		{
+		_streamStatus = NSStreamStatusAtEnd;	// input past the end of
+		return 0;								// the compressed data
+		}
+	_streamStatus = NSStreamStatusWriting;
+
+	for (; done < len && !_finished; done += _z.next_in - (buf + done))
+		{
+		_z.next_in = (unsigned char *)buf + done;
+		_z.avail_in = MIN(len - done, SLICE);
+		if ((r = [self _filter: Z_NO_FLUSH]) != Z_OK)
+			{
+			_streamStatus = NSStreamStatusError;
+			ASSIGN(_streamError, _NSError(NSPOSIXErrorDomain, EIO, @"zlib error"));
+			NSLog(@"ZLIB: stream %s failed (%d)",
+					(_compress) ? "deflate" : "inflate", r);
+
+			return -1;
+		}	}
+
+	return done;
+}
+
+- (void) close
+{
+	if (_compress && !_finished && _streamStatus != NSStreamStatusError)
 		{
-		[d release],	d = nil;
-		NSLog(@"ZLIB: decompress failed (%d)", r);
+		_z.next_in = NULL;
+		_z.avail_in = 0;
+		if ([self _filter: Z_FINISH] != Z_OK)
+			NSLog(@"ZLIB: stream deflate failed at close");
 		}
+	[_dest close];
+	[super close];
+}
+
+@end
+
 
-    return d;				// FIX ME by convention s/b autoreleased
+@implementation NSInputStream  (_NSStreamGZ)
+
++ (id) compressingStreamWithInputStream:(NSInputStream *)s
+								  level:(int)level
+								  format:(NSDataGZFormat)f
+{
+	return [[[_NSGZInputStream alloc] initWithInputStream: s
+									  compress: YES
+									  level: level
+									  format: f] autorelease];
+}
+
++ (id) decompressingStreamWithInputStream:(NSInputStream *)s
+								   format:(NSDataGZFormat)f
+{
+	return [[[_NSGZInputStream alloc] initWithInputStream: s
+									  compress: NO
+									  level: 0
+									  format: f] autorelease];
+}
+
+@end
+
+
+@implementation NSOutputStream  (_NSStreamGZ)
+
++ (id) compressingStreamWithOutputStream:(NSOutputStream *)s
+								   level:(int)level
+								   format:(NSDataGZFormat)f
+{
+	return [[[_NSGZOutputStream alloc] initWithOutputStream: s
+									   compress: YES
+									   level: level
+									   format: f] autorelease];
+}
+
++ (id) decompressingStreamWithOutputStream:(NSOutputStream *)s
+									format:(NSDataGZFormat)f
+{
+	return [[[_NSGZOutputStream alloc] initWithOutputStream: s
+									   compress: NO
+									   level: 0
+									   format: f] autorelease];
 }
 
 @end
@@ -17,8 +17,11 @@
 #include <Foundation/NSBundle.h>
 #include <Foundation/NSError.h>
 
+#include <CoreFoundation/CFSocket.h>
 #include <Security/Security.h>
 
+#include <errno.h>
+
 extern NSString *SSLErrorDomain;
 
 
@@ -31,11 +34,9 @@ extern NSString *SSLErrorDomain;
 @end
 
 @interface NSURLProtocol  (responder)
-- (BOOL) _respondWithHTTP:(NSMutableData *)mdata;
-@end
-
-@interface NSMutableData  (_NSDataDecompressGZ)
-- (id) decompressGZ;
+- (BOOL) _decodeData;
+- (void) _closedByPeer;
+- (BOOL) _sendRequest:(int)sd;
 @end
 
 
@@ -56,6 +57,32 @@ extern NSString *SSLErrorDomain;
 	[super dealloc];
 }
 
+- (CFTypeRef) _transport					{ return _context; }
+
+- (void) _setTransport:(CFTypeRef)transport		// TLS session of a socket
+{												// reused from the pool
+	if (_context)
+		CFRelease(_context);
+	_context = (transport) ? (SSLContextRef)CFRetain(transport) : NULL;
+	_handshake = _up.authenticated = (transport != NULL);
+}
+
+- (NSInteger) _write:(const void *)bytes length:(NSUInteger)len socket:(int)sd
+{
+	size_t size;
+	OSStatus r;
+								// a write that would block is retried with
+	if ((r = SSLWrite (_context, bytes, len, &size)) == errSSLWouldBlock)
+		errno = EAGAIN;										// the same args
+	else if (r != 0)
+		{
+		NSLog(@"URL: error writing to SSL socket (%d)\n", r);
+		errno = EIO;
+		}
+
+	return (r) ? -1 : (NSInteger)size;
+}
+
 - (void) useCredential:(NSURLCredential *)credential
 		 forAuthenticationChallenge:(NSURLAuthenticationChallenge *)ch
 {
@@ -77,7 +104,7 @@ extern NSString *SSLErrorDomain;
 				   extra:(const void*)extra				// the fd is ready
 {
 	int read_data = 0;
-	char buf[3584];
+	char buf[16384];
 	size_t size;
 	OSStatus r;
 
@@ -148,45 +175,25 @@ extern NSString *SSLErrorDomain;
 			return;
 		}	}
 
-	if (!_up.queried)
+	if (!_up.sent)
 		{
-		_up.queried = YES;
-///		printf ("SSL query string:\n%s", [_header cString]);
-
-		if ((r = SSLWrite (_context, [_header cString], [_header length], &size)) != 0)
-			if (r != errSSLWouldBlock)
-				{
-				id <NSURLConnectionDelegate> d = delegate;
-				NSError *e = _NSError(SSLErrorDomain, r, @"SSL write error");
-
-				NSLog(@"URL: error writing to SSL socket (%d)\n", r);
-				[d connection:_client didFailWithError:e];
-				}
-
+		[self _sendRequest: PTR2INT(extra)];
 		return;
 		}
+	if (!(type & kCFSocketReadCallBack))
+		return;									// writable, nothing to read
 
 	if (!_data)
 		_data = [NSMutableData new];
 
-	for (; !(r = SSLRead (_context, buf, 3584, &size)) && size > 0; read_data++)
-		[_data appendBytes:buf length:size];
-
-	if (read_data)
+	while (!(r = SSLRead (_context, buf, sizeof(buf), &size)) && size > 0)
 		{
-		NSLog(@"URL: SSLRead data %lu\n", [_data length]);
-		if (!_up.responded && ![self _respondWithHTTP:_data])
-			return;
-
-		if (_up.gzip && [_data length] >= _length)
-			if ((_data = [[_data autorelease] decompressGZ]))
-				_up.decompressed = YES;
+		[_data appendBytes:buf length:size];
+		read_data++;
+		}
 
-		if (!_up.gzip || _up.decompressed)
-			{
-			[_client URLProtocol:self didLoadData:_data];
-			[_data setLength: 0];
-		}	}
+	if (read_data && [self _decodeData])
+		return;
 
 	if (r < 0 && r != errSSLWouldBlock && errno != EAGAIN && errno != 0)
 		{
@@ -198,8 +205,8 @@ extern NSString *SSLErrorDomain;
 		DBLog(@"URL: NSURLProtocol read %lu\n", size);
 		if (r != errSSLWouldBlock && size == 0)
 			{
-			NSLog(@"URL: NSURLProtocol complete\n");
-			[_client URLProtocolDidFinishLoading: self];
+			DBLog(@"URL: NSURLProtocol complete\n");
+			[self _closedByPeer];
 			}
 		}
 }
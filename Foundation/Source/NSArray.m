@@ -21,16 +21,387 @@
 #include <Foundation/NSException.h>
 #include <Foundation/NSAutoreleasePool.h>
 #include <Foundation/NSIndexSet.h>
+#include <Foundation/NSData.h>
+#include <Foundation/NSOperation.h>
+
+#include <unistd.h>
 
 #define MAX_AUTO	1024
-							// shell sort value for stride factor is not well
-#define STRIDE_FACTOR 3		// understood 3 is a good choice (Sedgewick)
 
 
 static Class __mutableArrayClass = Nil;
 static Class __arrayClass = Nil;
 static Class __stringClass = Nil;
 
+/* ****************************************************************************
+
+	Merge sort -- stable natural merge sort.  Ascending and strictly
+	descending runs already in the data are found and used as they are,
+	short runs are extended by binary insertion to SORT_RUN_MIN and runs
+	are merged as they are found while their lengths keep the stack
+	shallow (the TimSort rules).  A merge first skips, by binary search,
+	the head of the left run and the tail of the right run that are already
+	in place, so presorted input costs n - 1 compares and an append to a
+	sorted array O(log n) per merge.
+
+** ***************************************************************************/
+
+#define SORT_RUN_MIN		32
+#define SORT_STACK			96
+
+typedef struct _SortSpec {
+	NSInteger (*compare)(id, id, void *);
+	void *context;
+} SortSpec;
+
+#define LESS(a, b)	((*spec->compare)((a), (b), spec->context) < 0)
+
+
+static NSUInteger									// elements of a[0..n) that
+_UpperBound(id key, id *a, NSUInteger n, SortSpec *spec)	// are <= key
+{
+	NSUInteger lo = 0, hi = n;
+
+	while (lo < hi)
+		{
+		NSUInteger mid = lo + (hi - lo) / 2;
+
+		if (LESS(key, a[mid]))
+			hi = mid;
+		else
+			lo = mid + 1;
+		}
+
+	return lo;
+}
+
+static NSUInteger									// elements of a[0..n) that
+_LowerBound(id key, id *a, NSUInteger n, SortSpec *spec)	// are < key
+{
+	NSUInteger lo = 0, hi = n;
+
+	while (lo < hi)
+		{
+		NSUInteger mid = lo + (hi - lo) / 2;
+
+		if (LESS(a[mid], key))
+			lo = mid + 1;
+		else
+			hi = mid;
+		}
+
+	return lo;
+}
+
+static void											// a[0..sorted) is in order
+_InsertionSort(id *a, NSUInteger sorted, NSUInteger n, SortSpec *spec)
+{
+	for (; sorted < n; sorted++)
+		{
+		id key = a[sorted];
+		NSUInteger i = _UpperBound(key, a, sorted, spec);
+
+		memmove(a + i + 1, a + i, (sorted - i) * sizeof(id));
+		a[i] = key;
+		}
+}
+
+static NSUInteger
+_CountRun(id *a, NSUInteger n, SortSpec *spec)
+{
+	NSUInteger i = 2;
+
+	if (n < 2)
+		return n;
+
+	if (LESS(a[1], a[0]))							// strictly descending runs
+		{											// are reversed, equal
+		id *lo = a, *hi;							// elements never swap
+
+		while (i < n && LESS(a[i], a[i-1]))
+			i++;
+		for (hi = a + i - 1; lo < hi; lo++, hi--)
+			{
+			id t = *lo;
+
+			*lo = *hi;
+			*hi = t;
+		}	}
+	else
+		while (i < n && !LESS(a[i], a[i-1]))
+			i++;
+
+	return i;
+}
+
+static void										// merge a[0..n1) a[n1..n1+n2)
+_MergeRuns(id *a, NSUInteger n1, NSUInteger n2, id *tmp, SortSpec *spec)
+{
+	NSUInteger k = _UpperBound(a[n1], a, n1, spec);	// left head in place
+	id *l, *le, *r, *re, *out;
+
+	a += k;
+	if ((n1 -= k) == 0)
+		return;
+	n2 = _LowerBound(a[n1 - 1], a + n1, n2, spec);	// right tail in place
+	if (n2 == 0)
+		return;
+
+	memcpy(tmp, a, n1 * sizeof(id));
+	l = tmp, le = tmp + n1;
+	r = a + n1, re = r + n2;
+	out = a;
+	while (l < le && r < re)
+		*out++ = (LESS(*r, *l)) ? *r++ : *l++;
+	memcpy(out, l, (le - l) * sizeof(id));			// rest of right in place
+}
+
+static void
+_MergeSort(id *a, NSUInteger n, id *tmp, SortSpec *spec)
+{
+	NSUInteger base[SORT_STACK], len[SORT_STACK];
+	NSUInteger i = 0, s = 0;
+
+	while (i < n || s > 1)
+		{
+		if (i < n)
+			{
+			NSUInteger r = _CountRun(a + i, n - i, spec);
+
+			if (r < SORT_RUN_MIN && r < n - i)
+				{
+				NSUInteger m = MIN(SORT_RUN_MIN, n - i);
+
+				_InsertionSort(a + i, r, m, spec);
+				r = m;
+				}
+			base[s] = i;
+			len[s++] = r;
+			i += r;
+			}
+
+		while (s > 1)								// merge while the lengths
+			{										// break the invariants,
+			NSUInteger m = s - 2;					// or all when done
+
+			if (i == n)
+				{
+				if (m > 0 && len[m-1] < len[m+1])
+					m--;
+				}
+			else if ((m > 0 && len[m-1] <= len[m] + len[m+1])
+					|| (m > 1 && len[m-2] <= len[m-1] + len[m]))
+				{
+				if (len[m-1] < len[m+1])
+					m--;
+				}
+			else if (len[m] > len[m+1])
+				break;
+
+			_MergeRuns(a + base[m], len[m], len[m+1], tmp, spec);
+			len[m] += len[m+1];
+			if (m + 2 < s)
+				{
+				base[m+1] = base[m+2];
+				len[m+1] = len[m+2];
+				}
+			s--;
+		}	}
+}
+
+static void										// out of place merge of l, r
+_MergeInto(id *l, NSUInteger nl, id *r, NSUInteger nr, id *out, SortSpec *spec)
+{
+	id *le = l + nl, *re = r + nr;
+
+	if (nl > 0 && nr > 0 && LESS(*r, le[-1]))
+		while (l < le && r < re)
+			*out++ = (LESS(*r, *l)) ? *r++ : *l++;
+	memcpy(out, l, (le - l) * sizeof(id));
+	memcpy(out + (le - l), r, (re - r) * sizeof(id));
+}
+
+/* ****************************************************************************
+
+	Parallel sort -- arrays of SORT_PARALLEL_MIN or more objects are cut
+	into one block per pool worker (a power of 2, MGSTEP_OPERATION_THREADS
+	or the online CPUs) and the blocks are sorted by NSOperations on the
+	shared pool.  Sorted blocks are then merged in pairs, level by level
+	between the array and a buffer.  Each merge is cut into pieces at a
+	binary searched split of its right block, so every level runs one job
+	per worker however few merges it has.
+
+** ***************************************************************************/
+
+#define SORT_PARALLEL_MIN	65536
+#define SORT_PARTS_MAX		16
+
+typedef struct _SortJob {
+	SortSpec *spec;
+	id *l;
+	id *r;									// NULL sorts l into place
+	id *out;								// merge output or sort buffer
+	NSUInteger nl;
+	NSUInteger nr;
+} SortJob;
+
+
+@interface _NSSortOperation : NSOperation
+{
+	SortJob _job;
+}
+- (id) initWithJob:(SortJob)job;
+@end
+
+@implementation _NSSortOperation
+
+- (id) initWithJob:(SortJob)job
+{
+	if ((self = [super init]))
+		_job = job;
+
+	return self;
+}
+
+- (void) main
+{
+	if (_job.r)
+		_MergeInto(_job.l, _job.nl, _job.r, _job.nr, _job.out, _job.spec);
+	else
+		_MergeSort(_job.l, _job.nl, _job.out, _job.spec);
+}
+
+@end
+
+static NSUInteger
+_SortParts(void)
+{
+	static NSUInteger parts = 0;				// racing callers agree
+
+	if (parts == 0)
+		{
+		char *s = getenv("MGSTEP_OPERATION_THREADS");
+		long n = (s) ? atol(s) : sysconf(_SC_NPROCESSORS_ONLN);
+		NSUInteger p = 1;
+
+		while ((long)p < n && p < SORT_PARTS_MAX)
+			p *= 2;
+		parts = p;
+		}
+
+	return parts;
+}
+
+static void
+_RunJobs(SortJob *jobs, NSUInteger count)
+{
+	NSAutoreleasePool *arp = [NSAutoreleasePool new];
+	NSOperationQueue *q = [[NSOperationQueue new] autorelease];
+	NSMutableArray *ops = [NSMutableArray arrayWithCapacity: count];
+	NSUInteger i;
+
+	for (i = 0; i < count; i++)
+		[ops addObject: [[[_NSSortOperation alloc] initWithJob: jobs[i]]
+							autorelease]];
+	[q addOperations: ops waitUntilFinished: YES];
+	[arp release];
+}
+
+static void
+_ParallelSort(id *a, NSUInteger n, id *tmp, SortSpec *spec, NSUInteger parts)
+{
+	SortJob jobs[SORT_PARTS_MAX];
+	NSUInteger b[SORT_PARTS_MAX + 1];
+	id *src = a, *dst = tmp;
+	NSUInteger j, k, q, w;
+
+	for (k = 0; k <= parts; k++)
+		b[k] = n * k / parts;
+	for (k = 0; k < parts; k++)
+		jobs[k] = (SortJob){spec, a + b[k], NULL, tmp + b[k], b[k+1] - b[k], 0};
+	_RunJobs(jobs, parts);
+
+	for (w = 1; w < parts; w *= 2)
+		{
+		id *t;
+
+		for (k = 0, j = 0; k < parts; k += 2 * w)
+			{
+			id *l = src + b[k], *r = src + b[k + w];
+			NSUInteger nl = b[k + w] - b[k], nr = b[k + 2 * w] - b[k + w];
+			NSUInteger i0 = 0, j0 = 0;
+
+			for (q = 1; q <= 2 * w; q++)			// left pieces of equal
+				{									// size, right cut before
+				NSUInteger i1 = (q < 2 * w) ? nl * q / (2 * w) : nl;	// the
+				NSUInteger j1 = (q < 2 * w)						// first not
+							  ? _LowerBound(l[i1], r, nr, spec)	// less
+							  : nr;
+
+				jobs[j++] = (SortJob){spec, l + i0, r + j0,
+									  dst + b[k] + i0 + j0, i1 - i0, j1 - j0};
+				i0 = i1;
+				j0 = j1;
+			}	}
+		_RunJobs(jobs, j);
+		t = src, src = dst, dst = t;
+		}
+
+	if (src != a)
+		memcpy(a, src, n * sizeof(id));
+}
+
+static void
+_SortObjects(id *a, NSUInteger n, NSInteger (*compare)(id,id,void*), void *cx)
+{
+	SortSpec spec = { compare, cx };
+	NSUInteger parts = (n >= SORT_PARALLEL_MIN) ? _SortParts() : 1;
+	id o[(n > 1 && n <= MAX_AUTO) ? n : 1];
+	id *tmp = o;
+
+	if (n < 2)
+		return;
+	if (n > MAX_AUTO && !(tmp = malloc(n * sizeof(id))))
+		[NSException raise:NSMallocException format:@"malloc failed"];
+
+	if (parts > 1)
+		_ParallelSort(a, n, tmp, &spec, parts);
+	else
+		_MergeSort(a, n, tmp, &spec);
+
+	if (tmp != o)
+		free(tmp);
+}
+
+typedef struct _SelectorCache {
+	SEL selector;
+	Class class;								// class of the first object
+	IMP imp;									// and its comparator method
+} SelectorCache;
+
+static NSInteger
+_CachedCompare(id elem1, id elem2, void *cx)
+{
+	SelectorCache *c = (SelectorCache *)cx;
+	IMP imp = (elem1->class_pointer == c->class)
+			? c->imp : objc_msg_lookup(elem1, c->selector);
+
+	return (NSInteger)(*imp)(elem1, c->selector, elem2);
+}
+
+static void
+_SortObjectsUsingSelector(id *a, NSUInteger n, SEL comparator)
+{
+	SelectorCache c = { comparator, Nil, NULL };
+
+	if (n > 1)									// looked up once per sort
+		{										// rather than per compare
+		c.class = a[0]->class_pointer;
+		c.imp = objc_msg_lookup(a[0], comparator);
+		}
+	_SortObjects(a, n, _CachedCompare, &c);
+}
+
 
 /* ****************************************************************************
 
@@ -534,35 +905,82 @@ static Class __stringClass = Nil;
 		[_contents[i] performSelector:aSelector withObject:argument];
 }
 
-static NSInteger _Compare(id elem1, id elem2, void *comparator)
-{
-    return (NSInteger)[elem1 performSelector:comparator withObject:elem2];
-}
-
 - (NSArray*) sortedArrayUsingSelector:(SEL)comparator
 {
-    return [self sortedArrayUsingFunction:_Compare context:(void*)comparator];
+	NSArray *sortedArray = [NSArray arrayWithArray: self];
+
+	_SortObjectsUsingSelector(sortedArray->_contents, _count, comparator);
+
+	return sortedArray;
 }
 
 - (NSArray*) sortedArrayUsingFunction:(NSInteger(*)(id,id,void*))comparator
 							  context:(void*)context
 {
-	SEL s = @selector(sortUsingFunction:context:);
-	IMP im = [NSMutableArray instanceMethodForSelector: s];
 	NSArray *sortedArray = [NSArray arrayWithArray: self];
 
-	(*im)(sortedArray, s, comparator, context);
+	_SortObjects(sortedArray->_contents, _count, comparator, context);
 
 	return sortedArray;
 }
 
-- (NSData *) sortedArrayHint				{ return nil; }
+/* ****************************************************************************
+
+	The hint of a sorted array is its objects in order.  The hint is only a
+	seed: if the receiver holds the same objects, permuted or not, they are
+	laid out in the hint's order and the merge sort still runs, finding the
+	runs that order kept, which after a few changes is close to linear.
+
+** ***************************************************************************/
+
+static int
+_ComparePointers(const void *a, const void *b)
+{
+	char *x = *(char **)a;
+	char *y = *(char **)b;
+
+	return (x < y) ? -1 : (x > y);
+}
+
+static BOOL
+_SamePointers(id *a, id *b, NSUInteger n)		// same objects, in any order
+{
+	id *sa, *sb;
+	BOOL same;
+
+	if (memcmp(a, b, n * sizeof(id)) == 0)
+		return YES;
+
+	sa = malloc(2 * n * sizeof(id));
+	sb = sa + n;
+	memcpy(sa, a, n * sizeof(id));
+	memcpy(sb, b, n * sizeof(id));
+	qsort(sa, n, sizeof(id), _ComparePointers);
+	qsort(sb, n, sizeof(id), _ComparePointers);
+	same = (memcmp(sa, sb, n * sizeof(id)) == 0);
+	free(sa);
+
+	return same;
+}
+
+- (NSData *) sortedArrayHint
+{
+	return [NSData dataWithBytes: _contents length: _count * sizeof(id)];
+}
 
 - (NSArray*) sortedArrayUsingFunction:(NSInteger(*)(id,id,void*))comparator
 							  context:(void*)context
 							  hint:(NSData*)hint
 {
-    return [self sortedArrayUsingFunction:comparator context:context];
+	NSArray *sortedArray = [NSArray arrayWithArray: self];
+
+	if (_count > 1 && [hint length] == _count * sizeof(id)
+			&& _SamePointers((id *)[hint bytes], _contents, _count))
+		memcpy(sortedArray->_contents, [hint bytes], _count * sizeof(id));
+
+	_SortObjects(sortedArray->_contents, _count, comparator, context);
+
+	return sortedArray;
 }
 
 - (NSString *) componentsJoinedByString:(NSString*)separator
@@ -1052,47 +1470,12 @@ static NSInteger _Compare(id elem1, id elem2, void *comparator)
 
 - (void) sortUsingFunction:(NSInteger(*)(id,id,void*))compare context:(void*)cx
 {
-	NSUInteger c, d, stride = 1;					// Shell sort algorithm 
-													// from SortingInAction
-	while (stride <= _count)						// a NeXT example
-		stride = stride * STRIDE_FACTOR + 1;
-
-	while(stride > (STRIDE_FACTOR - 1)) 			// loop to sort for each 
-		{											// value of stride
-		stride = stride / STRIDE_FACTOR;
-		for (c = stride; c < _count; c++) 
-			{
-			BOOL found = NO;
-
-			if (stride > c)
-				break;
-			d = c - stride;
-			while (!found) 							// move to left until the 
-				{									// correct place is found
-				id a = _contents[d + stride];
-				id b = _contents[d];
-
-				if ((*compare)(a, b, cx) == NSOrderedAscending)
-					{
-					_contents[d + stride] = b;		// swap values
-					_contents[d] = a;
-					if (stride > d)
-						break;
-					d -= stride;					// jump by stride factor
-					}
-				else 
-					found = YES;
-		}	}	}
-}
-
-static NSInteger _SelectorCompare(id elem1, id elem2, void *comparator)
-{
-    return (NSInteger)[elem1 performSelector:(SEL)comparator withObject:elem2];
+	_SortObjects(_contents, _count, compare, cx);
 }
 
 - (void) sortUsingSelector:(SEL)comparator
 {
-    [self sortUsingFunction:_SelectorCompare context:(void*)comparator];
+	_SortObjectsUsingSelector(_contents, _count, comparator);
 }
 
 @end  /* NSMutableArray */
@@ -29,30 +29,280 @@ static Class __attrStrClass;
 static Class __mutableAttrStrClass;
 
 
+/* ****************************************************************************
+
+	Attribute runs
+
+	Runs are kept in a treap ordered by position.  Each node holds the
+	length of its run and the total length of its subtree, so no node
+	stores an absolute location: finding the run at an index, splitting,
+	inserting and removing runs are O(log n) and an edit never renumbers
+	the runs after it.  An empty string keeps its attributes in a single
+	run of zero length.
+
+** ***************************************************************************/
+
+typedef struct _NSAttributeRun {
+	struct _NSAttributeRun *left;
+	struct _NSAttributeRun *right;
+	NSDictionary *attributes;
+	NSUInteger length;								// characters in this run
+	NSUInteger total;								// characters in subtree
+	unsigned int priority;
+} AttributeRun;
+
+static unsigned int __runSeed = 1;				// races only cost balance
+
+
+static inline NSUInteger
+_Total(AttributeRun *t)
+{
+	return (t) ? t->total : 0;
+}
+
+static inline void
+_Update(AttributeRun *t)
+{
+	t->total = _Total(t->left) + t->length + _Total(t->right);
+}
+
+static AttributeRun *
+_NewRun(NSDictionary *attributes, NSUInteger length)
+{
+	AttributeRun *r = malloc(sizeof(AttributeRun));
+
+	r->left = r->right = NULL;
+	r->attributes = [attributes retain];
+	r->length = r->total = length;
+	r->priority = (__runSeed = __runSeed * 1103515245 + 12345) >> 1;
+
+	return r;
+}
+
 static void
-_setAttributesFrom( NSAttributedString *attributedString,
-					NSRange aRange,
-					NSMutableArray *attributeArray,
-					NSMutableArray *locateArray)
-{				// always called immediately after -initWithString:attributes:
-	NSRange effectiveRange;
-	NSDictionary *attributeDict;
-	NSUInteger m;
+_FreeRuns(AttributeRun *t)
+{
+	if (t)
+		{
+		_FreeRuns(t->left);
+		_FreeRuns(t->right);
+		[t->attributes release];
+		free(t);
+		}
+}
+
+static AttributeRun *
+_Merge(AttributeRun *a, AttributeRun *b)		// all of a precedes all of b
+{
+	if (!a)
+		return b;
+	if (!b)
+		return a;
+	if (a->priority > b->priority)
+		{
+		a->right = _Merge(a->right, b);
+		_Update(a);
 
-	if(aRange.length == 0)
-		return;										// No attributes
+		return a;
+		}
+	b->left = _Merge(a, b->left);
+	_Update(b);
 
-	attributeDict = [attributedString attributesAtIndex:aRange.location
-									  effectiveRange:&effectiveRange];
-	[attributeArray replaceObjectAtIndex:0 withObject:attributeDict];
-	
-	while ((m = NSMaxRange(effectiveRange)) < NSMaxRange(aRange))
+	return b;
+}
+
+static void										// split t before character
+_Split(AttributeRun *t, NSUInteger index, AttributeRun **l, AttributeRun **r)
+{												// index, cutting a run in
+	NSUInteger lt;								// two if it spans index
+
+	if (!t)
+		{
+		*l = *r = NULL;
+		return;
+		}
+
+	lt = _Total(t->left);
+	if (index <= lt)
+		{
+		_Split(t->left, index, l, &t->left);
+		_Update(t);
+		*r = t;
+		}
+	else if (index >= lt + t->length)
+		{
+		_Split(t->right, index - lt - t->length, &t->right, r);
+		_Update(t);
+		*l = t;
+		}
+	else
+		{
+		AttributeRun *tail = _NewRun(t->attributes, lt + t->length - index);
+
+		*r = _Merge(tail, t->right);
+		t->right = NULL;
+		t->length = index - lt;
+		_Update(t);
+		*l = t;
+		}
+}
+
+static AttributeRun *
+_RunAt(AttributeRun *t, NSUInteger index, NSRange *range)
+{
+	NSUInteger base = 0;
+
+	while (t)
+		{
+		NSUInteger lt = _Total(t->left);
+
+		if (index < lt)
+			t = t->left;
+		else if (index < lt + t->length)
+			{
+			if (range)
+				*range = (NSRange){base + lt, t->length};
+			return t;
+			}
+		else
+			{
+			index -= lt + t->length;
+			base += lt + t->length;
+			t = t->right;
+		}	}
+
+	return NULL;
+}
+
+static void
+_GrowRunAt(AttributeRun *t, NSUInteger index, NSUInteger delta)
+{
+	while (t)
+		{
+		NSUInteger lt = _Total(t->left);
+
+		t->total += delta;
+		if (index < lt)
+			t = t->left;
+		else if (index < lt + t->length)
+			{
+			t->length += delta;
+			return;
+			}
+		else
+			{
+			index -= lt + t->length;
+			t = t->right;
+		}	}
+}
+
+static AttributeRun *
+_SetRuns(AttributeRun *root, NSDictionary *attributes, NSRange range)
+{
+	AttributeRun *a, *b, *c;
+
+	if (_Total(root) == 0)
+		{
+		[attributes retain];
+		[root->attributes release];
+		root->attributes = attributes;
+
+		return root;
+		}
+	if (range.length == 0)
+		return root;
+
+	_Split(root, range.location, &a, &b);
+	_Split(b, range.length, &b, &c);
+	_FreeRuns(b);
+
+	return _Merge(_Merge(a, _NewRun(attributes, range.length)), c);
+}
+
+/* ****************************************************************************
+
+	Replace the characters in range with length new ones.  They take the
+	attributes of the first replaced character, or of the last character
+	when appending, and join a neighbouring run holding the same attributes
+	rather than starting one of their own.
+
+** ***************************************************************************/
+
+static AttributeRun *
+_ReplaceRuns(AttributeRun *root, NSRange range, NSUInteger length)
+{
+	NSUInteger total = _Total(root);
+	NSUInteger i = range.location;
+	NSDictionary *attrs;
+	AttributeRun *a, *b, *c;
+
+	if (total == 0)
 		{
-		attributeDict = [attributedString attributesAtIndex:m
-										  effectiveRange:&effectiveRange];
-		[attributeArray addObject:attributeDict];
-		[locateArray addObject: [NSNumber numberWithUnsignedInt: 
-								effectiveRange.location - aRange.location]];
+		root->length = root->total = length;
+		return root;
+		}
+
+	attrs = [_RunAt(root, (i < total) ? i : total - 1, NULL)->attributes retain];
+	if (range.length > 0)
+		{
+		_Split(root, i, &a, &b);
+		_Split(b, range.length, &b, &c);
+		_FreeRuns(b);
+		root = _Merge(a, c);
+		total -= range.length;
+		}
+
+	if (length > 0)
+		{
+		if (i < total && _RunAt(root, i, NULL)->attributes == attrs)
+			_GrowRunAt(root, i, length);
+		else if (i > 0 && _RunAt(root, i - 1, NULL)->attributes == attrs)
+			_GrowRunAt(root, i - 1, length);
+		else
+			{
+			_Split(root, i, &a, &c);
+			root = _Merge(_Merge(a, _NewRun(attrs, length)), c);
+		}	}
+
+	if (!root)
+		root = _NewRun(attrs, 0);
+	[attrs release];
+
+	return root;
+}
+
+static AttributeRun *
+_RunsFrom(NSAttributedString *attributedString, NSRange aRange)
+{
+	AttributeRun *runs = NULL;
+	NSUInteger m = aRange.location;
+	NSRange r;
+
+	while (m < NSMaxRange(aRange))
+		{
+		NSDictionary *d = [attributedString attributesAtIndex:m
+											effectiveRange:&r];
+
+		r = NSIntersectionRange(r, aRange);
+		runs = _Merge(runs, _NewRun(d, r.length));
+		m = NSMaxRange(r);
+		}
+
+	return runs;
+}
+
+static void
+_RunsToArrays(AttributeRun *t, NSUInteger base, NSMutableArray *attributes,
+										   NSMutableArray *locations)
+{
+	if (t)
+		{
+		NSUInteger lt = _Total(t->left);
+
+		_RunsToArrays(t->left, base, attributes, locations);
+		[attributes addObject: t->attributes];
+		[locations addObject: [NSNumber numberWithUnsignedInt: base + lt]];
+		_RunsToArrays(t->right, base + lt + t->length, attributes, locations);
 		}
 }
 
@@ -60,56 +310,18 @@ static NSDictionary *
 _attributesAtIndexEffectiveRange( NSUInteger index,
 								  NSRange *aRange,
 								  NSUInteger tmpLength,
-								  NSMutableArray *attributeArray,
-								  NSMutableArray *locateArray,
-								  NSUInteger *foundIndex)
+								  AttributeRun *runs)
 {
-	NSUInteger low, high, used, cnt, foundLoc, nextLoc;
-	NSDictionary *foundDict;
+	AttributeRun *r;
 
 	if(index >= tmpLength)
 		[NSException raise:NSRangeException format: @"index out of range in \
 							_attributesAtIndexEffectiveRange()"];
 
-				// Binary search for efficiency in huge attributed strings
-	used = [attributeArray count];
-	low = 0;
-	high = used - 1;
-	while(low <= high)
-		{
-		cnt = (low + high) / 2;
-		foundDict = [attributeArray objectAtIndex:cnt];
-		foundLoc = [[locateArray objectAtIndex:cnt] unsignedIntValue];
-
-		if(foundLoc > index)
-			high = cnt-1;
-		else
-			{
-			if(cnt >= used - 1)
-				nextLoc = tmpLength;
-			else
-				nextLoc = [[locateArray objectAtIndex:cnt+1] unsignedIntValue];
-
-			if(foundLoc == index || index < nextLoc)
-				{											// Found
-				if(aRange)
-					{
-					aRange->location = foundLoc;
-					aRange->length = nextLoc - foundLoc;
-					}
-				if(foundIndex)
-					*foundIndex = cnt;
-
-				return foundDict;
-				}
-			else
-				low = cnt+1;
-		}	}
+	if (!(r = _RunAt(runs, index, aRange)))
+		NSLog(@"Error in attribute run tree");
 
-	NSLog(@"Error in binary search algorithm");
-// NSCAssert(NO,@"Error in binary search algorithm");
-
-	return nil;
+	return (r) ? r->attributes : nil;
 }
 
 @implementation NSAttributedString
@@ -154,21 +366,20 @@ _attributesAtIndexEffectiveRange( NSUInteger index,
 		return [self initWithString:nil attributes:nil];
 
 	t = [attributedString string];
-	if ((self = [self initWithString:t attributes:nil]))
-		_setAttributesFrom(attributedString, NSMakeRange(0,[t length]),
-							_attributes, _locations);
+	if ((self = [self initWithString:t attributes:nil]) && [t length] > 0)
+		{
+		_FreeRuns(_runs);
+		_runs = _RunsFrom(attributedString, NSMakeRange(0,[t length]));
+		}
 	return self;
 }
 
 - (id) initWithString:(NSString *)aString attributes:(NSDictionary *)attributes
 {
 	_string = [[NSString alloc] initWithString: aString];
-	_attributes = [[NSMutableArray alloc] init];
-	_locations = [[NSMutableArray alloc] init];
 	if(!attributes)
 		attributes = [[[NSDictionary alloc] init] autorelease];
-	[_attributes addObject:attributes];
-	[_locations addObject:[NSNumber numberWithUnsignedInt:0]];
+	_runs = _NewRun(attributes, [_string length]);
 
 	return self;
 }
@@ -176,8 +387,7 @@ _attributesAtIndexEffectiveRange( NSUInteger index,
 - (void) dealloc
 {
 	[_string release];
-	[_attributes release];
-	[_locations release];
+	_FreeRuns(_runs);
 	[super dealloc];
 }
 
@@ -188,7 +398,7 @@ _attributesAtIndexEffectiveRange( NSUInteger index,
 					  effectiveRange:(NSRange *)aRange
 {
 	return _attributesAtIndexEffectiveRange( index, aRange, 
-				[self length], _attributes, _locations, NULL);
+				[self length], _runs);
 }
 
 - (NSDictionary *) attributesAtIndex:(NSUInteger)index 
@@ -357,27 +567,50 @@ _attributesAtIndexEffectiveRange( NSUInteger index,
 	newAttrString = [NSAttributedString alloc];
 	[[newAttrString initWithString:[_string substringWithRange:aRange] 
 					attributes:nil] autorelease];
-	_setAttributesFrom(newAttrString, aRange,
-				((NSAttributedString *)newAttrString)->_attributes, 
-				((NSAttributedString *)newAttrString)->_locations);
+	if(aRange.length > 0)
+		{
+		_FreeRuns(((NSAttributedString *)newAttrString)->_runs);
+		((NSAttributedString *)newAttrString)->_runs = _RunsFrom(self, aRange);
+		}
 
 	return newAttrString;
 }
 
 - (void) encodeWithCoder:(NSCoder *)aCoder				// NSCoding protocol
 {
-	[super encodeWithCoder:aCoder];
+	NSMutableArray *attributes = [NSMutableArray array];
+	NSMutableArray *locations = [NSMutableArray array];
+
+	_RunsToArrays(_runs, 0, attributes, locations);	// archive keeps the
+	[super encodeWithCoder:aCoder];					// run array format
 	[aCoder encodeObject:_string];
-	[aCoder encodeObject:_attributes];
-	[aCoder encodeObject:_locations];
+	[aCoder encodeObject:attributes];
+	[aCoder encodeObject:locations];
 }
 
 - (id) initWithCoder:(NSCoder *)aCoder
 {
+	NSArray *attributes, *locations;
+	NSUInteger i, count;
+
 	self = [super initWithCoder:aCoder];
 	[aCoder decodeValueOfObjCType: @encode(id) at: &_string];
-	[aCoder decodeValueOfObjCType: @encode(id) at: &_attributes];
-	[aCoder decodeValueOfObjCType: @encode(id) at: &_locations];
+	[aCoder decodeValueOfObjCType: @encode(id) at: &attributes];
+	[aCoder decodeValueOfObjCType: @encode(id) at: &locations];
+
+	for (i = 0, count = [attributes count]; i < count; i++)
+		{
+		NSUInteger l = [[locations objectAtIndex:i] unsignedIntValue];
+		NSUInteger e = (i + 1 < count)
+					 ? [[locations objectAtIndex:i+1] unsignedIntValue]
+					 : [_string length];
+
+		_runs = _Merge(_runs, _NewRun([attributes objectAtIndex:i], e - l));
+		}
+	if (!_runs)
+		_runs = _NewRun([NSDictionary dictionary], [_string length]);
+	[attributes release];
+	[locations release];
 
 	return self;
 }
@@ -399,12 +632,9 @@ _attributesAtIndexEffectiveRange( NSUInteger index,
 - (id) initWithString:(NSString *)aString attributes:(NSDictionary *)attributes
 {
 	_string = [[NSMutableString alloc] initWithString: aString];
-	_attributes = [[NSMutableArray alloc] init];
-	_locations = [[NSMutableArray alloc] init];
 	if(!attributes)
 		attributes = [[[NSDictionary alloc] init] autorelease];
-	[_attributes addObject:attributes];
-	[_locations addObject:[NSNumber numberWithUnsignedInt:0]];
+	_runs = _NewRun(attributes, [_string length]);
 
 	return self;
 }
@@ -422,9 +652,11 @@ _attributesAtIndexEffectiveRange( NSUInteger index,
 	newAttrString = [[NSAttributedString alloc] initWithString:newSubstring 
 												attributes:nil];
 	[newAttrString autorelease];
-	_setAttributesFrom(self, aRange, 
-				((NSMutableAttributedString *)newAttrString)->_attributes, 
-				((NSMutableAttributedString *)newAttrString)->_locations);
+	if(aRange.length > 0)
+		{
+		_FreeRuns(((NSAttributedString *)newAttrString)->_runs);
+		((NSAttributedString *)newAttrString)->_runs = _RunsFrom(self, aRange);
+		}
 
 	return newAttrString;
 }
@@ -453,61 +685,12 @@ _attributesAtIndexEffectiveRange( NSUInteger index,
 
 - (void) setAttributes:(NSDictionary *)attributes range:(NSRange)range
 {
-	NSUInteger tmpLength, arrayIndex, arraySize, location;
-	NSRange effectiveRange;
-	NSNumber *afterRangeLocation, *beginRangeLocation;
-	NSDictionary *attrs;
-  
 	if(!attributes)
 		attributes = [NSDictionary dictionary];
-	if(NSMaxRange(range) > (tmpLength = [self length]))
+	if(NSMaxRange(range) > [self length])
 		[NSException raise:NSRangeException format:@"in setAttributes:range:"];
 
-	arraySize = [_locations count];
-	if(NSMaxRange(range) < tmpLength)
-		{
-		attrs = _attributesAtIndexEffectiveRange( NSMaxRange(range),
-			&effectiveRange,tmpLength,_attributes,_locations,&arrayIndex);
-
-		afterRangeLocation = [NSNumber numberWithUnsignedInt: 
-								NSMaxRange(range)];
-		if(effectiveRange.location > range.location)
-			[_locations replaceObjectAtIndex:arrayIndex
-							withObject:afterRangeLocation];
-		else
-			{
-			arrayIndex++;
-			[_attributes insertObject:attrs atIndex:arrayIndex];
-			[_locations insertObject:afterRangeLocation atIndex:arrayIndex];
-			}
-		arrayIndex--;
-		}
-	else
-		arrayIndex = arraySize - 1;
-  
-	while(arrayIndex > 0
-		&& [[_locations objectAtIndex:arrayIndex-1] unsignedIntValue] >= range.location)
-		{
-		[_locations removeObjectAtIndex:arrayIndex];
-		[_attributes removeObjectAtIndex:arrayIndex];
-		arrayIndex--;
-		}
-	beginRangeLocation = [NSNumber numberWithUnsignedInt:range.location];
-	location = [[_locations objectAtIndex:arrayIndex] unsignedIntValue];
-	if(location >= range.location)
-		{
-		if(location > range.location)
-			[_locations replaceObjectAtIndex:arrayIndex
-						 withObject:beginRangeLocation];
-
-		[_attributes replaceObjectAtIndex:arrayIndex withObject:attributes];
-		}
-	else
-		{
-		arrayIndex++;
-		[_attributes insertObject:attributes atIndex:arrayIndex];
-		[_locations insertObject:beginRangeLocation atIndex:arrayIndex];
-		}
+	_runs = _SetRuns(_runs, attributes, range);
 }
 
 - (void) addAttribute:(NSString *)name value:(id)value range:(NSRange)aRange
@@ -647,56 +830,13 @@ _attributesAtIndexEffectiveRange( NSUInteger index,
 - (void) replaceCharactersInRange:(NSRange)range
 		 			   withString:(NSString *)aString
 {
-	NSUInteger tmpLength, arrayIndex, arraySize, cnt, location, moveLocations;
-	NSRange effectiveRange;
-	NSDictionary *attrs;
-	NSNumber *afterRangeLocation;
-
 	if(!aString)
 		aString = @"";
-	if(NSMaxRange(range) > (tmpLength = [self length]))
+	if(NSMaxRange(range) > [self length])
 		[NSException raise:NSRangeException
 					 format:@"-replaceCharactersInRange:withString:"];
 
-	arraySize = [_locations count];
-	if(NSMaxRange(range) < tmpLength)
-		{
-		attrs = _attributesAtIndexEffectiveRange( NSMaxRange(range),
-			&effectiveRange,tmpLength,_attributes,_locations,&arrayIndex);
-    
-		moveLocations = [aString length] - range.length;
-		afterRangeLocation =
-			[NSNumber numberWithUnsignedInt:NSMaxRange(range)+moveLocations];
-    
-		if(effectiveRange.location > range.location)
-			[_locations replaceObjectAtIndex:arrayIndex
-						 withObject:afterRangeLocation];
-		else
-			{
-			arrayIndex++;
-			[_attributes insertObject:attrs atIndex:arrayIndex];
-			[_locations insertObject:afterRangeLocation atIndex:arrayIndex];
-			}
-    
-		for(cnt = arrayIndex + 1; cnt < arraySize; cnt++)
-			{
-			location = [[_locations objectAtIndex:cnt] unsignedIntValue]
-					+ moveLocations;
-			[_locations replaceObjectAtIndex:cnt
-						 withObject:[NSNumber numberWithUnsignedInt:location]];
-			}
-		arrayIndex--;
-		}
-	else
-		arrayIndex = arraySize - 1;
-
-	while(arrayIndex > 0 &&
-    [[_locations objectAtIndex:arrayIndex] unsignedIntValue] > range.location)
-		{
-		[_locations removeObjectAtIndex:arrayIndex];
-		[_attributes removeObjectAtIndex:arrayIndex];
-		arrayIndex--;
-		}
+	_runs = _ReplaceRuns(_runs, range, [aString length]);
 	[_string replaceCharactersInRange:range withString:aString];
 }
 
@@ -17,79 +17,155 @@
 #include <Foundation/NSException.h>
 #include <Foundation/NSArray.h>
 
-#include <math.h>
+/* ****************************************************************************
 
+	Hash and map tables are open addressed with Robin Hood probing.  Slots
+	live in flat parallel arrays (hashes, keys and for maps values) carved
+	out of a single allocation whose size is a power of two, so a lookup is
+	a mask and a short linear scan with no per item nodes.  A stored hash of
+	zero marks an empty slot.  Removal shifts the following displaced items
+	back one slot which keeps probe sequences short without tombstones.
 
-static void _NSHashGrow(NSHashTable *table, NSUInteger newSize);
-static void _NSMapGrow(NSMapTable *table, NSUInteger newSize);
+** ***************************************************************************/
 
+#define MIN_TABLE_SIZE		16
+#define MAX_LOAD(size)		(((size) * 3) / 4)
 
-static BOOL
-is_prime(NSUInteger n)							// Hash / Map table utilities
-{
-	int i, n2;
 
-	if(n % 2 == 0)
-		return NO;
-	n2 = sqrt(n);
-    for(i = 3; i <= n2; i+=2)
-        if(n % i == 0)
-            return NO;
+static inline NSUInteger
+_NSMixHash(NSUInteger h)			// spread weak callback hashes (pointers,
+{									// small ints) over the low bits used by
+	h ^= h >> (sizeof(NSUInteger) * 4);					// the table mask
+	h *= (NSUInteger)0x9E3779B97F4A7C15ULL;
+	h ^= h >> (sizeof(NSUInteger) * 4);
 
-    return YES;
+	return (h) ? h : 1;
 }
 
-static NSUInteger 
-nextPrime(NSUInteger old_value)
+static NSUInteger
+_NSTableSizeForCapacity(NSUInteger capacity)
 {
-	NSUInteger i, new_value = old_value | 1;
+	NSUInteger size = MIN_TABLE_SIZE;
 
-    for(i = new_value; i >= new_value; i += 2)
-        if(is_prime(i))
-            return i;
+	while (MAX_LOAD(size) < capacity)
+		size <<= 1;
 
-	return old_value;
+	return size;
 }
 
-static void 								
-_NSCheckHashTableFull(NSHashTable* table)
+/* ****************************************************************************
+
+	NSHashTable functions
+
+** ***************************************************************************/
+
+static void
+_NSHashAllocSlots(NSHashTable *table, NSUInteger size)
 {
-    if( ++(table->itemsCount) >= ((table->hashSize * 3) / 4))
+	table->hashes = calloc(size, sizeof(NSUInteger) + sizeof(void*));
+	table->keys = (void **)(table->hashes + size);
+	table->hashSize = size;
+}
+
+static NSInteger
+_NSHashFind(NSHashTable *table, const void *key, NSUInteger h)
+{
+	NSUInteger mask = table->hashSize - 1;
+	NSUInteger i = h & mask;
+	NSUInteger d;
+
+	for (d = 0; ; d++, i = (i + 1) & mask)
 		{
-		NSUInteger newSize = nextPrime((table->hashSize * 4) / 3);
-		if(newSize != table->hashSize)
-			_NSHashGrow(table, newSize);
+		NSUInteger sh = table->hashes[i];
+						// an empty slot or a resident closer to its home than
+		if (sh == 0 || ((i - sh) & mask) < d)		// we are means not found
+			return -1;
+		if (sh == h && table->callbacks.isEqual(table, key, table->keys[i]))
+			return i;
 		}
 }
 
-static void 
-_NSCheckMapTableFull(NSMapTable* table)
+static void
+_NSHashPlace(NSHashTable *table, NSUInteger h, void *key)
 {
-    if( ++(table->itemsCount) >= ((table->hashSize * 3) / 4))
+	NSUInteger mask = table->hashSize - 1;
+	NSUInteger i = h & mask;
+	NSUInteger d;
+
+	for (d = 0; ; d++, i = (i + 1) & mask)
 		{
-		NSUInteger newSize = nextPrime((table->hashSize * 4) / 3);
-		if(newSize != table->hashSize)
-			_NSMapGrow(table, newSize);
+		NSUInteger sh = table->hashes[i];
+		NSUInteger sd;
+
+		if (sh == 0)
+			{
+			table->hashes[i] = h;
+			table->keys[i] = key;
+
+			return;
+			}
+		if ((sd = (i - sh) & mask) < d)		// resident is closer to home,
+			{								// take its slot and carry it on
+			void *k = table->keys[i];
+
+			table->hashes[i] = h;
+			table->keys[i] = key;
+			h = sh;
+			key = k;
+			d = sd;
+		}	}
+}
+
+static void
+_NSHashDelete(NSHashTable *table, NSUInteger i)
+{
+	NSUInteger mask = table->hashSize - 1;
+	NSUInteger j = (i + 1) & mask;
+											// shift displaced followers back
+	while (table->hashes[j] != 0 && ((j - table->hashes[j]) & mask) != 0)
+		{
+		table->hashes[i] = table->hashes[j];
+		table->keys[i] = table->keys[j];
+		i = j;
+		j = (j + 1) & mask;
 		}
+
+	table->hashes[i] = 0;
+	table->keys[i] = NULL;
 }
 
-/* ****************************************************************************
+static void
+_NSHashGrow(NSHashTable *table, NSUInteger newSize)
+{
+	NSUInteger i, oldSize = table->hashSize;
+	NSUInteger *oldHashes = table->hashes;
+	void **oldKeys = table->keys;
 
-	NSHashTable functions
+	_NSHashAllocSlots(table, newSize);
+	for (i = 0; i < oldSize; i++)
+		if (oldHashes[i])
+			_NSHashPlace(table, oldHashes[i], oldKeys[i]);
 
-** ***************************************************************************/
+	free(oldHashes);
+}
+
+static void
+_NSHashAdd(NSHashTable *table, NSUInteger h, const void *pointer)
+{
+	if (table->itemsCount + 1 > MAX_LOAD(table->hashSize))
+		_NSHashGrow(table, table->hashSize << 1);
+
+	table->callbacks.retain(table, pointer);
+	_NSHashPlace(table, h, (void*)pointer);
+	table->itemsCount++;
+}
 
 NSHashTable *
 NSCreateHashTable(NSHashTableCallBacks callBacks, NSUInteger capacity)
 {
 	NSHashTable *t = malloc(sizeof(NSHashTable));
 
-    capacity = capacity ? capacity : 13;
-    if (!is_prime(capacity))
-		capacity = nextPrime(capacity);
-
-    t->hashSize = capacity;
-    t->nodes = calloc(t->hashSize, sizeof(void*));
+    _NSHashAllocSlots(t, _NSTableSizeForCapacity(capacity));
     t->itemsCount = 0;
     t->callbacks = callBacks;
     if (t->callbacks.hash == NULL)
@@ -110,25 +186,18 @@ NSHashTable *
 NSCopyHashTable(NSHashTable *table)
 {
 	NSUInteger i;
-	struct _NSHashNode *oldnode, *newnode;
 	NSHashTable *new = malloc(sizeof(NSHashTable));
-    
-    new->hashSize = table->hashSize;
+
+    _NSHashAllocSlots(new, table->hashSize);
     new->itemsCount = table->itemsCount;
     new->callbacks = table->callbacks;
-    new->nodes = calloc(new->hashSize, sizeof(void*));
-    
-    for (i = 0; i < new->hashSize; i++) 
-		{
-		for (oldnode = table->nodes[i]; oldnode; oldnode = oldnode->next) 
-			{
-			newnode = malloc(sizeof(struct _NSHashNode));
-			newnode->key = oldnode->key;
-			newnode->next = new->nodes[i];
-			new->nodes[i] = newnode;
-			table->callbacks.retain(new, oldnode->key);
-		}	}
-    
+    memcpy(new->hashes, table->hashes,
+		   table->hashSize * (sizeof(NSUInteger) + sizeof(void*)));
+
+    for (i = 0; i < new->hashSize; i++)
+		if (new->hashes[i])
+			table->callbacks.retain(new, new->keys[i]);
+
     return new;
 }
 
@@ -136,7 +205,7 @@ void
 NSFreeHashTable(NSHashTable *table)
 {
     NSResetHashTable(table);
-    free(table->nodes);
+    free(table->hashes);
     free(table);
 }
 
@@ -146,18 +215,14 @@ NSResetHashTable(NSHashTable *table)
 	NSUInteger i;
 
     for(i = 0; i < table->hashSize; i++) 
-		{
-		struct _NSHashNode *next, *node;
-		
-		node = table->nodes[i];
-		table->nodes[i] = NULL;		
-		while (node) 
+		if (table->hashes[i])
 			{
-			table->callbacks.release(table, node->key);
-			next = node->next;
-			free(node);
-			node = next;
-		}	}
+			void *key = table->keys[i];
+
+			table->hashes[i] = 0;
+			table->keys[i] = NULL;
+			table->callbacks.release(table, key);
+			}
 
     table->itemsCount = 0;
 }
@@ -166,18 +231,14 @@ BOOL
 NSCompareHashTables(NSHashTable *table1, NSHashTable *table2)
 {
 	NSUInteger i;											// Compare Tables
-	struct _NSHashNode *node1;
 	
-    if (table1->hashSize != table2->hashSize)
+    if (table1->itemsCount != table2->itemsCount)
 		return NO;
     for (i = 0; i < table1->hashSize; i++)
-		{ 
-		for (node1 = table1->nodes[i]; node1; node1 = node1->next) 
-	    	if (NSHashGet(table2, node1->key) == NULL)
-				return NO;
-		}
+		if (table1->hashes[i] && NSHashGet(table2, table1->keys[i]) == NULL)
+			return NO;
 
-    return YES;;
+    return YES;
 }	
 
 NSUInteger
@@ -186,26 +247,21 @@ NSCountHashTable(NSHashTable *table)			{ return table->itemsCount;	}
 void *
 NSHashGet(NSHashTable *table, const void *pointer)
 {
-	struct _NSHashNode *node;								// Retrieve Items
-
-	node =table->nodes[table->callbacks.hash(table,pointer) % table->hashSize];
-    for(; node; node = node->next)
-        if(table->callbacks.isEqual(table, pointer, node->key))
-            return node->key;
+	NSUInteger h = _NSMixHash(table->callbacks.hash(table, pointer));
+	NSInteger i = _NSHashFind(table, pointer, h);			// Retrieve Items
 
-    return NULL;
+    return (i >= 0) ? table->keys[i] : NULL;
 }
 
 NSArray *
 NSAllHashTableObjects(NSHashTable *table)
 {
 	id array = [NSMutableArray arrayWithCapacity:table->itemsCount];
-	struct _NSHashNode *node;
 	NSUInteger i;
 
     for(i = 0; i < table->hashSize; i++)
-		for(node = table->nodes[i]; node; node = node->next)
-			[array addObject:(NSObject*)(node->key)];
+		if (table->hashes[i])
+			[array addObject:(NSObject*)(table->keys[i])];
 
     return array;
 }
@@ -213,150 +269,82 @@ NSAllHashTableObjects(NSHashTable *table)
 NSHashEnumerator 
 NSEnumerateHashTable(NSHashTable *table)
 {
-    return (NSHashEnumerator){table, NULL, -1};
+    return (NSHashEnumerator){table, 0};
 }
 
 void *
 NSNextHashEnumeratorItem(NSHashEnumerator *en)
 {
-    if(en->node)
-		en->node = en->node->next;
-    if(en->node == NULL)
-		{
-		for(en->bucket++; ((NSUInteger)en->bucket) < en->table->hashSize;
-				en->bucket++)
-			if (en->table->nodes[en->bucket])
-				{
-				en->node = en->table->nodes[en->bucket];
-				break;
-				};
-
-		if (((NSUInteger)en->bucket) >= en->table->hashSize)
-			{
-			en->node = NULL;
-			en->bucket = en->table->hashSize - 1;
+	NSHashTable *table = en->table;
 
-			return NULL;
-		}	}
+    for (; en->bucket < table->hashSize; en->bucket++)
+		if (table->hashes[en->bucket])
+			return table->keys[en->bucket++];
 
-    return en->node->key;
-}
-
-static void 
-_NSHashGrow(NSHashTable *table, NSUInteger newSize)
-{
-	NSUInteger i;
-	struct _NSHashNode **newNodeTable =calloc(newSize,sizeof(struct _NSHashNode*));
-    
-    for(i = 0; i < table->hashSize; i++) 
-		{
-		struct _NSHashNode *next, *node;
-		NSUInteger h;
-
-		node = table->nodes[i];
-		while(node) 
-			{
-			next = node->next;
-			h = table->callbacks.hash(table, node->key) % newSize;
-			node->next = newNodeTable[h];
-			newNodeTable[h] = node;
-			node = next;
-		}	}
-
-    free(table->nodes);
-	table->nodes = newNodeTable;
-    table->hashSize = newSize;
+    return NULL;
 }
 
 void 
 NSHashInsert(NSHashTable *table, const void *pointer)
 {
 	NSUInteger h;
-	struct _NSHashNode *node;
+	NSInteger i;
 
     if (pointer == nil)
 		[NSException raise: NSInvalidArgumentException
         			 format: @"Nil object to be added in NSHashTable."];
 
-    h = table->callbacks.hash(table, pointer) % table->hashSize;
-    for(node = table->nodes[h]; node; node = node->next)
-        if(table->callbacks.isEqual(table, pointer, node->key))
-            break;
-						// Check if an entry for key exists in nodeTable.
-    if(node)
+    h = _NSMixHash(table->callbacks.hash(table, pointer));
+						// Check if an entry for key exists in the table.
+    if ((i = _NSHashFind(table, pointer, h)) >= 0)
 		{							// key exists. Set new value and 
-		if (pointer != node->key)	// return it's old value of it
+		void *old = table->keys[i];	// release it's old value
+
+		table->keys[i] = (void*)pointer;
+		if (pointer != old)
 			{
 			table->callbacks.retain(table, pointer);
-			table->callbacks.release(table, node->key);
+			table->callbacks.release(table, old);
 			}
-		node->key = (void*)pointer;
 
         return;
 		}
-					// key not found. Allocate a new bucket and initialize it.
-    node = malloc(sizeof(struct _NSHashNode));
-	table->callbacks.retain(table, pointer);
-    node->key = (void*)pointer;
-    node->next = table->nodes[h];
-    table->nodes[h] = node;
 
-    _NSCheckHashTableFull(table);
+	_NSHashAdd(table, h, pointer);		// key not found, add it to the table
 }
 
 void 
 NSHashInsertKnownAbsent(NSHashTable *table, const void *pointer)
 {
 	NSUInteger h;
-	struct _NSHashNode *node;
 
     if (pointer == nil)
 		[NSException raise: NSInvalidArgumentException
         			 format: @"Nil object to be added in NSHashTable."];
 
-    h = table->callbacks.hash(table, pointer) % table->hashSize;
-    for(node = table->nodes[h]; node; node = node->next)
-        if(table->callbacks.isEqual(table, pointer, node->key))
-            break;
-
-    if(node)				// Check if an entry for key exist in nodeTable.
-		[NSException raise: NSInvalidArgumentException
+    h = _NSMixHash(table->callbacks.hash(table, pointer));
+    if (_NSHashFind(table, pointer, h) >= 0)		// Check if an entry for 
+		[NSException raise: NSInvalidArgumentException	// key exists in table
         			 format: @"Nil object already existing in NSHashTable."];
-							// key not found. Alloc and init a new bucket
-    node = malloc(sizeof(struct _NSHashNode));
-	table->callbacks.retain(table, pointer);
-    node->key = (void*)pointer;
-    node->next = table->nodes[h];
-    table->nodes[h] = node;
 
-    _NSCheckHashTableFull(table);
+	_NSHashAdd(table, h, pointer);
 }
 
 void *
 NSHashInsertIfAbsent(NSHashTable *table, const void *pointer)
 {
 	NSUInteger h;
-	struct _NSHashNode *node;
+	NSInteger i;
 
     if (pointer == nil)
 		[NSException raise: NSInvalidArgumentException
         			 format: @"Nil object to be added in NSHashTable."];
 
-    h = table->callbacks.hash(table, pointer) % table->hashSize;
-    for(node = table->nodes[h]; node; node = node->next)
-        if(table->callbacks.isEqual(table, pointer, node->key))
-            break;
-
-    if(node)				// Check if an entry for key exist in nodeTable.
-		return node->key;
-							// key not found. Alloc and init a new bucket
-    node = malloc(sizeof(struct _NSHashNode));
-    table->callbacks.retain(table, pointer);
-    node->key = (void*)pointer;
-    node->next = table->nodes[h];
-    table->nodes[h] = node;
-
-    _NSCheckHashTableFull(table);
+    h = _NSMixHash(table->callbacks.hash(table, pointer));
+    if ((i = _NSHashFind(table, pointer, h)) >= 0)	// Check if an entry for
+		return table->keys[i];						// key exists in table
+
+	_NSHashAdd(table, h, pointer);
     
     return NULL;
 }
@@ -365,40 +353,32 @@ void
 NSHashRemove(NSHashTable *table, const void *pointer)
 {
 	NSUInteger h;
-	struct _NSHashNode *node, *node1 = NULL;
+	NSInteger i;
 
     if (pointer == nil)
 	    return;
 
-    h = table->callbacks.hash(table, pointer) % table->hashSize;
-    			// node points to current bucket, and node1 to previous bucket 
-				// or to NULL if current node is the first node in the list 
-    for(node = table->nodes[h]; node; node1 = node, node = node->next)
-        if(table->callbacks.isEqual(table, pointer, node->key))
-			{
-			table->callbacks.release(table, node->key);
-            if(!node1)
-                table->nodes[h] = node->next;
-            else
-                node1->next = node->next;
-			free(node);
-			(table->itemsCount)--;
-	
-			return;
-			}
+    h = _NSMixHash(table->callbacks.hash(table, pointer));
+    if ((i = _NSHashFind(table, pointer, h)) >= 0)
+		{
+		void *key = table->keys[i];
+						// unlink before release in case release reenters us
+		_NSHashDelete(table, i);
+		(table->itemsCount)--;
+		table->callbacks.release(table, key);
+		}
 }
 
 NSString *
 NSStringFromHashTable(NSHashTable *table)
 {
 	id ret = [NSMutableString new];				// Get a String Representation
-	struct _NSHashNode *node;
 	NSUInteger i;
 
     for (i = 0; i < table->hashSize; i++)
-		for (node = table->nodes[i]; node; node = node->next) 
+		if (table->hashes[i])
 			{
-	    	[ret appendString:table->callbacks.describe(table, node->key)];
+	    	[ret appendString:table->callbacks.describe(table, table->keys[i])];
 	    	[ret appendString:@" "];
 			}
     
@@ -411,19 +391,124 @@ NSStringFromHashTable(NSHashTable *table)
 
 ** ***************************************************************************/
 
+static void
+_NSMapAllocSlots(NSMapTable *table, NSUInteger size)
+{
+	table->hashes = calloc(size, sizeof(NSUInteger) + 2 * sizeof(void*));
+	table->keys = (void **)(table->hashes + size);
+	table->values = table->keys + size;
+	table->hashSize = size;
+}
+
+static NSInteger
+_NSMapFind(NSMapTable *table, const void *key, NSUInteger h)
+{
+	NSUInteger mask = table->hashSize - 1;
+	NSUInteger i = h & mask;
+	NSUInteger d;
+
+	for (d = 0; ; d++, i = (i + 1) & mask)
+		{
+		NSUInteger sh = table->hashes[i];
+
+		if (sh == 0 || ((i - sh) & mask) < d)
+			return -1;
+		if (sh == h && table->keyCallbacks.isEqual(table, key, table->keys[i]))
+			return i;
+		}
+}
+
+static void
+_NSMapPlace(NSMapTable *table, NSUInteger h, void *key, void *value)
+{
+	NSUInteger mask = table->hashSize - 1;
+	NSUInteger i = h & mask;
+	NSUInteger d;
+
+	for (d = 0; ; d++, i = (i + 1) & mask)
+		{
+		NSUInteger sh = table->hashes[i];
+		NSUInteger sd;
+
+		if (sh == 0)
+			{
+			table->hashes[i] = h;
+			table->keys[i] = key;
+			table->values[i] = value;
+
+			return;
+			}
+		if ((sd = (i - sh) & mask) < d)
+			{
+			void *k = table->keys[i];
+			void *v = table->values[i];
+
+			table->hashes[i] = h;
+			table->keys[i] = key;
+			table->values[i] = value;
+			h = sh;
+			key = k;
+			value = v;
+			d = sd;
+		}	}
+}
+
+static void
+_NSMapDelete(NSMapTable *table, NSUInteger i)
+{
+	NSUInteger mask = table->hashSize - 1;
+	NSUInteger j = (i + 1) & mask;
+
+	while (table->hashes[j] != 0 && ((j - table->hashes[j]) & mask) != 0)
+		{
+		table->hashes[i] = table->hashes[j];
+		table->keys[i] = table->keys[j];
+		table->values[i] = table->values[j];
+		i = j;
+		j = (j + 1) & mask;
+		}
+
+	table->hashes[i] = 0;
+	table->keys[i] = NULL;
+	table->values[i] = NULL;
+}
+
+static void 
+_NSMapGrow(NSMapTable *table, NSUInteger newSize)
+{
+	NSUInteger i, oldSize = table->hashSize;
+	NSUInteger *oldHashes = table->hashes;
+	void **oldKeys = table->keys;
+	void **oldValues = table->values;
+
+	_NSMapAllocSlots(table, newSize);
+	for (i = 0; i < oldSize; i++)
+		if (oldHashes[i])
+			_NSMapPlace(table, oldHashes[i], oldKeys[i], oldValues[i]);
+
+	free(oldHashes);
+}
+
+static void
+_NSMapAdd(NSMapTable *table, NSUInteger h, const void *key, const void *value)
+{
+	if (table->itemsCount + 1 > MAX_LOAD(table->hashSize))
+		_NSMapGrow(table, table->hashSize << 1);
+
+    table->keyCallbacks.retain(table, key);
+	table->valueCallbacks.retain(table, value);
+	_NSMapPlace(table, h, (void*)key, (void*)value);
+	table->itemsCount++;
+}
+
 NSMapTable *
 NSCreateMapTable(NSMapTableKeyCallBacks keyCallbacks, 
 				 NSMapTableValueCallBacks valueCallbacks, 
 				 NSUInteger capacity)
 {
 	NSMapTable *t = malloc(sizeof(NSMapTable));
-    
-    capacity = capacity ? capacity : 13;
-    if (!is_prime(capacity))
-		capacity = nextPrime(capacity);
 
-    t->hashSize = capacity;
-    t->nodes = calloc(t->hashSize, sizeof(void*));
+    _NSMapAllocSlots(t, _NSTableSizeForCapacity(capacity));
     t->itemsCount = 0;
     t->keyCallbacks = keyCallbacks;
     t->valueCallbacks = valueCallbacks;
@@ -450,29 +535,22 @@ NSCreateMapTable(NSMapTableKeyCallBacks keyCallbacks,
 NSMapTable *
 NSCopyMapTable(NSMapTable *table)
 {
-	NSMapTable *new;
-	struct _NSMapNode *oldnode, *newnode;
+	NSMapTable *new = malloc(sizeof(NSMapTable));
 	NSUInteger i;
 
-    new = malloc(sizeof(NSMapTable));
-    new->hashSize = table->hashSize;
+    _NSMapAllocSlots(new, table->hashSize);
     new->itemsCount = table->itemsCount;
     new->keyCallbacks = table->keyCallbacks;
     new->valueCallbacks = table->valueCallbacks;
-    new->nodes = calloc(new->hashSize, sizeof(void*));
+    memcpy(new->hashes, table->hashes,
+		   table->hashSize * (sizeof(NSUInteger) + 2 * sizeof(void*)));
 
     for (i = 0; i < new->hashSize; i++) 
-		{
-		for (oldnode = table->nodes[i]; oldnode; oldnode = oldnode->next) 
+		if (new->hashes[i])
 			{
-			newnode = malloc(sizeof(struct _NSMapNode));
-			newnode->key = oldnode->key;
-			newnode->value = oldnode->value;
-			newnode->next = new->nodes[i];
-			new->nodes[i] = newnode;
-			table->keyCallbacks.retain(new, oldnode->key);
-			table->valueCallbacks.retain(new, oldnode->value);
-		}	}
+			table->keyCallbacks.retain(new, new->keys[i]);
+			table->valueCallbacks.retain(new, new->values[i]);
+			}
 
     return new;
 }
@@ -481,7 +559,7 @@ void
 NSFreeMapTable(NSMapTable *table)
 {															// Free a Table
     NSResetMapTable(table);
-    free(table->nodes);
+    free(table->hashes);
     free(table);
 }
 
@@ -491,19 +569,17 @@ NSResetMapTable(NSMapTable *table)
 	NSUInteger i;
 
     for(i = 0; i < table->hashSize; i++)
-		{
-		struct _NSMapNode *next, *node;
-
-		node = table->nodes[i];
-		table->nodes[i] = NULL;
-		while (node)
+		if (table->hashes[i])
 			{
-			table->keyCallbacks.release(table, node->key);
-			table->valueCallbacks.release(table, node->value);
-			next = node->next;
-			free(node);
-			node = next;
-		}	}
+			void *key = table->keys[i];
+			void *value = table->values[i];
+
+			table->hashes[i] = 0;
+			table->keys[i] = NULL;
+			table->values[i] = NULL;
+			table->keyCallbacks.release(table, key);
+			table->valueCallbacks.release(table, value);
+			}
 
     table->itemsCount = 0;
 }
@@ -512,13 +588,12 @@ BOOL
 NSCompareMapTables(NSMapTable *table1, NSMapTable *table2)
 {
 	NSUInteger i;										// Compare Two Tables
-	struct _NSMapNode *node1;
 
-    if (table1->hashSize != table2->hashSize)
+    if (table1->itemsCount != table2->itemsCount)
 		return NO;
     for (i = 0; i < table1->hashSize; i++) 
-		for (node1 = table1->nodes[i]; node1; node1 = node1->next)
-			if (NSMapGet(table2, node1->key) != node1->value)
+		if (table1->hashes[i])
+			if (NSMapGet(table2, table1->keys[i]) != table1->values[i])
 				return NO;
 
     return YES;
@@ -530,79 +605,59 @@ NSCountMapTable(NSMapTable *table)			{ return table->itemsCount; }
 BOOL 
 NSMapMember(NSMapTable *table, const void *key,void **originalKey,void **value)
 {
-	struct _NSMapNode *node;
+	NSUInteger h = _NSMixHash(table->keyCallbacks.hash(table, key));
+	NSInteger i = _NSMapFind(table, key, h);
 
-	node = table->nodes[table->keyCallbacks.hash(table,key) % table->hashSize];
-    for(; node; node = node->next)
-        if(table->keyCallbacks.isEqual(table, key, node->key)) 
-			{
-            *originalKey = node->key;
-			*value = node->value;
+    if (i < 0)
+		return NO;
 
-			return YES;
-			}
+	*originalKey = table->keys[i];
+	*value = table->values[i];
 
-    return NO;
+	return YES;
 }
 
 void *
 NSMapGet(NSMapTable *table, const void *key)
 {
-	struct _NSMapNode *node;
-
-	node = table->nodes[table->keyCallbacks.hash(table,key) % table->hashSize];
-    for(; node; node = node->next)
-        if(table->keyCallbacks.isEqual(table, key, node->key))
-            return node->value;
+	NSUInteger h = _NSMixHash(table->keyCallbacks.hash(table, key));
+	NSInteger i = _NSMapFind(table, key, h);
 
-    return NULL;
+    return (i >= 0) ? table->values[i] : NULL;
 }
 
 NSMapEnumerator 
 NSEnumerateMapTable(NSMapTable *table)
 {
-    return (NSMapEnumerator){table, NULL, -1};
+    return (NSMapEnumerator){table, 0};
 }
 
 BOOL 
 NSNextMapEnumeratorPair(NSMapEnumerator *en, void **key, void **value)
 {
-    if(en->node)
-		en->node = en->node->next;
-    if(en->node == NULL)
-		{
-		en->bucket++;
-		for (; (NSUInteger)en->bucket < en->table->hashSize; en->bucket++)
-			if (en->table->nodes[en->bucket])
-				{
-				en->node = en->table->nodes[en->bucket];
-				break;
-				};
-
-		if ((NSUInteger)en->bucket >= en->table->hashSize)
-			{
-			en->node = NULL;
-			en->bucket = en->table->hashSize - 1;
+	NSMapTable *table = en->table;
 
-			return NO;
-		}	}
+    for (; en->bucket < table->hashSize; en->bucket++)
+		if (table->hashes[en->bucket])
+			{
+			*key = table->keys[en->bucket];
+			*value = table->values[en->bucket++];
 
-    *key = en->node->key;
-    *value = en->node->value;
+			return YES;
+			}
 
-    return YES;
+    return NO;
 }
 
 NSArray *
 NSAllMapTableKeys(NSMapTable *table)
 {
 	id array = [NSMutableArray arrayWithCapacity:table->itemsCount];
-	struct _NSMapNode *node;
 	NSUInteger i;
 
     for(i = 0; i < table->hashSize; i++)
-		for(node = table->nodes[i]; node; node=node->next)
-			[array addObject:(NSObject*)(node->key)];
+		if (table->hashes[i])
+			[array addObject:(NSObject*)(table->keys[i])];
 
     return array;
 }
@@ -611,112 +666,66 @@ NSArray *
 NSAllMapTableValues(NSMapTable *table)
 {
 	id array = [NSMutableArray arrayWithCapacity:table->itemsCount];
-	struct _NSMapNode *node;
 	NSUInteger i;
 
     for(i = 0; i < table->hashSize; i++)
-		for(node = table->nodes[i]; node; node = node->next)
-			[array addObject:(NSObject*)(node->value)];
+		if (table->hashes[i])
+			[array addObject:(NSObject*)(table->values[i])];
 
     return array;
 }
 
-static void 
-_NSMapGrow(NSMapTable *table, NSUInteger newSize)
-{
-	NSUInteger i;
-	struct _NSMapNode **newNodeTable = calloc(newSize, sizeof(struct _NSMapNode*));
-    
-    for(i = 0; i < table->hashSize; i++) 
-		{
-		struct _NSMapNode *next, *node;
-		NSUInteger h;
-
-		node = table->nodes[i];
-		while(node) 
-			{
-			next = node->next;
-			h = table->keyCallbacks.hash(table, node->key) % newSize;
-			node->next = newNodeTable[h];
-			newNodeTable[h] = node;
-			node = next;
-		}	}
-
-    free(table->nodes);
-    table->nodes = newNodeTable;
-    table->hashSize = newSize;
-}
-
 void 
 NSMapInsert(NSMapTable *table, const void *key, const void *value)
 {
 	NSUInteger h;
-	struct _NSMapNode *node;
+	NSInteger i;
 
 	if (key == table->keyCallbacks.notAKeyMarker)
 		[NSException raise: NSInvalidArgumentException
         			 format: @"Invalid key to be added in NSMapTable."];
 
-    h = table->keyCallbacks.hash(table, key) % table->hashSize;
-    for(node = table->nodes[h]; node; node = node->next)
-        if(table->keyCallbacks.isEqual(table, key, node->key))
-            break;
+    h = _NSMixHash(table->keyCallbacks.hash(table, key));
 											// Check if an entry for key exists
-    if(node) 								// in nodeTable.
-		{									
-		if (key != node->key) 				// key exists.  Set it's new value
-			{								// and release the old value.
+    if ((i = _NSMapFind(table, key, h)) >= 0)			// in the table.
+		{
+		void *oldKey = table->keys[i];
+		void *oldValue = table->values[i];
+
+		table->keys[i] = (void*)key;		// key exists.  Set it's new value
+		table->values[i] = (void*)value;	// and release the old value.
+		if (key != oldKey)
+			{
 			table->keyCallbacks.retain(table, key);
-			table->keyCallbacks.release(table, node->key);
+			table->keyCallbacks.release(table, oldKey);
 			}
-		if (value != node->value) 
+		if (value != oldValue) 
 			{
 			table->valueCallbacks.retain(table, value);
-			table->valueCallbacks.release(table, node->value);
+			table->valueCallbacks.release(table, oldValue);
 			}
-		node->key = (void*)key;
-		node->value = (void*)value;
 
 		return;
 		}
 
-    node = malloc(sizeof(struct _NSMapNode));	// key not found so allocate a
-    table->keyCallbacks.retain(table, key);		// new bucket for the key
-	table->valueCallbacks.retain(table, value);
-    node->key = (void*)key;
-    node->value = (void*)value;
-    node->next = table->nodes[h];
-    table->nodes[h] = node;
-
-    _NSCheckMapTableFull(table);
+	_NSMapAdd(table, h, key, value);		// key not found so add it
 }
 
 void *
 NSMapInsertIfAbsent(NSMapTable *table, const void *key,const void *value)
 {
 	NSUInteger h;
-	struct _NSMapNode *node;
+	NSInteger i;
 
     if (key == table->keyCallbacks.notAKeyMarker)
 		[NSException raise: NSInvalidArgumentException
         			 format: @"Invalid key to be added in NSMapTable."];
 
-    h = table->keyCallbacks.hash(table, key) % table->hashSize;
-    for(node = table->nodes[h]; node; node = node->next)
-        if(table->keyCallbacks.isEqual(table, key, node->key))
-            break;								// Check if key already exists
-    if(node)									// in the nodeTable and return
-        return node->key;						// it if it does.
-
-    node = malloc(sizeof(struct _NSMapNode));	// key not found, alloc a new
-    table->keyCallbacks.retain(table, key);		// bucket for the key
-    table->valueCallbacks.retain(table, value);
-    node->key = (void*)key;
-    node->value = (void*)value;
-    node->next = table->nodes[h];
-    table->nodes[h] = node;
+    h = _NSMixHash(table->keyCallbacks.hash(table, key));
+    if ((i = _NSMapFind(table, key, h)) >= 0)	// Check if key already exists
+		return table->keys[i];					// and return it if it does.
 
-    _NSCheckMapTableFull(table);
+	_NSMapAdd(table, h, key, value);
 
     return NULL;
 }
@@ -725,74 +734,53 @@ void
 NSMapInsertKnownAbsent(NSMapTable *table, const void *key, const void *value)
 {
 	NSUInteger h;
-	struct _NSMapNode *node;
 
     if (key == table->keyCallbacks.notAKeyMarker)
 		[NSException raise: NSInvalidArgumentException
         			 format: @"Invalid key to be added in NSMapTable."];
 
-    h = table->keyCallbacks.hash(table, key) % table->hashSize;
-    for(node = table->nodes[h]; node; node = node->next)
-        if(table->keyCallbacks.isEqual(table, key, node->key))
-            break;
-
-    if(node) 				// Check if an entry for key exists in nodeTable
+    h = _NSMixHash(table->keyCallbacks.hash(table, key));
+    if (_NSMapFind(table, key, h) >= 0)	// Check if an entry for key exists
 		[NSException raise: NSInvalidArgumentException
         			 format: @"Nil object already existing in NSMapTable."];
 
-    node = malloc(sizeof(struct _NSMapNode));	// key not found, alloc a new
-    table->keyCallbacks.retain(table, key);		// bucket for the key
-    table->valueCallbacks.retain(table, value);
-    node->key = (void*)key;
-    node->value = (void*)value;
-    node->next = table->nodes[h];
-    table->nodes[h] = node;
-
-    _NSCheckMapTableFull(table);
+	_NSMapAdd(table, h, key, value);
 }
 
 void 
 NSMapRemove(NSMapTable *table, const void *key)
 {
 	NSUInteger h;
-	struct _NSMapNode *node, *node1 = NULL;
+	NSInteger i;
 
     if (key == nil)
 	    return;
 
-    h = table->keyCallbacks.hash(table, key) % table->hashSize;
-
-    			// node points to current bucket, and node1 to previous bucket 
-				// or to NULL if current node is the first node in the list 
-    for(node = table->nodes[h]; node; node1 = node, node = node->next)
-        if(table->keyCallbacks.isEqual(table, key, node->key)) 
-			{
-	    	table->keyCallbacks.release(table, node->key);
-	    	table->valueCallbacks.release(table, node->value);
-            if(!node1)
-                table->nodes[h] = node->next;
-            else
-                node1->next = node->next;
-	    	free(node);
-	    	(table->itemsCount)--;
-
-	    	return;
-        	}
+    h = _NSMixHash(table->keyCallbacks.hash(table, key));
+    if ((i = _NSMapFind(table, key, h)) >= 0)
+		{
+		void *oldKey = table->keys[i];
+		void *oldValue = table->values[i];
+						// unlink before release in case release reenters us
+		_NSMapDelete(table, i);
+		(table->itemsCount)--;
+	    table->keyCallbacks.release(table, oldKey);
+	    table->valueCallbacks.release(table, oldValue);
+		}
 }
 
 NSString *
 NSStringFromMapTable(NSMapTable *table)
 {
 	id ret = [NSMutableString new];
-	struct _NSMapNode *node;
 	NSUInteger i;
 
     for (i = 0; i < table->hashSize; i++)
-	  for (node = table->nodes[i]; node; node = node->next) 
+	  if (table->hashes[i])
 		{
-	    [ret appendString:table->keyCallbacks.describe(table, node->key)];
+	    [ret appendString:table->keyCallbacks.describe(table, table->keys[i])];
 	    [ret appendString:@"="];
-	    [ret appendString:table->valueCallbacks.describe(table, node->value)];
+	    [ret appendString:table->valueCallbacks.describe(table, table->values[i])];
 	    [ret appendString:@"\n"];
 		}
 
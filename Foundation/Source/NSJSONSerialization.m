@@ -22,9 +22,11 @@
 #include <Foundation/NSDictionary.h>
 #include <Foundation/NSEnumerator.h>
 #include <Foundation/NSException.h>
-#include <Foundation/NSScanner.h>
-#include <Foundation/NSCharacterSet.h>
-#include <math.h>
+#include <Foundation/NSStream.h>
+#include <Foundation/NSFileHandle.h>
+#include <Foundation/NSAutoreleasePool.h>
+
+#include <errno.h>
 
 #define PP_INDENT  4
 
@@ -240,167 +242,776 @@ _isUnicodeDataUTF8(const char *bytes, unsigned int length)
 	return YES;												// UTF-8
 }
 
-@interface NSScanner (NSPropertyList)
-
-- (NSString *) _propertyListScanQuotedString;
+/* ****************************************************************************
 
-- (id) _scanLeafWithOptions:(NSJSONReadingOptions)opts error:(NSError **)error;
-- (id) _scanArrayWithOptions:(NSJSONReadingOptions)opt error:(NSError **)error;
-- (id) _scanDictionaryWithOptions:(NSJSONReadingOptions)options
-							error:(NSError **)error;
-@end
+	JSON reader
 
-@implementation NSScanner  (DeserializeJSON)
+	Recursive descent over the raw UTF-8 bytes.  NSData is parsed in place,
+	streams and file handles are read through a fixed size window so memory
+	is bounded by the objects produced rather than by the input.  String
+	bodies are scanned eight bytes at a time, parsed values are held +1 on
+	a stack and handed to the container initializers in one call, and short
+	dictionary keys are interned so that repeated keys share one string.
 
-static NSCharacterSet *__numbers = nil;	// @"0123456789Ee.-+"
+** ***************************************************************************/
 
-- (NSString *) _scanNumberString
+#define JSON_WINDOW			(64 * 1024)		// stream read size
+#define JSON_MAX_DEPTH		512				// nesting limit
+#define KEY_CACHE_SIZE		256				// interned keys, direct mapped
+#define KEY_CACHE_MAXLEN	48				// longest key that is interned
+
+typedef struct _JSONKey {
+	unsigned int hash;
+	unsigned int length;
+	NSString *string;
+	unsigned char bytes[KEY_CACHE_MAXLEN];
+} _JSONKey;
+
+typedef struct _JSONStack {
+	id *items;
+	NSUInteger count;
+	NSUInteger size;
+} _JSONStack;
+
+typedef struct _JSONReader {
+	const unsigned char *p;					// next unread byte
+	const unsigned char *end;				// end of buffered bytes
+	const unsigned char *start;				// start of buffered bytes
+	unsigned long long offset;				// input consumed before start
+	unsigned char *window;					// stream buffer, NULL for NSData
+	id stream;								// NSInputStream or NSFileHandle
+	BOOL isFileHandle;
+	NSJSONReadingOptions options;
+	NSString *error;						// first error encountered
+	unsigned int depth;
+	unsigned char *scratch;					// unescaped string, number text
+	NSUInteger scratchLength;
+	NSUInteger scratchSize;
+	_JSONStack values;						// array elements, object values
+	_JSONStack keys;						// object keys
+	_JSONKey *interned;
+} _JSONReader;
+
+static const unsigned char __jsonSpace[256] = {
+	[' '] = 1, ['\t'] = 1, ['\n'] = 1, ['\r'] = 1
+};
+
+static const unsigned char __jsonNumber[256] = {
+	['0' ... '9'] = 1, ['-'] = 1, ['+'] = 1, ['.'] = 1, ['e'] = 1, ['E'] = 1
+};
+
+static id __jsonTrue = nil;
+static id __jsonFalse = nil;
+static id __jsonNull = nil;
+
+
+static id
+_JSONError(_JSONReader *r, NSString *reason)
 {
-	NSString *str;
-	if(!__numbers)
-		__numbers=[[NSCharacterSet characterSetWithCharactersInString:@"0123456789Ee.-+"] retain];
-	if([self scanCharactersFromSet:__numbers intoString:&str])
-		return str;	// at least one
+	if (!r->error)
+		{
+		unsigned long long at = r->offset + (r->p - r->start);
+
+		r->error = [NSString stringWithFormat:@"%@ at offset %llu", reason, at];
+		}
 
 	return nil;
 }
 
-/* ****************************************************************************
+static BOOL
+_JSONFill(_JSONReader *r)					// refill the window from stream
+{
+	NSInteger n = 0;
 
-	leaf can be of any JSON type  (order scan by likelihood of each type):
+	if (r->stream == nil)
+		return NO;
 
-	dict {}, array [], number 0123456789 true false, null, string " "
+	if (r->isFileHandle)
+		{
+		NSAutoreleasePool *arp = [NSAutoreleasePool new];
+		NSData *d = [r->stream readDataOfLength: JSON_WINDOW];
 
-** ***************************************************************************/
+		if ((n = [d length]) > 0)
+			memcpy(r->window, [d bytes], n);
+		[arp release];
+		}
+	else
+		n = [r->stream read:r->window maxLength:JSON_WINDOW];
 
-- (id) _scanLeafWithOptions:(NSJSONReadingOptions)options
-					  error:(NSError **)error
+	r->offset += (r->end - r->start);
+	r->p = r->start = r->end = r->window;
+	if (n <= 0)
+		{
+		if (n < 0)
+			_JSONError(r, @"JSON stream read error");
+		r->stream = nil;
+
+		return NO;
+		}
+	r->end = r->window + n;
+
+	return YES;
+}
+
+static inline int
+_JSONNext(_JSONReader *r)
 {
-	id leaf = nil;
-	long long lval = 0;
-	double dval = 0;
+	return (r->p < r->end || _JSONFill(r)) ? *r->p++ : -1;
+}
 
-	if ([self scanString:@"\"" intoString:NULL])		// quoted string
+static inline int
+_JSONSkipSpace(_JSONReader *r)				// return next non-space byte
+{											// without consuming it, or -1
+	do {
+		const unsigned char *p = r->p;
+
+		while (p < r->end && __jsonSpace[*p])
+			p++;
+		if ((r->p = p) < r->end)
+			return *p;
+		} while (_JSONFill(r));
+
+	return -1;
+}
+
+static void
+_JSONAppend(_JSONReader *r, const void *bytes, NSUInteger length)
+{
+	if (r->scratchLength + length >= r->scratchSize)
 		{
-		leaf = [self _propertyListScanQuotedString];
+		NSUInteger size = r->scratchSize ? r->scratchSize * 2 : 256;
+
+		while (r->scratchLength + length >= size)
+			size *= 2;
+		r->scratch = realloc(r->scratch, r->scratchSize = size);
 		}
-	else if ([self scanLongLong: &lval])
+	memcpy(r->scratch + r->scratchLength, bytes, length);
+	r->scratchLength += length;
+}
+
+static inline void
+_JSONPush(_JSONStack *s, id object)
+{
+	if (s->count == s->size)
 		{
-		leaf = [NSNumber numberWithLong: lval];
+		s->size = s->size ? s->size * 2 : 64;
+		s->items = realloc(s->items, s->size * sizeof(id));
 		}
-	else if ([self scanDouble: &dval])
+	s->items[s->count++] = object;
+}
+
+static void
+_JSONPop(_JSONStack *s, NSUInteger base)	// release items above base
+{
+	while (s->count > base)
+		[s->items[--(s->count)] release];
+}
+
+/* ****************************************************************************
+
+	Strings.  A string body is plain while it holds no '"', '\\', control
+	or non-ASCII byte.  Words are tested for any of these at once with the
+	usual SWAR zero byte tricks and the byte loop only runs near the end of
+	a plain run.  Escape free strings are copied once, straight from the
+	input into the new string's own buffer.
+
+** ***************************************************************************/
+
+#define ONES			((uint64_t)0x0101010101010101ULL)
+#define HIGHS			((uint64_t)0x8080808080808080ULL)
+#define HAS_LESS(w, n)	(((w) - ONES * (n)) & ~(w) & HIGHS)
+#define HAS_BYTE(w, b)	HAS_LESS((w) ^ (ONES * (b)), 1)
+
+static inline const unsigned char *
+_JSONScanPlain(const unsigned char *p, const unsigned char *end)
+{
+	for (; end - p >= 8; p += 8)
 		{
-		dval = floor(dval * 100000000) / 100000000; 	// limit precision to
-		leaf = [NSNumber numberWithDouble: dval];		// 8 decimal places
+		uint64_t w;
+
+		memcpy(&w, p, 8);
+		if (HAS_BYTE(w, '"') | HAS_BYTE(w, '\\') | HAS_LESS(w, 0x20)
+				| (w & HIGHS))
+			break;
 		}
-//	else if (leaf = [self _scanNumberString])
-//		{
-//		leaf = [NSNumber numberWithLong: [leaf intValue]];
-//		}
-	if([self scanString:@"{" intoString:NULL])			// dictionary
+
+	while (p < end && *p >= 0x20 && *p < 0x80 && *p != '"' && *p != '\\')
+		p++;
+
+	return p;
+}
+
+static int
+_JSONHex4(_JSONReader *r)
+{
+	int i, v = 0;
+
+	for (i = 0; i < 4; i++)
 		{
-		leaf = [self _scanDictionaryWithOptions:options error:error];
+		int c = _JSONNext(r);
+
+		if (c >= '0' && c <= '9')
+			v = (v << 4) | (c - '0');
+		else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+			v = (v << 4) | ((c | 0x20) - 'a' + 10);
+		else
+			return -1;
 		}
-	else if([self scanString:@"[" intoString:NULL])		// array
+
+	return v;
+}
+
+static BOOL
+_JSONScanEscape(_JSONReader *r, BOOL *ascii)	// backslash consumed
+{
+	unsigned char u[4];
+	unsigned int cp;
+	int c, lo;
+
+	switch (c = _JSONNext(r))
 		{
-		leaf = [self _scanArrayWithOptions:options error:error];
+		case '"':
+		case '\\':
+		case '/':	u[0] = c;		break;
+		case 'b':	u[0] = '\b';	break;
+		case 'f':	u[0] = '\f';	break;
+		case 'n':	u[0] = '\n';	break;
+		case 'r':	u[0] = '\r';	break;
+		case 't':	u[0] = '\t';	break;
+		case 'u':
+			if ((c = _JSONHex4(r)) < 0)
+				return (_JSONError(r, @"Invalid \\u escape"), NO);
+
+			if (c >= 0xD800 && c < 0xDC00)		// high surrogate must be
+				{								// followed by a low one
+				if (_JSONNext(r) != '\\' || _JSONNext(r) != 'u'
+						|| (lo = _JSONHex4(r)) < 0xDC00 || lo > 0xDFFF)
+					return (_JSONError(r, @"Invalid surrogate pair"), NO);
+				cp = 0x10000 + ((c - 0xD800) << 10) + (lo - 0xDC00);
+				}
+			else if (c >= 0xDC00 && c < 0xE000)
+				return (_JSONError(r, @"Unpaired surrogate"), NO);
+			else
+				cp = c;
+
+			if (cp == 0 || cp >= 0x80)			// NUL can not live in a
+				*ascii = NO;					// C string
+
+			if (cp < 0x80)
+				{
+				u[0] = cp;
+				_JSONAppend(r, u, 1);
+				}
+			else if (cp < 0x800)
+				{
+				u[0] = 0xC0 | (cp >> 6);
+				u[1] = 0x80 | (cp & 0x3F);
+				_JSONAppend(r, u, 2);
+				}
+			else if (cp < 0x10000)
+				{
+				u[0] = 0xE0 | (cp >> 12);
+				u[1] = 0x80 | ((cp >> 6) & 0x3F);
+				u[2] = 0x80 | (cp & 0x3F);
+				_JSONAppend(r, u, 3);
+				}
+			else
+				{
+				u[0] = 0xF0 | (cp >> 18);
+				u[1] = 0x80 | ((cp >> 12) & 0x3F);
+				u[2] = 0x80 | ((cp >> 6) & 0x3F);
+				u[3] = 0x80 | (cp & 0x3F);
+				_JSONAppend(r, u, 4);
+				}
+			return YES;
+
+		default:
+			return (_JSONError(r, @"Invalid escape in string"), NO);
 		}
-	else if ([self scanString:@"true" intoString:NULL])
+
+	_JSONAppend(r, u, 1);
+
+	return YES;
+}
+
+static BOOL										// opening quote consumed,
+_JSONScanString(_JSONReader *r,					// on return bytes point at
+				const unsigned char **bytes,	// the input or the scratch
+				NSUInteger *length,				// buffer and are valid till
+				BOOL *ascii)					// the next scan
+{
+	const unsigned char *s = r->p;
+	const unsigned char *p = s;
+	BOOL copied = NO;
+
+	*ascii = YES;
+	r->scratchLength = 0;
+
+	for (;;)
 		{
-		leaf = [NSNumber numberWithBool: YES];
+		int c;
+
+		if ((p = _JSONScanPlain(p, r->end)) == r->end)
+			{
+			_JSONAppend(r, s, p - s);
+			copied = YES;
+			r->p = p;
+			if (!_JSONFill(r))
+				return (_JSONError(r, @"Unterminated string"), NO);
+			s = p = r->p;
+			}
+		else if ((c = *p) == '"')
+			{
+			r->p = p + 1;
+			if (copied)
+				{
+				_JSONAppend(r, s, p - s);
+				*bytes = r->scratch;
+				*length = r->scratchLength;
+				}
+			else
+				{
+				*bytes = s;
+				*length = p - s;
+				}
+
+			return YES;
+			}
+		else if (c >= 0x80)						// validated when converted
+			{
+			*ascii = NO;
+			for (p++; p < r->end && *p >= 0x80; p++);
+			}
+		else if (c == '\\')
+			{
+			_JSONAppend(r, s, p - s);
+			copied = YES;
+			r->p = p + 1;
+			if (!_JSONScanEscape(r, ascii))
+				return NO;
+			s = p = r->p;
+			}
+		else
+			{
+			r->p = p;
+			return (_JSONError(r, @"Control character in string"), NO);
+		}	}
+}
+
+static unichar *
+_JSONUTF16(const unsigned char *b, NSUInteger length, NSUInteger *count)
+{												// UTF-16 never needs more
+	unichar *u = malloc(sizeof(unichar) * (length + 1));	// units than UTF-8
+	const unsigned char *end = b + length;				// has bytes
+	NSUInteger k = 0;
+
+	while (b < end)
+		{
+		unsigned int c = *b++;
+		unsigned int n, min;
+
+		if (c < 0x80)
+			{
+			u[k++] = c;
+			continue;
+			}
+
+		if (c < 0xC2)
+			break;
+		else if (c < 0xE0)
+			n = 1, min = 0x80, c &= 0x1F;
+		else if (c < 0xF0)
+			n = 2, min = 0x800, c &= 0x0F;
+		else if (c < 0xF5)
+			n = 3, min = 0x10000, c &= 0x07;
+		else
+			break;
+
+		if ((NSUInteger)(end - b) < n)
+			break;
+		for (; n > 0 && (*b & 0xC0) == 0x80; n--)
+			c = (c << 6) | (*b++ & 0x3F);
+		if (n > 0 || c < min || c > 0x10FFFF || (c >= 0xD800 && c < 0xE000))
+			break;
+
+		if (c >= 0x10000)
+			{
+			c -= 0x10000;
+			u[k++] = 0xD800 + (c >> 10);
+			u[k++] = 0xDC00 + (c & 0x3FF);
+			}
+		else
+			u[k++] = c;
 		}
-	else if ([self scanString:@"false" intoString:NULL])
+
+	if (b < end)								// malformed UTF-8
 		{
-		leaf = [NSNumber numberWithBool: NO];
+		free(u);
+		return NULL;
 		}
-	else if ([self scanString:@"null" intoString:NULL])
+	*count = k;
+
+	return u;
+}
+
+static NSString *
+_JSONMakeString(_JSONReader *r, const unsigned char *b, NSUInteger length,
+				BOOL ascii)
+{
+	NSUInteger count;
+	unichar *u;
+
+	if (ascii)									// short ones are inline
+		return [_NSCString _newWithCString: (const char *)b length: length];
+
+	if (!(u = _JSONUTF16(b, length, &count)))
+		return _JSONError(r, @"Invalid UTF-8 in string");
+
+	return [[_NSUString alloc] initWithCharactersNoCopy: u
+							   length: count
+							   freeWhenDone: YES];
+}
+
+static NSString *
+_JSONKeyString(_JSONReader *r, const unsigned char *b, NSUInteger length,
+			   BOOL ascii)
+{
+	unsigned int i, h = 2166136261U;			// FNV-1a
+	NSString *s;
+	_JSONKey *k;
+
+	if (length > KEY_CACHE_MAXLEN)
+		return _JSONMakeString(r, b, length, ascii);
+
+	for (i = 0; i < length; i++)
+		h = (h ^ b[i]) * 16777619U;
+
+	if (!r->interned)
+		r->interned = calloc(KEY_CACHE_SIZE, sizeof(_JSONKey));
+	k = &r->interned[h & (KEY_CACHE_SIZE - 1)];
+
+	if (k->string && k->hash == h && k->length == length
+			&& memcmp(k->bytes, b, length) == 0)
+		return [k->string retain];
+
+	if ((s = _JSONMakeString(r, b, length, ascii)))
 		{
-		leaf = [NSNull null];
+		[k->string release];
+		k->string = [s retain];
+		k->hash = h;
+		k->length = length;
+		memcpy(k->bytes, b, length);
 		}
 
-	leaf && [self scanString:@"," intoString:NULL];		// comma at end
-					// if no comma we are AT END of leaves
-	return leaf;
+	return s;
 }
 
-- (id) _scanDictionaryWithOptions:(NSJSONReadingOptions)options
-							error:(NSError **)error
+/* ****************************************************************************
+
+	Numbers.  The text is checked against the JSON grammar, integers that
+	fit are kept exact as long long, everything else goes through strtod()
+	at full double precision.
+
+** ***************************************************************************/
+
+#define IS_DIGIT(c)		((c) >= '0' && (c) <= '9')
+
+static id
+_JSONNumber(_JSONReader *r)
 {
-	NSMutableDictionary *d = nil;
+	const unsigned char *p;
+	BOOL integer = YES;
+	long long v = 0;
+	int digits = 0;
+	BOOL negative;
+
+	r->scratchLength = 0;
+	do {										// gather across refills
+		for (p = r->p; p < r->end && __jsonNumber[*p]; p++);
+		_JSONAppend(r, r->p, p - r->p);
+		r->p = p;
+		} while (p == r->end && _JSONFill(r));
+	_JSONAppend(r, "", 1);
+
+	p = r->scratch;
+	if ((negative = (*p == '-')))
+		p++;
+	if (*p == '0')
+		p++, digits = 1;
+	else if (IS_DIGIT(*p))
+		for (; IS_DIGIT(*p); p++, digits++)
+			v = (digits < 18) ? v * 10 + (*p - '0') : 0;
+	else
+		return _JSONError(r, @"Invalid number");
+
+	if (*p == '.')
+		{
+		integer = NO;
+		if (!IS_DIGIT(p[1]))
+			return _JSONError(r, @"Invalid number");
+		for (p++; IS_DIGIT(*p); p++);
+		}
+	if (*p == 'e' || *p == 'E')
+		{
+		integer = NO;
+		if (*(++p) == '+' || *p == '-')
+			p++;
+		if (!IS_DIGIT(*p))
+			return _JSONError(r, @"Invalid number");
+		while (IS_DIGIT(*p))
+			p++;
+		}
+	if (*p != '\0')
+		return _JSONError(r, @"Invalid number");
 
-	while (![self isAtEnd])
+	if (integer)
 		{
-		if ([self scanString:@"\"" intoString:NULL])
+		if (digits <= 18)
+			return [[NSNumber alloc] initWithLongLong: negative ? -v : v];
+
+		errno = 0;
+		v = strtoll((char *)r->scratch, NULL, 10);
+		if (errno != ERANGE)
+			return [[NSNumber alloc] initWithLongLong: v];
+		}
+
+	return [[NSNumber alloc] initWithDouble: strtod((char *)r->scratch, NULL)];
+}
+
+/* ****************************************************************************
+
+	Values and containers, each returned +1 retained
+
+** ***************************************************************************/
+
+static id _JSONValue(_JSONReader *r);
+
+static id
+_JSONArray(_JSONReader *r)						// '[' consumed
+{
+	NSUInteger base = r->values.count;
+	Class class = (r->options & NSJSONReadingMutableContainers)
+				? [NSMutableArray class] : [NSArray class];
+	id a, v;
+	int c;
+
+	if (++(r->depth) > JSON_MAX_DEPTH)
+		return _JSONError(r, @"JSON nested too deeply");
+
+	if (_JSONSkipSpace(r) == ']')
+		r->p++;
+	else
+		for (;;)
 			{
-			NSString *key;
-			id val;
-			
-			if (!(key = [self _propertyListScanQuotedString])
-					|| ![self scanString:@":" intoString:NULL])
+			if (!(v = _JSONValue(r)))
 				{
-				if (error)
-					*error = _NSError(nil, -1, @"Invalid JSON dictionary key");
-				return nil;		// invalid dictionary
+				_JSONPop(&r->values, base);
+				return nil;
 				}
+			_JSONPush(&r->values, v);
 
-			if (!(val = [self _scanLeafWithOptions:options error:error]))
+			if ((c = _JSONSkipSpace(r)) == ',')
+				r->p++;
+			else if (c == ']')
 				{
-				if (error)
-					*error = _NSError(nil, -2, @"Invalid JSON dictionary leaf");
-				return nil;		// invalid dictionary
+				r->p++;
+				break;
 				}
+			else
+				{
+				_JSONPop(&r->values, base);
+				return _JSONError(r, @"Expected ',' or ']' in array");
+			}	}
 
-			if (!d)
-				d = [[NSMutableDictionary new] autorelease];
-			[d setObject:val forKey:key];
-			}
-		else if([self scanString:@"}" intoString:NULL])
-			break;
-		else
+	a = [[class alloc] initWithObjects: r->values.items + base
+					   count: r->values.count - base];
+	_JSONPop(&r->values, base);
+	r->depth--;
+
+	return a;
+}
+
+static id
+_JSONObject(_JSONReader *r)						// '{' consumed
+{
+	NSUInteger vbase = r->values.count;
+	NSUInteger kbase = r->keys.count;
+	Class class = (r->options & NSJSONReadingMutableContainers)
+				? [NSMutableDictionary class] : [NSDictionary class];
+	NSString *reason = nil;
+	id d, k, v;
+	int c;
+
+	if (++(r->depth) > JSON_MAX_DEPTH)
+		return _JSONError(r, @"JSON nested too deeply");
+
+	if ((c = _JSONSkipSpace(r)) == '}')
+		r->p++;
+	else
+		for (;;)
 			{
-			if (error)
-				*error = _NSError(nil, -3, @"Invalid JSON dictionary");
-			return nil;		// invalid dictionary
-			}
+			const unsigned char *bytes;
+			NSUInteger length;
+			BOOL ascii;
+
+			if (c != '"')
+				{
+				reason = @"Expected string key in object";
+				break;
+				}
+			r->p++;
+			if (!_JSONScanString(r, &bytes, &length, &ascii)
+					|| !(k = _JSONKeyString(r, bytes, length, ascii)))
+				break;
+			_JSONPush(&r->keys, k);
+
+			if (_JSONSkipSpace(r) != ':')
+				{
+				reason = @"Expected ':' after object key";
+				break;
+				}
+			r->p++;
+
+			if (!(v = _JSONValue(r)))
+				break;
+			_JSONPush(&r->values, v);
+
+			if ((c = _JSONSkipSpace(r)) == ',')
+				{
+				r->p++;
+				c = _JSONSkipSpace(r);
+				}
+			else if (c == '}')
+				{
+				r->p++;
+				break;
+				}
+			else
+				{
+				reason = @"Expected ',' or '}' in object";
+				break;
+			}	}
+
+	if (reason || r->error || r->keys.count - kbase != r->values.count - vbase)
+		{
+		_JSONPop(&r->values, vbase);
+		_JSONPop(&r->keys, kbase);
+
+		return (reason) ? _JSONError(r, reason) : nil;
 		}
 
-	if (!(options & NSJSONReadingMutableContainers) && d)
-		d = [NSDictionary dictionaryWithDictionary: d];
-		
+	d = [[class alloc] initWithObjects: r->values.items + vbase
+					   forKeys: r->keys.items + kbase
+					   count: r->values.count - vbase];
+	_JSONPop(&r->values, vbase);
+	_JSONPop(&r->keys, kbase);
+	r->depth--;
+
 	return d;
 }
 
-- (id) _scanArrayWithOptions:(NSJSONReadingOptions)options
-					   error:(NSError **)error
+static id
+_JSONValue(_JSONReader *r)
 {
-	NSMutableArray *a = nil;
-	id obj;
+	const unsigned char *bytes;
+	NSUInteger length;
+	BOOL ascii;
+	id s;
 
-	while (![self isAtEnd])
-		{						// find obj, can be dict, array, num or str.
-		if ((obj = [self _scanLeafWithOptions:options error:error]))
-			{
-			if (!a)
-				a = [[NSMutableArray new] autorelease];
-			[a addObject:obj];
-			}
-		else if([self scanString:@"]" intoString:NULL])
+	switch (_JSONSkipSpace(r))
+		{
+		case '{':	r->p++;		return _JSONObject(r);
+		case '[':	r->p++;		return _JSONArray(r);
+		case '"':
+			r->p++;
+			if (!_JSONScanString(r, &bytes, &length, &ascii)
+					|| !(s = _JSONMakeString(r, bytes, length, ascii)))
+				return nil;
+			if (r->options & NSJSONReadingMutableLeaves)
+				{
+				id m = [s mutableCopy];
+
+				[s release];
+				s = m;
+				}
+			return s;
+
+		case 't':
+			if (_JSONNext(r) == 't' && _JSONNext(r) == 'r'
+					&& _JSONNext(r) == 'u' && _JSONNext(r) == 'e')
+				return [__jsonTrue retain];
 			break;
-		else
-			{
-			if (error)
-				*error = _NSError(nil, -1, @"Invalid JSON array");
-			return nil;			// invalid array
-			}
+		case 'f':
+			if (_JSONNext(r) == 'f' && _JSONNext(r) == 'a' && _JSONNext(r) == 'l'
+					&& _JSONNext(r) == 's' && _JSONNext(r) == 'e')
+				return [__jsonFalse retain];
+			break;
+		case 'n':
+			if (_JSONNext(r) == 'n' && _JSONNext(r) == 'u'
+					&& _JSONNext(r) == 'l' && _JSONNext(r) == 'l')
+				return [__jsonNull retain];
+			break;
+
+		case '-':
+		case '0': case '1': case '2': case '3': case '4':
+		case '5': case '6': case '7': case '8': case '9':
+			return _JSONNumber(r);
+
+		case -1:
+			return _JSONError(r, @"Unexpected end of JSON");
 		}
 
-	if (!(options & NSJSONReadingMutableContainers) && a)
-		a = [NSArray arrayWithArray: a];
-		
-	return a;
+	return _JSONError(r, @"Unexpected character in JSON");
 }
 
-@end
+static id
+_JSONRead(_JSONReader *r, NSError **error)
+{
+	NSUInteger i;
+	id object = nil;
+	int c;
+
+	if (!__jsonNull)
+		{
+		__jsonTrue = [[NSNumber numberWithBool: YES] retain];
+		__jsonFalse = [[NSNumber numberWithBool: NO] retain];
+		__jsonNull = [[NSNull null] retain];
+		}
+
+	if ((c = _JSONSkipSpace(r)) == 0xEF)			// skip a UTF-8 BOM
+		{
+		if (_JSONNext(r) != 0xEF || _JSONNext(r) != 0xBB || _JSONNext(r) != 0xBF)
+			_JSONError(r, @"Invalid byte order mark");
+		c = _JSONSkipSpace(r);
+		}
+
+	if (r->error)
+		;
+	else if (c != '{' && c != '[' && !(r->options & NSJSONReadingAllowFragments))
+		_JSONError(r, @"Top-level type is not JSON");
+	else if ((object = _JSONValue(r)) && _JSONSkipSpace(r) != -1)
+		{
+		[object release];
+		object = _JSONError(r, @"Garbage at end of JSON");
+		}
+
+	_JSONPop(&r->values, 0);
+	_JSONPop(&r->keys, 0);
+	free(r->values.items);
+	free(r->keys.items);
+	free(r->scratch);
+	if (r->interned)
+		{
+		for (i = 0; i < KEY_CACHE_SIZE; i++)
+			[r->interned[i].string release];
+		free(r->interned);
+		}
+
+	if (!object && error)
+		*error = _NSError(nil, -1, r->error);
+
+	return [object autorelease];
+}
 
 
 @implementation NSJSONSerialization
@@ -409,32 +1020,64 @@ static NSCharacterSet *__numbers = nil;	// @"0123456789Ee.-+"
 				  options:(NSJSONReadingOptions)options
 				  error:(NSError **)error
 {
-	id topObject = nil;
+	_JSONReader r = {0};
 	const char *bytes = [data bytes];
 	NSUInteger length = [data length];
-	NSString *s = [NSString alloc];
-	NSScanner *sc;
 
-	if (_isUnicodeDataUTF8(bytes, length))
-		s = [[s initWithData:data encoding:NSUTF8StringEncoding] autorelease];
-	else
-		s = [[s initWithData:data encoding:NSUnicodeStringEncoding] autorelease];
-
-	sc = [NSScanner scannerWithString: s];
+	if (data == nil)
+		[NSException raise:NSInvalidArgumentException format:@"nil JSON data"];
 
-	if([sc scanString:@"{" intoString:NULL])		// top-level dictionary
+	if (!_isUnicodeDataUTF8(bytes, length))
 		{
-		topObject = [sc _scanDictionaryWithOptions:options error:error];
-		}
-	else if([sc scanString:@"[" intoString:NULL])	// top-level array
-		{
-		topObject = [sc _scanArrayWithOptions:options error:error];
+		NSString *s = [[NSString alloc] initWithData: data
+										encoding: NSUnicodeStringEncoding];
+
+		data = [s dataUsingEncoding: NSUTF8StringEncoding];
+		bytes = [data bytes];
+		length = [data length];
+		[s autorelease];
 		}
 
-	if (!topObject)
-		[NSException raise:NSInvalidArgumentException
-					 format: @"Top-level type is not JSON"];
-	return topObject;
+	r.p = r.start = (const unsigned char *)bytes;
+	r.end = r.p + length;
+	r.options = options;
+
+	return _JSONRead(&r, error);
+}
+
++ (id) JSONObjectWithStream:(NSInputStream *)stream
+					options:(NSJSONReadingOptions)options
+					error:(NSError **)error
+{
+	_JSONReader r = {0};
+	id object;
+
+	r.stream = stream;
+	r.window = malloc(JSON_WINDOW);
+	r.p = r.start = r.end = r.window;
+	r.options = options;
+	object = _JSONRead(&r, error);
+	free(r.window);
+
+	return object;
+}
+
++ (id) JSONObjectWithFileHandle:(NSFileHandle *)fh
+						options:(NSJSONReadingOptions)options
+						error:(NSError **)error
+{
+	_JSONReader r = {0};
+	id object;
+
+	r.stream = fh;
+	r.isFileHandle = YES;
+	r.window = malloc(JSON_WINDOW);
+	r.p = r.start = r.end = r.window;
+	r.options = options;
+	object = _JSONRead(&r, error);
+	free(r.window);
+
+	return object;
 }
 
 + (NSData *) dataWithJSONObject:(id)object
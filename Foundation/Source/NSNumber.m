@@ -67,11 +67,81 @@ static NSNumber *__FALSE = nil;
 
 @end
 
+/* ****************************************************************************
+
+	Small integers -- one shared, never deallocated instance of each integer
+	class for each value in SMALL_MIN ... SMALL_MAX, made on first use.
+	Like the BOOL singletons they are returned without an autorelease.
+
+** ***************************************************************************/
+
+#define SMALL_MIN			-16
+#define SMALL_MAX			255
+#define SMALL_COUNT			(SMALL_MAX - SMALL_MIN + 1)
+
+#define SMALL_SIGNED(v)		((v) >= SMALL_MIN && (v) <= SMALL_MAX)
+#define SMALL_UNSIGNED(v)	((v) <= SMALL_MAX)
+
+enum { _CHR, _UCHR, _SHT, _USHT, _INT, _UINT, _LNG, _ULNG, _LLNG, _ULLNG,
+	   SMALL_CLASSES };
+
+typedef struct { @defs(_NSNumber); } _NumberDefs;
+
+static Class __smallClass[SMALL_CLASSES];
+static NSNumber *__small[SMALL_CLASSES][SMALL_COUNT];
+
+
+static NSNumber *
+_NewSmallNumber(int kind, long long value)
+{
+	NSNumber *expected = nil;
+	NSNumber *n = NSAllocateObject(__smallClass[kind]);
+	NSNumber **slot = &__small[kind][value - SMALL_MIN];
+
+	((_NumberDefs *)n)->data.ll = value;
+	if (!__atomic_compare_exchange_n(slot, &expected, n, NO,
+									 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		{
+		NSDeallocateObject(n);					// another thread won
+		n = expected;
+		}
+
+	return n;
+}
+
+static inline NSNumber *
+_SmallNumber(int kind, long long value)
+{
+	NSNumber *n = __atomic_load_n(&__small[kind][value - SMALL_MIN],
+								  __ATOMIC_ACQUIRE);
+
+	return (n) ? n : _NewSmallNumber(kind, value);
+}
+
+static BOOL
+_IsSmallNumber(NSNumber *n, long long value)
+{
+	int kind;
+
+	if (SMALL_SIGNED(value))
+		for (kind = 0; kind < SMALL_CLASSES; kind++)
+			if (__small[kind][value - SMALL_MIN] == n)
+				return YES;
+
+	return NO;
+}
+
 
 @implementation _NSNumber
 
 + (id) alloc						  	{ return NSAllocateObject(self); }
-- (void) dealloc						{ NSDeallocateObject(self); NO_WARN; }
+
+- (void) dealloc
+{
+	if (!_IsSmallNumber(self, data.ll))			// shared small integers
+		NSDeallocateObject(self);				// outlive a bad release
+	NO_WARN;
+}
 
 - (BOOL) boolValue					  		 { return (data.b != 0); }
 - (char) charValue					  		 { return data.c; }
@@ -114,7 +184,19 @@ static NSNumber *__FALSE = nil;
 + (void) initialize
 {
 	if (!__numberAllocator && (self == [NSNumber class]))
+		{
+		__smallClass[_CHR] = [_CharNumber class];
+		__smallClass[_UCHR] = [_UCharNumber class];
+		__smallClass[_SHT] = [_ShortNumber class];
+		__smallClass[_USHT] = [_UShortNumber class];
+		__smallClass[_INT] = [_IntNumber class];
+		__smallClass[_UINT] = [_UIntNumber class];
+		__smallClass[_LNG] = [_LongNumber class];
+		__smallClass[_ULNG] = [_ULongNumber class];
+		__smallClass[_LLNG] = [_LongLongNumber class];
+		__smallClass[_ULLNG] = [_ULongLongNumber class];
 		__numberAllocator = (NSNumber *)NSAllocateObject(self);
+		}
 }
 
 + (id) alloc						{ return __numberAllocator; }
@@ -152,6 +234,9 @@ static NSNumber *__FALSE = nil;
 
 + (NSNumber *) numberWithChar:(char)value
 {
+	if (SMALL_SIGNED(value))
+		return _SmallNumber(_CHR, value);
+
     return [[[_CharNumber alloc] initWithChar:value] autorelease];
 }
 
@@ -167,46 +252,73 @@ static NSNumber *__FALSE = nil;
 
 + (NSNumber *) numberWithInt:(int)value
 {
+	if (SMALL_SIGNED(value))
+		return _SmallNumber(_INT, value);
+
     return [[[_IntNumber alloc] initWithInt:value] autorelease];
 }
 
 + (NSNumber *) numberWithLong:(long)value
 {
+	if (SMALL_SIGNED(value))
+		return _SmallNumber(_LNG, value);
+
     return [[[_LongNumber alloc] initWithLong:value] autorelease];
 }
 
 + (NSNumber *) numberWithLongLong:(long long)value
 {
+	if (SMALL_SIGNED(value))
+		return _SmallNumber(_LLNG, value);
+
     return [[[_LongLongNumber alloc] initWithLongLong:value] autorelease];
 }
 
 + (NSNumber *) numberWithShort:(short)value
 {
+	if (SMALL_SIGNED(value))
+		return _SmallNumber(_SHT, value);
+
     return [[[_ShortNumber alloc] initWithShort:value]	autorelease];
 }
 
 + (NSNumber *) numberWithUnsignedChar:(unsigned char)value
 {
+	if (SMALL_UNSIGNED(value))
+		return _SmallNumber(_UCHR, value);
+
     return [[[_UCharNumber alloc] initWithUnsignedChar:value] autorelease];
 }
 
 + (NSNumber *) numberWithUnsignedInt:(unsigned int)value
 {
+	if (SMALL_UNSIGNED(value))
+		return _SmallNumber(_UINT, value);
+
     return [[[_UIntNumber alloc] initWithUnsignedInt:value] autorelease];
 }
 
 + (NSNumber *) numberWithUnsignedShort:(unsigned short)value
 {
+	if (SMALL_UNSIGNED(value))
+		return _SmallNumber(_USHT, value);
+
 	return [[[_UShortNumber alloc] initWithUnsignedShort:value] autorelease];
 }
 
 + (NSNumber *) numberWithUnsignedLong:(unsigned long)value
 {
+	if (SMALL_UNSIGNED(value))
+		return _SmallNumber(_ULNG, value);
+
     return [[[_ULongNumber alloc] initWithUnsignedLong:value] autorelease];
 }
 
 + (NSNumber *) numberWithUnsignedLongLong:(unsigned long long)v
 {
+	if (SMALL_UNSIGNED(v))
+		return _SmallNumber(_ULLNG, v);
+
 	return [[[_ULongLongNumber alloc] initWithUnsignedLongLong:v] autorelease];
 }
 
@@ -217,6 +329,9 @@ static NSNumber *__FALSE = nil;
 
 - (id) initWithChar:(char)value
 {
+	if (SMALL_SIGNED(value))
+		return [_SmallNumber(_CHR, value) retain];
+
     return [[_CharNumber alloc] initWithChar:value];
 }
 
@@ -232,46 +347,73 @@ static NSNumber *__FALSE = nil;
 
 - (id) initWithInt:(int)value
 {
+	if (SMALL_SIGNED(value))
+		return [_SmallNumber(_INT, value) retain];
+
     return [[_IntNumber alloc] initWithInt:value];
 }
 
 - (id) initWithLong:(long)value
 {
+	if (SMALL_SIGNED(value))
+		return [_SmallNumber(_LNG, value) retain];
+
     return [[_LongNumber alloc] initWithLong:value];
 }
 
 - (id) initWithLongLong:(long long)value
 {
+	if (SMALL_SIGNED(value))
+		return [_SmallNumber(_LLNG, value) retain];
+
     return [[_LongLongNumber alloc] initWithLongLong:value];
 }
 
 - (id) initWithShort:(short)value
 {
+	if (SMALL_SIGNED(value))
+		return [_SmallNumber(_SHT, value) retain];
+
     return [[_ShortNumber alloc] initWithShort:value];
 }
 
 - (id) initWithUnsignedChar:(unsigned char)value
 {
+	if (SMALL_UNSIGNED(value))
+		return [_SmallNumber(_UCHR, value) retain];
+
     return [[_UCharNumber alloc] initWithUnsignedChar:value];
 }
 
 - (id) initWithUnsignedInt:(unsigned int)value
 {
+	if (SMALL_UNSIGNED(value))
+		return [_SmallNumber(_UINT, value) retain];
+
     return [[_UIntNumber alloc] initWithUnsignedInt:value];
 }
 
 - (id) initWithUnsignedShort:(unsigned short)value
 {
+	if (SMALL_UNSIGNED(value))
+		return [_SmallNumber(_USHT, value) retain];
+
     return [[_UShortNumber alloc] initWithUnsignedShort:value];
 }
 
 - (id) initWithUnsignedLong:(unsigned long)value
 {
+	if (SMALL_UNSIGNED(value))
+		return [_SmallNumber(_ULNG, value) retain];
+
     return [[_ULongNumber alloc] initWithUnsignedLong:value];
 }
 
 - (id) initWithUnsignedLongLong:(unsigned long long)value
 {
+	if (SMALL_UNSIGNED(value))
+		return [_SmallNumber(_ULLNG, value) retain];
+
     return [[_ULongLongNumber alloc] initWithUnsignedLongLong:value];
 }
 
@@ -16,74 +16,363 @@
 
 #include <Foundation/NSObject.h>
 #include <Foundation/NSException.h>
+#include <Foundation/Private/_NSObject.h>
+
+#include <pthread.h>
 
 
 static Class __CFBridgeClass = Nil;
 
 
+#ifndef ATOMIC_REFCOUNT
+BOOL __NSAtomicRefCount = NO;				// set by NSThread on first detach
+#endif
+
+
+BOOL
+NSDecrementExtraRefCountWasZero(id object) 			// reference count
+{
+	return _NSDecrementRefCountWasZero(object);
+}
+
+void
+NSIncrementExtraRefCount(id object)
+{
+	_NSIncrementRefCount(object);
+}
+
+NSUInteger
+NSExtraRefCount(id object)
+{
+	return _NSRefCount(object);
+}
+
 /* ****************************************************************************
 
-	Define a wrapper structure around each NSObject to store the reference
-	count locally.  Required for legacy runtime compatibility.
+	Small object slab allocator
+
+	Objects whose header plus instance size fit in SLAB_MAX_BLOCK bytes are
+	carved from malloc'd slabs and recycled through per thread free lists,
+	one per 16 byte size class, so alloc / dealloc of short lived objects
+	never takes the malloc lock.  Thread caches exchange batches of blocks
+	with a mutex protected depot when they run dry or grow too long, and
+	hand everything back to the depot when their thread exits.  A free
+	block links through its header word, the class pointer still reads
+	0xdeadface.
+
+	MGSTEP_MALLOC_OBJECTS	  allocate every object with malloc / free
+	MGSTEP_DEBUG_OBJECTS	  scribble 0xdeadface over freed objects and
+							  report any that are written after free
+	MGSTEP_OBJECT_STATS		  dump per class allocation counts at exit
 
 ** ***************************************************************************/
 
-#define	UNP    sizeof(unp)
-#define	ALIGN  __alignof__(double)
+#define SLAB_GRANULE		16
+#define SLAB_CLASSES		32
+#define SLAB_MAX_BLOCK		(SLAB_GRANULE * SLAB_CLASSES)
+#define SLAB_SIZE			(16 * 1024)
+#define CACHE_BATCH			32				// blocks moved to / from depot
+#define CACHE_LIMIT			(4 * CACHE_BATCH)
 
-typedef struct obj_layout_unpadded
-{									// Define a structure to hold data locally
-    NSUInteger retained;			// before the start of each object
-} unp;
+#define FREE_NEXT(b)		(*(void **)(b))
 
-									// Now wrap the other version to determine
-struct obj_layout 					// what padding if any is required to get
-{									// the alignment of the structure correct.
-    NSUInteger retained;
-    char padding[ALIGN - ((UNP % ALIGN) ? (UNP % ALIGN) : ALIGN)];
-};
+typedef struct _NSSlabCache {
+	void *list[SLAB_CLASSES];
+	unsigned int count[SLAB_CLASSES];
+	BOOL registered;
+} _NSSlabCache;
 
-typedef	struct obj_layout *obj_t;
+typedef struct _NSClassStats {
+	Class cls;
+	NSUInteger allocs;
+	NSUInteger deallocs;
+	NSUInteger bytes;
+} _NSClassStats;
 
+#define STATS_SIZE			4096			// power of two
 
+static __thread _NSSlabCache __slabCache;
 
-BOOL
-NSDecrementExtraRefCountWasZero(id object) 			// reference count
+static void *__depot[SLAB_CLASSES];
+static pthread_mutex_t __depotLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t __slabCacheKey;
+
+static int __allocInit = 0;
+static BOOL __useSlabs = YES;
+static BOOL __debugObjects = NO;
+
+static _NSClassStats *__classStats = NULL;
+static pthread_mutex_t __statsLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static void
+_NSCheckScribble(obj_t o, size_t size)
+{
+	unsigned int *p = (unsigned int *)&o[1];
+	unsigned int *end = (unsigned int *)((char *)o + size);
+
+	for (; p < end; p++)
+		if (*p != 0xdeadface)
+			{
+			fprintf(stderr, "*** object %p (%lu bytes) modified after free\n",
+					(void *)&o[1], (unsigned long)(size - sizeof(*o)));
+			break;
+			}
+}
+
+static void
+_NSScribble(obj_t o, size_t size)
 {
-	return (((obj_t)(object))[-1].retained-- == 0 ? YES : NO);
+	unsigned int *p = (unsigned int *)&o[1];
+	unsigned int *end = (unsigned int *)((char *)o + size);
+
+	while (p < end)
+		*p++ = 0xdeadface;
 }
 
-void
-NSIncrementExtraRefCount(id object)
+static void
+_NSDepotPut(unsigned int sc, void *head, void *tail)
 {
-	((obj_t)(object))[-1].retained++;
+	pthread_mutex_lock(&__depotLock);
+	FREE_NEXT(tail) = __depot[sc];
+	__depot[sc] = head;
+	pthread_mutex_unlock(&__depotLock);
 }
 
-NSUInteger
-NSExtraRefCount(id object)
+static void
+_NSSlabCacheFlush(void *cache)						// thread exit destructor
 {
-	return ((obj_t)(object))[-1].retained + 1;
+	_NSSlabCache *c = (_NSSlabCache *)cache;
+	unsigned int sc;
+
+	for (sc = 0; sc < SLAB_CLASSES; sc++)
+		if (c->list[sc] != NULL)
+			{
+			void *tail = c->list[sc];
+
+			while (FREE_NEXT(tail) != NULL)
+				tail = FREE_NEXT(tail);
+			_NSDepotPut(sc, c->list[sc], tail);
+			c->list[sc] = NULL;
+			c->count[sc] = 0;
+			}
+	c->registered = NO;
 }
 
-inline id
-NSAllocateObject(Class aClass)						// object allocation
+static inline void
+_NSSlabCacheRegister(_NSSlabCache *c)
 {
-	id new = nil;
+	if (!c->registered)				// flush this cache when its thread exits,
+		{							// a thread may only ever free blocks
+		pthread_setspecific(__slabCacheKey, c);
+		c->registered = YES;
+		}
+}
+
+static void
+_NSSlabCacheRefill(_NSSlabCache *c, unsigned int sc)
+{
+	size_t size = (sc + 1) * SLAB_GRANULE;
+	unsigned int n = 0;
+
+	_NSSlabCacheRegister(c);
+
+	pthread_mutex_lock(&__depotLock);
+	if (__depot[sc] != NULL)
+		{
+		void *head = __depot[sc];
+		void *tail = head;
+
+		for (n = 1; n < CACHE_BATCH && FREE_NEXT(tail) != NULL; n++)
+			tail = FREE_NEXT(tail);
+		__depot[sc] = FREE_NEXT(tail);
+		FREE_NEXT(tail) = c->list[sc];
+		c->list[sc] = head;
+		}
+	pthread_mutex_unlock(&__depotLock);
+
+	if (n == 0)										// depot is empty, carve
+		{											// a new slab
+		char *slab = malloc(SLAB_SIZE);
+		char *b;
+
+		if (slab == NULL)
+			return;
+		for (b = slab; b + size <= slab + SLAB_SIZE; b += size, n++)
+			{
+			if (__debugObjects)
+				_NSScribble((obj_t)b, size);
+			FREE_NEXT(b) = c->list[sc];
+			c->list[sc] = b;
+		}	}
+
+	c->count[sc] += n;
+}
+
+static void
+_NSSlabCacheTrim(_NSSlabCache *c, unsigned int sc)
+{
+	void *head = c->list[sc];
+	void *tail = head;
+	unsigned int n;
+
+	for (n = 1; n < CACHE_BATCH; n++)
+		tail = FREE_NEXT(tail);
+	c->list[sc] = FREE_NEXT(tail);
+	c->count[sc] -= n;
+	_NSDepotPut(sc, head, tail);
+}
+
+static int
+_NSCompareClassStats(const void *a, const void *b)
+{
+	NSUInteger x = ((_NSClassStats *)a)->allocs;
+	NSUInteger y = ((_NSClassStats *)b)->allocs;
+
+	return (x < y) ? 1 : ((x > y) ? -1 : 0);
+}
+
+static void
+_NSDumpClassStats(void)
+{
+	NSUInteger i, n = 0;
+
+	pthread_mutex_lock(&__statsLock);
+	for (i = 0; i < STATS_SIZE; i++)
+		if (__classStats[i].cls != Nil)
+			__classStats[n++] = __classStats[i];
+	qsort(__classStats, n, sizeof(_NSClassStats), _NSCompareClassStats);
+
+	fprintf(stderr, "%-32s %12s %12s %12s %14s\n",
+			"class", "allocs", "deallocs", "live", "bytes");
+	for (i = 0; i < n; i++)
+		{
+		_NSClassStats *s = &__classStats[i];
+
+		fprintf(stderr, "%-32s %12lu %12lu %12ld %14lu\n",
+				class_get_class_name(s->cls),
+				(unsigned long)s->allocs, (unsigned long)s->deallocs,
+				(long)(s->allocs - s->deallocs), (unsigned long)s->bytes);
+		}
+	pthread_mutex_unlock(&__statsLock);
+}
+
+static void
+_NSCountObject(Class aClass, NSUInteger size, BOOL isAlloc)
+{
+	NSUInteger i = ((NSUInteger)aClass >> 4) & (STATS_SIZE - 1);
+
+	pthread_mutex_lock(&__statsLock);
+	while (__classStats[i].cls != aClass && __classStats[i].cls != Nil)
+		i = (i + 1) & (STATS_SIZE - 1);		// table is sized well beyond the
+	__classStats[i].cls = aClass;			// number of classes in a process
+	if (isAlloc)
+		{
+		__classStats[i].allocs++;
+		__classStats[i].bytes += size;
+		}
+	else
+		__classStats[i].deallocs++;
+	pthread_mutex_unlock(&__statsLock);
+}
+
+static void
+_NSAllocInit(void)
+{
+	__allocInit = 1;
+	__useSlabs = (getenv("MGSTEP_MALLOC_OBJECTS") == NULL);
+	__debugObjects = (getenv("MGSTEP_DEBUG_OBJECTS") != NULL);
+	pthread_key_create(&__slabCacheKey, _NSSlabCacheFlush);
+
+	if (getenv("MGSTEP_OBJECT_STATS") != NULL)
+		{
+		__classStats = calloc(STATS_SIZE, sizeof(_NSClassStats));
+		atexit(_NSDumpClassStats);
+		}
+}
+
+static inline void *
+_NSAllocBlock(size_t size)
+{
+	obj_t o;
+
+	if (__useSlabs && size <= SLAB_MAX_BLOCK)
+		{
+		unsigned int sc = (size - 1) / SLAB_GRANULE;
+		_NSSlabCache *c = &__slabCache;
+
+		if (c->list[sc] == NULL)
+			_NSSlabCacheRefill(c, sc);
+		if ((o = c->list[sc]) == NULL)
+			return NULL;
+		c->list[sc] = FREE_NEXT(o);
+		c->count[sc]--;
+
+		if (__debugObjects)
+			_NSCheckScribble(o, (sc + 1) * SLAB_GRANULE);
+		memset (o, 0, size);
+		o->sizeClass = sc + 1;
+
+		return o;
+		}
+
+	if ((o = malloc(size)) != NULL)
+		memset (o, 0, size);
+
+	return o;
+}
+
+static inline void
+_NSFreeBlock(obj_t o)
+{
+	if (o->sizeClass)
+		{
+		unsigned int sc = o->sizeClass - 1;
+		_NSSlabCache *c = &__slabCache;
+
+		_NSSlabCacheRegister(c);
+		if (__debugObjects)
+			_NSScribble(o, (sc + 1) * SLAB_GRANULE);
+		FREE_NEXT(o) = c->list[sc];
+		c->list[sc] = o;
+		if (++c->count[sc] > CACHE_LIMIT)
+			_NSSlabCacheTrim(c, sc);
+		}
+	else
+		free(o);
+}
+
+inline id
+_NSAllocateObjectExtra(Class aClass, NSUInteger extraBytes)
+{													// instance plus bytes
+	id new = nil;									// following its ivars
+
+	if (__allocInit == 0)
+		_NSAllocInit();
 
 	if (CLS_ISCLASS (aClass))
 		{
-		int size = aClass->instance_size + sizeof(struct obj_layout);		
+		int size = aClass->instance_size + sizeof(struct obj_layout)
+				 + extraBytes;
 
-		if ((new = malloc(size)) != NULL)
+		if ((new = _NSAllocBlock(size)) != NULL)
 			{
-			memset (new, 0, size);
 			new = (id)&((obj_t)new)[1];
 			new->class_pointer = aClass;
+
+			if (__classStats)
+				_NSCountObject(aClass, size, YES);
 		}	}
 
 	return new;
 }
 
+inline id
+NSAllocateObject(Class aClass)						// object allocation
+{
+	return _NSAllocateObjectExtra(aClass, 0);
+}
+
 void
 _CFBridgeInit(Class BridgeClass)
 {
@@ -118,7 +407,26 @@ CFAllocatorReallocate (CFAllocatorRef a, void *ptr, CFIndex size, CFOptionFlags
 	if (size > 0)
 		size += sizeof(struct obj_layout) + __CFBridgeClass->instance_size;
 
-	if ((new = realloc(o, size)) != NULL)			// size 0 == free()
+	if (o->sizeClass)								// slab block, move it to
+		{											// the malloc heap
+		size_t old = o->sizeClass * SLAB_GRANULE;
+
+		if (size > 0 && (new = malloc(size)) == NULL)
+			return NULL;							// old block left intact
+		if (size > 0)
+			{
+			memcpy(new, o, (old < (size_t)size) ? old : (size_t)size);
+			((obj_t)new)->sizeClass = 0;
+			}
+		else
+			new = NULL;
+		((id)ptr)->class_pointer = (void*)0xdeadface;
+		_NSFreeBlock(o);
+		}
+	else
+		new = realloc(o, size);						// size 0 == free()
+
+	if (new != NULL)
 		{
 		new = (id)&((obj_t)new)[1];
 		new->class_pointer = __CFBridgeClass;
@@ -134,9 +442,12 @@ NSDeallocateObject(NSObject *anObject)				// object deallocation
 		{
 		obj_t o = &((obj_t)anObject)[-1];
 
+		if (__classStats)
+			_NSCountObject(((id)anObject)->class_pointer, 0, NO);
+
 		((id)anObject)->class_pointer = (void*)0xdeadface;
 
-		free(o);
+		_NSFreeBlock(o);
 		}
 }
 
@@ -149,7 +460,7 @@ CFAllocatorDeallocate (CFAllocatorRef a, void *ptr)
 
 		((id)ptr)->class_pointer = (void*)0xdeadface;
 
-		free(o);
+		_NSFreeBlock(o);
 		}
 }
 
@@ -20,6 +20,7 @@
 #include <Foundation/NSString.h>
 #include <Foundation/NSException.h>
 #include <Foundation/NSInvocation.h>
+#include <Foundation/Private/_NSObject.h>
 
 
 static id  __releaseClass = nil;		// Class responsible for autorelease
@@ -169,7 +170,7 @@ IMP method_get_imp(Method method);
 + (id) retain						{ return self; }
 + (oneway void) release				{ return; }
 + (NSUInteger) retainCount			{ return ULONG_MAX; }
-- (NSUInteger) retainCount			{ return NSExtraRefCount(self); }
+- (NSUInteger) retainCount			{ return _NSRefCount(self); }
 
 - (id) autorelease
 {
@@ -179,13 +180,13 @@ IMP method_get_imp(Method method);
 
 - (oneway void) release
 {
-	if (NSDecrementExtraRefCountWasZero(self))
+	if (_NSDecrementRefCountWasZero(self))
 		[self dealloc];
 }
 
 - (id) retain
 {
-	NSIncrementExtraRefCount(self);			// ((obj_t)(self))[-1].retained++;
+	_NSIncrementRefCount(self);				// ((obj_t)(self))[-1].retained++;
 	return self;
 }
 
@@ -0,0 +1,1106 @@
+/*
+   NSOperation.m
+
+   Units of work and the queues that run them on a shared thread pool
+
+   Copyright (C) 2026 Free Software Foundation, Inc.
+
+   This file is part of the mGSTEP Library and is provided
+   under the terms of the GNU Library General Public License.
+*/
+
+#include <Foundation/NSOperation.h>
+#include <Foundation/NSArray.h>
+#include <Foundation/NSString.h>
+#include <Foundation/NSException.h>
+#include <Foundation/NSInvocation.h>
+#include <Foundation/NSMethodSignature.h>
+#include <Foundation/NSMapTable.h>
+#include <Foundation/NSAutoreleasePool.h>
+#include <Foundation/NSThread.h>
+#include <Foundation/NSRunLoop.h>
+#include <Foundation/NSNotification.h>
+#include <Foundation/NSDictionary.h>
+
+#include <CoreFoundation/CFRunLoop.h>
+#include <CoreFoundation/CFSocket.h>
+
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+
+#define OP_CANCELLED	1
+#define OP_EXECUTING	2
+#define OP_FINISHED		4
+
+#define OP_STATE(op)	__atomic_load_n(&(op)->_state, __ATOMIC_ACQUIRE)
+
+										// guards dependency graph, queue
+static pthread_mutex_t __opLock = PTHREAD_MUTEX_INITIALIZER;	// membership
+static pthread_cond_t  __opDone = PTHREAD_COND_INITIALIZER;	// test and wait
+static int __opWaiters = 0;
+
+
+@interface NSOperation  (Private)
+- (void) _finish;
+- (void) _deliverCompletion;
+@end
+
+@interface NSOperationQueue  (Private)
+- (void) _operationReady:(NSOperation *)op;
+- (void) _operationFinished:(NSOperation *)op;
+@end
+
+/* ****************************************************************************
+
+	WorkDeque -- ring of operations, the owning worker pushes and pops the
+	newest end while idle workers steal from the oldest end.
+
+** ***************************************************************************/
+
+typedef struct _WorkDeque {
+	pthread_mutex_t lock;
+	NSOperation **items;
+	unsigned int head;						// steal end, oldest
+	unsigned int tail;						// owner end, newest
+	unsigned int size;						// power of 2
+} WorkDeque;
+
+
+static void
+DequeInit(WorkDeque *d)
+{
+	pthread_mutex_init(&d->lock, NULL);
+	d->size = 64;
+	d->items = malloc(d->size * sizeof(void *));
+	d->head = d->tail = 0;
+}
+
+static void
+DequePush(WorkDeque *d, NSOperation *op)
+{
+	pthread_mutex_lock(&d->lock);
+	if (d->tail - d->head == d->size)
+		{
+		NSOperation **items = malloc(2 * d->size * sizeof(void *));
+		unsigned int i;
+
+		for (i = 0; i < d->size; i++)
+			items[i] = d->items[(d->head + i) & (d->size - 1)];
+		free(d->items);
+		d->items = items;
+		d->head = 0;
+		d->tail = d->size;
+		d->size *= 2;
+		}
+	d->items[d->tail & (d->size - 1)] = op;
+	__atomic_store_n(&d->tail, d->tail + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&d->lock);
+}
+
+static BOOL
+DequeIsEmpty(WorkDeque *d)					// unlocked peek, avoids taking
+{											// the lock of empty victims
+	return __atomic_load_n(&d->head, __ATOMIC_ACQUIRE)
+			== __atomic_load_n(&d->tail, __ATOMIC_ACQUIRE);
+}
+
+static NSOperation *
+DequePop(WorkDeque *d)
+{
+	NSOperation *op = nil;
+
+	if (DequeIsEmpty(d))
+		return nil;
+
+	pthread_mutex_lock(&d->lock);
+	if (d->tail != d->head)
+		{
+		op = d->items[(d->tail - 1) & (d->size - 1)];
+		__atomic_store_n(&d->tail, d->tail - 1, __ATOMIC_RELEASE);
+		}
+	pthread_mutex_unlock(&d->lock);
+
+	return op;
+}
+
+static NSOperation *
+DequeSteal(WorkDeque *d)
+{
+	NSOperation *op = nil;
+
+	if (DequeIsEmpty(d))
+		return nil;
+
+	pthread_mutex_lock(&d->lock);
+	if (d->tail != d->head)
+		{
+		op = d->items[d->head & (d->size - 1)];
+		__atomic_store_n(&d->head, d->head + 1, __ATOMIC_RELEASE);
+		}
+	pthread_mutex_unlock(&d->lock);
+
+	return op;
+}
+
+/* ****************************************************************************
+
+	Worker pool -- one thread per online CPU (or MGSTEP_OPERATION_THREADS)
+	started on first use.  Work submitted by a worker goes to its own deque,
+	other threads submit to a shared deque.  Workers sleep only when no
+	deque holds work.
+
+** ***************************************************************************/
+
+typedef struct _Worker {
+	WorkDeque deque;
+	unsigned int index;
+	NSOperationQueue *queue;				// queue of running operation
+} Worker;
+
+static Worker *__workers = NULL;
+static unsigned int __workerCount = 0;
+static unsigned int __workersStarted = 0;
+static WorkDeque __submitted;				// from threads outside the pool
+static int __queued = 0;					// operations in all deques
+static int __sleeping = 0;
+static pthread_mutex_t __sleepLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  __wakeup = PTHREAD_COND_INITIALIZER;
+static pthread_once_t  __poolOnce = PTHREAD_ONCE_INIT;
+static __thread Worker *__currentWorker = NULL;
+
+
+@interface _NSOperationPool : NSObject
++ (void) _workerMain:(id)arg;
+@end
+
+static void
+PoolInit(void)
+{
+	char *s = getenv("MGSTEP_OPERATION_THREADS");
+	long n = (s) ? atol(s) : sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned int i;
+
+	__workerCount = (unsigned int)MAX(1, MIN(n, 256));
+	__workers = calloc(__workerCount, sizeof(Worker));
+	DequeInit(&__submitted);
+	for (i = 0; i < __workerCount; i++)
+		{
+		__workers[i].index = i;
+		DequeInit(&__workers[i].deque);
+		}
+
+	for (i = 0; i < __workerCount; i++)		// detaching NSThreads also
+		[NSThread detachNewThreadSelector: @selector(_workerMain:)
+				  toTarget: [_NSOperationPool class]	// switches retain
+				  withObject: nil];						// counts to atomics
+}
+
+static void
+PoolSubmit(NSOperation *op)
+{
+	pthread_once(&__poolOnce, PoolInit);
+
+	DequePush((__currentWorker) ? &__currentWorker->deque : &__submitted, op);
+	__atomic_add_fetch(&__queued, 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&__sleeping, __ATOMIC_SEQ_CST) > 0)
+		{
+		pthread_mutex_lock(&__sleepLock);
+		pthread_cond_signal(&__wakeup);
+		pthread_mutex_unlock(&__sleepLock);
+		}
+}
+
+static NSOperation *
+PoolTake(Worker *w)
+{
+	NSOperation *op;
+	unsigned int i;
+												// own newest work first, then
+	if (!(op = DequePop(&w->deque)))			// submitted work, then steal
+		if (!(op = DequeSteal(&__submitted)))	// the oldest of other workers
+			for (i = 1; i < __workerCount && !op; i++)
+				op = DequeSteal(&__workers[(w->index + i) % __workerCount].deque);
+
+	if (op)
+		__atomic_sub_fetch(&__queued, 1, __ATOMIC_SEQ_CST);
+
+	return op;
+}
+
+static void
+PoolSleep(void)
+{
+	pthread_mutex_lock(&__sleepLock);
+	__atomic_add_fetch(&__sleeping, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&__queued, __ATOMIC_SEQ_CST) <= 0)
+		pthread_cond_wait(&__wakeup, &__sleepLock);
+	__atomic_sub_fetch(&__sleeping, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&__sleepLock);
+}
+
+static void
+RunOperation(Worker *w, NSOperation *op)
+{
+	NSAutoreleasePool *arp = [NSAutoreleasePool new];
+	NSOperationQueue *outer = w->queue;		// nested when helping a wait
+
+	w->queue = op->_queue;
+	[op start];
+	w->queue = outer;
+	[arp release];
+}
+
+static BOOL
+PoolHelp(void)								// a worker about to block runs
+{											// queued work instead
+	NSOperation *op;
+
+	if (__currentWorker == NULL || !(op = PoolTake(__currentWorker)))
+		return NO;
+	RunOperation(__currentWorker, op);
+
+	return YES;
+}
+
+@implementation _NSOperationPool
+
++ (void) _workerMain:(id)arg
+{
+	unsigned int i = __atomic_fetch_add(&__workersStarted, 1, __ATOMIC_RELAXED);
+	Worker *w = &__workers[i];
+	NSOperation *op;
+
+	__currentWorker = w;
+	for (;;)
+		if ((op = PoolTake(w)))
+			RunOperation(w, op);
+		else
+			PoolSleep();
+}
+
+@end
+
+/* ****************************************************************************
+
+	_NSRunLoopChannel -- delivers finished operations to a run loop through
+	a pipe watched by a run loop source in the loop's common modes.  The
+	channel is closed and forgotten when its thread exits or its run loop
+	is deallocated, completions posted after that are dropped.
+
+** ***************************************************************************/
+
+@interface _NSRunLoopChannel : NSObject
+{
+	int _fds[2];
+	CFSocketRef _socket;
+	CFRunLoopSourceRef _source;
+	pthread_mutex_t _lock;
+	NSOperation *_head;
+	NSOperation *_tail;
+}
+
++ (id) channelForRunLoop:(NSRunLoop *)rl;
+
+- (void) post:(NSOperation *)op;
+- (void) deliver;
+- (void) close:(NSRunLoop *)rl;
+
+@end
+
+static NSMapTable *__channels = NULL;
+static pthread_mutex_t __channelLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static void
+_ChannelCallback(CFSocketRef s,
+				 CFSocketCallBackType type,
+				 CFDataRef address,
+				 const void *data,
+				 void *info)
+{
+	[(_NSRunLoopChannel *)info deliver];
+}
+
+void
+_NSRunLoopChannelRemove(NSRunLoop *rl)		// rl's thread exits or rl is
+{											// being deallocated
+	_NSRunLoopChannel *c = nil;
+
+	pthread_mutex_lock(&__channelLock);
+	if (__channels && (c = NSMapGet(__channels, rl)))
+		{
+		[c retain];
+		NSMapRemove(__channels, rl);
+		}
+	pthread_mutex_unlock(&__channelLock);
+
+	[c close: rl];
+	[c release];
+}
+
+@implementation _NSRunLoopChannel
+
++ (id) channelForRunLoop:(NSRunLoop *)rl
+{
+	_NSRunLoopChannel *c;
+
+	pthread_mutex_lock(&__channelLock);
+	if (!__channels)
+		{
+		__channels = NSCreateMapTable(NSNonOwnedPointerMapKeyCallBacks,
+									  NSObjectMapValueCallBacks, 0);
+		[[NSNotificationCenter defaultCenter]
+				addObserver: self
+				selector: @selector(_threadExiting:)
+				name: NSThreadExiting
+				object: nil];
+		}
+	if (!(c = NSMapGet(__channels, rl))
+			&& (c = [[self alloc] initWithRunLoop: rl]))
+		{
+		NSMapInsert(__channels, rl, c);
+		[c release];
+		}
+	[c retain];
+	pthread_mutex_unlock(&__channelLock);
+
+	return [c autorelease];
+}
+
++ (void) _threadExiting:(NSNotification *)n		// posted on exiting thread
+{
+	NSDictionary *d = [[n object] threadDictionary];
+	NSRunLoop *rl = [d objectForKey: @"NSRunLoopThreadKey"];
+
+	if (rl)
+		_NSRunLoopChannelRemove(rl);
+}
+
+- (id) initWithRunLoop:(NSRunLoop *)rl
+{
+	CFSocketContext cx = { 1, self, NULL, NULL, NULL };
+
+	if (pipe(_fds) < 0)
+		{
+		NSLog(@"NSOperation: unable to create run loop channel %s",
+				strerror(errno));
+		[self release];
+		return nil;
+		}
+	fcntl(_fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(_fds[1], F_SETFL, O_NONBLOCK);
+	fcntl(_fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(_fds[1], F_SETFD, FD_CLOEXEC);
+	pthread_mutex_init(&_lock, NULL);
+
+	_socket = CFSocketCreateWithNative(NULL, _fds[0], kCFSocketReadCallBack,
+									   &_ChannelCallback, &cx);
+	_source = CFSocketCreateRunLoopSource(NULL, _socket, 0);
+	CFRunLoopAddSource((CFRunLoopRef)rl, _source, kCFRunLoopCommonModes);
+
+	return self;
+}
+
+- (void) dealloc
+{
+	if (_socket)
+		{
+		if (_fds[1] >= 0)
+			close(_fds[1]);
+		close(_fds[0]);
+		CFRelease(_source);
+		CFRelease(_socket);
+		pthread_mutex_destroy(&_lock);
+		}
+
+	[super dealloc];
+}
+
+- (void) close:(NSRunLoop *)rl				// rl's thread or its dealloc
+{
+	NSOperation *op, *next;
+
+	CFRunLoopRemoveSource((CFRunLoopRef)rl, _source, kCFRunLoopCommonModes);
+
+	pthread_mutex_lock(&_lock);
+	close(_fds[1]);
+	_fds[1] = -1;
+	op = _head;
+	_head = _tail = nil;
+	pthread_mutex_unlock(&_lock);
+
+	for (; op; op = next)					// undeliverable
+		{
+		next = op->_nextReady;
+		[op release];
+		}
+}
+
+- (void) post:(NSOperation *)op				// any thread
+{
+	pthread_mutex_lock(&_lock);
+	if (_fds[1] >= 0)						// else run loop is gone
+		{
+		[op retain];
+		op->_nextReady = nil;
+		if (_head == nil)					// one byte per batch of posts
+			{
+			_head = op;
+			write(_fds[1], "", 1);
+			}
+		else
+			_tail->_nextReady = op;
+		_tail = op;
+		}
+	pthread_mutex_unlock(&_lock);
+}
+
+- (void) deliver							// run loop's thread
+{
+	NSOperation *op, *next;
+	char buf[64];
+
+	while (read(_fds[0], buf, sizeof(buf)) > 0);
+
+	pthread_mutex_lock(&_lock);
+	op = _head;
+	_head = _tail = nil;
+	pthread_mutex_unlock(&_lock);
+
+	for (; op; op = next)
+		{
+		next = op->_nextReady;
+		[op _deliverCompletion];
+		[op release];
+		}
+}
+
+@end
+
+/* ****************************************************************************
+
+	NSOperation
+
+** ***************************************************************************/
+
+static BOOL
+RemoveDependent(NSOperation *op, NSOperation *dependent)
+{
+	unsigned int i;
+
+	for (i = 0; i < op->_dependentCount; i++)
+		if (op->_dependents[i] == dependent)
+			{
+			op->_dependents[i] = op->_dependents[--op->_dependentCount];
+			return YES;
+			}
+
+	return NO;
+}
+
+@implementation NSOperation
+
+- (void) dealloc
+{
+	NSUInteger i, count = [_dependencies count];
+
+	pthread_mutex_lock(&__opLock);
+	for (i = 0; i < count; i++)
+		RemoveDependent([_dependencies objectAtIndex: i], self);
+	pthread_mutex_unlock(&__opLock);
+
+	free(_dependents);
+	[_dependencies release];
+	[_completionBlock release];
+	[_completionTarget release];
+	[_completionChannel release];
+
+	[super dealloc];
+}
+
+- (void) start
+{
+	unsigned int state = OP_STATE(self);
+
+	if (state & (OP_EXECUTING | OP_FINISHED))
+		[NSException raise: NSInvalidArgumentException
+					 format: @"NSOperation %@ already started", self];
+	if (!(state & OP_CANCELLED) && ![self isReady])
+		[NSException raise: NSInvalidArgumentException
+					 format: @"NSOperation %@ is not ready", self];
+
+	if (!(state & OP_CANCELLED))
+		{
+		__atomic_or_fetch(&_state, OP_EXECUTING, __ATOMIC_RELEASE);
+		[self main];
+		}
+
+	[self _finish];
+}
+
+- (void) main								{ }
+
+- (void) _finish
+{
+	NSOperationQueue *queue = _queue;
+	NSOperation **ready;
+	unsigned int i, count, n = 0;
+
+	pthread_mutex_lock(&__opLock);
+	ready = _dependents;
+	count = _dependentCount;
+	__atomic_store_n(&_state, (_state & ~OP_EXECUTING) | OP_FINISHED,
+					 __ATOMIC_RELEASE);
+	_dependents = NULL;
+	_dependentCount = _dependentSize = 0;
+
+	for (i = 0; i < count; i++)				// queued dependents whose last
+		{									// dependency this was are ready
+		NSOperation *d = ready[i];
+
+		if (--d->_pendingDependencies == 0 && d->_queue)
+			ready[n++] = [d retain];
+		}
+
+	if (__opWaiters)
+		pthread_cond_broadcast(&__opDone);
+	pthread_mutex_unlock(&__opLock);
+
+	for (i = 0; i < n; i++)
+		{
+		[ready[i]->_queue _operationReady: ready[i]];
+		[ready[i] release];
+		}
+	free(ready);
+
+#ifdef __BLOCKS__
+	if (_completionBlock)
+		((void (^)(void))_completionBlock)();
+#endif
+	if (_completionChannel)
+		[_completionChannel post: self];
+
+	[queue _operationFinished: self];		// may release us
+}
+
+- (void) _deliverCompletion
+{
+	[_completionTarget performSelector: _completionAction withObject: self];
+}
+
+- (void) cancel								// a cancelled operation is ready,
+{											// its dependencies are ignored
+	NSOperationQueue *queue = nil;
+	NSUInteger i, count;
+
+	if (__atomic_fetch_or(&_state, OP_CANCELLED, __ATOMIC_ACQ_REL)
+			& (OP_CANCELLED | OP_EXECUTING | OP_FINISHED))
+		return;
+
+	pthread_mutex_lock(&__opLock);
+	if (_pendingDependencies > 0)
+		{
+		count = [_dependencies count];
+		for (i = 0; i < count; i++)
+			RemoveDependent([_dependencies objectAtIndex: i], self);
+		__atomic_store_n(&_pendingDependencies, 0, __ATOMIC_RELEASE);
+		queue = _queue;
+		}
+	pthread_mutex_unlock(&__opLock);
+
+	[queue _operationReady: self];
+}
+
+- (BOOL) isCancelled				{ return (OP_STATE(self) & OP_CANCELLED) != 0; }
+- (BOOL) isExecuting				{ return (OP_STATE(self) & OP_EXECUTING) != 0; }
+- (BOOL) isFinished					{ return (OP_STATE(self) & OP_FINISHED) != 0; }
+- (BOOL) isConcurrent				{ return NO; }
+- (BOOL) isAsynchronous				{ return NO; }
+
+- (BOOL) isReady
+{
+	return __atomic_load_n(&_pendingDependencies, __ATOMIC_ACQUIRE) == 0;
+}
+
+- (void) addDependency:(NSOperation *)op
+{
+	pthread_mutex_lock(&__opLock);
+	if (!_dependencies)
+		_dependencies = [NSMutableArray new];
+	if ([_dependencies indexOfObjectIdenticalTo: op] == NSNotFound)
+		{
+		[_dependencies addObject: op];
+		if (!(OP_STATE(op) & OP_FINISHED) && !(OP_STATE(self) & OP_CANCELLED))
+			{
+			if (op->_dependentCount == op->_dependentSize)
+				{
+				op->_dependentSize = MAX(4, op->_dependentSize * 2);
+				op->_dependents = realloc(op->_dependents,
+									op->_dependentSize * sizeof(void *));
+				}
+			op->_dependents[op->_dependentCount++] = self;
+			_pendingDependencies++;
+		}	}
+	pthread_mutex_unlock(&__opLock);
+}
+
+- (void) removeDependency:(NSOperation *)op
+{
+	NSOperationQueue *queue = nil;
+
+	[op retain];
+	pthread_mutex_lock(&__opLock);
+	if ([_dependencies indexOfObjectIdenticalTo: op] != NSNotFound)
+		{
+		if (RemoveDependent(op, self) && --_pendingDependencies == 0)
+			queue = _queue;
+		[_dependencies removeObjectIdenticalTo: op];
+		}
+	pthread_mutex_unlock(&__opLock);
+	[op release];
+
+	[queue _operationReady: self];
+}
+
+- (NSArray *) dependencies
+{
+	NSArray *a;
+
+	pthread_mutex_lock(&__opLock);
+	a = (_dependencies) ? [_dependencies copy] : [NSArray new];
+	pthread_mutex_unlock(&__opLock);
+
+	return [a autorelease];
+}
+
+- (NSOperationQueuePriority) queuePriority		{ return _priority; }
+- (void) setQueuePriority:(NSOperationQueuePriority)p	{ _priority = p; }
+
+- (void) waitUntilFinished
+{
+	while (!(OP_STATE(self) & OP_FINISHED) && PoolHelp());
+
+	pthread_mutex_lock(&__opLock);
+	__opWaiters++;
+	while (!(OP_STATE(self) & OP_FINISHED))
+		pthread_cond_wait(&__opDone, &__opLock);
+	__opWaiters--;
+	pthread_mutex_unlock(&__opLock);
+}
+
+#ifdef __BLOCKS__
+
+- (void (^)(void)) completionBlock				{ return _completionBlock; }
+
+- (void) setCompletionBlock:(void (^)(void))block
+{
+	id old = _completionBlock;
+
+	_completionBlock = [(id)block copy];
+	[old release];
+}
+
+#endif  /* __BLOCKS__ */
+
+- (void) setCompletionTarget:(id)target
+					  action:(SEL)action
+					  runLoop:(NSRunLoop *)runLoop
+{											// must be called on runLoop's
+	id c = nil;								// thread or before it runs,
+											// the first use adds a source
+	if (target && runLoop)
+		c = [_NSRunLoopChannel channelForRunLoop: runLoop];
+	ASSIGN(_completionTarget, target);
+	ASSIGN(_completionChannel, c);
+	_completionAction = action;
+}
+
+@end  /* NSOperation */
+
+/* ****************************************************************************
+
+	NSInvocationOperation
+
+** ***************************************************************************/
+
+@implementation NSInvocationOperation
+
+- (id) initWithTarget:(id)target selector:(SEL)sel object:(id)arg
+{
+	NSMethodSignature *sig = [target methodSignatureForSelector: sel];
+	NSInvocation *inv;
+
+	if (sig == nil)
+		{
+		[self release];
+		return nil;
+		}
+
+	inv = [NSInvocation invocationWithMethodSignature: sig];
+	[inv setTarget: target];
+	[inv setSelector: sel];
+	if ([sig numberOfArguments] > 2)
+		[inv setArgument: &arg atIndex: 2];
+
+	return [self initWithInvocation: inv];
+}
+
+- (id) initWithInvocation:(NSInvocation *)inv
+{
+	if ((self = [super init]))
+		{
+		_invocation = [inv retain];
+		[_invocation retainArguments];
+		}
+
+	return self;
+}
+
+- (void) dealloc
+{
+	[_invocation release];
+	[super dealloc];
+}
+
+- (void) main								{ [_invocation invoke]; }
+- (NSInvocation *) invocation				{ return _invocation; }
+
+- (id) result
+{
+	id r = nil;
+
+	if ([self isFinished] && ![self isCancelled]
+			&& *[[_invocation methodSignature] methodReturnType] == _C_ID)
+		[_invocation getReturnValue: &r];
+
+	return r;
+}
+
+@end  /* NSInvocationOperation */
+
+/* ****************************************************************************
+
+	NSBlockOperation
+
+** ***************************************************************************/
+
+#ifdef __BLOCKS__
+
+@implementation NSBlockOperation
+
++ (id) blockOperationWithBlock:(void (^)(void))block
+{
+	NSBlockOperation *op = [[self alloc] init];
+
+	[op addExecutionBlock: block];
+
+	return [op autorelease];
+}
+
+- (void) dealloc
+{
+	[_executionBlocks release];
+	[super dealloc];
+}
+
+- (void) addExecutionBlock:(void (^)(void))block
+{
+	id b = [(id)block copy];
+
+	if (!_executionBlocks)
+		_executionBlocks = [NSMutableArray new];
+	[_executionBlocks addObject: b];
+	[b release];
+}
+
+- (NSArray *) executionBlocks				{ return _executionBlocks; }
+
+- (void) main
+{
+	NSUInteger i, count = [_executionBlocks count];
+
+	for (i = 0; i < count; i++)
+		((void (^)(void))[_executionBlocks objectAtIndex: i])();
+}
+
+@end  /* NSBlockOperation */
+
+#endif  /* __BLOCKS__ */
+
+/* ****************************************************************************
+
+	NSOperationQueue
+
+	Operations that are ready wait in per priority FIFO lists and are handed
+	to the worker pool while fewer than maxConcurrentOperationCount of them
+	run.  Operations still waiting on dependencies are only in the list of
+	all operations until their last dependency finishes.
+
+** ***************************************************************************/
+
+#define PRIORITY_LEVELS		5
+
+typedef struct _QueueState {
+	pthread_mutex_t lock;
+	pthread_cond_t empty;
+	NSOperation *first;						// every operation in the queue
+	NSOperation *last;
+	NSOperation *ready[PRIORITY_LEVELS];	// VeryHigh first
+	NSOperation *readyTail[PRIORITY_LEVELS];
+	unsigned int count;
+	unsigned int running;
+} QueueState;
+
+
+static int
+PriorityLevel(NSOperationQueuePriority p)
+{
+	if (p >= NSOperationQueuePriorityVeryHigh)
+		return 0;
+	if (p >= NSOperationQueuePriorityHigh)
+		return 1;
+	if (p >= NSOperationQueuePriorityNormal)
+		return 2;
+
+	return (p > NSOperationQueuePriorityVeryLow) ? 3 : 4;
+}
+
+static void
+QueuePushReady(QueueState *q, NSOperation *op)
+{
+	int l = PriorityLevel([op queuePriority]);
+
+	op->_nextReady = nil;
+	if (q->readyTail[l])
+		q->readyTail[l]->_nextReady = op;
+	else
+		q->ready[l] = op;
+	q->readyTail[l] = op;
+}
+
+static NSOperation *
+QueuePopReady(QueueState *q)
+{
+	NSOperation *op;
+	int l;
+
+	for (l = 0; l < PRIORITY_LEVELS; l++)
+		if ((op = q->ready[l]))
+			{
+			if (!(q->ready[l] = op->_nextReady))
+				q->readyTail[l] = nil;
+			return op;
+			}
+
+	return nil;
+}
+
+static void
+QueueDispatch(QueueState *q, NSInteger max, BOOL suspended)
+{
+	NSOperation *op;
+
+	while (!suspended && (max < 0 || q->running < max)
+			&& (op = QueuePopReady(q)))
+		{
+		q->running++;
+		PoolSubmit(op);
+		}
+}
+
+
+@implementation NSOperationQueue
+
++ (NSOperationQueue *) currentQueue
+{
+	return (__currentWorker) ? __currentWorker->queue : nil;
+}
+
+- (id) init
+{
+	if ((self = [super init]))
+		{
+		QueueState *q = calloc(1, sizeof(QueueState));
+
+		pthread_mutex_init(&q->lock, NULL);
+		pthread_cond_init(&q->empty, NULL);
+		_private = q;
+		_maxConcurrent = NSOperationQueueDefaultMaxConcurrentOperationCount;
+		}
+
+	return self;
+}
+
+- (void) dealloc
+{
+	QueueState *q = _private;
+
+	pthread_mutex_destroy(&q->lock);
+	pthread_cond_destroy(&q->empty);
+	free(q);
+	[_name release];
+
+	[super dealloc];
+}
+
+- (void) addOperation:(NSOperation *)op
+{
+	QueueState *q = _private;
+	BOOL ready;
+
+	if (op->_queue || (OP_STATE(op) & (OP_EXECUTING | OP_FINISHED)))
+		[NSException raise: NSInvalidArgumentException
+					 format: @"NSOperation %@ already queued or run", op];
+
+	[op retain];
+	pthread_mutex_lock(&q->lock);
+	if (q->count++ == 0)					// keep the queue alive while it
+		[self retain];						// has operations
+	op->_next = nil;
+	if ((op->_prev = q->last))
+		q->last->_next = op;
+	else
+		q->first = op;
+	q->last = op;
+
+	pthread_mutex_lock(&__opLock);
+	op->_queue = self;
+	ready = (op->_pendingDependencies == 0);
+	pthread_mutex_unlock(&__opLock);
+
+	if (ready)
+		QueuePushReady(q, op);
+	QueueDispatch(q, _maxConcurrent, _suspended);
+	pthread_mutex_unlock(&q->lock);
+}
+
+- (void) addOperations:(NSArray *)ops waitUntilFinished:(BOOL)wait
+{
+	NSUInteger i, count = [ops count];
+
+	for (i = 0; i < count; i++)
+		[self addOperation: [ops objectAtIndex: i]];
+
+	if (wait)
+		for (i = 0; i < count; i++)
+			[[ops objectAtIndex: i] waitUntilFinished];
+}
+
+- (void) _operationReady:(NSOperation *)op
+{
+	QueueState *q = _private;
+
+	pthread_mutex_lock(&q->lock);
+	QueuePushReady(q, op);
+	QueueDispatch(q, _maxConcurrent, _suspended);
+	pthread_mutex_unlock(&q->lock);
+}
+
+- (void) _operationFinished:(NSOperation *)op
+{
+	QueueState *q = _private;
+	BOOL empty;
+
+	pthread_mutex_lock(&q->lock);
+	if (op->_prev)
+		op->_prev->_next = op->_next;
+	else
+		q->first = op->_next;
+	if (op->_next)
+		op->_next->_prev = op->_prev;
+	else
+		q->last = op->_prev;
+	op->_prev = op->_next = nil;
+	op->_queue = nil;
+
+	q->running--;
+	if ((empty = (--q->count == 0)))
+		pthread_cond_broadcast(&q->empty);
+	else
+		QueueDispatch(q, _maxConcurrent, _suspended);
+	pthread_mutex_unlock(&q->lock);
+
+	[op release];
+	if (empty)
+		[self release];
+}
+
+- (NSArray *) operations
+{
+	QueueState *q = _private;
+	NSMutableArray *a = [NSMutableArray arrayWithCapacity: q->count];
+	NSOperation *op;
+
+	pthread_mutex_lock(&q->lock);
+	for (op = q->first; op; op = op->_next)
+		[a addObject: op];
+	pthread_mutex_unlock(&q->lock);
+
+	return a;
+}
+
+- (NSUInteger) operationCount
+{
+	return ((QueueState *)_private)->count;
+}
+
+- (NSInteger) maxConcurrentOperationCount		{ return _maxConcurrent; }
+
+- (void) setMaxConcurrentOperationCount:(NSInteger)count
+{
+	QueueState *q = _private;
+
+	pthread_mutex_lock(&q->lock);
+	_maxConcurrent = (count < 0)
+				   ? NSOperationQueueDefaultMaxConcurrentOperationCount : count;
+	QueueDispatch(q, _maxConcurrent, _suspended);
+	pthread_mutex_unlock(&q->lock);
+}
+
+- (void) setSuspended:(BOOL)flag
+{
+	QueueState *q = _private;
+
+	pthread_mutex_lock(&q->lock);
+	_suspended = flag;
+	QueueDispatch(q, _maxConcurrent, _suspended);
+	pthread_mutex_unlock(&q->lock);
+}
+
+- (BOOL) isSuspended							{ return _suspended; }
+- (void) setName:(NSString *)name				{ ASSIGN(_name, name); }
+- (NSString *) name								{ return _name; }
+
+- (void) cancelAllOperations
+{
+	QueueState *q = _private;
+	NSMutableArray *a;
+	NSOperation *op;
+	NSUInteger i, count;
+
+	pthread_mutex_lock(&q->lock);
+	a = [NSMutableArray arrayWithCapacity: q->count];
+	for (op = q->first; op; op = op->_next)
+		[a addObject: op];
+	pthread_mutex_unlock(&q->lock);
+											// cancel may make operations
+	for (i = 0, count = [a count]; i < count; i++)		// ready, which takes
+		[[a objectAtIndex: i] cancel];					// the queue lock
+}
+
+- (void) waitUntilAllOperationsAreFinished
+{
+	QueueState *q = _private;
+
+	while (q->count > 0 && PoolHelp());
+
+	pthread_mutex_lock(&q->lock);
+	while (q->count > 0)
+		pthread_cond_wait(&q->empty, &q->lock);
+	pthread_mutex_unlock(&q->lock);
+}
+
+@end  /* NSOperationQueue */
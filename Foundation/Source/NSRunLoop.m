@@ -30,6 +30,7 @@
 #include <CoreFoundation/CFSocket.h>
 
 #include <sys/time.h>
+#include <math.h>
 
 
 // Class variables
@@ -46,8 +47,11 @@ extern BOOL _RunLoopAwaitsIdle(void);
 
 extern NSDate *_RunLoopSourceLimitDate(CFRunLoopSourceRef rs);
 extern void _RunLoopSourceInvalidate(CFRunLoopSourceRef rs);
-extern id _RunLoopSourceTarget(CFRunLoopSourceRef rs);
-extern int _RunLoopSourceHandle(CFRunLoopSourceRef rs);
+extern int _RunLoopPollMode(NSRunLoop *rl, NSString *mode, int timeout);
+extern void _RunLoopFreePollSets(NSMapTable *pollSets);
+extern void _NSRunLoopChannelRemove(NSRunLoop *rl);
+
+extern unsigned int __NSTimerFireDateEarlier;
 
 /* ****************************************************************************
 
@@ -82,6 +86,163 @@ extern int _RunLoopSourceHandle(CFRunLoopSourceRef rs);
 
 @end
 
+/* ****************************************************************************
+
+	TimerHeap -- per mode min-heap of timers ordered by fire time
+
+	A node's key may lag its timer's fire time (the timer fired or its fire
+	date was moved later) but never lead it.  Stale keys are refreshed and
+	invalid timers dropped as they reach the top, or in a sweep before the
+	heap grows.  Fire dates moved earlier re-key the whole heap.
+
+** ***************************************************************************/
+
+typedef struct _TimerNode {
+	NSTimeInterval fireTime;
+	NSTimer *timer;							// retained
+} TimerNode;
+
+typedef struct _TimerHeap {
+	TimerNode *nodes;
+	unsigned int count;
+	unsigned int size;
+	unsigned int earlier;					// __NSTimerFireDateEarlier seen
+} TimerHeap;
+
+
+static void
+TimerHeapUp(TimerHeap *h, unsigned int i)
+{
+	TimerNode n = h->nodes[i];
+
+	while (i > 0)
+		{
+		unsigned int parent = (i - 1) / 2;
+
+		if (h->nodes[parent].fireTime <= n.fireTime)
+			break;
+		h->nodes[i] = h->nodes[parent];
+		i = parent;
+		}
+	h->nodes[i] = n;
+}
+
+static void
+TimerHeapDown(TimerHeap *h, unsigned int i)
+{
+	TimerNode n = h->nodes[i];
+	unsigned int child;
+
+	while ((child = 2 * i + 1) < h->count)
+		{
+		if (child + 1 < h->count
+				&& h->nodes[child + 1].fireTime < h->nodes[child].fireTime)
+			child++;
+		if (n.fireTime <= h->nodes[child].fireTime)
+			break;
+		h->nodes[i] = h->nodes[child];
+		i = child;
+		}
+	h->nodes[i] = n;
+}
+
+static void
+TimerHeapRebuild(TimerHeap *h)				// drop invalid timers, refresh
+{											// keys and restore heap order
+	unsigned int i, j;
+
+	for (i = j = 0; i < h->count; i++)
+		{
+		NSTimer *t = h->nodes[i].timer;
+
+		if (!t->_is_valid)
+			[t release];
+		else
+			{
+			h->nodes[j].timer = t;
+			h->nodes[j++].fireTime = t->_fireTime;
+		}	}
+
+	h->count = j;
+	h->earlier = __NSTimerFireDateEarlier;
+	for (i = h->count / 2; i-- > 0;)
+		TimerHeapDown(h, i);
+}
+
+static void
+TimerHeapAdd(TimerHeap *h, NSTimer *t)
+{
+	if (h->count == h->size)
+		{
+		TimerHeapRebuild(h);				// sweep cancelled timers first
+		if (h->count > h->size / 2)
+			{
+			h->size = (h->size) ? h->size * 2 : 16;
+			h->nodes = realloc(h->nodes, h->size * sizeof(TimerNode));
+		}	}
+
+	h->nodes[h->count].fireTime = t->_fireTime;
+	h->nodes[h->count].timer = [t retain];
+	TimerHeapUp(h, h->count++);
+}
+
+static void
+TimerHeapPop(TimerHeap *h)
+{
+	[h->nodes[0].timer release];
+	if (--h->count > 0)
+		{
+		h->nodes[0] = h->nodes[h->count];
+		TimerHeapDown(h, 0);
+		}
+}
+
+static NSTimer *
+TimerHeapFire(TimerHeap *h)
+{
+	NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+
+	if (h->earlier != __NSTimerFireDateEarlier)
+		TimerHeapRebuild(h);
+
+	while (h->count > 0)
+		{
+		TimerNode *top = &h->nodes[0];
+		NSTimer *t = top->timer;
+
+		if (!t->_is_valid)						// lazily remove invalidated
+			TimerHeapPop(h);					// timers
+		else if (top->fireTime != t->_fireTime)
+			{									// fired or moved later since
+			top->fireTime = t->_fireTime;		// it was keyed
+			TimerHeapDown(h, 0);
+			}
+		else if (t->_fireTime > now)			// earliest valid timer
+			return t;
+		else
+			{									// Firing increments the timers
+			[t retain];							// fire date and can produce
+			[t fire];							// recursion into the run loop
+			[t release];						// which may reorder the heap
+			now = [NSDate timeIntervalSinceReferenceDate];
+			if (h->earlier != __NSTimerFireDateEarlier)
+				TimerHeapRebuild(h);
+		}	}
+
+	return nil;
+}
+
+static void
+TimerHeapFree(TimerHeap *h)
+{
+	unsigned int i;
+
+	for (i = 0; i < h->count; i++)
+		[h->nodes[i].timer release];
+	free(h->nodes);
+	free(h);
+}
+
 /* ****************************************************************************
 
 	NSRunLoop
@@ -121,13 +282,11 @@ extern int _RunLoopSourceHandle(CFRunLoopSourceRef rs);
 	[super init];
 
 	_mode_2_timers = NSCreateMapTable (NSNonRetainedObjectMapKeyCallBacks,
-									   NSObjectMapValueCallBacks, 0);
+									   NSNonOwnedPointerMapValueCallBacks, 0);
 	_mode_2_watchers = NSCreateMapTable (NSObjectMapKeyCallBacks,
 										 NSObjectMapValueCallBacks, 0);
-	_rfd_2_object = NSCreateMapTable (NSIntMapKeyCallBacks,
-									 NSObjectMapValueCallBacks, 0);
-	_wfd_2_object = NSCreateMapTable (NSIntMapKeyCallBacks,
-									 NSObjectMapValueCallBacks, 0);
+	_mode_2_pollset = NSCreateMapTable (NSObjectMapKeyCallBacks,
+										NSNonOwnedPointerMapValueCallBacks, 0);
 	_performers = [[NSMutableArray alloc] initWithCapacity:8];
 	_timedPerformers = [[NSMutableArray alloc] initWithCapacity:8];
 	_commonRunLoopModes[0] = NSDefaultRunLoopMode;
@@ -137,10 +296,17 @@ extern int _RunLoopSourceHandle(CFRunLoopSourceRef rs);
 
 - (void) dealloc
 {
+	NSMapEnumerator me = NSEnumerateMapTable(_mode_2_timers);
+	TimerHeap *h;
+	id mode;
+
+	_NSRunLoopChannelRemove(self);				// operation completions
+
+	while (NSNextMapEnumeratorPair(&me, (void **)&mode, (void **)&h))
+		TimerHeapFree(h);
 	NSFreeMapTable(_mode_2_timers);
-	NSFreeMapTable(_mode_2_watchers);
-	NSFreeMapTable (_rfd_2_object);
-	NSFreeMapTable (_wfd_2_object);
+	NSFreeMapTable(_mode_2_watchers);			// release sources before
+	_RunLoopFreePollSets(_mode_2_pollset);		// the sets they are in
 	[_performers release];
 	[_timedPerformers release];
 
@@ -155,7 +321,7 @@ extern int _RunLoopSourceHandle(CFRunLoopSourceRef rs);
 
 - (NSDate *) limitDateForMode:(NSString*)mode
 {
-	NSMutableArray *timers;
+	TimerHeap *timers;
 	NSMutableArray *watchers;
 	NSTimer *min_timer = nil;
 	CFRunLoopSourceRef min_source = NULL;
@@ -165,37 +331,9 @@ extern int _RunLoopSourceHandle(CFRunLoopSourceRef rs);
 	_PostRunLoopASAP();							// Post notifications
 
 	if ((timers = NSMapGet(_mode_2_timers, mode)))
-		{
-		NSTimeInterval minTime = 0;
-		NSTimer *timerWithNearestFireDate = nil;
-		int i = [timers count];
-
-		while (i-- > 0)							// Traverse list of timers for
-			{									// this RunLoop mode
-			min_timer = (NSTimer*)[timers objectAtIndex:i];
-												// if timer is not valid remove
-			if (!min_timer->_is_valid)			// it from the timers list
-				[timers removeObjectAtIndex: i];
-			else
-				{								// get time until fire date
-				NSTimeInterval tu = [[min_timer fireDate] timeIntervalSinceNow];
-
-				if (tu <= 0)					// Firing increments the timers
-					{							// fire date and can produce
-					[min_timer fire];			// recursion into this method
-
-					i = [timers count];			// restore loop sanity
-					timerWithNearestFireDate = nil;
-					minTime = 0;
-					_currentMode = mode;
-					}
-				else if ((tu < minTime || minTime == 0))
-					{							// detect the timer with the
-					minTime = tu;				// nearest fire date
-					timerWithNearestFireDate = min_timer;
-			}	}	};
-
-		min_timer = timerWithNearestFireDate;
+		{										// Fire due timers and find
+		min_timer = TimerHeapFire(timers);		// the one with the
+		_currentMode = mode;					// nearest fire date
 		}										// Traverse list of rl sources
 												// for this RunLoop mode
 	if ((watchers = NSMapGet(_mode_2_watchers, mode)))
@@ -264,21 +402,14 @@ extern int _RunLoopSourceHandle(CFRunLoopSourceRef rs);
 
 - (void) acceptInputForMode:(NSString*)mode beforeDate:(NSDate*)limit_date
 {
-	NSMutableArray *watchers;
-	struct timeval timeout = {0};
-	struct timeval *select_timeout = &timeout;
-	fd_set read_fds;							// read-ready fds
-	fd_set write_fds;							// write-ready fds
-	fd_set exception_fds;						// exception fds
-	int select_return;
-	int nfds = 0;								// highest num FD in any set +1
+	int timeout = 0;							// ms to wait, -1 is forever
+	int ready;
 
 	NSAssert(mode, NSInvalidArgumentException);
 
-	_currentMode = mode;						// Determine time to wait and
-												// set SELECT_TIMEOUT.
-	if (limit_date)								// Call select() with 0 timeout
-		{										// (no wait) if no limit date
+	_currentMode = mode;						// Determine time to wait.
+	if (limit_date)								// Poll with 0 timeout (no
+		{										// wait) if no limit date
 		NSTimeInterval ti = [limit_date timeIntervalSinceNow];
 
 		if (ti <= 0.0)							// If LIMIT_DATE has already
@@ -290,130 +421,27 @@ extern int _RunLoopSourceHandle(CFRunLoopSourceRef rs);
 			return;
 			}
 
-		if (ti < INT_MAX)
+		if (ti < INT_MAX / 1000)
     		{									// Wait until the LIMIT_DATE.
 			DBLog(@"NSRunLoop accept input %f seconds from now %f\n", 						
 					[limit_date timeIntervalSinceReferenceDate], ti);
 
-			timeout.tv_sec = ti;
-			timeout.tv_usec = (ti - timeout.tv_sec) * 1000000.0;
-			}
+			timeout = (int)ceil(ti * 1000.0);	// round up so that timers
+			}									// are due when we wake
 		else
 			{
 			DBLog(@"NSRunLoop accept input waiting forever\n");
-			select_timeout = NULL;
-			}
-		}
-
-	FD_ZERO (&read_fds);						// Initialize the set of FDS
-	FD_ZERO (&write_fds);						// we'll pass to select()
-
-	if ((watchers = NSMapGet(_mode_2_watchers, mode)))
-		{										// Do the pre-listening set-up
-		int	k = [watchers count];				// for the file descriptors of
-												// this mode.
-		while (k-- > 0)
-			{
-			CFRunLoopSourceRef e = (CFRunLoopSourceRef)[watchers objectAtIndex:k];
-			CFOptionFlags f = _RunLoopSourceGetCallbackTypes(e);
-			int fd = _RunLoopSourceHandle(e);
-
-			if (!CFRunLoopSourceIsValid(e))
-				{
-				[watchers removeObjectAtIndex: k];
-				continue;
-				}
-
-			if ((f & kCFSocketWriteCallBack) || (f & kCFSocketConnectCallBack))
-				{
-				FD_SET (fd, &write_fds);
-				NSMapInsert (_wfd_2_object, INT2PTR(fd), e);
-				nfds = MAX(fd + 1, nfds);
-				}
-			if ((f & kCFSocketReadCallBack))
-				{
-				FD_SET (fd, &read_fds);
-				NSMapInsert (_rfd_2_object, INT2PTR(fd), e);
-				nfds = MAX(fd + 1, nfds);
-				}
-			if ((f & kCFSocketReadCallBack) || (f & kCFSocketAcceptCallBack))
-				{
-				int num_ports = 128;	// FIX ME #define this constant
-				int port_fd_array[num_ports];
-				id port = _RunLoopSourceTarget(e);
-
-				if ([port respondsToSelector: @selector(getFds:count:)])
-					[port getFds: port_fd_array count: &num_ports];
-				else
-					num_ports = 0;
-				DBLog(@"NSRunLoop listening to %d sockets\n", num_ports);
-
-				while (num_ports--)
-					{
-					fd = port_fd_array[num_ports];
-					FD_SET (fd, &read_fds);
-					NSMapInsert (_rfd_2_object, INT2PTR(fd), e);
-					nfds = MAX(fd + 1, nfds);
-					}
-				}
-		}	};
-
-	exception_fds = read_fds;
-
-	if (nfds == 0 && _RunLoopAwaitsIdle())		// Detect if have idle in Q
-		{
-		timeout.tv_sec = 0;
-		timeout.tv_usec = 0;
-		select_timeout = &timeout;
-		}
-
-	select_return = select( nfds,				// max of FD_SETSIZE check ?
-							&read_fds,
-							&write_fds,
-							&exception_fds,
-							select_timeout);
-
-	DBLog(@"NSRunLoop select returned %d\n", select_return);
-
-	if (select_return < 0)
-		{
-		if (errno == EINTR)							// a signal was caught
-			select_return = 0;
-		else										// Some kind of exceptional
-			{										// condition has occurred
-			if (errno != EBADF)
-				abort();							// abort if not stale fd
-			perror("*** NSRunLoop acceptInputForMode:beforeDate: in select()");
-			select_return = 0;
+			timeout = -1;
 		}	}
+												// Wait on the descriptors
+	ready = _RunLoopPollMode(self, mode, timeout);	// registered for mode
+												// and dispatch ready ones
+	DBLog(@"NSRunLoop poll returned %d\n", ready);
 
-	if (select_return == 0)			// Detect an idle NSRunLoop
+	if (ready == 0)								// Detect an idle NSRunLoop
 		_PostRunLoopIdle();
-	else							// Inspect all file descriptors select()
-		{							// says are ready, notify the respective
-		int fd_index = 0;			// object for each ready fd.
-		CFRunLoopSourceRef rs;
-
-		for (; fd_index < nfds; fd_index++)
-			{
-			if (FD_ISSET (fd_index, &write_fds))
-				{
-				rs = NSMapGet(_wfd_2_object, INT2PTR(fd_index));
-				NSAssert(rs, NSInternalInconsistencyException);
-				_RunLoopSourceWriteReady(rs, fd_index);
-				}
-
-			if (FD_ISSET (fd_index, &read_fds))
-				{
-				rs = NSMapGet(_rfd_2_object, INT2PTR(fd_index));
-				NSAssert(rs, NSInternalInconsistencyException);
-				_RunLoopSourceReadReady(rs, fd_index);
-		}	}	}
 
 	_PostRunLoopASAP();
-
-	NSResetMapTable (_rfd_2_object);				// Clean up before return
-	NSResetMapTable (_wfd_2_object);
 	[self _checkPerformers];
 	_currentMode = nil;
 }
@@ -525,16 +553,16 @@ extern int _RunLoopSourceHandle(CFRunLoopSourceRef rs);
 
 - (void) addTimer:(NSTimer *)timer forMode:(NSString*)mode
 {
-	NSMutableArray *timers = NSMapGet(_mode_2_timers, mode);
+	TimerHeap *timers = NSMapGet(_mode_2_timers, mode);
 
 	if (!timers)									// Add timer. It is removed
 		{											// when it becomes invalid
-		timers = [NSMutableArray new];
+		timers = calloc(1, sizeof(TimerHeap));
+		timers->earlier = __NSTimerFireDateEarlier;
 		NSMapInsert (_mode_2_timers, mode, timers);
-		[timers release];
 		}				
 													// FIX ME Should we make  
-	[timers addObject: timer];						// sure it isn't already 
+	TimerHeapAdd(timers, timer);					// sure it isn't already 
 }													// there?
 
 @end  /* NSRunLoop */
@@ -19,6 +19,8 @@
 #include <CoreFoundation/CoreFoundation.h>
 #include <CoreFoundation/CFStream.h>
 
+#include <fcntl.h>
+
 
 @implementation NSStream
 
@@ -29,6 +31,13 @@
 	return (_delegate = (id <NSStreamDelegate>)self);
 }
 
+- (void) dealloc
+{											// socket streams share their fd,
+	if (_sm.ownsDescriptor && _fd >= 0)		// CFSocketInvalidate closes it
+		close(_fd);
+	[super dealloc];
+}
+
 - (void) open
 {
 	if (_streamStatus != NSStreamStatusNotOpen)
@@ -55,6 +64,9 @@
 
 		[self removeFromRunLoop:rl forMode:(id)kCFRunLoopCommonModes];
 		}
+
+	if (_sm.ownsDescriptor && _fd >= 0)
+		close(_fd), _fd = -1;
 }
 
 - (void) scheduleInRunLoop:(NSRunLoop *)rl forMode:(NSString *)m  { SUBCLASS; }
@@ -81,6 +93,23 @@
 
 + (id) alloc			  					{ return NSAllocateObject(self); }
 
++ (id) inputStreamWithFileAtPath:(NSString *)path
+{
+	return [[[self alloc] initWithFileAtPath: path] autorelease];
+}
+
+- (id) initWithFileAtPath:(NSString *)path
+{
+	if ((self = [self init]))
+		{
+		if ((_fd = open([path fileSystemRepresentation], O_RDONLY)) < 0)
+			return _NSInitError(self, @"unable to open %@", path);
+		_sm.ownsDescriptor = YES;
+		}
+
+	return self;
+}
+
 - (void) _readDescriptorReady:(id)sender
 {
 //	NSLog(@"NSStream _readDescriptorReady");
@@ -99,6 +128,10 @@
 	CFSocketRef s = CFSocketCreateWithNative(NULL, _fd, of, cb, &cx);
     CFRunLoopSourceRef rs = CFSocketCreateRunLoopSource(NULL, s, 0);
 
+	if (_sm.ownsDescriptor)						// fd outlives the source
+		CFSocketSetSocketFlags(s, CFSocketGetSocketFlags(s)
+								  & ~kCFSocketCloseOnInvalidate);
+
     CFRunLoopAddSource((CFRunLoopRef)rl, rs, (CFStringRef)m);
     CFRelease(rs);
 	_socket = s;
@@ -145,6 +178,25 @@
 
 + (id) alloc			  					{ return NSAllocateObject(self); }
 
++ (id) outputStreamToFileAtPath:(NSString *)path append:(BOOL)flag
+{
+	return [[[self alloc] initToFileAtPath:path append:flag] autorelease];
+}
+
+- (id) initToFileAtPath:(NSString *)path append:(BOOL)flag
+{
+	if ((self = [self init]))
+		{
+		int o = O_WRONLY | O_CREAT | ((flag) ? O_APPEND : O_TRUNC);
+
+		if ((_fd = open([path fileSystemRepresentation], o, 0644)) < 0)
+			return _NSInitError(self, @"unable to open %@", path);
+		_sm.ownsDescriptor = YES;
+		}
+
+	return self;
+}
+
 - (void) _writeDescriptorReady:(id)sender
 {
 //	NSLog(@"NSStream _writeDescriptorReady");
@@ -162,6 +214,10 @@
 	CFSocketRef s = CFSocketCreateWithNative(NULL, _fd, of, cb, &cx);
     CFRunLoopSourceRef rs = CFSocketCreateRunLoopSource(NULL, s, 0);
 
+	if (_sm.ownsDescriptor)						// fd outlives the source
+		CFSocketSetSocketFlags(s, CFSocketGetSocketFlags(s)
+								  & ~kCFSocketCloseOnInvalidate);
+
     CFRunLoopAddSource((CFRunLoopRef)rl, rs, (CFStringRef)m);
     CFRelease(rs);
 	_socket = s;
@@ -38,6 +38,7 @@
 
 #define HASH_STR_LENGTH		63
 #define MAXDEC 				18
+#define CSTRING_INLINE_MAX	23				// longest C string held inline
 
 
 static Class __nsStringClass;				// Abstract superclass
@@ -226,6 +227,473 @@ static NSCharacterSet *__pathSep = nil;
 
 @end
 
+/* ****************************************************************************
+
+ 		String search -- scans over the storage of the concrete classes
+
+ 		C strings are searched a byte at a time with memchr() and memcmp(),
+ 		unichar strings with an SSE2 scan for the first character, and long
+ 		or case folded needles with a Boyer-Moore-Horspool skip.  Case is
+ 		folded through tables: the least byte of each byte's case class and
+ 		pages of uni_tolower() built as they are needed.
+
+** ***************************************************************************/
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define HORSPOOL_MIN		8				// needle length at which skipping
+											// beats a first character scan
+#define PLAIN_MAX			0x02ff			// below the first nonspacing and
+											// singly decomposed characters
+#define NEEDLE_STACK		256
+
+extern NSStringEncoding __StringEncoding;
+
+static NSStringEncoding __foldEncoding = 0;	// encoding of the byte tables
+static unsigned char __byteFold[256];		// least byte of the case class
+static BOOL __bytePlain[256];				// byte maps below PLAIN_MAX
+static BOOL __bytesPlain;					// every byte does
+static unichar *__charFold[256];			// uni_tolower() pages
+
+
+static void
+_BuildByteTables(void)
+{
+	NSStringEncoding e = __StringEncoding;
+	unichar lower[256];
+	BOOL plain = YES;
+	int a, b;
+
+	for (b = 0; b < 256; b++)
+		{
+		unichar u = ByteToUChar((char)b);
+
+		lower[b] = uni_tolower(u);
+		if (!(__bytePlain[b] = (u <= PLAIN_MAX)))
+			plain = NO;
+		for (a = 0; lower[a] != lower[b]; a++);
+		__byteFold[b] = a;
+		}
+	__bytesPlain = plain;
+	__atomic_store_n(&__foldEncoding, e, __ATOMIC_RELEASE);
+}
+
+static inline void
+_ByteTables(void)
+{
+	if (__atomic_load_n(&__foldEncoding, __ATOMIC_ACQUIRE) != __StringEncoding)
+		_BuildByteTables();
+}
+
+static unichar *
+_BuildCharFold(unsigned hi)
+{
+	unichar *page = malloc(256 * sizeof(unichar));
+	unichar *expected = NULL;
+	int i;
+
+	for (i = 0; i < 256; i++)
+		page[i] = uni_tolower((unichar)((hi << 8) | i));
+
+	if (!__atomic_compare_exchange_n(&__charFold[hi], &expected, page, NO,
+									 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		{
+		free(page);								// another thread won
+		page = expected;
+		}
+
+	return page;
+}
+
+static inline unichar
+_FoldChar(unichar c)
+{
+	unichar *page = __atomic_load_n(&__charFold[c >> 8], __ATOMIC_ACQUIRE);
+
+	return (page ? page : _BuildCharFold(c >> 8))[c & 0xff];
+}
+
+static inline const unsigned char *
+_CStringBytes(NSString *s)
+{
+	Class c = ((Class)s)->class_pointer;
+
+	if (c == __cStringClass || c == __mutableCStringClass
+			|| c == __constantStringClass)
+		return (const unsigned char *)((CFString *)s)->_cString;
+
+	return NULL;
+}
+
+static inline const unichar *
+_UStringChars(NSString *s)
+{
+	Class c = ((Class)s)->class_pointer;
+
+	if (c == __uStrClass || c == __mutableUStringClass)
+		return ((CFString *)s)->_uniChars;
+
+	return NULL;
+}
+
+/* ****************************************************************************
+
+	Find the first (or last) occurrence of needle p of length m in the
+	n units at h.  A fold table or flag means p is already case folded and
+	each unit of h is folded as it is read.  Returns NSNotFound or the
+	index of the match.
+
+** ***************************************************************************/
+
+#define FOLD8(f, b)		((f) ? (f)[b] : (b))
+#define FOLD16(f, c)	((f) ? _FoldChar(c) : (c))
+
+static NSUInteger
+_BytesFind(const unsigned char *h, NSUInteger n,
+		   const unsigned char *p, NSUInteger m, const unsigned char *f)
+{
+	NSUInteger skip[256];
+	NSUInteger i, pos;
+
+	if (!f && m < HORSPOOL_MIN)
+		{
+		const unsigned char *s = h;
+		const unsigned char *e = h + n - m + 1;			// past last candidate
+
+		while (s < e && (s = memchr(s, p[0], e - s)))
+			{
+			if (memcmp(s + 1, p + 1, m - 1) == 0)
+				return s - h;
+			s++;
+			}
+
+		return NSNotFound;
+		}
+
+	for (i = 0; i < 256; i++)
+		skip[i] = m;
+	for (i = 0; i < m - 1; i++)
+		skip[p[i]] = m - 1 - i;
+
+	for (pos = 0; pos + m <= n; pos += skip[i])
+		{
+		if ((i = FOLD8(f, h[pos + m - 1])) == p[m - 1])
+			{
+			NSUInteger j = 0;
+
+			if (f)
+				while (j < m - 1 && f[h[pos + j]] == p[j])
+					j++;
+			else if (memcmp(h + pos, p, m - 1) == 0)
+				j = m - 1;
+			if (j == m - 1)
+				return pos;
+		}	}
+
+	return NSNotFound;
+}
+
+static NSUInteger
+_BytesFindBack(const unsigned char *h, NSUInteger n,
+			   const unsigned char *p, NSUInteger m, const unsigned char *f)
+{
+	NSUInteger skip[256];
+	NSUInteger i, pos = n - m;
+
+	for (i = 0; i < 256; i++)
+		skip[i] = m;
+	for (i = m - 1; i > 0; i--)
+		skip[p[i]] = i;
+
+	for (;;)
+		{
+		if ((i = FOLD8(f, h[pos])) == p[0])
+			{
+			NSUInteger j = 1;
+
+			while (j < m && FOLD8(f, h[pos + j]) == p[j])
+				j++;
+			if (j == m)
+				return pos;
+			}
+		if (pos < skip[i])
+			break;
+		pos -= skip[i];
+		}
+
+	return NSNotFound;
+}
+
+static NSUInteger
+_CharsFind(const unichar *h, NSUInteger n,
+		   const unichar *p, NSUInteger m, BOOL f)
+{
+	NSUInteger skip[256];
+	NSUInteger i, pos = 0;
+
+	if (!f && m < HORSPOOL_MIN)
+		{
+		NSUInteger last = n - m;						// last candidate
+#ifdef __SSE2__
+		__m128i first = _mm_set1_epi16((short)p[0]);
+
+		for (; pos + 8 <= n && pos <= last; pos += 8)
+			{
+			__m128i v = _mm_loadu_si128((const __m128i *)(h + pos));
+			unsigned bits = _mm_movemask_epi8(_mm_cmpeq_epi16(v, first));
+
+			while (bits)
+				{
+				NSUInteger c = pos + (__builtin_ctz(bits) >> 1);
+
+				if (c > last)
+					return NSNotFound;
+				if (memcmp(h + c + 1, p + 1, (m - 1) * sizeof(unichar)) == 0)
+					return c;
+				bits &= bits - 1;						// both bytes of the
+				bits &= bits - 1;						// matching unichar
+			}	}
+#endif
+		for (; pos <= last; pos++)
+			if (h[pos] == p[0]
+					&& memcmp(h + pos + 1, p + 1, (m - 1) * sizeof(unichar)) == 0)
+				return pos;
+
+		return NSNotFound;
+		}
+
+	for (i = 0; i < 256; i++)						// skip on the low byte
+		skip[i] = m;
+	for (i = 0; i < m - 1; i++)
+		skip[p[i] & 0xff] = m - 1 - i;
+
+	for (; pos + m <= n; pos += skip[i & 0xff])
+		{
+		if ((i = FOLD16(f, h[pos + m - 1])) == p[m - 1])
+			{
+			NSUInteger j = 0;
+
+			while (j < m - 1 && FOLD16(f, h[pos + j]) == p[j])
+				j++;
+			if (j == m - 1)
+				return pos;
+		}	}
+
+	return NSNotFound;
+}
+
+static NSUInteger
+_CharsFindBack(const unichar *h, NSUInteger n,
+			   const unichar *p, NSUInteger m, BOOL f)
+{
+	NSUInteger skip[256];
+	NSUInteger i, pos = n - m;
+
+	for (i = 0; i < 256; i++)
+		skip[i] = m;
+	for (i = m - 1; i > 0; i--)
+		skip[p[i] & 0xff] = i;
+
+	for (;;)
+		{
+		if ((i = FOLD16(f, h[pos])) == p[0])
+			{
+			NSUInteger j = 1;
+
+			while (j < m && FOLD16(f, h[pos + j]) == p[j])
+				j++;
+			if (j == m)
+				return pos;
+			}
+		if (pos < skip[i & 0xff])
+			break;
+		pos -= skip[i & 0xff];
+		}
+
+	return NSNotFound;
+}
+
+static BOOL
+_CharsPlain(const unichar *u, NSUInteger n)
+{
+	NSUInteger i = 0;
+#ifdef __SSE2__
+	__m128i max = _mm_set1_epi16(PLAIN_MAX);
+	__m128i zero = _mm_setzero_si128();
+
+	for (; i + 8 <= n; i += 8)
+		{
+		__m128i v = _mm_loadu_si128((const __m128i *)(u + i));
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_subs_epu16(v, max), zero))
+				!= 0xffff)
+			return NO;
+		}
+#endif
+	for (; i < n; i++)
+		if (u[i] > PLAIN_MAX)
+			return NO;
+
+	return YES;
+}
+
+static BOOL
+_BytesPlain(const unsigned char *b, NSUInteger n)
+{
+	NSUInteger i;
+
+	if (__bytesPlain)
+		return YES;
+	for (i = 0; i < n; i++)
+		if (!__bytePlain[b[i]])
+			return NO;
+
+	return YES;
+}
+
+/* ****************************************************************************
+
+	_SearchString -- rangeOfString:options:range: of the concrete classes
+
+	Returns NO if the receiver is not a concrete string or the search needs
+	composed character sequences, leaving it to the general search.  A
+	non literal search gives the literal result when the needle and the
+	searched range (and the character after it) are all below U+0300, as
+	none of those characters are nonspacing or decompose to a single one.
+
+** ***************************************************************************/
+
+static BOOL
+_SearchString(NSString *str, NSString *aString, NSUInteger m,
+			  unsigned int mask, NSRange aRange, NSRange *result)
+{
+	NSUInteger n = aRange.length;
+	NSUInteger count = ((CFString *)str)->_count;
+	NSUInteger end = NSMaxRange(aRange);
+	NSUInteger ahead;
+	BOOL fold = (mask & NSCaseInsensitiveSearch) ? YES : NO;
+	BOOL back = (mask & NSBackwardsSearch) ? YES : NO;
+	const unsigned char *hb = _CStringBytes(str);
+	const unichar *hu = (hb) ? NULL : _UStringChars(str);
+	unichar stack[NEEDLE_STACK];
+	unichar *u = stack;
+	NSUInteger i, at = NSNotFound;
+	BOOL handled = YES;
+
+	if (!hb && !hu)
+		return NO;
+
+	if (mask & NSAnchoredSearch)					// a single candidate
+		{
+		if (back)
+			aRange.location = end - m;
+		n = m;
+		}
+	ahead = (aRange.location + n < count) ? 1 : 0;	// unit after the range
+	if (m > NEEDLE_STACK)
+		u = malloc(m * sizeof(unichar));
+	if (!hb || !_CStringBytes(aString))
+		[aString getCharacters: u];
+
+	if (hb)
+		{
+		const unsigned char *nb = _CStringBytes(aString);
+		unsigned char *p = (unsigned char *)u;		// bytes fit in place
+
+		_ByteTables();
+		for (i = 0; i < m && handled; i++)
+			{
+			unsigned char b = (nb) ? nb[i] : (unsigned char)UCharToByte(u[i]);
+
+			if (!nb && ByteToUChar((char)b) != u[i])
+				handled = NO;						// needs a wider search
+			else if (!(mask & NSLiteralSearch) && !__bytePlain[b])
+				handled = NO;
+			p[i] = (fold) ? __byteFold[b] : b;
+			}
+		if (handled && !(mask & NSLiteralSearch))
+			handled = _BytesPlain(hb + aRange.location, n + ahead);
+		if (handled)
+			at = (back) ? _BytesFindBack(hb + aRange.location, n, p, m,
+										 (fold) ? __byteFold : NULL)
+						: _BytesFind(hb + aRange.location, n, p, m,
+									 (fold) ? __byteFold : NULL);
+		}
+	else
+		{
+		if (!(mask & NSLiteralSearch))
+			handled = _CharsPlain(u, m)
+					  && _CharsPlain(hu + aRange.location, n + ahead);
+		if (handled && fold)
+			for (i = 0; i < m; i++)
+				u[i] = _FoldChar(u[i]);
+		if (handled)
+			at = (back) ? _CharsFindBack(hu + aRange.location, n, u, m, fold)
+						: _CharsFind(hu + aRange.location, n, u, m, fold);
+		}
+
+	if (u != stack)
+		free(u);
+	if (handled)
+		*result = (at == NSNotFound) ? (NSRange){0, 0}
+									 : (NSRange){aRange.location + at, m};
+
+	return handled;
+}
+
+/* ****************************************************************************
+
+	Index of the first unit at which a and b differ in their first n.
+
+** ***************************************************************************/
+
+static inline unichar
+_CharAt(const unsigned char *b, const unichar *u, NSUInteger i)
+{
+	return (b) ? ByteToUChar((char)b[i]) : u[i];
+}
+
+static NSUInteger
+_CharsMismatch(const unichar *a, const unichar *b, NSUInteger n)
+{
+	NSUInteger i = 0;
+#ifdef __SSE2__
+	for (; i + 8 <= n; i += 8)
+		{
+		__m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+		unsigned bits = _mm_movemask_epi8(_mm_cmpeq_epi16(va, vb));
+
+		if (bits != 0xffff)
+			return i + (__builtin_ctz(~bits) >> 1);
+		}
+#endif
+	for (; i < n && a[i] == b[i]; i++);
+
+	return i;
+}
+
+static NSUInteger
+_BytesMismatch(const unsigned char *a, const unsigned char *b, NSUInteger n)
+{
+	NSUInteger i = 0;
+
+	for (; i + sizeof(unsigned long) <= n; i += sizeof(unsigned long))
+		{
+		unsigned long x, y;
+
+		memcpy(&x, a + i, sizeof(x));
+		memcpy(&y, b + i, sizeof(y));
+		if (x != y)
+			break;
+		}
+	for (; i < n && a[i] == b[i]; i++);
+
+	return i;
+}
+
 /* ****************************************************************************
 
  		NSString
@@ -287,12 +755,14 @@ _AllocCString( char *content, NSUInteger size, const char *bytes)
 
 + (id) stringWithCString:(const char*)bytes
 {
-	return [[[_NSCString alloc] initWithCString:bytes] autorelease];
+	NSUInteger len = (bytes ? strlen(bytes) : 0);
+
+	return [[__cStringClass _newWithCString:bytes length:len] autorelease];
 }
 
 + (id) stringWithCString:(const char*)bytes length:(NSUInteger)len
 {
-	return [[[_NSCString alloc] initWithCString:bytes length:len] autorelease];
+	return [[__cStringClass _newWithCString:bytes length:len] autorelease];
 }
 
 + (id) stringWithContentsOfFile:(NSString *)path
@@ -337,6 +807,12 @@ _AllocCString( char *content, NSUInteger size, const char *bytes)
 
 - (id) initWithCString:(const char*)byteString length:(NSUInteger)length
 {
+	if (((Class)self)->class_pointer == __uStrClass)	// +alloc placeholder
+		{
+		[self release];
+		return [__cStringClass _newWithCString:byteString length:length];
+		}
+
 	return [self initWithCStringNoCopy: _AllocCString(NULL, length, byteString)
 				 length:length
 				 freeWhenDone:YES];
@@ -345,7 +821,15 @@ _AllocCString( char *content, NSUInteger size, const char *bytes)
 - (id) initWithCString:(const char*)byteString
 {
 	NSUInteger length = (byteString ? strlen(byteString) : 0);
-	char *s = _AllocCString(NULL, length, byteString);
+	char *s;
+
+	if (((Class)self)->class_pointer == __uStrClass)	// +alloc placeholder
+		{
+		[self release];
+		return [__cStringClass _newWithCString:byteString length:length];
+		}
+
+	s = _AllocCString(NULL, length, byteString);
 
 	return [self initWithCStringNoCopy:s length:length freeWhenDone:YES];
 }
@@ -356,6 +840,16 @@ _AllocCString( char *content, NSUInteger size, const char *bytes)
 	UInt32 ucs4;
 	unichar	*p, *s;
 
+	if (length <= CSTRING_INLINE_MAX
+			&& ((Class)self)->class_pointer == __uStrClass)
+		{
+		for (i = 0; i < length && !(byteString[i] & 0x80); i++);
+		if (i == length)								// short and ASCII
+			{
+			[self release];
+			return [__cStringClass _newWithCString:byteString length:length];
+		}	}
+
 	for (i = 0, k = 0; i < length; i += j, k++)
 		if ((j = _UTF8toUCS4(&((byteString)[i]), &ucs4, length - i)) < 1)
 			return _NSInitError(self, @"UTF8 conversion failed");
@@ -382,7 +876,23 @@ _AllocCString( char *content, NSUInteger size, const char *bytes)
 
 - (id) initWithCharacters:(const unichar*)chars length:(NSUInteger)length
 {
-	unichar	*s = malloc(sizeof(unichar)*length);
+	unichar	*s;
+
+	if (length <= CSTRING_INLINE_MAX && chars
+			&& ((Class)self)->class_pointer == __uStrClass)
+		{
+		char b[CSTRING_INLINE_MAX];
+		NSUInteger i;
+
+		for (i = 0; i < length && chars[i] < 0x80; i++)
+			b[i] = (char)chars[i];
+		if (i == length)								// short and ASCII
+			{
+			[self release];
+			return [__cStringClass _newWithCString:b length:length];
+		}	}
+
+	s = malloc(sizeof(unichar)*length);
 
 	if (chars)
 		memcpy(s, chars, sizeof(unichar) * length);
@@ -735,6 +1245,14 @@ _AllocCString( char *content, NSUInteger size, const char *bytes)
 	if ((strLength = [aString length]) > aRange.length || strLength == 0)
 		return (NSRange){0, 0};
 
+	if (mask <= 15)
+		{
+		NSRange r;
+
+		if (_SearchString(self, aString, strLength, mask, aRange, &r))
+			return r;
+		}
+
 	switch (mask)
 		{
 		case 3:
@@ -1050,6 +1568,8 @@ _AllocCString( char *content, NSUInteger size, const char *bytes)
 					   options:(NSStringCompareOptions)mask
 					   range:(NSRange)aRange
 {								// FIX ME Should implement full POSIX.2 collate
+	const unsigned char *b1, *b2;
+	const unichar *u1, *u2;
 	NSUInteger s2len;
 
 	if (NSMaxRange(aRange) > _count)
@@ -1064,6 +1584,36 @@ _AllocCString( char *content, NSUInteger size, const char *bytes)
 	if (!(s2len = [aString length]))
 		return NSOrderedDescending;
 
+	u1 = ((b1 = _CStringBytes(self))) ? NULL : _UStringChars(self);
+	u2 = ((b2 = _CStringBytes(aString))) ? NULL : _UStringChars(aString);
+
+	if ((mask & NSLiteralSearch) && (b1 || u1) && (b2 || u2))
+		{
+		NSUInteger s1len = aRange.length;
+		NSUInteger i = 0, end = (s2len < s1len) ? s2len : s1len;
+
+		if (b1 && b2)							// skip the identical prefix
+			i = _BytesMismatch(b1 + aRange.location, b2, end);
+		else if (u1 && u2)
+			i = _CharsMismatch(u1 + aRange.location, u2, end);
+
+		for (; i < end; i++)
+			{
+			unichar c1 = _CharAt(b1, u1, aRange.location + i);
+			unichar c2 = _CharAt(b2, u2, i);
+
+			if (mask & NSCaseInsensitiveSearch)
+				c1 = _FoldChar(c1), c2 = _FoldChar(c2);
+			if (c1 != c2)
+				return (c1 < c2) ? NSOrderedAscending : NSOrderedDescending;
+			}
+
+		if (s1len > s2len)
+			return NSOrderedDescending;
+
+		return (s1len < s2len) ? NSOrderedAscending : NSOrderedSame;
+		}
+
 	if (mask & NSLiteralSearch)
 		{
 		NSUInteger i, end;
@@ -1083,8 +1633,8 @@ _AllocCString( char *content, NSUInteger size, const char *bytes)
 			{
 			for (i = 0; i < end; i++)
 				{
-				int c1 = uni_tolower(s1[i]);
-				int c2 = uni_tolower(s2[i]);
+				int c1 = _FoldChar(s1[i]);
+				int c2 = _FoldChar(s2[i]);
 
 				if (c1 < c2) 
 					return NSOrderedAscending;
@@ -1116,6 +1666,21 @@ _AllocCString( char *content, NSUInteger size, const char *bytes)
 		_CSequence *mySeq;
 		NSComparisonResult result;
 
+		if (((b1 && b2) || (u1 && u2)) && s2len > myCount
+				&& !uni_isnonsp(_CharAt(b1, u1, myCount)))
+			{				// resume at the last base character of the
+			NSUInteger k;	// identical prefix, a sequence start in both
+			NSUInteger n = ((end < s2len) ? end : s2len) - myCount;
+
+			k = myCount + ((b1) ? _BytesMismatch(b1 + myCount, b2 + myCount, n)
+								: _CharsMismatch(u1 + myCount, u2 + myCount, n));
+			while (k-- > myCount)
+				if (!uni_isnonsp(_CharAt(b1, u1, k)))
+					{
+					myCount = sCnt = k;
+					break;
+			}		}
+
 		while (myCount < end)
 			{
 			if (sCnt >= s2len)
@@ -2207,10 +2772,12 @@ _AllocCString( char *content, NSUInteger size, const char *bytes)
 
 		return (memcmp(_cString,((NSString *)aString)->_cString, _count) == 0);
 		}
+											// skip the identical prefix
+	mi = si = _CharsMismatch(_uniChars, ((_NSUString*)aString)->_uniChars, _count);
 
 	while((mi < _count) && (si < ((NSString *)aString)->_count))
 		{
-		if([self characterAtIndex:mi] == [aString characterAtIndex:si])
+		if(_uniChars[mi] == ((_NSUString*)aString)->_uniChars[si])
 			{
 			mi++;
 			si++;
@@ -2394,9 +2961,9 @@ _AllocCString( char *content, NSUInteger size, const char *bytes)
 		[NSException raise:NSRangeException format:@"Invalid location+length"];
 	
 	if (_count + stringLength > _capacity + aRange.length)
-		{
-		_capacity += stringLength - aRange.length;
-		if (_capacity < 2)
+		{										// grow geometrically so
+		_capacity = MAX(_capacity * 2, _count + offset);	// edits realloc
+		if (_capacity < 2)									// O(log n) times
 			_capacity = 2;
 		_uniChars = realloc(_uniChars, sizeof(unichar)*_capacity);
 		}
@@ -2636,6 +3203,28 @@ _AllocCString( char *content, NSUInteger size, const char *bytes)
 
 + (id) alloc						{ return NSAllocateObject(self); }
 
++ (id) _newWithCString:(const char*)bytes length:(NSUInteger)length
+{										// short strings keep their chars
+	_NSCString *s;						// inside the object's allocation
+
+	if (length <= CSTRING_INLINE_MAX)
+		{
+		s = _NSAllocateObjectExtra(__cStringClass, length + 1);
+		s->_cString = (char *)s + __cStringClass->instance_size;
+		if (bytes)
+			memcpy(s->_cString, bytes, length);
+		s->_dontFree = YES;
+		}
+	else
+		{
+		s = NSAllocateObject(__cStringClass);
+		s->_cString = _AllocCString(NULL, length, bytes);
+		}
+	s->_count = length;
+
+	return s;
+}
+
 - (id) initWithCStringNoCopy:(char*)byteString			// OPENSTEP designated 
 					  length:(NSUInteger)length			// initializer
 					  freeWhenDone:(BOOL)flag
@@ -18,6 +18,7 @@
 #include <Foundation/NSLock.h>
 #include <Foundation/NSString.h>
 #include <Foundation/NSNotification.h>
+#include <Foundation/Private/_NSObject.h>
 
 
 NSString *NSBecomingMultiThreaded = @"NSBecomingMultiThreadedNotification";
@@ -164,6 +165,9 @@ objc_thread_detach (SEL selector, id object, id argument)
 	if (!__hasEverBeenMultiThreaded)	// Won't work properly if threads are
 		{								// not all created by the objc runtime.
 		__hasEverBeenMultiThreaded = YES;
+#ifndef ATOMIC_REFCOUNT
+		__NSAtomicRefCount = YES;		// switch retain / release to atomics
+#endif
 
 		[NSNotificationCenter post: NSBecomingMultiThreaded object: nil];
 		}
@@ -17,6 +17,13 @@
 #include <Foundation/NSRunLoop.h>
 #include <Foundation/NSInvocation.h>
 
+#include <math.h>
+
+
+unsigned int __NSTimerFireDateEarlier = 0;		// bumped when a timer's fire
+												// date moves earlier so run
+												// loops re-key their heaps
+
 
 @implementation NSTimer
 
@@ -28,6 +35,7 @@
 
 	t->_interval = (seconds <= 0) ? 0.01 : seconds;
 	t->_fireDate = [[NSDate alloc] initWithTimeIntervalSinceNow: seconds];
+	t->_fireTime = [t->_fireDate timeIntervalSinceReferenceDate];
 	t->_is_valid = YES;
 	t->_target = [invocation retain];
 	t->_repeats = f;
@@ -45,6 +53,7 @@
 
 	t->_interval = (seconds <= 0) ? 0.01 : seconds;
 	t->_fireDate = [[NSDate alloc] initWithTimeIntervalSinceNow: seconds];
+	t->_fireTime = [t->_fireDate timeIntervalSinceReferenceDate];
 	t->_is_valid = YES;
 	t->_selector = selector;
 	t->_target = [object retain];
@@ -100,15 +109,14 @@
 		_is_valid = NO;
 	else if (_is_valid)
 		{
-		NSTimeInterval ti = [_fireDate timeIntervalSinceReferenceDate];
+		NSTimeInterval ti = _fireTime;			// skip missed intervals so
 		NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
-
-		NSAssert(now < 0.0, NSInternalInconsistencyException);
-
-		while (ti < now)						// FIX ME remove this
-			ti += _interval;
+												// the next fire date is in
+		if (ti <= now)							// the future
+			ti += _interval * (floor((now - ti) / _interval) + 1);
 		[_fireDate autorelease];
 		_fireDate = [[NSDate alloc] initWithTimeIntervalSinceReferenceDate: ti];
+		_fireTime = ti;
 		}
 
 	if (_selector)
@@ -128,9 +136,18 @@
 	[info release];
 }
 
+- (void) setFireDate:(NSDate *)date
+{
+	NSTimeInterval ti = [date timeIntervalSinceReferenceDate];
+
+	if (ti < _fireTime)							// run loop heaps can lazily
+		__NSTimerFireDateEarlier++;				// re-key later fire dates
+	ASSIGN(_fireDate, date);
+	_fireTime = ti;
+}
+
 - (BOOL) isValid						{ return _is_valid; }
 - (NSDate *) fireDate					{ return _fireDate; }
-- (void) setFireDate:(NSDate *)date		{ ASSIGN(_fireDate, date); }
 - (id) userInfo							{ return _info; }
 - (NSTimeInterval) timeInterval			{ return _interval; }
 
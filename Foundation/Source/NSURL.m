@@ -19,20 +19,33 @@
 #include <Foundation/NSArray.h>
 #include <Foundation/NSBundle.h>
 #include <Foundation/NSData.h>
+#include <Foundation/NSDate.h>
 #include <Foundation/NSDictionary.h>
+#include <Foundation/NSEnumerator.h>
 #include <Foundation/NSError.h>
 #include <Foundation/NSException.h>
 #include <Foundation/NSHost.h>
+#include <Foundation/NSLock.h>
+#include <Foundation/NSMapTable.h>
+#include <Foundation/NSPathUtilities.h>
 #include <Foundation/NSValue.h>
 #include <Foundation/NSString.h>
 #include <Foundation/NSRunLoop.h>
+#include <Foundation/NSStream.h>
+#include <Foundation/NSTimer.h>
 #include <Foundation/Private/_NSURL.h>
+#include <Foundation/Private/_NSDataGZ.h>
 
 #include <CoreFoundation/CFBase.h>
 #include <CoreFoundation/CFRunLoop.h>
 #include <CoreFoundation/CFSocket.h>
 
 #include <ctype.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 
@@ -52,7 +65,8 @@ NSString *NSURLAuthenticationMethodClientCertificate = @"ClientCert";
 NSString *NSURLAuthenticationMethodServerTrust       = @"ServerTrust";
 
 static NSMutableArray *__registeredURLProtocols = nil;
-static NSString *__content = @"Accept: */*\r\nAccept-Encoding: identity\r\n";
+static NSString *__accept = @"Accept: */*\r\n";
+static NSString *__encoding = @"Accept-Encoding: identity\r\n";
 static Class __gzPlugin = Nil;
 
 struct _schemeItem { NSString *scheme; char *prefix; int port; };
@@ -426,23 +440,43 @@ extern NSMutableData * _NSDataDecompressGZ(NSData *source);
 	[_url release],				_url = nil;
 	[_method release],			_method = nil;
 	[_headerFields release],	_headerFields = nil;
+	[_body release],			_body = nil;
+	[_bodyStream release],		_bodyStream = nil;
 
 	[super dealloc];
 }
 
 - (NSString *) _header
 {
-	NSString *fmt = @"%@ %@ HTTP/1.0\r\n%@Host: %@\r\n%@\r\n\r\n";
-//	NSString *c = @"Connection: Keep-Alive";
-	NSString *c = @"User-agent: mGSTEP\r\nConnection: close";
+	NSString *fmt = @"%@ %@ HTTP/1.1\r\n%@%@Host: %@\r\n%@\r\n%@\r\n";
+	NSString *c = @"User-agent: mGSTEP\r\nConnection: %@";
+	NSString *v = [self valueForHTTPHeaderField: @"Connection"];
+	NSMutableString *fields = [NSMutableString string];
+	NSEnumerator *e = [_headerFields keyEnumerator];
 	NSString *path = [_url path];
 	NSString *host = [_url host];
 	NSString *user = [_url user];
 	NSString *pass = [_url password];
+	NSString *accept = __accept;
+	NSString *encoding = __encoding;
 	NSString *auth;
 
-	if (_headerFields)
-		c = [_headerFields objectForKey:@"Connection"];
+	if ([self valueForHTTPHeaderField: @"Accept"])		// caller's own are
+		accept = @"";									// sent with fields
+	if ([self valueForHTTPHeaderField: @"Accept-Encoding"])
+		encoding = @"";
+	c = [NSString stringWithFormat: c, (v) ? v : @"keep-alive"];
+
+	while ((v = [e nextObject]))		// those written here are not repeated
+		if (![v isEqualToString: @"connection"] && ![v isEqualToString: @"host"]
+				&& ![v isEqualToString: @"user-agent"]
+				&& ![v isEqualToString: @"transfer-encoding"])
+			[fields appendFormat: @"%@: %@\r\n", v, [_headerFields objectForKey:v]];
+
+	if (_body && ![self valueForHTTPHeaderField: @"Content-Length"])
+		[fields appendFormat: @"Content-Length: %lu\r\n", [_body length]];
+	else if (_bodyStream && ![self valueForHTTPHeaderField: @"Content-Length"])
+		[fields appendString: @"Transfer-Encoding: chunked\r\n"];
 
 	if (user && pass)
 		{
@@ -464,12 +498,15 @@ extern NSMutableData * _NSDataDecompressGZ(NSData *source);
 		}
 #endif
 
-	return [NSString stringWithFormat: fmt, _method, path, __content, host, c];
+	return [NSString stringWithFormat: fmt, _method, path, accept, encoding,
+											host, c, fields];
 }
 
 - (NSURL *) URL								{ return _url; }
 - (NSString *) HTTPMethod					{ return _method; }
 - (NSDictionary *) allHTTPHeaderFields		{ return _headerFields; }
+- (NSData *) HTTPBody						{ return _body; }
+- (NSInputStream *) HTTPBodyStream			{ return _bodyStream; }
 - (NSURLRequestCachePolicy) cachePolicy		{ return _rq.policy; }
 - (BOOL) HTTPShouldHandleCookies			{ return _rq.cookies; }
 - (NSTimeInterval) interval					{ return _timeout; }
@@ -492,6 +529,8 @@ extern NSMutableData * _NSDataDecompressGZ(NSData *source);
 		rq->_timeout = _timeout;
 		rq->_method = [_method copy];
 		rq->_headerFields = [_headerFields mutableCopy];
+		rq->_body = [_body retain];
+		rq->_bodyStream = [_bodyStream retain];
 		rq->_rq.cookies = _rq.cookies;
 		}
 		
@@ -540,7 +579,18 @@ extern NSMutableData * _NSDataDecompressGZ(NSData *source);
 - (void) setHTTPShouldHandleCookies:(BOOL)flag			{ _rq.cookies = flag; }
 - (void) setTimeoutInterval:(NSTimeInterval)to			{ _timeout = to; }
 - (void) setURL:(NSURL *)url							{ ASSIGN(_url, url); }
-- (void) setHTTPBody:(NSData *)data						{ NIMP; }
+
+- (void) setHTTPBody:(NSData *)data
+{
+	ASSIGN(_body, data);
+	[_bodyStream release],	_bodyStream = nil;
+}
+
+- (void) setHTTPBodyStream:(NSInputStream *)stream
+{
+	ASSIGN(_bodyStream, stream);
+	[_body release],		_body = nil;
+}
 
 - (id) copy
 {
@@ -553,6 +603,8 @@ extern NSMutableData * _NSDataDecompressGZ(NSData *source);
 		rq->_timeout = _timeout;
 		rq->_method = [_method retain];
 		rq->_headerFields = [_headerFields copy];
+		rq->_body = [_body retain];
+		rq->_bodyStream = [_bodyStream retain];
 		rq->_rq.cookies = _rq.cookies;
 		}
 		
@@ -656,7 +708,10 @@ extern NSMutableData * _NSDataDecompressGZ(NSData *source);
 
 - (id) initWithResponse:(NSURLResponse *)response data:(NSData *)data
 {
-	return nil;
+	return [self initWithResponse:response
+				 data:data
+				 userInfo:nil
+				 storagePolicy:NSURLCacheStorageAllowed];
 }
 
 - (id) initWithResponse:(NSURLResponse *)response
@@ -664,13 +719,31 @@ extern NSMutableData * _NSDataDecompressGZ(NSData *source);
 				   userInfo:(NSDictionary *)userInfo
 				   storagePolicy:(NSURLCacheStoragePolicy)policy
 {
-	return nil;
+	_response = [response retain];
+	_data = [data retain];
+	_userInfo = [userInfo retain];
+	_storagePolicy = policy;
+
+	return self;
 }
 
-- (NSData *) data								{ return nil; }
-- (NSURLResponse *) response					{ return nil; }
-- (NSURLCacheStoragePolicy) storagePolicy		{ return 0; }
-- (NSDictionary *) userInfo						{ return nil; }
+- (void) dealloc
+{
+	[_response release],	_response = nil;
+	[_data release],		_data = nil;
+	[_userInfo release],	_userInfo = nil;
+
+	[super dealloc];
+}
+
+- (NSData *) data								{ return _data; }
+- (NSURLResponse *) response					{ return _response; }
+- (NSURLCacheStoragePolicy) storagePolicy		{ return _storagePolicy; }
+- (NSDictionary *) userInfo						{ return _userInfo; }
+- (NSTimeInterval) _date						{ return _date; }
+- (void) _setDate:(NSTimeInterval)date			{ _date = date; }
+- (BOOL) _isRevalidated							{ return _revalidated; }
+- (void) _setRevalidated:(BOOL)flag				{ _revalidated = flag; }
 
 - (id) copy										{ return [self retain]; }
 - (id) initWithCoder:(NSCoder*)aDecoder			{ return self; }
@@ -678,6 +751,504 @@ extern NSMutableData * _NSDataDecompressGZ(NSData *source);
 
 @end  /* NSCachedURLResponse */
 
+/* ****************************************************************************
+
+	NSURLCache
+
+	Responses are kept in two LRU tiers, each a list ordered by use with a
+	map table index.  The memory tier holds NSCachedURLResponse objects.
+	The disk tier holds a body file and a property list of the response
+	headers for each URL, named by a hash of it, and maps bodies back in
+	with mmap.  As in OS X a response is only cached if it is no larger
+	than a twentieth of a tier's capacity.  The shared cache is used by
+	connections on any thread, each method holds the cache's lock.
+
+** ***************************************************************************/
+
+#define ENTRY_OVERHEAD		512				// response, headers and entry
+
+typedef struct _NSURLCacheEntry {
+	struct _NSURLCacheEntry *prev;
+	struct _NSURLCacheEntry *next;
+	NSString *key;							// URL, or file name on disk
+	NSCachedURLResponse *response;			// memory tier only
+	NSUInteger cost;
+} _NSURLCacheEntry;
+
+typedef struct _NSURLCacheTier {
+	NSMapTable *index;
+	_NSURLCacheEntry *head;					// most recently used
+	_NSURLCacheEntry *tail;
+	NSUInteger usage;
+	NSUInteger capacity;
+	NSString *path;							// disk tier directory
+} _NSURLCacheTier;
+
+#define MEMORY(c)  ((_NSURLCacheTier *)(c)->_memory)
+#define DISK(c)	   ((_NSURLCacheTier *)(c)->_disk)
+
+static NSURLCache *__sharedURLCache = nil;
+static pthread_mutex_t __sharedURLCacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static _NSURLCacheTier *
+_TierCreate(NSUInteger capacity, NSString *path)
+{
+	_NSURLCacheTier *t = calloc(1, sizeof(_NSURLCacheTier));
+
+	t->index = NSCreateMapTable(NSObjectMapKeyCallBacks,
+								NSNonOwnedPointerMapValueCallBacks, 0);
+	t->capacity = capacity;
+	t->path = [path retain];
+
+	return t;
+}
+
+static void
+_TierUnlink(_NSURLCacheTier *t, _NSURLCacheEntry *e)
+{
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		t->head = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		t->tail = e->prev;
+	e->prev = e->next = NULL;
+}
+
+static void
+_TierPushFront(_NSURLCacheTier *t, _NSURLCacheEntry *e)
+{
+	if ((e->next = t->head))
+		t->head->prev = e;
+	else
+		t->tail = e;
+	t->head = e;
+}
+
+static _NSURLCacheEntry *
+_TierGet(_NSURLCacheTier *t, NSString *key)		// and mark as recently used
+{
+	_NSURLCacheEntry *e = NSMapGet(t->index, key);
+
+	if (e && e != t->head)
+		{
+		_TierUnlink(t, e);
+		_TierPushFront(t, e);
+		}
+
+	return e;
+}
+
+static void
+_TierRemove(_NSURLCacheTier *t, _NSURLCacheEntry *e)
+{
+	if (t->path)								// delete body and headers
+		{
+		NSString *f = [t->path stringByAppendingPathComponent: e->key];
+
+		unlink([f fileSystemRepresentation]);
+		f = [f stringByAppendingPathExtension: @"plist"];
+		unlink([f fileSystemRepresentation]);
+		}
+
+	_TierUnlink(t, e);
+	NSMapRemove(t->index, e->key);
+	t->usage -= e->cost;
+	[e->response release];
+	[e->key release];
+	free(e);
+}
+
+static void
+_TierTrim(_NSURLCacheTier *t, NSUInteger capacity)
+{
+	while (t->tail && t->usage > capacity)
+		_TierRemove(t, t->tail);
+}
+
+static void
+_TierInsert(_NSURLCacheTier *t, NSString *key, id response, NSUInteger cost)
+{
+	_NSURLCacheEntry *e = NSMapGet(t->index, key);
+
+	if (e)
+		{
+		t->usage -= e->cost;
+		[e->response release];
+		_TierUnlink(t, e);
+		}
+	else
+		{
+		e = calloc(1, sizeof(_NSURLCacheEntry));
+		e->key = [key retain];
+		NSMapInsert(t->index, e->key, e);
+		}
+	e->response = [response retain];
+	e->cost = cost;
+	t->usage += cost;
+	_TierPushFront(t, e);
+	_TierTrim(t, t->capacity);
+}
+
+static NSString *
+_DiskName(NSString *key)						// FNV-1a of the URL string
+{
+	const unsigned char *s = (const unsigned char *)[key UTF8String];
+	unsigned long long h = 14695981039346656037ULL;
+
+	for (; *s; s++)
+		h = (h ^ *s) * 1099511628211ULL;
+
+	return [NSString stringWithFormat:@"%016llx", h];
+}
+
+typedef struct _NSURLCacheFile {
+	char name[32];
+	off_t size;
+	time_t mtime;
+} _NSURLCacheFile;
+
+static int
+_DiskCompareAge(const void *a, const void *b)
+{
+	time_t ta = ((_NSURLCacheFile *)a)->mtime;
+	time_t tb = ((_NSURLCacheFile *)b)->mtime;
+
+	return (ta > tb) - (ta < tb);
+}
+
+static void
+_DiskLoad(_NSURLCacheTier *t)		// index the files left by an earlier run
+{
+	_NSURLCacheFile *f = NULL;
+	const char *dir = [t->path fileSystemRepresentation];
+	struct dirent *d;
+	struct stat st;
+	char path[PATH_MAX];
+	int i, count = 0, max = 0;
+	DIR *dp;
+
+	if (!(dp = opendir(dir)))
+		return;
+
+	while ((d = readdir(dp)))
+		{
+		if (strlen(d->d_name) != 16)			// skip headers, . and ..
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, d->d_name);
+		if (stat(path, &st) != 0)
+			continue;
+		if (count == max)
+			f = realloc(f, (max = max * 2 + 64) * sizeof(*f));
+		strcpy(f[count].name, d->d_name);
+		f[count].size = st.st_size + ENTRY_OVERHEAD;
+		f[count++].mtime = st.st_mtime;
+		}
+	closedir(dp);
+
+	qsort(f, count, sizeof(*f), _DiskCompareAge);
+	for (i = 0; i < count; i++)					// oldest first, newest ends
+		_TierInsert(t, [NSString stringWithCString: f[i].name], nil, f[i].size);
+	free(f);										// up at the head
+}
+
+static BOOL
+_DiskWrite(_NSURLCacheTier *t, NSString *name, NSCachedURLResponse *cr,
+		   NSString *key, BOOL body)
+{
+	NSHTTPURLResponse *r = (NSHTTPURLResponse *)[cr response];
+	NSString *f = [t->path stringByAppendingPathComponent: name];
+	NSMutableDictionary *h = [NSMutableDictionary dictionaryWithCapacity: 4];
+	NSData *d = [cr data];
+
+	[h setObject:key forKey:@"URL"];
+	[h setObject:[NSString stringWithFormat:@"%f", [cr _date]] forKey:@"Date"];
+	if ([r respondsToSelector: @selector(statusCode)])
+		{
+		[h setObject:[NSString stringWithFormat:@"%d", (int)[r statusCode]]
+		   forKey:@"StatusCode"];
+		[h setObject:[r allHeaderFields] forKey:@"Headers"];
+		}
+
+	if (body && ![d writeToFile:f atomically:YES])
+		return NO;
+
+	return [h writeToFile:[f stringByAppendingPathExtension:@"plist"]
+			  atomically:YES];
+}
+
+static NSCachedURLResponse *
+_DiskRead(_NSURLCacheTier *t, NSString *name, NSString *key)
+{
+	NSString *f = [t->path stringByAppendingPathComponent: name];
+	NSString *p = [f stringByAppendingPathExtension: @"plist"];
+	NSDictionary *h = [NSDictionary dictionaryWithContentsOfFile: p];
+	NSCachedURLResponse *cr;
+	NSURLResponse *r;
+	NSData *d;
+
+	if (!h || ![[h objectForKey: @"URL"] isEqualToString: key])
+		return nil;								// gone or a hash collision
+	if (!(d = [NSData dataWithContentsOfMappedFile: f]))
+		return nil;
+
+	r = [NSHTTPURLResponse alloc];
+	r = [r initWithURL: [NSURL URLWithString: key]
+		   statusCode: [[h objectForKey: @"StatusCode"] intValue]
+		   HTTPVersion: nil
+		   headerFields: [h objectForKey: @"Headers"]];
+	cr = [[NSCachedURLResponse alloc] initWithResponse: r data: d];
+	[cr _setDate: [[h objectForKey: @"Date"] doubleValue]];
+	[r release];
+
+	return [cr autorelease];
+}
+
+static void
+_MakeDirectory(NSString *path)
+{
+	char p[PATH_MAX], *s;
+
+	strncpy(p, [path fileSystemRepresentation], sizeof(p) - 1);
+	p[sizeof(p) - 1] = '\0';
+	for (s = strchr(p + 1, '/'); s; s = strchr(s + 1, '/'))
+		{
+		*s = '\0';
+		mkdir(p, 0700);
+		*s = '/';
+		}
+	mkdir(p, 0700);
+}
+
+
+@implementation NSURLCache
+
++ (NSURLCache *) sharedURLCache
+{
+	NSURLCache *c;
+
+	pthread_mutex_lock(&__sharedURLCacheLock);
+	if (!__sharedURLCache)
+		{
+		NSString *p = @".mGSTEP/URLCache";
+
+		p = [NSHomeDirectory() stringByAppendingPathComponent: p];
+		__sharedURLCache = [[NSURLCache alloc] initWithMemoryCapacity: 4 << 20
+											   diskCapacity: 20 << 20
+											   diskPath: p];
+		}
+	c = [[__sharedURLCache retain] autorelease];
+	pthread_mutex_unlock(&__sharedURLCacheLock);
+
+	return c;
+}
+
++ (void) setSharedURLCache:(NSURLCache *)cache
+{
+	pthread_mutex_lock(&__sharedURLCacheLock);
+	ASSIGN(__sharedURLCache, cache);
+	pthread_mutex_unlock(&__sharedURLCacheLock);
+}
+
+- (id) initWithMemoryCapacity:(NSUInteger)memoryCapacity
+				 diskCapacity:(NSUInteger)diskCapacity
+				 diskPath:(NSString *)path
+{
+	if ((self = [super init]))
+		{
+		_lock = [NSRecursiveLock new];
+		_memory = _TierCreate(memoryCapacity, nil);
+		_disk = _TierCreate((path) ? diskCapacity : 0, path);
+		_diskPath = [path retain];
+		if (path && diskCapacity)
+			{
+			_MakeDirectory(path);
+			_DiskLoad(DISK(self));
+		}	}
+
+	return self;
+}
+
+- (void) dealloc
+{
+	_TierTrim(MEMORY(self), 0);
+	NSFreeMapTable(MEMORY(self)->index);
+	free(_memory);
+	while (DISK(self)->head)					// free the index, keep files
+		{
+		_NSURLCacheEntry *e = DISK(self)->head;
+
+		_TierUnlink(DISK(self), e);
+		[e->key release];
+		free(e);
+		}
+	NSFreeMapTable(DISK(self)->index);
+	[DISK(self)->path release];
+	free(_disk);
+	[_diskPath release];
+	[_lock release];
+
+	[super dealloc];
+}
+
+- (NSCachedURLResponse *) cachedResponseForRequest:(NSURLRequest *)request
+{
+	NSString *key = [[request URL] absoluteString];
+	NSString *name = _DiskName(key);
+	NSCachedURLResponse *cr = nil;
+	_NSURLCacheEntry *e;
+
+	[_lock lock];
+	_stats.requests++;
+	if ((e = _TierGet(MEMORY(self), key)))
+		{
+		_stats.memoryHits++;
+		cr = [[e->response retain] autorelease];
+		}
+	else if (DISK(self)->capacity && (e = _TierGet(DISK(self), name)))
+		{
+		if (!(cr = _DiskRead(DISK(self), name, key)))
+			_TierRemove(DISK(self), e);
+		else
+			{
+			NSUInteger cost = [[cr data] length] + ENTRY_OVERHEAD;
+
+			_stats.diskHits++;
+			if (cost <= MEMORY(self)->capacity / 20)
+				_TierInsert(MEMORY(self), key, cr, cost);
+		}	}
+	[_lock unlock];
+
+	return cr;
+}
+
+- (void) _storeCachedResponse:(NSCachedURLResponse *)cr
+				   forRequest:(NSURLRequest *)request
+				   body:(BOOL)body
+{
+	NSString *key = [[request URL] absoluteString];
+	NSUInteger cost = [[cr data] length] + ENTRY_OVERHEAD;
+	NSURLCacheStoragePolicy policy = [cr storagePolicy];
+	NSString *name = _DiskName(key);
+	_NSURLCacheEntry *e;
+
+	if (policy == NSURLCacheStorageNotAllowed)
+		return;
+
+	[_lock lock];
+	[cr _setDate: [NSDate timeIntervalSinceReferenceDate]];
+	if (cost <= MEMORY(self)->capacity / 20)
+		_TierInsert(MEMORY(self), key, cr, cost);
+	else if ((e = NSMapGet(MEMORY(self)->index, key)))
+		_TierRemove(MEMORY(self), e);
+
+	if (policy == NSURLCacheStorageAllowed && cost <= DISK(self)->capacity / 20)
+		{										// a body already on disk is
+		body = body || !NSMapGet(DISK(self)->index, name);	// kept as is
+		if (_DiskWrite(DISK(self), name, cr, key, body))
+			_TierInsert(DISK(self), name, nil, cost);
+		}
+	else if ((e = NSMapGet(DISK(self)->index, name)))
+		_TierRemove(DISK(self), e);
+	[_lock unlock];
+}
+
+- (void) storeCachedResponse:(NSCachedURLResponse *)cachedResponse
+				  forRequest:(NSURLRequest *)request
+{
+	[_lock lock];
+	[self _storeCachedResponse:cachedResponse forRequest:request body:YES];
+	_stats.bytesStored += [[cachedResponse data] length];
+	[_lock unlock];
+}
+
+- (void) _cachedResponseIsValid:(NSCachedURLResponse *)cachedResponse
+					 forRequest:(NSURLRequest *)request
+{
+	[_lock lock];
+	_stats.bytesServed += [[cachedResponse data] length];
+	if ([cachedResponse _isRevalidated])		// refreshed by a 304, update
+		{										// its headers but not body
+		[cachedResponse _setRevalidated: NO];
+		_stats.validated++;
+		[self _storeCachedResponse:cachedResponse forRequest:request body:NO];
+		}
+	[_lock unlock];
+}
+
+- (void) removeCachedResponseForRequest:(NSURLRequest *)request
+{
+	NSString *key = [[request URL] absoluteString];
+	_NSURLCacheEntry *e;
+
+	[_lock lock];
+	if ((e = NSMapGet(MEMORY(self)->index, key)))
+		_TierRemove(MEMORY(self), e);
+	if ((e = NSMapGet(DISK(self)->index, _DiskName(key))))
+		_TierRemove(DISK(self), e);
+	[_lock unlock];
+}
+
+- (void) removeAllCachedResponses
+{
+	[_lock lock];
+	_TierTrim(MEMORY(self), 0);
+	_TierTrim(DISK(self), 0);
+	[_lock unlock];
+}
+
+- (NSUInteger) memoryCapacity				{ return MEMORY(self)->capacity; }
+- (NSUInteger) diskCapacity					{ return DISK(self)->capacity; }
+
+- (NSUInteger) currentMemoryUsage
+{
+	NSUInteger usage;
+
+	[_lock lock];
+	usage = MEMORY(self)->usage;
+	[_lock unlock];
+
+	return usage;
+}
+
+- (NSUInteger) currentDiskUsage
+{
+	NSUInteger usage;
+
+	[_lock lock];
+	usage = DISK(self)->usage;
+	[_lock unlock];
+
+	return usage;
+}
+
+- (void) setMemoryCapacity:(NSUInteger)memoryCapacity
+{
+	[_lock lock];
+	_TierTrim(MEMORY(self), (MEMORY(self)->capacity = memoryCapacity));
+	[_lock unlock];
+}
+
+- (void) setDiskCapacity:(NSUInteger)diskCapacity
+{
+	[_lock lock];
+	if (_diskPath)
+		_TierTrim(DISK(self), (DISK(self)->capacity = diskCapacity));
+	[_lock unlock];
+}
+
+- (void) getStatistics:(NSURLCacheStatistics *)statistics
+{
+	[_lock lock];
+	*statistics = _stats;
+	[_lock unlock];
+}
+
+@end  /* NSURLCache */
+
 /* ****************************************************************************
 
 	NSURLCredential
@@ -777,17 +1348,49 @@ extern NSMutableData * _NSDataDecompressGZ(NSData *source);
 
 ** ***************************************************************************/
 
+#define READ_BUFFER_SIZE	16384
+
+#define HAS_TOKEN(s, t) \
+	([s rangeOfString:t options:NSCaseInsensitiveSearch].length != 0)
+
+enum { CHUNK_SIZE, CHUNK_DATA, CHUNK_END, CHUNK_TRAILER };	// _chunkState
+
+#define WRITE_CHUNK_SIZE	65536			// read from a body stream per chunk
+
+#ifndef MSG_NOSIGNAL						// SO_NOSIGPIPE is set on the
+#define MSG_NOSIGNAL		0				// socket instead
+#endif
+
+enum { SEND_HEADER, SEND_BODY, SEND_STREAM, SEND_DONE, SEND_FAILED };
+
+
 @interface NSURLProtocol  (responder)
 - (BOOL) _respondWithHTTP:(NSMutableData *)mdata;
+- (BOOL) _decodeData;
+- (void) _closedByPeer;
+- (void) _connectionLost:(int)en;
+- (void) _reset;
+- (BOOL) _keepAlive;
+- (CFTypeRef) _transport;
+- (void) _setTransport:(CFTypeRef)transport;
+- (BOOL) _cachedResponseIsUsable;
+- (BOOL) _sendRequest:(int)sd;
 @end
 
-@interface _NSURLProtocolHTTP : NSURLProtocol
+@interface NSURLConnection  (_NSURLConnectionPool)
++ (void) _reapIdleSockets:(NSTimer *)timer;
+- (BOOL) _reconnect;
 @end
 
-@interface NSMutableData  (_NSDataDecompressGZ)
-- (id) decompressGZ;
+@interface NSURLConnection  (_NSURLConnectionUpload)
+- (void) _waitForWriteReady:(BOOL)flag;
+- (void) _didSendBodyData:(NSInteger)bytesWritten
+		 totalBytesWritten:(NSInteger)totalBytesWritten
+		 totalBytesExpectedToWrite:(NSInteger)totalBytesExpectedToWrite;
 @end
 
+@interface _NSURLProtocolHTTP : NSURLProtocol
+@end
 
 @implementation _NSURLProtocolHTTP
 
@@ -823,6 +1426,35 @@ _LoadPlugin(NSString *plugin)
 	return c;
 }
 
+static time_t
+_HTTPDate(NSString *s)				// RFC 1123  Sun, 06 Nov 1994 08:49:37 GMT
+{
+	struct tm tm;
+
+	memset(&tm, 0, sizeof(tm));
+	if (!s || !strptime([s cString], "%a, %d %b %Y %H:%M:%S", &tm))
+		return 0;
+
+	return timegm(&tm);
+}
+
+static BOOL
+_IsFresh(NSCachedURLResponse *cr)			// RFC 7234 4.2, no heuristics
+{
+	NSDictionary *h = [(NSHTTPURLResponse *)[cr response] allHeaderFields];
+	NSString *cc = [[h objectForKey: @"Cache-Control"] lowercaseString];
+	NSTimeInterval age = [NSDate timeIntervalSinceReferenceDate] - [cr _date];
+	NSRange r;												// directives are
+															// case-insensitive
+	if (cc && HAS_TOKEN(cc, @"no-cache"))
+		return NO;
+	if (cc && (r = [cc rangeOfString: @"max-age="]).length)
+		return age < atol([cc cString] + NSMaxRange(r));
+
+	return _HTTPDate([h objectForKey: @"Expires"]) > time(NULL);
+}
+
+
 @implementation NSURLProtocol
 
 + (id) alloc											{ return nil; }
@@ -854,6 +1486,23 @@ _LoadPlugin(NSString *plugin)
 	_client = client;
 	_header = [[_request _header] retain];
 
+	if (_cachedResponse && ![self _cachedResponseIsUsable])
+		{									// ask server if it's still valid
+		NSHTTPURLResponse *r = (NSHTTPURLResponse *)[_cachedResponse response];
+		NSString *tag = [[r allHeaderFields] objectForKey: @"Etag"];
+		NSString *lm = [[r allHeaderFields] objectForKey: @"Last-Modified"];
+		NSString *h = [_header substringToIndex: [_header length] - 2];
+
+		if (tag)
+			h = [h stringByAppendingFormat: @"If-None-Match: %@\r\n", tag];
+		if (lm)
+			h = [h stringByAppendingFormat: @"If-Modified-Since: %@\r\n", lm];
+		if (tag || lm)
+			ASSIGN(_header, [h stringByAppendingString: @"\r\n"]);
+		else
+			[_cachedResponse release],	_cachedResponse = nil;
+		}
+
 	return self;
 }
 
@@ -865,6 +1514,9 @@ _LoadPlugin(NSString *plugin)
 		[_request release],			_request = nil;
 		[_cachedResponse release],	_cachedResponse = nil;
 		[_data release],			_data = nil;
+		[_out release],				_out = nil;
+		if (_inflate)
+			[NSMutableData inflateGZEnd: &_inflate];
 		}
 
 	[super dealloc];
@@ -874,149 +1526,501 @@ _LoadPlugin(NSString *plugin)
 - (id <NSURLProtocolClient>) client					{ return _client; }
 - (NSCachedURLResponse *) cachedResponse			{ return _cachedResponse; }
 
+- (BOOL) _cachedResponseIsUsable			// as is, without asking server
+{
+	switch ([_request cachePolicy])
+		{
+		case NSURLRequestReturnCacheDataElseLoad:
+		case NSURLRequestReturnCacheDataDontLoad:	return YES;
+		case NSURLRequestUseProtocolCachePolicy:	return _IsFresh(_cachedResponse);
+		default:									return NO;
+		}
+}
+
+- (void) _loadCachedResponse
+{
+	NSURLResponse *r = [_cachedResponse response];
+
+	[_client URLProtocol:self
+			 didReceiveResponse:r
+			 cacheStoragePolicy:NSURLCacheStorageNotAllowed];
+	[_client URLProtocol:self cachedResponseIsValid:_cachedResponse];
+	[_client URLProtocol:self didLoadData:[_cachedResponse data]];
+	[_client URLProtocolDidFinishLoading: self];
+}
+
+- (void) _failCacheMiss
+{
+	NSError *e = _NSError(NSPOSIXErrorDomain, ENOENT, @"URL is not cached");
+
+	[_client URLProtocol:self didFailWithError:e];
+}
+
 - (void) startLoading
 {
-	[(NSURLConnection *)_client scheduleInRunLoop:[NSRunLoop currentRunLoop]
-								forMode:NSDefaultRunLoopMode];
+	SEL s = NULL;
+
+	if (_cachedResponse && [self _cachedResponseIsUsable])
+		s = @selector(_loadCachedResponse);
+	else if ([_request cachePolicy] == NSURLRequestReturnCacheDataDontLoad)
+		s = @selector(_failCacheMiss);
+
+	if (s)								// callbacks after -init returns
+		[self performSelector:s withObject:nil afterDelay:0];
+	else
+		[(NSURLConnection *)_client scheduleInRunLoop:[NSRunLoop currentRunLoop]
+									forMode:NSDefaultRunLoopMode];
 }
 
 - (void) stopLoading
 {
+	[NSObject cancelPreviousPerformRequestsWithTarget: self];
 	[(NSURLConnection *)_client unscheduleFromRunLoop:[NSRunLoop currentRunLoop]
 								forMode:NSDefaultRunLoopMode];
 }
 
+static NSString *
+_HTTPHeaderName(const char *p, int len)		// canonical case, Content-Type
+{
+	char buf[64];
+	BOOL upper = YES;
+	int i;
+
+	len = MIN(len, sizeof(buf));
+	for (i = 0; i < len; upper = (p[i++] == '-'))
+		buf[i] = (upper) ? toupper(p[i]) : tolower(p[i]);
+
+	return [NSString stringWithCString:buf length:len];
+}
+
 - (BOOL) _respondWithHTTP:(NSMutableData *)mdata
 {
-	NSString *k[] = { @"Content-Type",   @"Content-Encoding",
-					  @"Content-Length", @"Connection", @"Transfer-Encoding" };
-	NSString *v[] = { @"", @"", @"", @"close" };
-	NSDictionary *hd;
+	NSMutableDictionary *hd;
 	NSURLResponse *rp;
+	NSURLCacheStoragePolicy sp = NSURLCacheStorageAllowed;
 	NSUInteger l = [mdata length];
-	const char *by = [mdata bytes];
-	const char *e, *p, *ep;
-	char codeBuf[16] = {0};
+	char *by = [mdata mutableBytes];
+	char *e, *p, *ep, *v, *ve;
 	NSInteger code;
+	BOOL close;
 
-	if (l < strlen("HTTP/1.0 200 OK") || *by != 'H' || *(by+1) != 'T')
+	if (l < strlen("HTTP/1.0 200 OK") || strncmp(by, "HTTP/1.", 7))
 		return NO;								// malformed response
 
-	for (p = by; *p != ' ' && p < (by+12); p++);
-	if (*p != ' ')
+	if (!(p = memchr(by, ' ', 12)))
 		return NO;								// malformed response
-
-	memcpy(codeBuf, ++p, 3);
-	code = (NSInteger)atol(codeBuf);
+	code = (NSInteger)atol(p + 1);
 
 	[mdata appendBytes:"\0" length:1];
-	if (!(e = strstr(by, "\r\n\r\n")) && !(e = strstr(by, "\n\n")))
+	by = [mdata mutableBytes];
+	if ((e = strstr(by, "\r\n\r\n")))
+		e += 4;
+	else if ((e = strstr(by, "\n\n")))
+		e += 2;
+	else
 		{
 		[mdata setLength: l];
 		return NO;								// incomplete response
 		}
 
-//	NSLog(@"HTTP Response Raw Header: '%s'\n", by);
-	if ((p = strstr(by, "Content-Type:")))
-		{
-		p += sizeof("Content-Type:");
-		if ((ep = strstr(p, "\r\n")))
-			v[0] = [NSString stringWithCString:p length: (ep - p)];
-		}
-	if ((p = strstr(by, "Content-Encoding:")))
-		{
-		p += sizeof("Content-Encoding:");
-		if ((ep = strstr(p, "\r\n")))
-			v[1] = [NSString stringWithCString:p length: (ep - p)];
-		_up.gzip = ([v[1] isEqualToString: @"gzip"]);
-		}
-	if ((p = strstr(by, "Content-Length:")))
-		{
-		p += sizeof("Content-Length:");
-		if ((ep = strstr(p, "\r\n")))
-			v[2] = [NSString stringWithCString:p length: (ep - p)];
-		memset(codeBuf, 0, sizeof(codeBuf));
-		memcpy(codeBuf, p, (ep - p));
-		_length = (NSInteger)atol(codeBuf);
+	if (code / 100 == 1 && code != 101)			// interim response, drop it
+		{										// and parse the final one
+		l -= (e - by);
+		memmove(by, e, l);
+		[mdata setLength: l];
+
+		return (l > 0) ? [self _respondWithHTTP: mdata] : NO;
 		}
-	if ((p = strstr(by, "Connection:")))
+
+//	NSLog(@"HTTP Response Raw Header: '%s'\n", by);
+	hd = [NSMutableDictionary dictionaryWithCapacity: 8];
+	close = (by[7] == '0');						// 1.0 closes unless keep-alive
+	_length = -1;								// RFC7230 3.3.3 read to close
+	for (p = strchr(by, '\n') + 1; p < e && (ep = strchr(p, '\n')); p = ep + 1)
 		{
-		p += sizeof("Connection:");
-		if (strncmp(p, "close", strlen("close")) && (ep = strstr(p, "\r\n")))
-			v[3] = [NSString stringWithCString:p length: (ep - p)];
+		NSString *k, *o, *x;
+
+		if (!(v = memchr(p, ':', ep - p)))
+			continue;							// blank line or malformed
+		k = _HTTPHeaderName(p, v - p);
+		for (v++; *v == ' ' || *v == '\t'; v++);
+		for (ve = ep; ve > v && isspace(*(ve - 1)); ve--);
+		o = [NSString stringWithCString:v length:(ve - v)];
+
+		if ([k isEqualToString: @"Content-Length"])
+			_length = (NSInteger)atol(v);
+		else if ([k isEqualToString: @"Transfer-Encoding"])
+			_up.chunked = HAS_TOKEN(o, @"chunked");
+		else if ([k isEqualToString: @"Content-Encoding"])
+			_up.gzip = HAS_TOKEN(o, @"gzip");
+		else if ([k isEqualToString: @"Connection"])
+			close = HAS_TOKEN(o, @"close")
+				 || (close && !HAS_TOKEN(o, @"keep-alive"));
+
+		if ((x = [hd objectForKey: k]))
+			o = [NSString stringWithFormat:@"%@, %@", x, o];
+		[hd setObject:o forKey:k];
 		}
-//	_up.chunked = YES;	// FIX ME RFC7230 HTTP/1.1  Transfer-Encoding: chunked
-	hd = [NSDictionary dictionaryWithObjects:v forKeys:k count:4];
 
-	e += (*e == '\r') ? 4 : 2;
-	memmove((void *)by, (void *)e, (l - (e - by)));
-	[mdata setLength: (l - (e - by))];
+	if (code / 100 == 1 || code == 204 || code == 304
+			|| [[_request HTTPMethod] isEqualToString: @"HEAD"])
+		_up.chunked = NO, _length = 0;			// response has no body
+	if (_up.chunked)
+		_length = 0, _chunkState = CHUNK_SIZE;
+	_up.keepAlive = !close && (_up.chunked || _length >= 0);
+
+	l -= (e - by);
+	memmove(by, e, l);
+	[mdata setLength: l];
+	_up.responded = YES;
 
+	if (code == 304 && _cachedResponse)			// not modified, serve cached
+		{										// body with updated headers
+		NSHTTPURLResponse *c = (NSHTTPURLResponse *)[_cachedResponse response];
+		NSMutableDictionary *m = [[c allHeaderFields] mutableCopy];
+		NSCachedURLResponse *cr = [NSCachedURLResponse alloc];
+
+		[hd removeObjectForKey: @"Content-Length"];
+		[hd removeObjectForKey: @"Transfer-Encoding"];
+		[m addEntriesFromDictionary: hd];
+		rp = [[NSHTTPURLResponse alloc] initWithURL: [_request URL]
+										statusCode:  [c statusCode]
+										HTTPVersion: nil
+										headerFields:m];
+		cr = [cr initWithResponse: rp
+				 data: [_cachedResponse data]
+				 userInfo: [_cachedResponse userInfo]
+				 storagePolicy: [_cachedResponse storagePolicy]];
+		[cr _setRevalidated: YES];
+		[_cachedResponse release];
+		_cachedResponse = cr;
+		[m release];
+
+		[_client URLProtocol:self
+				 didReceiveResponse:rp
+				 cacheStoragePolicy:NSURLCacheStorageNotAllowed];
+		[_client URLProtocol:self cachedResponseIsValid:cr];
+		[_client URLProtocol:self didLoadData:[cr data]];
+		[rp release];
+
+		return YES;
+		}
+
+	if (HAS_TOKEN([hd objectForKey: @"Cache-Control"], @"no-store"))
+		sp = NSURLCacheStorageNotAllowed;
 	rp = [[NSHTTPURLResponse alloc] initWithURL: [_request URL]
 									statusCode:  code
 									HTTPVersion: nil
 									headerFields:hd];
-	_up.responded = YES;
 	[_client URLProtocol:self
 			 didReceiveResponse:rp
-			 cacheStoragePolicy:NSURLRequestUseProtocolCachePolicy];
+			 cacheStoragePolicy:sp];
 	[rp release];
 	
 	return YES;
 }
 
+- (BOOL) _loadBytes:(const char *)bytes length:(NSUInteger)length
+{											// NO if the load has failed
+	NSMutableData *d;
+
+	if (_up.gzip && __gzPlugin && !_up.decompressed)
+		{
+		int r;
+
+		d = [NSMutableData dataWithCapacity: length * 4];
+		if ((r = [d inflateGZBytes:bytes length:length stream:&_inflate]) < 0)
+			{								// corrupt body, socket is not
+			NSError *e = _NSError(NSPOSIXErrorDomain, EIO,	// reused
+								  @"unable to inflate gzip content");
+
+			_up.keepAlive = NO;
+			[_client URLProtocol:self didFailWithError:e];
+
+			return NO;
+			}
+		_up.decompressed = (r == 1);
+		}
+	else
+		d = [NSMutableData dataWithBytes:bytes length:length];
+
+	if ([d length])
+		[_client URLProtocol:self didLoadData:d];
+
+	return YES;
+}
+
+/* ****************************************************************************
+
+	_decodeData
+
+	Passes the body bytes read so far into _data on to the client as they
+	arrive, removing chunked transfer framing and inflating a gzip content
+	encoding along the way.  Bytes of a chunk size line split across reads
+	are kept in _data.  Returns YES if the response is complete or failed
+	to inflate, in which case the client has been told so and may have
+	released the protocol.
+
+** ***************************************************************************/
+
+- (BOOL) _decodeData
+{
+	char *b, *e, *p;
+	NSUInteger n;
+
+	if (!_up.responded && ![self _respondWithHTTP:_data])
+		return NO;
+
+	b = [_data mutableBytes];
+	e = b + [_data length];
+	while (!_up.finished && (b < e || (_length == 0 && !_up.chunked)))
+		{
+		if (!_up.chunked)
+			{
+			n = (_length < 0) ? (e - b) : MIN(e - b, _length);
+			if (n && ![self _loadBytes:b length:n])
+				return YES;
+			b += n;
+			if (_length >= 0 && (_length -= n) == 0)
+				_up.finished = YES;
+			}
+		else if (_chunkState == CHUNK_DATA)
+			{
+			n = MIN(e - b, _length);
+			if (![self _loadBytes:b length:n])
+				return YES;
+			b += n;
+			if ((_length -= n) == 0)
+				_chunkState = CHUNK_END;
+			}
+		else if (!(p = memchr(b, '\n', e - b)))
+			break;								// wait for the rest of line
+		else
+			{
+			if (_chunkState == CHUNK_SIZE)		// hex size [; extension]
+				{
+				_length = (NSInteger)strtol(b, NULL, 16);
+				_chunkState = (_length > 0) ? CHUNK_DATA : CHUNK_TRAILER;
+				}
+			else if (_chunkState == CHUNK_END)	// CRLF after chunk data
+				_chunkState = CHUNK_SIZE;
+			else if (p - b <= 1)				// blank line ends trailer
+				_up.finished = YES;
+			b = p + 1;
+		}	}
+
+	if (_up.finished)
+		{
+		if (b < e)
+			_up.keepAlive = NO;					// unexpected trailing bytes
+		[_data setLength: 0];
+		[_client URLProtocolDidFinishLoading: self];
+
+		return YES;
+		}
+
+	if ((n = e - b) > 0)
+		memmove([_data mutableBytes], b, n);
+	[_data setLength: n];
+
+	return NO;
+}
+
+- (void) _closedByPeer					{ [self _connectionLost: 0]; }
+
+- (void) _connectionLost:(int)en		// EOF (0), reset or broken pipe
+{
+	_up.keepAlive = NO;
+	if (!_up.responded && [(NSURLConnection *)_client _reconnect])
+		return;					// a reused connection the server had closed
+
+	if (en || !_up.responded || _up.chunked || _length > 0)
+		{						// a request that can't be resent fails
+		NSError *e = _NSError(NSPOSIXErrorDomain, (en) ? en : ECONNRESET,
+							  @"connection closed before end of response");
+
+		[_client URLProtocol:self didFailWithError:e];
+		}
+	else
+		[_client URLProtocolDidFinishLoading: self];
+}
+
+- (void) _reset
+{
+	memset(&_up, 0, sizeof(_up));
+	[_data setLength: 0];
+	[_out release],	_out = nil;
+	_outOffset = 0;
+	_bodySent = 0;
+	_sendState = SEND_HEADER;
+	if (_inflate)
+		[NSMutableData inflateGZEnd: &_inflate];
+	[self _setTransport: NULL];
+}
+
+- (BOOL) _keepAlive							{ return _up.keepAlive; }
+- (CFTypeRef) _transport					{ return NULL; }
+- (void) _setTransport:(CFTypeRef)transport	{}
+
+- (NSInteger) _write:(const void *)bytes length:(NSUInteger)len socket:(int)sd
+{											// a pooled socket the server
+	return send(sd, bytes, len, MSG_NOSIGNAL);	// closed is EPIPE, no signal
+}
+
+- (NSData *) _nextStreamChunk:(NSInputStream *)s		// chunked unless the
+{														// length was given
+	BOOL chunked = ([_request valueForHTTPHeaderField:@"Content-Length"] == nil);
+	uint8_t *b = malloc(WRITE_CHUNK_SIZE + 12);
+	NSInteger n = [s read:b + ((chunked) ? 10 : 0) maxLength:WRITE_CHUNK_SIZE];
+	char h[12];
+
+	if (n <= 0)
+		{
+		free(b);
+		_sendState = ([s streamStatus] == NSStreamStatusError) ? SEND_FAILED
+															   : SEND_DONE;
+		[s close];
+
+		return (chunked && _sendState == SEND_DONE)
+				? [NSData dataWithBytes:"0\r\n\r\n" length:5] : nil;
+		}
+
+	_outBody = n;
+	if (chunked)								// fixed width size so the
+		{										// data is read in place
+		sprintf(h, "%08lx\r\n", (unsigned long)n);
+		memcpy(b, h, 10);
+		memcpy(b + 10 + n, "\r\n", 2);
+		n += 12;
+		}
+
+	return [NSData dataWithBytesNoCopy:b length:n];
+}
+
+- (NSData *) _nextRequestData
+{
+	NSInputStream *s = [_request HTTPBodyStream];
+	NSData *b = [_request HTTPBody];
+	const char *h;
+
+	_outBody = 0;
+	switch (_sendState)
+		{
+		case SEND_HEADER:
+			_up.queried = YES;
+			_sendState = ([b length]) ? SEND_BODY : (s) ? SEND_STREAM : SEND_DONE;
+			if (s)
+				[s open];
+			h = [_header cString];
+
+			return [NSData dataWithBytes:h length:strlen(h)];
+
+		case SEND_BODY:							// sent from the request's
+			_sendState = SEND_DONE;				// data as is, not copied
+			_outBody = -1;
+
+			return b;
+
+		case SEND_STREAM:
+			return [self _nextStreamChunk: s];
+		}
+
+	return nil;
+}
+
+- (BOOL) _sendRequest:(int)sd				// write what the socket will take
+{											// now, NO if sending failed
+	long long sent = _bodySent;
+	NSInteger n = 0;
+
+	while (_out || (_out = [[self _nextRequestData] retain]))
+		{
+		const char *b = (const char *)[_out bytes] + _outOffset;
+
+		if ((n = [self _write:b length:[_out length] - _outOffset socket:sd]) <= 0)
+			break;
+		_outOffset += n;
+		if (_outBody < 0)
+			_bodySent += n;
+		if (_outOffset == [_out length])
+			{
+			_bodySent += MAX(_outBody, 0);
+			[_out release],	_out = nil;
+			_outOffset = 0;
+		}	}
+
+	if (n < 0 && (errno == EPIPE || errno == ECONNRESET))
+		{
+		[self _connectionLost: errno];		// resent once if idempotent
+		return NO;
+		}
+	if ((n < 0 && errno != EAGAIN && errno != EINTR) || _sendState == SEND_FAILED)
+		{
+		int en = (n < 0) ? errno : EIO;
+
+		[_client URLProtocol:self
+				 didFailWithError:_NSError(NSPOSIXErrorDomain, en,
+										   @"error sending request")];
+		return NO;
+		}
+
+	_up.sent = (_out == nil);				// else resume when writable
+	[(NSURLConnection *)_client _waitForWriteReady: !_up.sent];
+
+	if (_bodySent > sent)
+		{
+		NSString *cl = [_request valueForHTTPHeaderField: @"Content-Length"];
+		NSData *b = [_request HTTPBody];
+		NSInteger x = (b) ? [b length] : (cl) ? atol([cl cString]) : -1;
+
+		[(NSURLConnection *)_client _didSendBodyData: _bodySent - sent
+									totalBytesWritten: _bodySent
+									totalBytesExpectedToWrite: x];
+		}
+
+	return YES;
+}
+
 - (void) _receivedEvent:(void*)data						// called by Connection
 				   type:(CFSocketCallBackType)type		// when select() says
 				   extra:(const void*)extra				// the fd is ready
 {
-	char buf[3584] = {0};
+	char buf[READ_BUFFER_SIZE];
 	int read_data = 0;
-	int size;
+	int size, en;
 
 	DBLog(@"NSURLProtocol _receivedEvent");
-	if (!_up.queried)
-		{
-		_up.queried = YES;
-///		printf ("query string:\n'%s'\n", [_header cString]);
-
-		if (write(PTR2INT(extra), [_header cString], [_header length]) == -1)
-			NSLog(@"URL: error writing to socket\n");
+	if (!_up.sent && ![self _sendRequest: PTR2INT(extra)])
 		return;
-		}
+	if (!(type & kCFSocketReadCallBack))
+		return;									// writable, nothing to read
 
 	if (!_data)
-		_data = [NSMutableData new];
+		_data = [[NSMutableData alloc] initWithCapacity: READ_BUFFER_SIZE];
 															// read response
-	for (;(size = read (PTR2INT(extra), buf, 3584)) > 0; read_data++)
+	for (;(size = read (PTR2INT(extra), buf, sizeof(buf))) > 0; read_data++)
 		[_data appendBytes:buf length:size];
+	en = (size < 0) ? errno : 0;
 
-	if (read_data)
-		{
-		if (!_up.responded && ![self _respondWithHTTP:_data])
-			return;
-
-		if (_up.gzip && [_data length] >= _length)
-			if ((_data = [[_data autorelease] decompressGZ]))
-				_up.decompressed = YES;
-		
-		if (!_up.gzip || _up.decompressed)
-			{
-			[_client URLProtocol:self didLoadData:_data];
-			[_data setLength: 0];
-		}	}
+	if (read_data && [self _decodeData])
+		return;
 
-	if (size < 0 && errno != EAGAIN && errno != 0)
+	if (en == ECONNRESET || en == EPIPE)
+		[self _connectionLost: en];			// resent once if idempotent
+	else if (en != 0 && en != EAGAIN)
 		{
-		NSLog(@"URL: Error in read() %d - %s\n", errno, strerror(errno));
-		[_client URLProtocol:self didFailWithError:nil];
+		NSLog(@"URL: Error in read() %d - %s\n", en, strerror(en));
+		[_client URLProtocol:self
+				 didFailWithError:_NSError(NSPOSIXErrorDomain, en,
+										   @"error reading response")];
 		}
 	else
 		{
 		DBLog(@"URL: NSURLProtocol read %d %d\n", size, read_data);
-		if (size == 0 && read_data == 0)
+		if (size == 0)
 			{
-			NSLog(@"URL: NSURLProtocol complete\n");
-			[_client URLProtocolDidFinishLoading: self];
+			DBLog(@"URL: NSURLProtocol complete\n");
+			[self _closedByPeer];
 			}
 		}
 }
@@ -1054,7 +2058,7 @@ _ConnectionCallback( CFSocketRef socket,				// called by NSRunLoop
 			return;
 			}
 
-		NSLog(@"Connected %d - %s\n", se, strerror(se));
+		DBLog(@"Connected %d - %s\n", se, strerror(se));
 		p->_uc.connected = YES;
 		}
 
@@ -1063,6 +2067,129 @@ _ConnectionCallback( CFSocketRef socket,				// called by NSRunLoop
 // that failed in the background, it is a pointer to an SInt32 error code
 }
 
+/* ****************************************************************************
+
+	Idle connection pool
+
+	Sockets an HTTP/1.1 server left open after a complete response wait here,
+	keyed by scheme, host and port, for the next request to the same server.
+	A TLS session is kept with its socket as the protocol's transport.  Idle
+	sockets are closed after IDLE_TIMEOUT, below the common server default,
+	by a reaper timer on the run loop of the thread that pooled them, which
+	also closes any the server has closed so they don't linger in CLOSE_WAIT.
+	A socket is peeked again before reuse.  The pool is shared by all
+	threads and guarded by __idleLock.
+
+** ***************************************************************************/
+
+#define IDLE_SOCKETS_MAX	16
+#define IDLE_TIMEOUT		4.0
+#define IDLE_REAP_INTERVAL	1.0
+
+typedef struct _NSURLIdleSocket {
+	struct _NSURLIdleSocket *next;
+	NSString *key;
+	CFSocketNativeHandle sd;
+	CFTypeRef transport;
+	NSTimeInterval expires;
+} _NSURLIdleSocket;
+
+static _NSURLIdleSocket *__idleSockets = NULL;
+static unsigned int __idleCount = 0;
+static NSTimer *__idleReaper = nil;
+static pthread_mutex_t __idleLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static NSString *
+_IdleSocketKey(NSURL *u)
+{
+	return [NSString stringWithFormat:@"%@://%@:%@", [u scheme], [u host],
+					 [u port]];
+}
+
+static BOOL
+_IdleSocketIsOpen(_NSURLIdleSocket *s, NSTimeInterval now)
+{
+	char c;											// open with nothing to read
+	
+	return (s->expires > now && recv(s->sd, &c, 1, MSG_PEEK|MSG_DONTWAIT) < 0
+			&& (errno == EAGAIN || errno == EWOULDBLOCK));
+}
+
+static void
+_IdleSocketFree(_NSURLIdleSocket *s, BOOL closeSocket)	// caller holds lock
+{
+	if (closeSocket)
+		{
+		close(s->sd);
+		if (s->transport)
+			CFRelease(s->transport);
+		}
+	[s->key release];
+	free(s);
+	__idleCount--;
+}
+
+static CFSocketNativeHandle
+_IdleSocketTake(NSString *key, CFTypeRef *transport)
+{
+	NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+	CFSocketNativeHandle sd = -1;
+	_NSURLIdleSocket **p;
+	_NSURLIdleSocket *s;
+
+	pthread_mutex_lock(&__idleLock);
+	for (p = &__idleSockets; (s = *p);)
+		if (s->expires > now && ![s->key isEqualToString: key])
+			p = &s->next;
+		else
+			{
+			*p = s->next;
+			if (_IdleSocketIsOpen(s, now))
+				{
+				sd = s->sd;
+				*transport = s->transport;
+				_IdleSocketFree(s, NO);
+				break;
+				}
+			_IdleSocketFree(s, YES);
+			}
+	pthread_mutex_unlock(&__idleLock);
+
+	return sd;
+}
+
+static void
+_IdleSocketPut(NSString *key, CFSocketNativeHandle sd, CFTypeRef transport)
+{
+	_NSURLIdleSocket *s = malloc(sizeof(_NSURLIdleSocket));
+	_NSURLIdleSocket **p = &__idleSockets;
+
+	s->key = [key retain];
+	s->sd = sd;
+	s->transport = (transport) ? CFRetain(transport) : NULL;
+	s->expires = [NSDate timeIntervalSinceReferenceDate] + IDLE_TIMEOUT;
+
+	pthread_mutex_lock(&__idleLock);
+	s->next = __idleSockets;
+	__idleSockets = s;
+
+	if (++__idleCount > IDLE_SOCKETS_MAX)			// close the oldest
+		{
+		while ((*p)->next)
+			p = &(*p)->next;
+		_IdleSocketFree(*p, YES);
+		*p = NULL;
+		}
+	if (!__idleReaper)
+		__idleReaper = [NSTimer scheduledTimerWithTimeInterval:IDLE_REAP_INTERVAL
+								target: [NSURLConnection class]
+								selector: @selector(_reapIdleSockets:)
+								userInfo: nil
+								repeats: NO];
+	pthread_mutex_unlock(&__idleLock);
+}
+
 static id
 _AllocURLProtocol(NSURLRequest *r)
 {
@@ -1082,7 +2209,7 @@ _AllocURLProtocol(NSURLRequest *r)
 		}	}
 
 	if (!__gzPlugin && (__gzPlugin = _LoadPlugin(@"GZ")))
-		__content = @"Accept: */*\r\nAccept-Encoding: gzip\r\n";
+		__encoding = @"Accept-Encoding: gzip\r\n";
 	if ([(scheme = [[r URL] scheme]) isEqualToString: @"http"])
 		return NSAllocateObject([_NSURLProtocolHTTP class]);
 	if ([scheme isEqualToString: @"https"])
@@ -1097,6 +2224,20 @@ _AllocURLProtocol(NSURLRequest *r)
 }
 
 
+static NSCachedURLResponse *
+_CachedResponse(NSURLRequest *r)
+{
+	NSURLRequestCachePolicy p = [r cachePolicy];
+
+	if (p == NSURLRequestReloadIgnoringLocalCacheData
+			|| p == NSURLRequestReloadIgnoringLocalAndRemoteCacheData
+			|| ![[r HTTPMethod] isEqualToString: @"GET"])
+		return nil;
+
+	return [[NSURLCache sharedURLCache] cachedResponseForRequest: r];
+}
+
+
 @implementation NSURLConnection
 
 + (BOOL) canHandleRequest:(NSURLRequest *)request		{ return YES; }
@@ -1124,7 +2265,7 @@ _AllocURLProtocol(NSURLRequest *r)
 			return _NSInitError(self, @"no URL protocol for %@", request);
 
 		_protocol = [_protocol initWithRequest:request
-							   cachedResponse:nil
+							   cachedResponse:_CachedResponse(request)
 							   client:(id <NSURLProtocolClient>)self];
 		_delegate = delegate;
 		_request = [request retain];
@@ -1140,6 +2281,8 @@ _AllocURLProtocol(NSURLRequest *r)
 {
 	[_request release],		_request = nil;
 	[_protocol release],	_protocol = nil;
+	[_response release],	_response = nil;
+	[_cacheData release],	_cacheData = nil;
 	if (_socket)
 		[self unscheduleFromRunLoop:nil forMode:nil];
 	[super dealloc];
@@ -1155,24 +2298,52 @@ _AllocURLProtocol(NSURLRequest *r)
 {
 	CFOptionFlags fl = kCFSocketConnectCallBack | kCFSocketReadCallBack;
 	CFSocketContext cx = { 1, self, NULL, NULL, NULL };
+	CFTypeRef transport = NULL;
+	CFSocketNativeHandle sd;
+	CFRunLoopSourceRef rs;
 	NSData *address;
 
-	if (!(address = [[_request URL] _socketAddress]))
-		return;
-
-	_socket = CFSocketCreate (NULL, 0, 0, 0, fl, &_ConnectionCallback, &cx);
-
-	if (CFSocketConnectToAddress(_socket, (CFDataRef)address, -1) < 0)
-		NSLog(@"CFSocketConnectToAddress failed to connect");
+	if (![_request HTTPBodyStream]			// a stream can't be sent twice
+			&& (sd = _IdleSocketTake(_IdleSocketKey([_request URL]), &transport)) >= 0)
+		{
+		fl = kCFSocketReadCallBack;
+		_socket = CFSocketCreateWithNative(NULL, sd, fl, &_ConnectionCallback,
+										   &cx);
+		_uc.connected = _uc.reused = YES;
+		[_protocol _setTransport: transport];
+		if (transport)
+			CFRelease(transport);
+		}
 	else
 		{
-		CFRunLoopSourceRef rs;
+		if (!(address = [[_request URL] _socketAddress]))
+			return;
 
-		if ((rs = CFSocketCreateRunLoopSource(NULL, _socket, 0)) == NULL)
-			[NSException raise:NSGenericException format:@"CFSocket init error"];
-		CFRunLoopAddSource((CFRunLoopRef)rl, rs, (CFStringRef)mode);
-		CFRelease(rs);
+		_socket = CFSocketCreate (NULL, 0, 0, 0, fl, &_ConnectionCallback, &cx);
+#ifdef SO_NOSIGPIPE
+		{
+		int r = 1;
+
+		sd = CFSocketGetNative(_socket);
+		setsockopt(sd, SOL_SOCKET, SO_NOSIGPIPE, (char*)&r, sizeof(r));
 		}
+#endif
+
+		if (CFSocketConnectToAddress(_socket, (CFDataRef)address, -1) < 0)
+			{
+			NSLog(@"CFSocketConnectToAddress failed to connect");
+			return;
+		}	}
+
+	if ((rs = CFSocketCreateRunLoopSource(NULL, _socket, 0)) == NULL)
+		[NSException raise:NSGenericException format:@"CFSocket init error"];
+	CFRunLoopAddSource((CFRunLoopRef)rl, rs, (CFStringRef)mode);
+	CFRelease(rs);
+
+	if (_uc.reused)						// already connected, send request now
+		[_protocol _receivedEvent:_delegate
+				   type:kCFSocketWriteCallBack
+				   extra:INT2PTR(sd)];
 }
 
 - (void) unscheduleFromRunLoop:(NSRunLoop *)rl forMode:(NSString *)mode
@@ -1196,6 +2367,86 @@ _AllocURLProtocol(NSURLRequest *r)
 		}
 }
 
+- (void) _releaseSocketToPool
+{
+	CFSocketRef s = _socket;
+	CFSocketNativeHandle sd = CFSocketGetNative(s);
+									// invalidate without closing the socket
+	_socket = NULL;
+	CFSocketSetSocketFlags(s, CFSocketGetSocketFlags(s)
+							  & ~kCFSocketCloseOnInvalidate);
+	CFSocketInvalidate(s);
+	CFRelease(s);
+	_IdleSocketPut(_IdleSocketKey([_request URL]), sd, [_protocol _transport]);
+}
+
+- (void) _waitForWriteReady:(BOOL)flag
+{
+	if (_socket && flag)
+		CFSocketEnableCallBacks(_socket, kCFSocketWriteCallBack);
+	else if (_socket)
+		CFSocketDisableCallBacks(_socket, kCFSocketWriteCallBack);
+}
+
+- (void) _didSendBodyData:(NSInteger)bytesWritten
+		 totalBytesWritten:(NSInteger)totalBytesWritten
+		 totalBytesExpectedToWrite:(NSInteger)totalBytesExpectedToWrite
+{
+	SEL s = @selector(connection:didSendBodyData:totalBytesWritten:totalBytesExpectedToWrite:);
+
+	if ([_delegate respondsToSelector: s])
+		[_delegate connection:self
+				   didSendBodyData:bytesWritten
+				   totalBytesWritten:totalBytesWritten
+				   totalBytesExpectedToWrite:totalBytesExpectedToWrite];
+}
+
++ (void) _reapIdleSockets:(NSTimer *)timer
+{
+	NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+	_NSURLIdleSocket **p;
+	_NSURLIdleSocket *s;
+
+	pthread_mutex_lock(&__idleLock);
+	for (p = &__idleSockets; (s = *p);)
+		if (_IdleSocketIsOpen(s, now))
+			p = &s->next;
+		else
+			{										// expired or closed by
+			*p = s->next;							// the server
+			_IdleSocketFree(s, YES);
+			}
+	__idleReaper = nil;
+	if (__idleSockets)
+		__idleReaper = [NSTimer scheduledTimerWithTimeInterval:IDLE_REAP_INTERVAL
+								target: self
+								selector: @selector(_reapIdleSockets:)
+								userInfo: nil
+								repeats: NO];
+	pthread_mutex_unlock(&__idleLock);
+}
+
+- (BOOL) _reconnect
+{
+	NSString *m = [_request HTTPMethod];
+
+	if (!_uc.reused)
+		return NO;
+	if (!([m isEqualToString: @"GET"] || [m isEqualToString: @"HEAD"]
+			|| [m isEqualToString: @"PUT"] || [m isEqualToString: @"DELETE"]
+			|| [m isEqualToString: @"OPTIONS"]))
+		return NO;						// only idempotent requests are resent
+
+											// server closed an idle socket
+	[self unscheduleFromRunLoop:nil forMode:nil];	// as the request was sent
+	_uc.connected = _uc.reused = NO;
+	[_protocol _reset];
+	[self scheduleInRunLoop:[NSRunLoop currentRunLoop]
+		  forMode:NSDefaultRunLoopMode];
+
+	return YES;
+}
+
 - (void) URLProtocol:(NSURLProtocol *)proto
 		 wasRedirectedToRequest:(NSURLRequest *)request
 		 redirectResponse:(NSURLResponse *)redirectResponse
@@ -1222,21 +2473,67 @@ _AllocURLProtocol(NSURLRequest *r)
 		 didReceiveResponse:(NSURLResponse *)response
 		 cacheStoragePolicy:(NSURLCacheStoragePolicy)policy
 {
+	ASSIGN(_response, response);
+	[_cacheData release],	_cacheData = nil;
+	if ((_uc.storage = policy) != NSURLCacheStorageNotAllowed
+			&& [(NSHTTPURLResponse *)response statusCode] == 200
+			&& [[_request HTTPMethod] isEqualToString: @"GET"])
+		_cacheData = [NSMutableData new];
+
 	[_delegate connection:self didReceiveResponse:response];
 }
 
+- (void) URLProtocol:(NSURLProtocol *)proto
+		 cachedResponseIsValid:(NSCachedURLResponse *)cachedResponse
+{
+	[[NSURLCache sharedURLCache] _cachedResponseIsValid:cachedResponse
+								 forRequest:_request];
+}
+
+- (void) _cacheResponse
+{
+	NSCachedURLResponse *cr = [NSCachedURLResponse alloc];
+	SEL s = @selector(connection:willCacheResponse:);
+
+	cr = [[cr initWithResponse: _response
+			  data: _cacheData
+			  userInfo: nil
+			  storagePolicy: _uc.storage] autorelease];
+	if ([_delegate respondsToSelector: s])
+		cr = [_delegate connection:self willCacheResponse:cr];
+	if (cr)
+		[[NSURLCache sharedURLCache] storeCachedResponse:cr forRequest:_request];
+	[_cacheData release],	_cacheData = nil;
+}
+
 - (void) URLProtocolDidFinishLoading:(NSURLProtocol *)proto
 {
 	if (!_uc.done)
 		{
 		_uc.done = YES;
+		if (_socket && [proto _keepAlive])	// pool before the delegate can
+			[self _releaseSocketToPool];	// ask for the next resource
+		else
+			[self unscheduleFromRunLoop:nil forMode:nil];
+		if (_cacheData)
+			[self _cacheResponse];
 		[_delegate connectionDidFinishLoading:self];
-		[self unscheduleFromRunLoop:nil forMode:nil];
 		}
 }
 
 - (void) URLProtocol:(NSURLProtocol *)proto didLoadData:(NSData *)data
 {
+	if (_cacheData)
+		{
+		NSURLCache *c = [NSURLCache sharedURLCache];
+		NSUInteger max = MAX([c memoryCapacity], [c diskCapacity]) / 20;
+
+		if ([_cacheData length] + [data length] > max)
+			[_cacheData release],	_cacheData = nil;	// too large to cache
+		else
+			[_cacheData appendData: data];
+		}
+
 	[_delegate connection:self didReceiveData:data];
 }
 
@@ -0,0 +1,110 @@
+/*
+   editbench.m
+
+   Editing cost of large mutable strings.  Characters are inserted one at
+   a time at random positions into an NSMutableString and into an
+   NSMutableAttributedString whose text starts out split into many
+   attribute runs, as an editor does on a large log file.  The time per
+   insert is reported for every tenth of the inserts, so that a cost
+   growing with the document shows up as a rising column.  Random
+   attributesAtIndex:effectiveRange: lookups are timed last.
+
+   usage:  editbench [initial characters] [inserts] [run length]
+*/
+
+#include <stdio.h>
+#include <sys/time.h>
+#include <Foundation/NSAttributedString.h>
+#include <Foundation/NSAutoreleasePool.h>
+#include <Foundation/NSDictionary.h>
+#include <Foundation/NSString.h>
+
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static unsigned int __seed = 1;
+
+static NSUInteger
+position(NSUInteger length)
+{
+	__seed = __seed * 1103515245 + 12345;
+
+	return (__seed >> 8) % (length + 1);
+}
+
+static void
+bench(const char *name, id s, int inserts)
+{
+	NSString *c = @"x";
+	int i, j, step = (inserts < 10) ? 1 : inserts / 10;
+
+	printf("  %s\n", name);
+	for (i = 0; i < inserts; i += step)
+		{
+		NSAutoreleasePool *pool = [NSAutoreleasePool new];
+		double t = now();
+
+		for (j = 0; j < step; j++)
+			[s replaceCharactersInRange:(NSRange){position([s length]), 0}
+			   withString:c];
+		t = now() - t;
+		printf("    %8lu chars %10.3f us/insert\n",
+				(unsigned long)[s length], t * 1000000.0 / step);
+		[pool release];
+		}
+}
+
+/* ****************************************************************************
+
+	Benchmark driver
+
+** ***************************************************************************/
+
+int
+main(int argc, char **argv)
+{
+	NSAutoreleasePool *arp = [NSAutoreleasePool new];
+	NSUInteger size = (argc > 1) ? strtoul(argv[1], NULL, 10) : 1 << 20;
+	int inserts = (argc > 2) ? atoi(argv[2]) : 100000;
+	NSUInteger run = (argc > 3) ? strtoul(argv[3], NULL, 10) : 64;
+	NSMutableString *text = [NSMutableString stringWithCapacity: size];
+	NSMutableAttributedString *a;
+	NSDictionary *bold;
+	NSRange r = {0, 0};
+	NSUInteger i;
+	double t;
+
+	while ([text length] < size)
+		[text appendString: @"the quick brown fox jumps over the lazy dog\n"];
+	a = [[NSMutableAttributedString alloc] initWithString: text];
+	bold = [NSDictionary dictionaryWithObject: @"bold" forKey: @"NSFont"];
+	for (i = 0; i + run <= [a length]; i += 2 * run)
+		[a setAttributes: bold range: (NSRange){i, run}];
+
+	printf("editbench: %lu characters, %d inserts, runs of %lu\n",
+			(unsigned long)[text length], inserts, (unsigned long)run);
+
+	bench("NSMutableString", text, inserts);
+	bench("NSMutableAttributedString", a, inserts);
+
+	t = now();
+	for (i = 0; i < (NSUInteger)inserts; i++)
+		[a attributesAtIndex: position([a length] - 1) effectiveRange: &r];
+	t = now() - t;
+	printf("  attributesAtIndex:effectiveRange: %10.3f us/lookup\n",
+			t * 1000000.0 / inserts);
+
+	[a release];
+	[arp release];
+	printf("editbench complete\n");
+
+	exit (0);
+}
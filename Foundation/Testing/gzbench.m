@@ -0,0 +1,259 @@
+/*
+   gzbench.m
+
+   Compression ratio and speed of the GZ plugin at each zlib level, on
+   text resembling a property list and a server log.  Every level from 0
+   (stored) to 9 compresses the text as gzip in one call and decompresses
+   it again, the round trip is checked and the rate of each direction is
+   reported in MB/s of uncompressed text.  Raw deflate, zlib and gzip are
+   each round tripped, and decoded with format auto detection too.  The
+   text is then written to a file through a compressing output stream and
+   read back through a decompressing input stream, neither of which holds
+   more than a buffer, and the other two stream directions are checked.
+   gzbench exits 1 if any round trip differs.
+
+   usage:  gzbench [size in KB] [rounds]
+*/
+
+#include <Foundation/NSObject.h>
+#include <Foundation/NSBundle.h>
+#include <Foundation/NSData.h>
+#include <Foundation/NSString.h>
+#include <Foundation/NSStream.h>
+#include <Foundation/NSAutoreleasePool.h>
+#include <Foundation/Private/_NSDataGZ.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static NSData *
+text(NSUInteger size)
+{
+	static const char *paths[] = { "/index.html", "/images/logo.png",
+								   "/api/v1/items", "/css/site.css" };
+	NSMutableData *d = [NSMutableData dataWithCapacity: size + 256];
+	char line[256];
+	int i, n;
+
+	for (i = 0; [d length] < size; i++)
+		{
+		if ((i / 64) % 2)
+			n = sprintf(line, "10.0.%d.%d - - [17/Oct/2020:12:%02d:%02d] "
+							  "\"GET %s HTTP/1.1\" 200 %d\n",
+							  (i * 7) % 256, (i * 13) % 256, (i / 60) % 60,
+							  i % 60, paths[(i * 31) % 4], (i * 977) % 65536);
+		else
+			n = sprintf(line, "\t<dict>\n\t\t<key>id</key>\n\t\t<integer>%d"
+							  "</integer>\n\t\t<key>name</key>\n\t\t<string>"
+							  "item%d</string>\n\t</dict>\n", i, i * 3);
+		[d appendBytes: line length: n];
+		}
+	[d setLength: size];
+
+	return d;
+}
+
+static int
+bench(NSData *d, int level, int rounds)
+{
+	NSUInteger length = 0;
+	double tc = 0, td = 0;
+	int r, bad = 0;
+
+	for (r = 0; r < rounds; r++)
+		{
+		NSAutoreleasePool *pool = [NSAutoreleasePool new];
+		NSData *c, *u;
+
+		tc -= now();
+		c = [d compressedDataWithLevel: level format: NSDataGZFormatGZip];
+		tc += now();
+
+		td -= now();
+		u = [c decompressedDataWithFormat: NSDataGZFormatGZip];
+		td += now();
+
+		if (!c || ![u isEqual: d])
+			{
+			printf("  level %d round trip differs\n", level);
+			bad++;
+			}
+		length = [c length];
+		[pool release];
+		}
+
+	printf("  level %d  %9lu bytes  %5.1f%%  compress %8.1f MB/s  "
+			"decompress %8.1f MB/s\n", level, (unsigned long)length,
+			100.0 * length / [d length],
+			[d length] * rounds / tc / 1000000.0,
+			[d length] * rounds / td / 1000000.0);
+
+	return bad;
+}
+
+static int
+formats(NSData *d)
+{
+	static struct { NSDataGZFormat f; const char *name; } t[] = {
+		{ NSDataGZFormatRaw, "raw" }, { NSDataGZFormatZlib, "zlib" },
+		{ NSDataGZFormatGZip, "gzip" } };
+	int i, bad = 0;
+
+	for (i = 0; i < sizeof(t) / sizeof(t[0]); i++)
+		{
+		NSAutoreleasePool *pool = [NSAutoreleasePool new];
+		NSData *c = [d compressedDataWithLevel: NSDataGZDefaultLevel
+					   format: t[i].f];
+		BOOL ok = c && [[c decompressedDataWithFormat: t[i].f] isEqual: d];
+
+		if (ok && t[i].f != NSDataGZFormatRaw)		// header is detected
+			ok = [[c decompressedDataWithFormat: NSDataGZFormatAuto]
+					isEqual: d];
+		printf("  format %-5s %9lu bytes  %s\n", t[i].name,
+				(unsigned long)[c length], (ok) ? "ok" : "round trip differs");
+		bad += !ok;
+		[pool release];
+		}
+
+	return bad;
+}
+
+static int
+file(NSData *d, NSString *path)
+{
+	NSOutputStream *o = [NSOutputStream outputStreamToFileAtPath: path
+										append: NO];
+	NSInputStream *i;
+	NSMutableData *u = [NSMutableData dataWithCapacity: [d length]];
+	const uint8_t *b = [d bytes];
+	NSUInteger l = [d length];
+	NSInteger n;
+	uint8_t buf[8192];
+	double t = now();
+
+	o = [NSOutputStream compressingStreamWithOutputStream: o
+						level: NSDataGZDefaultLevel
+						format: NSDataGZFormatGZip];
+	[o open];
+	for (; l > 0; b += n, l -= n)
+		if ((n = [o write: b maxLength: MIN(l, sizeof(buf))]) <= 0)
+			break;
+	[o close];
+	printf("  file write  %8.1f MB/s\n", [d length] / (now() - t) / 1000000.0);
+
+	t = now();
+	i = [NSInputStream inputStreamWithFileAtPath: path];
+	i = [NSInputStream decompressingStreamWithInputStream: i
+					   format: NSDataGZFormatAuto];
+	[i open];
+	while ((n = [i read: buf maxLength: sizeof(buf)]) > 0)
+		[u appendBytes: buf length: n];
+	[i close];
+	printf("  file read   %8.1f MB/s\n", [d length] / (now() - t) / 1000000.0);
+
+	unlink([path cString]);
+	if (![u isEqual: d])
+		{
+		printf("  file round trip differs\n");
+		return 1;
+		}
+
+	return 0;
+}
+
+static int
+streams(NSData *d, NSString *path)		// compressing input, inflating output
+{
+	NSInputStream *i = [NSInputStream inputStreamWithData: d];
+	NSOutputStream *o = [NSOutputStream outputStreamToFileAtPath: path
+										append: NO];
+	NSMutableData *c = [NSMutableData dataWithCapacity: [d length] / 4];
+	const uint8_t *b;
+	NSUInteger l;
+	NSInteger n;
+	uint8_t buf[8192];
+	BOOL ok;
+
+	i = [NSInputStream compressingStreamWithInputStream: i
+					   level: NSDataGZDefaultLevel
+					   format: NSDataGZFormatZlib];
+	[i open];
+	while ((n = [i read: buf maxLength: sizeof(buf)]) > 0)
+		[c appendBytes: buf length: n];
+	[i close];
+	ok = [[c decompressedDataWithFormat: NSDataGZFormatZlib] isEqual: d];
+	printf("  input stream compress    %s\n", (ok) ? "ok" : "round trip differs");
+
+	o = [NSOutputStream decompressingStreamWithOutputStream: o
+						format: NSDataGZFormatAuto];
+	[o open];
+	for (b = [c bytes], l = [c length]; l > 0; b += n, l -= n)
+		if ((n = [o write: b maxLength: MIN(l, 1000)]) <= 0)
+			break;
+	[o close];
+	if ([[NSData dataWithContentsOfFile: path] isEqual: d])
+		printf("  output stream decompress ok\n");
+	else
+		{
+		printf("  output stream decompress round trip differs\n");
+		ok = NO;
+		}
+	unlink([path cString]);
+
+	return !ok;
+}
+
+/* ****************************************************************************
+
+	Benchmark driver
+
+** ***************************************************************************/
+
+int
+main(int argc, char **argv)
+{
+	NSAutoreleasePool *arp = [NSAutoreleasePool new];
+	int size = (argc > 1) ? atoi(argv[1]) : 4096;
+	int rounds = (argc > 2) ? atoi(argv[2]) : 5;
+	NSString *p = [[NSBundle systemBundle] pathForResource: @"GZ"
+										   ofType: @"bundle"
+										   inDirectory: @"Foundation/Plugins"];
+	NSString *tmp = [NSString stringWithFormat: @"/tmp/gzbench.%d", getpid()];
+	NSData *d;
+	int level, bad = 0;
+
+	if (!p || ![[[NSBundle alloc] initWithPath: p] principalClass])
+		{
+		printf("gzbench: GZ plugin not found\n");
+		exit (1);
+		}
+
+	d = text(size * 1024);
+	printf("gzbench: %d KB of text, %d rounds\n", size, rounds);
+
+	for (level = 0; level <= 9; level++)
+		bad += bench(d, level, rounds);
+	bad += formats(d);
+
+	bad += file(d, [tmp stringByAppendingPathExtension: @"gz"]);
+	bad += streams(d, tmp);
+
+	[arp release];
+	printf("gzbench %s\n", (bad) ? "FAILED" : "complete");
+
+	exit ((bad) ? 1 : 0);
+}
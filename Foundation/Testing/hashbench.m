@@ -0,0 +1,299 @@
+/*
+   hashbench.m
+
+   Compare insert / lookup / remove / enumerate throughput and memory use
+   of the open addressed NSMapTable against the chained bucket table it
+   replaced (reproduced below as _ChainTable).
+
+   usage:  hashbench [items] [rounds]
+*/
+
+#include <stdio.h>
+#include <sys/time.h>
+#include <Foundation/NSMapTable.h>
+#include <Foundation/NSValue.h>
+#include <Foundation/NSAutoreleasePool.h>
+
+
+/* ****************************************************************************
+
+	_ChainTable -- the prime sized chained bucket map of mGSTEP 2.07
+
+** ***************************************************************************/
+
+typedef struct _ChainNode {
+	void *key;
+	void *value;
+	struct _ChainNode *next;
+} _ChainNode;
+
+typedef struct _ChainTable {
+	_ChainNode **nodes;
+	NSUInteger hashSize;
+	NSUInteger itemsCount;
+} _ChainTable;
+
+static BOOL
+is_prime(NSUInteger n)
+{
+	NSUInteger i;
+
+	if (n % 2 == 0)
+		return NO;
+	for (i = 3; i * i <= n; i += 2)
+		if (n % i == 0)
+			return NO;
+
+	return YES;
+}
+
+static NSUInteger
+nextPrime(NSUInteger n)
+{
+	for (n |= 1; !is_prime(n); n += 2);
+
+	return n;
+}
+
+static NSUInteger
+chain_hash(const void *key)			{ return (NSUInteger)(long)key; }
+
+static _ChainTable *
+chain_create(NSUInteger capacity)
+{
+	_ChainTable *t = malloc(sizeof(_ChainTable));
+
+	t->hashSize = nextPrime(capacity ? capacity : 13);
+	t->nodes = calloc(t->hashSize, sizeof(void*));
+	t->itemsCount = 0;
+
+	return t;
+}
+
+static void
+chain_grow(_ChainTable *t, NSUInteger newSize)
+{
+	_ChainNode **nodes = calloc(newSize, sizeof(void*));
+	NSUInteger i;
+
+	for (i = 0; i < t->hashSize; i++)
+		{
+		_ChainNode *next, *node = t->nodes[i];
+
+		for (; node; node = next)
+			{
+			NSUInteger h = chain_hash(node->key) % newSize;
+
+			next = node->next;
+			node->next = nodes[h];
+			nodes[h] = node;
+		}	}
+
+	free(t->nodes);
+	t->nodes = nodes;
+	t->hashSize = newSize;
+}
+
+static void
+chain_insert(_ChainTable *t, const void *key, const void *value)
+{
+	NSUInteger h = chain_hash(key) % t->hashSize;
+	_ChainNode *node;
+
+	for (node = t->nodes[h]; node; node = node->next)
+		if (node->key == key)
+			{
+			node->value = (void*)value;
+			return;
+			}
+
+	node = malloc(sizeof(_ChainNode));
+	node->key = (void*)key;
+	node->value = (void*)value;
+	node->next = t->nodes[h];
+	t->nodes[h] = node;
+
+	if (++(t->itemsCount) >= ((t->hashSize * 3) / 4))
+		chain_grow(t, nextPrime((t->hashSize * 4) / 3));
+}
+
+static void *
+chain_get(_ChainTable *t, const void *key)
+{
+	_ChainNode *node = t->nodes[chain_hash(key) % t->hashSize];
+
+	for (; node; node = node->next)
+		if (node->key == key)
+			return node->value;
+
+	return NULL;
+}
+
+static void
+chain_remove(_ChainTable *t, const void *key)
+{
+	NSUInteger h = chain_hash(key) % t->hashSize;
+	_ChainNode *node, *prev = NULL;
+
+	for (node = t->nodes[h]; node; prev = node, node = node->next)
+		if (node->key == key)
+			{
+			if (prev)
+				prev->next = node->next;
+			else
+				t->nodes[h] = node->next;
+			free(node);
+			t->itemsCount--;
+
+			return;
+			}
+}
+
+static NSUInteger
+chain_enumerate(_ChainTable *t)
+{
+	NSUInteger i, sum = 0;
+	_ChainNode *node;
+
+	for (i = 0; i < t->hashSize; i++)
+		for (node = t->nodes[i]; node; node = node->next)
+			sum += (NSUInteger)node->value;
+
+	return sum;
+}
+
+static void
+chain_free(_ChainTable *t)
+{
+	NSUInteger i;
+
+	for (i = 0; i < t->hashSize; i++)
+		{
+		_ChainNode *next, *node = t->nodes[i];
+
+		for (; node; node = next)
+			{
+			next = node->next;
+			free(node);
+		}	}
+
+	free(t->nodes);
+	free(t);
+}
+
+/* ****************************************************************************
+
+	Benchmark driver
+
+** ***************************************************************************/
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static NSUInteger
+malloc_cost(NSUInteger size)		// assume an 8 byte malloc header and 16
+{									// byte alignment (glibc on 64-bit)
+	size = (size + 8 + 15) & ~(NSUInteger)15;
+
+	return (size < 32) ? 32 : size;
+}
+
+static void
+report(const char *name, const char *op, NSUInteger n, double t)
+{
+	printf("  %-8s %-10s %8.2f Mops/s\n", name, op, (n / t) / 1000000.0);
+}
+
+int
+main(int argc, char **argv)
+{
+	NSAutoreleasePool *arp = [NSAutoreleasePool new];
+	NSUInteger items = (argc > 1) ? strtoul(argv[1], NULL, 10) : 1000000;
+	NSUInteger rounds = (argc > 2) ? strtoul(argv[2], NULL, 10) : 3;
+	NSUInteger *keys = malloc(items * sizeof(NSUInteger));
+	NSUInteger i, r, sum;
+	double t;
+
+	for (i = 0; i < items; i++)				// unique, non-zero and scattered
+		keys[i] = (i + 1) * (NSUInteger)2654435761UL;
+
+	printf("hashbench: %lu items, %lu rounds\n",
+			(unsigned long)items, (unsigned long)rounds);
+
+	for (r = 0; r < rounds; r++)
+		{
+		NSMapTable *mt;
+		_ChainTable *ct;
+		NSMapEnumerator me;
+		void *k, *v;
+
+		printf("round %lu\n", (unsigned long)r + 1);
+
+		t = now();
+		mt = NSCreateMapTable(NSIntMapKeyCallBacks, NSIntMapValueCallBacks, 0);
+		for (i = 0; i < items; i++)
+			NSMapInsert(mt, (void*)keys[i], (void*)i);
+		report("open", "insert", items, now() - t);
+
+		t = now();
+		for (i = 0, sum = 0; i < items; i++)
+			sum += (NSUInteger)NSMapGet(mt, (void*)keys[i]);
+		report("open", "lookup", items, now() - t);
+
+		t = now();
+		me = NSEnumerateMapTable(mt);
+		for (sum = 0; NSNextMapEnumeratorPair(&me, &k, &v);)
+			sum += (NSUInteger)v;
+		report("open", "enumerate", items, now() - t);
+
+		if (r == 0)
+			printf("  %-8s %-10s %8.1f bytes/entry\n", "open", "memory",
+					(double)(sizeof(NSMapTable) + mt->hashSize
+					* (sizeof(NSUInteger) + 2 * sizeof(void*))) / items);
+
+		t = now();
+		for (i = 0; i < items; i++)
+			NSMapRemove(mt, (void*)keys[i]);
+		report("open", "remove", items, now() - t);
+		NSFreeMapTable(mt);
+
+		t = now();
+		ct = chain_create(0);
+		for (i = 0; i < items; i++)
+			chain_insert(ct, (void*)keys[i], (void*)i);
+		report("chained", "insert", items, now() - t);
+
+		t = now();
+		for (i = 0, sum = 0; i < items; i++)
+			sum += (NSUInteger)chain_get(ct, (void*)keys[i]);
+		report("chained", "lookup", items, now() - t);
+
+		t = now();
+		sum = chain_enumerate(ct);
+		report("chained", "enumerate", items, now() - t);
+
+		if (r == 0)
+			printf("  %-8s %-10s %8.1f bytes/entry\n", "chained", "memory",
+					(double)(sizeof(_ChainTable) + ct->hashSize * sizeof(void*)
+					+ ct->itemsCount * malloc_cost(sizeof(_ChainNode))) / items);
+
+		t = now();
+		for (i = 0; i < items; i++)
+			chain_remove(ct, (void*)keys[i]);
+		report("chained", "remove", items, now() - t);
+		chain_free(ct);
+		}
+
+	free(keys);
+	[arp release];
+	printf("hashbench complete\n");
+
+	exit (0);
+}
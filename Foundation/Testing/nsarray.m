@@ -7,12 +7,18 @@
 #include <stdlib.h>
 #include <assert.h>
 
-static int
+static NSInteger
 compare(id elem1, id elem2, void *context)
 {
 	return (long)[elem1 performSelector:@selector(compare:) withObject:elem2];
 }
 
+static NSInteger
+lastDigit(id elem1, id elem2, void *context)
+{
+	return ([elem1 intValue] % 10) - ([elem2 intValue] % 10);
+}
+
 void
 print_array(char *msg, NSArray *a)
 {
@@ -410,8 +416,51 @@ printf("Method -removeObjectsFromIndices: {1, 0, 0, 4, 5, 6, 7} " "numIndices: 7
 
   {
     // Sorting Elements
-    //[ sortUsingFunction: context:];
-    //[ sortUsingSelector:];
+	NSMutableArray *m = [NSMutableArray array];
+	NSData *hint;
+	BOOL ok = YES;
+	unsigned int *order = malloc(101000 * sizeof(unsigned int));
+
+	for (p = 0; p < 100000; p++)			// distinct values, order[] holds
+		{									// each one's insertion index
+		int v = 1000 + (p * 7919) % 100000;
+
+		order[v] = p;
+		[m addObject: [NSNumber numberWithInt: v]];
+		}
+
+	[m sortUsingFunction: lastDigit context: NULL];		// parallel and stable
+	for (p = 1; p < [m count] && ok; p++)
+		{
+		int x = [[m objectAtIndex: p - 1] intValue];
+		int y = [[m objectAtIndex: p] intValue];
+
+		ok = (x % 10 < y % 10) || (x % 10 == y % 10 && order[x] < order[y]);
+		}
+	free(order);
+    printf("%s:  sortUsingFunction:context: stable\n", (ok) ? "PASS" : "FAIL");
+
+	[m sortUsingSelector: @selector(compare:)];
+	for (p = 1, ok = YES; p < [m count] && ok; p++)
+		ok = [[m objectAtIndex: p - 1] intValue] < [[m objectAtIndex: p] intValue];
+    printf("%s:  sortUsingSelector:\n", (ok) ? "PASS" : "FAIL");
+
+	f = [[m copy] autorelease];
+	hint = [f sortedArrayHint];
+	h = [f sortedArrayUsingFunction: compare context: NULL hint: hint];
+	i = [[m objectAtIndex: 10] retain];
+	[m removeObjectAtIndex: 10];
+	[m addObject: i];
+	[i release];
+	g = [m sortedArrayUsingFunction: compare context: NULL hint: hint];
+    printf("%s:  sortedArrayUsingFunction:context:hint:\n",
+			([g isEqualToArray: f] && [h isEqualToArray: f]) ? "PASS" : "FAIL");
+
+	e = [[f reverseObjectEnumerator] allObjects];	// hint of unsorted array
+	g = [e sortedArrayUsingFunction: compare context: NULL
+						   hint: [e sortedArrayHint]];
+    printf("%s:  sortedArrayUsingFunction:context:hint: unsorted\n",
+			([g isEqualToArray: f]) ? "PASS" : "FAIL");
   }
 
   [pool release];
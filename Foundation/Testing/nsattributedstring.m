@@ -17,6 +17,7 @@
 #include <Foundation/NSArray.h>
 #include <Foundation/NSDictionary.h>
 #include <Foundation/NSAttributedString.h>
+#include <Foundation/NSArchiver.h>
 #include <Foundation/NSAutoreleasePool.h>
 
 // These are normally defined in the AppKit
@@ -98,12 +99,57 @@ NSMutableDictionary *attributes,*colorAttributes,*twoAttributes;
 	print([muAttrString2 attributedSubstringFromRange:NSMakeRange(10,7)]);
 }
 
+void
+testEditing(void)
+{
+NSMutableAttributedString *m;
+NSDictionary *bold, *plain, *d;
+NSRange r;
+NSData *a;
+unsigned int i;
+
+	bold = [NSDictionary dictionaryWithObject:@"bold" forKey:NSFontAttributeName];
+	plain = [NSDictionary dictionary];
+	m = [[[NSMutableAttributedString alloc] initWithString:@"0123456789"
+											attributes:plain] autorelease];
+	[m setAttributes:bold range:NSMakeRange(3,4)];
+
+	[m replaceCharactersInRange:NSMakeRange(5,0) withString:@"ab"];
+	d = [m attributesAtIndex:5 effectiveRange:&r];
+	printf("%s edit test 1\n", (d == bold && r.location == 3 && r.length == 6)
+								? "PASS" : "FAIL");
+
+	[m replaceCharactersInRange:NSMakeRange(3,6) withString:nil];
+	d = [m attributesAtIndex:3 effectiveRange:&r];
+	printf("%s edit test 2\n", (d == plain && [m length] == 6) ? "PASS" : "FAIL");
+
+	[m deleteCharactersInRange:NSMakeRange(0,[m length])];
+	[m appendAttributedString:[[[NSAttributedString alloc]
+			initWithString:@"xyz" attributes:bold] autorelease]];
+	d = [m attributesAtIndex:2 effectiveRange:&r];
+	printf("%s edit test 3\n", ([d isEqual:bold] && r.length == 3)
+								? "PASS" : "FAIL");
+
+	for (i = 0; i < 1000; i++)
+		[m replaceCharactersInRange:NSMakeRange((i * 7) % [m length], 0)
+		   withString:@"q"];
+	d = [m attributesAtIndex:[m length] - 1 effectiveRange:&r];
+	printf("%s edit test 4\n", ([m length] == 1003 && r.location == 0
+								&& r.length == 1003) ? "PASS" : "FAIL");
+
+	[m setAttributes:plain range:NSMakeRange(10,10)];
+	a = [NSArchiver archivedDataWithRootObject:m];
+	printf("%s edit test 5\n", [[NSUnarchiver unarchiveObjectWithData:a]
+								isEqualToAttributedString:m] ? "PASS" : "FAIL");
+}
+
 int
 main()
 {
 NSAutoreleasePool *p = [NSAutoreleasePool new];
 
 	testAttributedString();
+	testEditing();
 	[p release];
 	printf("nsattributedstring test complete\n");
 	
@@ -0,0 +1,141 @@
+/*
+   nsjson.m
+
+   NSJSONSerialization reader tests: value types, escapes, number
+   precision, malformed input and the stream / file handle entry points.
+*/
+
+#include <stdio.h>
+#include <Foundation/NSArray.h>
+#include <Foundation/NSAutoreleasePool.h>
+#include <Foundation/NSData.h>
+#include <Foundation/NSDictionary.h>
+#include <Foundation/NSError.h>
+#include <Foundation/NSFileHandle.h>
+#include <Foundation/NSFileManager.h>
+#include <Foundation/NSJSONSerialization.h>
+#include <Foundation/NSNull.h>
+#include <Foundation/NSStream.h>
+#include <Foundation/NSString.h>
+#include <Foundation/NSValue.h>
+
+#define NONE        "\033[0m"
+#define FRED        "\033[31;40m"
+
+static int failures = 0;
+
+static void
+check(BOOL ok, const char *what)
+{
+	if (ok)
+		printf("ok:    %s\n", what);
+	else
+		{
+		printf(FRED "FAIL:  %s\n" NONE, what);
+		failures++;
+		}
+}
+
+static id
+parse(const char *json, NSJSONReadingOptions options, NSError **error)
+{
+	NSData *d = [NSData dataWithBytes:json length:strlen(json)];
+
+	return [NSJSONSerialization JSONObjectWithData:d options:options error:error];
+}
+
+
+int
+main ()
+{
+	id pool = [[NSAutoreleasePool alloc] init];
+	const char *doc = "{ \"name\" : \"caf\\u00e9 \\ud83d\\ude00\", \"tab\":\"a\\tb\","
+					  " \"pi\" : 3.141592653589793, \"tiny\" : 1e-300,"
+					  " \"big\" : 9007199254740993, \"neg\" : -42,"
+					  " \"list\" : [true, false, null, [], {}],"
+					  " \"utf8\" : \"\xc3\xa9t\xc3\xa9\" }";
+	NSString *path = @"/tmp/nsjson.json";
+	NSError *error = nil;
+	NSDictionary *d;
+	NSArray *a;
+	NSString *s;
+	id o;
+
+	printf("NSJSONSerialization tests\n");
+
+	d = parse(doc, 0, &error);
+	check([d isKindOfClass:[NSDictionary class]] && [d count] == 8,
+		  "top-level object with 8 keys");
+
+	s = [d objectForKey:@"name"];
+	check([s length] == 7 && [s characterAtIndex:3] == 0xe9
+		  && [s characterAtIndex:5] == 0xd83d && [s characterAtIndex:6] == 0xde00,
+		  "\\u escapes and surrogate pairs");
+	check([[d objectForKey:@"tab"] isEqualToString:@"a\tb"], "simple escapes");
+	check([[d objectForKey:@"utf8"] length] == 4
+		  && [[d objectForKey:@"utf8"] characterAtIndex:0] == 0xe9,
+		  "raw UTF-8 string");
+
+	check([[d objectForKey:@"pi"] doubleValue] == 3.141592653589793,
+		  "double keeps full precision");
+	check([[d objectForKey:@"tiny"] doubleValue] == 1e-300, "small exponent");
+	check([[d objectForKey:@"big"] longLongValue] == 9007199254740993LL,
+		  "64-bit integer is exact");
+	check([[d objectForKey:@"neg"] intValue] == -42, "negative integer");
+
+	a = [d objectForKey:@"list"];
+	check([a count] == 5 && [[a objectAtIndex:0] boolValue]
+		  && ![[a objectAtIndex:1] boolValue]
+		  && [a objectAtIndex:2] == [NSNull null], "true false null");
+	check([[a objectAtIndex:3] count] == 0 && [[a objectAtIndex:4] count] == 0,
+		  "empty array and object");
+
+	a = parse("[]", 0, &error);
+	check(a != nil && [a count] == 0, "empty top-level array");
+
+	a = parse(" [ 1 , 2 ] ", NSJSONReadingMutableContainers, &error);
+	[(NSMutableArray *)a addObject:@"3"];
+	check([a count] == 3, "mutable containers");
+
+	error = nil;
+	o = parse("[1, 2,]", 0, &error);
+	check(o == nil && error != nil, "trailing comma is an error");
+	error = nil;
+	o = parse("{\"a\" 1}", 0, &error);
+	check(o == nil && error != nil, "missing colon is an error");
+	error = nil;
+	o = parse("[\"abc", 0, &error);
+	check(o == nil && error != nil, "unterminated string is an error");
+	error = nil;
+	o = parse("[01]", 0, &error);
+	check(o == nil && error != nil, "leading zero is an error");
+	error = nil;
+	o = parse("17", 0, &error);
+	check(o == nil && error != nil, "fragment rejected by default");
+	o = parse("17", NSJSONReadingAllowFragments, &error);
+	check([o intValue] == 17, "fragment allowed with option");
+
+	{
+	NSData *data = [NSData dataWithBytes:doc length:strlen(doc)];
+	NSInputStream *is = [NSInputStream inputStreamWithData:data];
+	NSFileHandle *fh;
+
+	[is open];
+	o = [NSJSONSerialization JSONObjectWithStream:is options:0 error:&error];
+	[is close];
+	check([o isEqual:d], "stream result matches data result");
+
+	[data writeToFile:path atomically:NO];
+	fh = [NSFileHandle fileHandleForReadingAtPath:path];
+	o = [NSJSONSerialization JSONObjectWithFileHandle:fh options:0 error:&error];
+	check([o isEqual:d], "file handle result matches data result");
+	[[NSFileManager defaultManager] removeFileAtPath:path handler:nil];
+	}
+
+	printf("%d failures\n", failures);
+
+	[pool release];
+	printf("nsjson test complete\n");
+
+	return failures ? 1 : 0;
+}
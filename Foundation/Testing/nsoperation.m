@@ -0,0 +1,171 @@
+/*
+   nsoperation.m
+
+   NSOperationQueue tests: dependencies, max concurrency, cancellation,
+   readiness of cancelled operations, invocation results and completion
+   delivery to a run loop.
+*/
+
+#include <stdio.h>
+#include <unistd.h>
+#include <Foundation/NSOperation.h>
+#include <Foundation/NSArray.h>
+#include <Foundation/NSString.h>
+#include <Foundation/NSRunLoop.h>
+#include <Foundation/NSDate.h>
+#include <Foundation/NSThread.h>
+#include <Foundation/NSAutoreleasePool.h>
+
+#define NONE        "\033[0m"
+#define FRED        "\033[31;40m"
+
+static int failures = 0;
+static int order[64];
+static int orderCount = 0;
+static int running = 0;
+static int maxRunning = 0;
+static int completions = 0;
+static NSThread *completionThread = nil;
+
+
+static void
+check(BOOL ok, const char *what)
+{
+	if (ok)
+		printf("ok:    %s\n", what);
+	else
+		{
+		printf(FRED "FAIL:  %s\n" NONE, what);
+		failures++;
+		}
+}
+
+
+@interface Work : NSObject
+@end
+
+@implementation Work
+
+- (void) record:(id)n
+{
+	int r = __atomic_add_fetch(&running, 1, __ATOMIC_SEQ_CST);
+	int m = __atomic_load_n(&maxRunning, __ATOMIC_SEQ_CST);
+
+	while (r > m && !__atomic_compare_exchange_n(&maxRunning, &m, r, NO,
+						__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+	usleep(1000);
+	order[__atomic_fetch_add(&orderCount, 1, __ATOMIC_SEQ_CST)] = [n intValue];
+	__atomic_sub_fetch(&running, 1, __ATOMIC_SEQ_CST);
+}
+
+- (id) square:(id)n
+{
+	return [NSString stringWithFormat: @"%d", [n intValue] * [n intValue]];
+}
+
+- (void) completed:(NSOperation *)op
+{
+	completions++;
+	completionThread = [NSThread currentThread];
+}
+
+@end
+
+
+static NSOperation *
+recordOp(Work *w, int n)
+{
+	return [[[NSInvocationOperation alloc] initWithTarget: w
+										   selector: @selector(record:)
+										   object: [NSString stringWithFormat:
+													@"%d", n]] autorelease];
+}
+
+int
+main ()
+{
+	id pool = [[NSAutoreleasePool alloc] init];
+	NSOperationQueue *q = [[NSOperationQueue alloc] init];
+	NSOperationQueue *held;
+	NSRunLoop *rl = [NSRunLoop currentRunLoop];
+	Work *w = [Work new];
+	NSOperation *a, *b, *c;
+	NSInvocationOperation *s;
+	int i;
+
+	printf("NSOperation tests\n");
+
+	a = recordOp(w, 1);							// c waits on b waits on a
+	b = recordOp(w, 2);
+	c = recordOp(w, 3);
+	[c addDependency: b];
+	[b addDependency: a];
+	check(![c isReady] && [a isReady], "dependencies block readiness");
+	[q addOperation: c];
+	[q addOperation: b];
+	[q addOperation: a];
+	[q waitUntilAllOperationsAreFinished];
+	check(orderCount == 3 && order[0] == 1 && order[1] == 2 && order[2] == 3,
+		  "dependencies run in order");
+	check([c isFinished] && [q operationCount] == 0, "queue drained");
+
+	orderCount = maxRunning = 0;
+	[q setMaxConcurrentOperationCount: 1];
+	for (i = 0; i < 16; i++)
+		[q addOperation: recordOp(w, i)];
+	[q waitUntilAllOperationsAreFinished];
+	for (i = 0; i < 16 && order[i] == i; i++);
+	check(i == 16 && maxRunning == 1, "serial queue runs one at a time in order");
+
+	orderCount = 0;
+	[q setSuspended: YES];
+	for (i = 0; i < 8; i++)
+		[q addOperation: recordOp(w, i)];
+	check([q operationCount] == 8 && orderCount == 0, "suspended queue holds work");
+	[q cancelAllOperations];
+	[q setSuspended: NO];
+	[q waitUntilAllOperationsAreFinished];
+	check(orderCount == 0, "cancelled operations do not run");
+
+	held = [[NSOperationQueue alloc] init];		// b waits on a that never
+	[held setSuspended: YES];					// runs until b is cancelled
+	a = recordOp(w, 1);
+	b = recordOp(w, 2);
+	[b addDependency: a];
+	[held addOperation: a];
+	[q addOperation: b];
+	[b cancel];
+	check([b isReady], "cancelled operation is ready");
+	[b waitUntilFinished];
+	check([b isFinished] && ![a isFinished] && orderCount == 0,
+		  "cancelled operation finishes before its dependencies");
+	[held cancelAllOperations];
+	[held setSuspended: NO];
+	[held waitUntilAllOperationsAreFinished];
+	[held release];
+
+	[q setMaxConcurrentOperationCount: -1];
+	s = [[NSInvocationOperation alloc] initWithTarget: w
+									   selector: @selector(square:)
+									   object: @"12"];
+	[s setCompletionTarget: w action: @selector(completed:) runLoop: rl];
+	[q addOperation: s];
+	[s waitUntilFinished];
+	check([[s result] isEqual: @"144"], "invocation result");
+
+	for (i = 0; i < 50 && completions == 0; i++)
+		[rl runMode: NSDefaultRunLoopMode
+			beforeDate: [NSDate dateWithTimeIntervalSinceNow: 0.1]];
+	check(completions == 1 && completionThread == [NSThread currentThread],
+		  "completion delivered on the run loop's thread");
+	[s release];
+
+	printf("%d failures\n", failures);
+
+	[q release];
+	[w release];
+	[pool release];
+	printf("nsoperation test complete\n");
+
+	return failures ? 1 : 0;
+}
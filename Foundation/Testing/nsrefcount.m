@@ -0,0 +1,108 @@
+/*
+   nsrefcount.m
+
+   Share objects between threads that retain and release them concurrently
+   and verify that every object is deallocated exactly once.
+*/
+
+#include <stdio.h>
+#include <Foundation/NSObject.h>
+#include <Foundation/NSThread.h>
+#include <Foundation/NSDate.h>
+#include <Foundation/NSAutoreleasePool.h>
+
+#define THREADS		8
+#define OBJECTS		1000
+#define ROUNDS		1000
+
+
+@interface Counted : NSObject
+{
+@public
+	int deallocs;
+}
+@end
+
+@implementation Counted
+						// Count deallocs without freeing so that a second
+- (void) dealloc		// dealloc of the same object can be detected
+{
+	__atomic_fetch_add(&deallocs, 1, __ATOMIC_RELAXED);
+	NO_WARN;
+}
+@end
+
+
+static Counted *objects[OBJECTS];
+static int finished = 0;
+
+
+@interface Worker : NSObject
+@end
+
+@implementation Worker
+
+- (void) hammer:(id)arg
+{
+	NSAutoreleasePool *arp = [NSAutoreleasePool new];
+	int i, r;
+
+	for (r = 0; r < ROUNDS; r++)
+		{
+		for (i = 0; i < OBJECTS; i++)
+			[objects[i] retain];
+		for (i = 0; i < OBJECTS; i++)
+			[objects[i] release];
+		}
+											// drop the reference main took
+	for (i = 0; i < OBJECTS; i++)			// for this thread, the last
+		[objects[i] release];				// thread out deallocs each one
+
+	[arp release];
+	__atomic_fetch_add(&finished, 1, __ATOMIC_RELEASE);
+}
+
+@end
+
+
+int
+main()
+{
+	NSAutoreleasePool *arp = [NSAutoreleasePool new];
+	Worker *w = [Worker new];
+	int i, t, leaked = 0, doubled = 0;
+
+	for (i = 0; i < OBJECTS; i++)
+		{
+		objects[i] = [Counted new];
+		for (t = 1; t < THREADS; t++)		// one reference per thread
+			[objects[i] retain];
+		}
+
+	printf("nsrefcount: %d threads sharing %d objects for %d rounds\n",
+			THREADS, OBJECTS, ROUNDS);
+
+	for (t = 0; t < THREADS; t++)
+		[NSThread detachNewThreadSelector: @selector(hammer:)
+				  toTarget: w
+				  withObject: nil];
+
+	while (__atomic_load_n(&finished, __ATOMIC_ACQUIRE) < THREADS)
+		[NSThread sleepUntilDate: [NSDate dateWithTimeIntervalSinceNow: 0.1]];
+
+	for (i = 0; i < OBJECTS; i++)
+		{
+		if (objects[i]->deallocs == 0)
+			leaked++;
+		else if (objects[i]->deallocs > 1)
+			doubled++;
+		}
+
+	printf("leaked %d, deallocated more than once %d\n", leaked, doubled);
+	printf("nsrefcount test %s\n", (leaked || doubled) ? "FAILED" : "passed");
+
+	[arp release];
+	printf("nsrefcount test complete\n");
+
+	exit ((leaked || doubled) ? 1 : 0);
+}
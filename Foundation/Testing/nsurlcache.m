@@ -0,0 +1,246 @@
+/*
+   nsurlcache.m
+
+   NSURLCache against a local HTTP/1.1 server run in a child process.
+   /fresh is served with a max-age and is answered from the cache until
+   it expires, /etag must be revalidated and is answered with a 304 when
+   the request carries its ETag, /nostore is never cached.  A second cache
+   on the same directory is then expected to find /fresh on disk.
+*/
+
+#include <Foundation/NSObject.h>
+#include <Foundation/NSURL.h>
+#include <Foundation/NSData.h>
+#include <Foundation/NSDate.h>
+#include <Foundation/NSString.h>
+#include <Foundation/NSRunLoop.h>
+#include <Foundation/NSFileManager.h>
+#include <Foundation/NSAutoreleasePool.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define NONE        "\033[0m"
+#define FRED        "\033[31;40m"
+
+#define BODY		"cached body of some length"
+
+
+static int __failures = 0;
+
+static void
+expect(const char *test, unsigned long long value, unsigned long long wanted)
+{
+	if (value != wanted)
+		{
+		printf(FRED "FAIL:  %s is %llu, expected %llu\n" NONE, test, value, wanted);
+		__failures++;
+		}
+	else
+		printf("%-32s %llu\n", test, value);
+}
+
+/* ****************************************************************************
+
+	server -- answers requests on one connection at a time
+
+** ***************************************************************************/
+
+static void
+respond(int fd, char *rq)
+{
+	const char *cc = "max-age=60";
+	char h[512];
+	int n;
+
+	if (strncmp(rq, "GET /etag", 9) == 0)
+		{
+		if (strstr(rq, "If-None-Match: \"v2\""))
+			{
+			n = sprintf(h, "HTTP/1.1 304 Not Modified\r\nETag: \"v2\"\r\n"
+						   "Cache-Control: no-cache\r\n\r\n");
+			write(fd, h, n);
+			return;
+			}
+		cc = "no-cache";
+		}
+	else if (strncmp(rq, "GET /nostore", 12) == 0)
+		cc = "no-store";
+
+	n = sprintf(h, "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n"
+				   "Content-Length: %d\r\nETag: \"v2\"\r\nCache-Control: %s\r\n"
+				   "\r\n%s", (int)strlen(BODY), cc, BODY);
+	write(fd, h, n);
+}
+
+static void
+server(int ld)
+{
+	char buf[4096];
+	int fd, n, length;
+
+	while ((fd = accept(ld, NULL, NULL)) >= 0)
+		{
+		length = 0;
+		while ((n = read(fd, buf + length, sizeof(buf) - 1 - length)) > 0)
+			{
+			char *e;
+
+			buf[length += n] = '\0';
+			while ((e = strstr(buf, "\r\n\r\n")))
+				{
+				respond(fd, buf);
+				n = (e + 4) - buf;
+				memmove(buf, buf + n, length - n + 1);
+				length -= n;
+			}	}
+		close(fd);
+		}
+}
+
+/* ****************************************************************************
+
+	client
+
+** ***************************************************************************/
+
+@interface Fetcher : NSObject
+{
+@public
+	NSMutableData *_body;
+	BOOL _done;
+}
+@end
+
+@implementation Fetcher
+
+- (void) connection:(NSURLConnection *)c didReceiveResponse:(NSURLResponse *)r
+{
+	[_body setLength: 0];
+}
+
+- (void) connection:(NSURLConnection *)c didReceiveData:(NSData *)data
+{
+	[_body appendData: data];
+}
+
+- (void) connection:(NSURLConnection *)c didFailWithError:(NSError *)error
+{
+	[_body setLength: 0];
+	_done = YES;
+}
+
+- (void) connectionDidFinishLoading:(NSURLConnection *)c
+{
+	_done = YES;
+}
+
+@end
+
+
+static void
+fetch(NSString *base, NSString *path)
+{
+	NSURL *u = [NSURL URLWithString: [base stringByAppendingString: path]];
+	NSURLRequest *rq = [NSURLRequest requestWithURL: u];
+	Fetcher *f = [Fetcher new];
+	NSURLConnection *c;
+
+	f->_body = [NSMutableData new];
+	c = [[NSURLConnection alloc] initWithRequest: rq delegate: f];
+	while (!f->_done)
+		[[NSRunLoop currentRunLoop] runMode: NSDefaultRunLoopMode
+					beforeDate: [NSDate dateWithTimeIntervalSinceNow: 1.0]];
+
+	if ([f->_body length] != strlen(BODY)
+			|| memcmp([f->_body bytes], BODY, strlen(BODY)))
+		{
+		printf(FRED "FAIL:  %s body is wrong\n" NONE, [path cString]);
+		__failures++;
+		}
+	[c release];
+	[f->_body release];
+	[f release];
+}
+
+int
+main()
+{
+	NSAutoreleasePool *arp;
+	NSURLCacheStatistics st;
+	NSString *base, *dir;
+	NSURLCache *cache;
+	struct sockaddr_in sa;
+	socklen_t len = sizeof(sa);
+	int ld, status;
+	pid_t pid;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = inet_addr("127.0.0.1");
+	if ((ld = socket(AF_INET, SOCK_STREAM, 0)) < 0
+			|| bind(ld, (struct sockaddr *)&sa, sizeof(sa)) < 0
+			|| listen(ld, 16) < 0
+			|| getsockname(ld, (struct sockaddr *)&sa, &len) < 0)
+		{
+		perror("nsurlcache: listen");
+		exit (1);
+		}
+
+	if ((pid = fork()) == 0)
+		server(ld);
+	close(ld);
+
+	arp = [NSAutoreleasePool new];
+	printf("NSURLCache tests\n");
+
+	base = [NSString stringWithFormat: @"http://127.0.0.1:%d",
+										ntohs(sa.sin_port)];
+	dir = [NSString stringWithFormat: @"/tmp/nsurlcache.%d", getpid()];
+	cache = [[NSURLCache alloc] initWithMemoryCapacity: 1 << 20
+								diskCapacity: 1 << 20
+								diskPath: dir];
+	[NSURLCache setSharedURLCache: [cache autorelease]];
+
+	fetch(base, @"/fresh");
+	fetch(base, @"/fresh");
+	fetch(base, @"/etag");
+	fetch(base, @"/etag");
+	fetch(base, @"/nostore");
+	fetch(base, @"/nostore");
+
+	[cache getStatistics: &st];
+	expect("cache lookups", st.requests, 6);
+	expect("memory hits", st.memoryHits, 2);
+	expect("revalidated by 304", st.validated, 1);
+	expect("bytes served from cache", st.bytesServed, 2 * strlen(BODY));
+	expect("bytes stored in cache", st.bytesStored, 2 * strlen(BODY));
+
+	cache = [[NSURLCache alloc] initWithMemoryCapacity: 1 << 20
+								diskCapacity: 1 << 20
+								diskPath: dir];
+	[NSURLCache setSharedURLCache: [cache autorelease]];
+	expect("disk usage after reload", [cache currentDiskUsage] > 0, 1);
+
+	fetch(base, @"/fresh");
+	[cache getStatistics: &st];
+	expect("disk hits", st.diskHits, 1);
+
+	[cache removeAllCachedResponses];
+	expect("disk usage after remove", [cache currentDiskUsage], 0);
+	[[NSFileManager defaultManager] removeFileAtPath: dir handler: nil];
+
+	kill(pid, SIGTERM);
+	waitpid(pid, &status, 0);
+	[arp release];
+	printf("nsurlcache test complete\n");
+
+	return (__failures) ? 1 : 0;
+}
@@ -0,0 +1,148 @@
+/*
+   operationbench.m
+
+   Throughput of tiny tasks run by NSOperationQueue on the worker pool
+   versus a thread detached per task with detachNewThreadSelector:, and
+   the cost of delivering completions back to the main run loop.
+
+   Set MGSTEP_OPERATION_THREADS to change the pool size.
+
+   usage:  operationbench [tasks]
+*/
+
+#include <stdio.h>
+#include <sched.h>
+#include <sys/time.h>
+#include <Foundation/NSOperation.h>
+#include <Foundation/NSThread.h>
+#include <Foundation/NSRunLoop.h>
+#include <Foundation/NSDate.h>
+#include <Foundation/NSAutoreleasePool.h>
+
+#define MAX_DETACHED	256					// threads alive at once
+
+
+static unsigned long done = 0;
+static unsigned long delivered = 0;
+static int alive = 0;
+
+
+@interface Task : NSObject
+@end
+
+@implementation Task
+
+- (void) work:(id)arg
+{
+	__atomic_add_fetch(&done, 1, __ATOMIC_RELAXED);
+}
+
+- (void) detachedWork:(id)arg
+{
+	__atomic_add_fetch(&done, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&alive, 1, __ATOMIC_RELEASE);
+}
+
+- (void) completed:(NSOperation *)op
+{
+	delivered++;
+}
+
+@end
+
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void
+report(const char *name, unsigned long n, double t)
+{
+	printf("  %-22s %10.0f tasks/s  %8.2f us/task\n",
+			name, n / t, t * 1000000.0 / n);
+}
+
+int
+main(int argc, char **argv)
+{
+	NSAutoreleasePool *arp = [NSAutoreleasePool new];
+	unsigned long tasks = (argc > 1) ? strtoul(argv[1], NULL, 10) : 100000;
+	NSOperationQueue *queue = [NSOperationQueue new];
+	NSRunLoop *rl = [NSRunLoop currentRunLoop];
+	Task *task = [Task new];
+	unsigned long i;
+	double t;
+
+	printf("operationbench: %lu tasks\n", tasks);
+
+	t = now();
+	for (i = 0, done = 0; i < tasks; i++)
+		{
+		NSOperation *op = [[NSInvocationOperation alloc]
+							initWithTarget: task
+							selector: @selector(work:)
+							object: nil];
+		[queue addOperation: op];
+		[op release];
+		}
+	[queue waitUntilAllOperationsAreFinished];
+	report("NSOperationQueue", done, now() - t);
+
+	[queue setMaxConcurrentOperationCount: 1];
+	t = now();
+	for (i = 0, done = 0; i < tasks; i++)
+		{
+		NSOperation *op = [[NSInvocationOperation alloc]
+							initWithTarget: task
+							selector: @selector(work:)
+							object: nil];
+		[queue addOperation: op];
+		[op release];
+		}
+	[queue waitUntilAllOperationsAreFinished];
+	report("serial queue", done, now() - t);
+	[queue setMaxConcurrentOperationCount: -1];
+
+	t = now();
+	for (i = 0, done = delivered = 0; i < tasks; i++)
+		{
+		NSOperation *op = [[NSInvocationOperation alloc]
+							initWithTarget: task
+							selector: @selector(work:)
+							object: nil];
+		[op setCompletionTarget: task action: @selector(completed:) runLoop: rl];
+		[queue addOperation: op];
+		[op release];
+		}
+	while (delivered < tasks)
+		[rl runMode: NSDefaultRunLoopMode
+			beforeDate: [NSDate dateWithTimeIntervalSinceNow: 1.0]];
+	report("run loop completion", delivered, now() - t);
+
+	t = now();
+	for (i = 0, done = 0; i < tasks; i++)
+		{
+		while (__atomic_load_n(&alive, __ATOMIC_ACQUIRE) >= MAX_DETACHED)
+			sched_yield();
+		__atomic_add_fetch(&alive, 1, __ATOMIC_RELAXED);
+		[NSThread detachNewThreadSelector: @selector(detachedWork:)
+				  toTarget: task
+				  withObject: nil];
+		}
+	while (__atomic_load_n(&alive, __ATOMIC_ACQUIRE) > 0)
+		sched_yield();
+	report("detachNewThread", done, now() - t);
+
+	[queue release];
+	[task release];
+	[arp release];
+	printf("operationbench complete\n");
+
+	exit (0);
+}
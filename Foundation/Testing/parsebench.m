@@ -0,0 +1,179 @@
+/*
+   parsebench.m
+
+   Object creation cost of property list and JSON parsing.  A JSON array
+   of records with short keys, short strings and small integers is parsed,
+   then its description is read back as an old style property list.  The
+   strings and numbers such documents are made of are then created one by
+   one, as now (inline short strings, shared small integers) and as before
+   (a separately malloc'd C string and a new number object each time), and
+   the heap each takes is reported.  All of them are kept until the end so
+   no test reuses blocks another one freed.
+
+   usage:  parsebench [records] [rounds]
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <malloc.h>
+#include <sys/time.h>
+#include <Foundation/NSArray.h>
+#include <Foundation/NSAutoreleasePool.h>
+#include <Foundation/NSData.h>
+#include <Foundation/NSDictionary.h>
+#include <Foundation/NSJSONSerialization.h>
+#include <Foundation/NSString.h>
+#include <Foundation/NSValue.h>
+
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static long
+heap(void)											// bytes in use
+{
+	return (long)mallinfo2().uordblks;
+}
+
+static NSData *
+document(int records)
+{
+	NSMutableData *d = [NSMutableData dataWithCapacity: records * 128];
+	char buf[256];
+	int i;
+
+	[d appendBytes: "[" length: 1];
+	for (i = 0; i < records; i++)
+		{
+		int n = snprintf(buf, sizeof(buf), "%s{\"id\":%d,\"name\":\"item%d\","
+					"\"tags\":[\"a\",\"bb\",\"ccc\"],\"count\":%d,\"ok\":true,"
+					"\"note\":\"a note long enough to need a heap buffer\"}",
+					(i) ? "," : "", i, i, i % 100);
+
+		[d appendBytes: buf length: n];
+		}
+	[d appendBytes: "]" length: 1];
+
+	return d;
+}
+
+/* ****************************************************************************
+
+	Benchmark driver
+
+** ***************************************************************************/
+
+int
+main(int argc, char **argv)
+{
+	NSAutoreleasePool *arp = [NSAutoreleasePool new];
+	int records = (argc > 1) ? atoi(argv[1]) : 10000;
+	int rounds = (argc > 2) ? atoi(argv[2]) : 10;
+	int i, r, n = records * 10;
+	NSData *json = document(records);
+	NSString *plist;
+	Class intNumber = NSClassFromString(@"_IntNumber");
+	id *objects = malloc(4 * n * sizeof(id));
+	char keys[100][8];
+	id *kept = objects;
+	double t;
+	long h;
+	id o;
+
+	printf("parsebench: %d records, %lu bytes of JSON, %d rounds\n",
+			records, (unsigned long)[json length], rounds);
+
+	for (r = 0, t = 0; r < rounds; r++)
+		{
+		NSAutoreleasePool *pool = [NSAutoreleasePool new];
+
+		t -= now();
+		o = [NSJSONSerialization JSONObjectWithData: json options: 0 error: 0];
+		t += now();
+		[pool release];
+		}
+	printf("  %-16s %10.1f parses/s  %10.1f Mrecords/s\n", "JSON",
+			rounds / t, records * rounds / t / 1000000.0);
+
+	o = [NSJSONSerialization JSONObjectWithData: json options: 0 error: 0];
+	plist = [[o description] retain];
+	for (r = 0, t = 0; r < rounds; r++)
+		{
+		NSAutoreleasePool *pool = [NSAutoreleasePool new];
+
+		t -= now();
+		o = [plist propertyList];
+		t += now();
+		[pool release];
+		}
+	printf("  %-16s %10.1f parses/s  %10.1f Mrecords/s\n", "property list",
+			rounds / t, records * rounds / t / 1000000.0);
+	[plist release];
+
+	for (i = 0; i < 100; i++)
+		sprintf(keys[i], "key%d", i);
+
+	h = heap();
+	t = now();
+	for (i = 0; i < n; i++)
+		kept[i] = [_NSCString _newWithCString: keys[i % 100]
+								 length: strlen(keys[i % 100])];
+	t = now() - t;
+	h = heap() - h;
+	printf("  %-16s %10.1f Mobjects/s  %8.1f heap bytes/object\n",
+			"inline string", n / t / 1000000.0, (double)h / n);
+	kept += n;
+
+	h = heap();
+	t = now();
+	for (i = 0; i < n; i++)
+		{
+		int len = strlen(keys[i % 100]);
+		char *s = malloc(len + 1);
+
+		memcpy(s, keys[i % 100], len + 1);
+		kept[i] = [[_NSCString alloc] initWithCStringNoCopy: s
+										 length: len
+										 freeWhenDone: YES];
+		}
+	t = now() - t;
+	h = heap() - h;
+	printf("  %-16s %10.1f Mobjects/s  %8.1f heap bytes/object\n",
+			"malloc'd string", n / t / 1000000.0, (double)h / n);
+	kept += n;
+
+	h = heap();
+	t = now();
+	for (i = 0; i < n; i++)
+		kept[i] = [[NSNumber alloc] initWithInt: i % 100];
+	t = now() - t;
+	h = heap() - h;
+	printf("  %-16s %10.1f Mobjects/s  %8.1f heap bytes/object\n",
+			"shared number", n / t / 1000000.0, (double)h / n);
+	kept += n;
+
+	h = heap();
+	t = now();
+	for (i = 0; i < n; i++)
+		kept[i] = [[intNumber alloc] initWithInt: i % 100];
+	t = now() - t;
+	h = heap() - h;
+	printf("  %-16s %10.1f Mobjects/s  %8.1f heap bytes/object\n",
+			"new number", n / t / 1000000.0, (double)h / n);
+	kept += n;
+
+	for (i = 0; i < 4 * n; i++)
+		[objects[i] release];
+	free(objects);
+	[arp release];
+	printf("parsebench complete\n");
+
+	exit (0);
+}
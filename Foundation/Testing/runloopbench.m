@@ -0,0 +1,220 @@
+/*
+   runloopbench.m
+
+   Measure the cost of one NSRunLoop pass that services a single active
+   socket while 10, 1k and 10k idle sockets are registered in the same
+   mode.  The fd_set rebuild and select() scan done per pass by the
+   run loop this replaced is reproduced below as select_pass() for the
+   descriptors that fit in FD_SETSIZE.
+
+   Set MGSTEP_RUNLOOP_POLL=1 to measure the poll() backend.
+
+   usage:  runloopbench [iterations]
+*/
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <Foundation/NSRunLoop.h>
+#include <Foundation/NSDate.h>
+#include <Foundation/NSAutoreleasePool.h>
+#include <CoreFoundation/CFRunLoop.h>
+#include <CoreFoundation/CFSocket.h>
+
+
+static unsigned long reads = 0;
+
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void
+_ReadCallback(CFSocketRef s,
+			  CFSocketCallBackType type,
+			  CFDataRef address,
+			  const void *data,
+			  void *info)
+{
+	char c;
+
+	if (read(CFSocketGetNative(s), &c, 1) == 1)
+		reads++;
+}
+
+static CFSocketRef
+watch(CFRunLoopRef rl, int fd)
+{
+	CFSocketContext cx = { 1, NULL, NULL, NULL, NULL };
+	CFSocketRef s;
+	CFRunLoopSourceRef rs;
+
+	s = CFSocketCreateWithNative(NULL, fd, kCFSocketReadCallBack,
+								 &_ReadCallback, &cx);
+	rs = CFSocketCreateRunLoopSource(NULL, s, 0);
+	CFRunLoopAddSource(rl, rs, kCFRunLoopDefaultMode);
+	CFRelease(rs);
+
+	return s;
+}
+
+/* ****************************************************************************
+
+	select_pass -- per pass work of the select() based run loop
+
+** ***************************************************************************/
+
+static int
+select_pass(int *fds, int count)
+{
+	struct timeval timeout = {0, 0};
+	fd_set read_fds;
+	int i, fd_max = 0;
+
+	FD_ZERO (&read_fds);
+	for (i = 0; i < count; i++)
+		{
+		FD_SET (fds[i], &read_fds);
+		fd_max = MAX(fd_max, fds[i]);
+		}
+
+	if (select (fd_max + 1, &read_fds, NULL, NULL, &timeout) <= 0)
+		return 0;
+
+	for (i = 0; i < count; i++)
+		if (FD_ISSET (fds[i], &read_fds))
+			{
+			char c;
+
+			if (read(fds[i], &c, 1) == 1)
+				reads++;
+			}
+
+	return 1;
+}
+
+/* ****************************************************************************
+
+	Benchmark driver
+
+** ***************************************************************************/
+
+static void
+bench(int idle, unsigned long iterations)
+{
+	NSAutoreleasePool *arp = [NSAutoreleasePool new];
+	NSRunLoop *rl = [NSRunLoop currentRunLoop];
+	CFRunLoopRef cfrl = CFRunLoopGetCurrent();
+	NSDate *limit = [NSDate dateWithTimeIntervalSinceNow: 10.0];
+	CFSocketRef *sockets = malloc((idle + 1) * sizeof(CFSocketRef));
+	int *peers = malloc((idle + 1) * sizeof(int));
+	int *fds = malloc((idle + 1) * sizeof(int));
+	int i, active[2];
+	unsigned long n;
+	double t;
+
+	for (i = 0; i < idle; i++)
+		{
+		int sv[2];
+
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+			{
+			perror("runloopbench: socketpair");
+			exit (1);
+			}
+		peers[i] = sv[1];						// keep the peer open so
+		fds[i] = sv[0];							// the socket stays idle
+		sockets[i] = watch(cfrl, sv[0]);
+		}
+
+	socketpair(AF_UNIX, SOCK_STREAM, 0, active);
+	fds[idle] = active[0];
+	sockets[idle] = watch(cfrl, active[0]);
+
+	[rl runMode:NSDefaultRunLoopMode beforeDate:limit];		// warm up
+
+	t = now();
+	for (n = 0, reads = 0; n < iterations; n++)
+		{
+		write(active[1], "x", 1);
+		[rl runMode:NSDefaultRunLoopMode beforeDate:limit];
+		}
+	t = now() - t;
+	printf("  %6d idle  %-8s %8.2f us/pass  (%lu reads)\n",
+			idle, "runloop", t * 1000000.0 / iterations, reads);
+
+	if (fds[idle] < FD_SETSIZE)
+		{
+		t = now();
+		for (n = 0, reads = 0; n < iterations; n++)
+			{
+			write(active[1], "x", 1);
+			select_pass(fds, idle + 1);
+			}
+		t = now() - t;
+		printf("  %6d idle  %-8s %8.2f us/pass  (%lu reads)\n",
+				idle, "select", t * 1000000.0 / iterations, reads);
+		}
+	else
+		printf("  %6d idle  %-8s      n/a  (descriptors exceed FD_SETSIZE)\n",
+				idle, "select");
+
+	for (i = 0; i <= idle; i++)					// closes the watched end
+		{
+		CFSocketInvalidate(sockets[i]);
+		CFRelease(sockets[i]);
+		}
+	for (i = 0; i < idle; i++)
+		close(peers[i]);
+	close(active[1]);
+
+	free(sockets);
+	free(peers);
+	free(fds);
+	[arp release];
+}
+
+int
+main(int argc, char **argv)
+{
+	NSAutoreleasePool *arp = [NSAutoreleasePool new];
+	unsigned long iterations = (argc > 1) ? strtoul(argv[1], NULL, 10) : 10000;
+	int sizes[] = { 10, 1000, 10000 };
+	struct rlimit rlim;
+	int i;
+
+	getrlimit(RLIMIT_NOFILE, &rlim);			// two descriptors per socket
+	if (rlim.rlim_cur < 2 * 10000 + 64)			// pair, raise the soft limit
+		{
+		rlim.rlim_cur = MIN(rlim.rlim_max, 2 * 10000 + 64);
+		setrlimit(RLIMIT_NOFILE, &rlim);
+		}
+
+	printf("runloopbench: %lu passes, %s backend\n", iterations,
+			getenv("MGSTEP_RUNLOOP_POLL") ? "poll" : "default");
+
+	for (i = 0; i < sizeof(sizes) / sizeof(int); i++)
+		{
+		if (2 * sizes[i] + 64 > rlim.rlim_cur)
+			{
+			printf("  %6d idle  skipped, RLIMIT_NOFILE is %lu\n",
+					sizes[i], (unsigned long)rlim.rlim_cur);
+			continue;
+			}
+		bench(sizes[i], iterations);
+		}
+
+	[arp release];
+	printf("runloopbench complete\n");
+
+	exit (0);
+}
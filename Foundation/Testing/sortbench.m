@@ -0,0 +1,163 @@
+/*
+   sortbench.m
+
+   NSMutableArray sorting on random, presorted and reverse sorted input.
+   sortUsingSelector: and sortUsingFunction:context: are timed against
+   the shell sort they used before, kept below with the per compare
+   performSelector:withObject: that served selector sorts.  Setting
+   MGSTEP_OPERATION_THREADS=1 times the merge sort on one thread.
+
+   usage:  sortbench [count] [rounds]
+*/
+
+#include <stdio.h>
+#include <sys/time.h>
+#include <Foundation/NSArray.h>
+#include <Foundation/NSAutoreleasePool.h>
+#include <Foundation/NSValue.h>
+
+#define STRIDE_FACTOR 3
+
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static NSInteger
+compareNumbers(id elem1, id elem2, void *context)
+{
+	return [(NSNumber *)elem1 compare: elem2];
+}
+
+static NSInteger
+selectorCompare(id elem1, id elem2, void *comparator)
+{
+    return (NSInteger)[elem1 performSelector:(SEL)comparator withObject:elem2];
+}
+
+static void
+shellSort(id *contents, NSUInteger count,
+		  NSInteger (*compare)(id,id,void*), void *cx)
+{
+	NSUInteger c, d, stride = 1;
+
+	while (stride <= count)
+		stride = stride * STRIDE_FACTOR + 1;
+
+	while (stride > (STRIDE_FACTOR - 1))
+		{
+		stride = stride / STRIDE_FACTOR;
+		for (c = stride; c < count; c++)
+			{
+			BOOL found = NO;
+
+			if (stride > c)
+				break;
+			d = c - stride;
+			while (!found)
+				{
+				id a = contents[d + stride];
+				id b = contents[d];
+
+				if ((*compare)(a, b, cx) == NSOrderedAscending)
+					{
+					contents[d + stride] = b;
+					contents[d] = a;
+					if (stride > d)
+						break;
+					d -= stride;
+					}
+				else
+					found = YES;
+		}	}	}
+}
+
+static NSArray *
+input(int order, NSUInteger count)				// random, presorted, reverse
+{
+	NSMutableArray *a = [NSMutableArray arrayWithCapacity: count];
+	unsigned int seed = 1;
+	NSUInteger i;
+
+	for (i = 0; i < count; i++)
+		{
+		int v = (order == 0) ? (int)((seed = seed * 1103515245 + 12345) >> 1)
+							 : (order == 1) ? (int)i : (int)(count - i);
+
+		[a addObject: [NSNumber numberWithInt: v]];
+		}
+
+	return a;
+}
+
+static void
+bench(const char *order, NSArray *in, int rounds)
+{
+	NSUInteger count = [in count];
+	id *c = malloc(count * sizeof(id));
+	double t0 = 0, t1 = 0, t2 = 0, t3 = 0;
+	int r;
+
+	for (r = 0; r < rounds; r++)
+		{
+		NSAutoreleasePool *arp = [NSAutoreleasePool new];
+		NSMutableArray *m = [[in mutableCopy] autorelease];
+
+		t0 -= now();
+		[m sortUsingSelector: @selector(compare:)];
+		t0 += now();
+
+		m = [[in mutableCopy] autorelease];
+		t1 -= now();
+		[m sortUsingFunction: compareNumbers context: NULL];
+		t1 += now();
+
+		[in getObjects: c];
+		t2 -= now();
+		shellSort(c, count, selectorCompare, (void *)@selector(compare:));
+		t2 += now();
+
+		[in getObjects: c];
+		t3 -= now();
+		shellSort(c, count, compareNumbers, NULL);
+		t3 += now();
+		[arp release];
+		}
+
+	printf("  %-9s selector %9.1f ms (shell %9.1f ms)  %5.1fx\n", order,
+			t0 * 1000 / rounds, t2 * 1000 / rounds, t2 / t0);
+	printf("  %-9s function %9.1f ms (shell %9.1f ms)  %5.1fx\n", "",
+			t1 * 1000 / rounds, t3 * 1000 / rounds, t3 / t1);
+	free(c);
+}
+
+/* ****************************************************************************
+
+	Benchmark driver
+
+** ***************************************************************************/
+
+int
+main(int argc, char **argv)
+{
+	NSAutoreleasePool *arp = [NSAutoreleasePool new];
+	NSUInteger count = (argc > 1) ? strtoul(argv[1], NULL, 10) : 1000000;
+	int rounds = (argc > 2) ? atoi(argv[2]) : 3;
+
+	printf("sortbench: %lu objects, %d rounds\n", (unsigned long)count, rounds);
+
+	bench("random", input(0, count), rounds);
+	bench("presorted", input(1, count), rounds);
+	bench("reverse", input(2, count), rounds);
+
+	[arp release];
+	printf("sortbench complete\n");
+
+	exit (0);
+}
@@ -150,6 +150,28 @@ int main()
 	printf("%s  strlen %d\n", utf8, strlen(utf8));
 	}
 
+	{										// short strings are held inline
+	unichar ubuf[] = {'k', 'e', 'y'};
+	NSString *k1 = [NSString stringWithCString:"key"];
+	NSString *k2 = [NSString stringWithUTF8String:"key"];
+	NSString *k3 = [NSString stringWithCharacters:ubuf length:3];
+	NSString *k4 = [[NSString alloc] initWithCString:
+						"a string longer than twenty three bytes"];
+	NSMutableString *ms = [k1 mutableCopy];
+
+	[ms appendString:@"board"];
+	printf("inline string test 1 %s\n", ([k1 isEqual:k2] && [k2 isEqual:k3]
+			&& [k3 isEqual:@"key"]) ? "PASS" : "FAIL");
+	printf("inline string test 2 %s\n", ([k3 hash] == [@"key" hash]
+			&& [k3 length] == 3) ? "PASS" : "FAIL");
+	printf("inline string test 3 %s\n", ([ms isEqual:@"keyboard"]
+			&& [k1 isEqual:@"key"]) ? "PASS" : "FAIL");
+	printf("inline string test 4 %s\n", ([k4 length] == 39
+			&& [k4 hasSuffix:@"three bytes"]) ? "PASS" : "FAIL");
+	[ms release];
+	[k4 release];
+	}
+
 	s2 = [[NSString alloc] initWithCStringNoCopy:"FooFoo" length:6 freeWhenDone:NO];
 	print_string(s2);
 	[s2 release];
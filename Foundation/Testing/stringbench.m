@@ -0,0 +1,145 @@
+/*
+   stringbench.m
+
+   rangeOfString:options:range: over a text of 1 MB for each options mask,
+   on C and unichar strings, against the per character search they used
+   before.  The old search still serves strings other than the concrete
+   classes, so it is timed through _Wrap, an NSString subclass wrapping
+   the C string.  The needle sits half way through the text.
+
+   usage:  stringbench [bytes] [rounds]
+*/
+
+#include <stdio.h>
+#include <sys/time.h>
+#include <Foundation/NSString.h>
+#include <Foundation/NSAutoreleasePool.h>
+
+
+@interface _Wrap : NSString
+{
+	NSString *_s;
+}
+- (id) initWithString:(NSString *)s;
+@end
+
+@implementation _Wrap
+
++ (id) alloc									{ return NSAllocateObject(self); }
+
+- (id) initWithString:(NSString *)s
+{
+	_s = [s retain];
+	_count = [s length];
+
+	return self;
+}
+
+- (void) dealloc
+{
+	[_s release];
+	[super dealloc];
+}
+
+- (NSUInteger) length							{ return _count; }
+- (unichar) characterAtIndex:(NSUInteger)i		{ return [_s characterAtIndex:i]; }
+
+- (void) getCharacters:(unichar *)buffer range:(NSRange)r
+{
+	[_s getCharacters:buffer range:r];
+}
+
+@end
+
+/* ****************************************************************************
+
+	Benchmark driver
+
+** ***************************************************************************/
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void
+bench(const char *name, NSString *s, NSString *needle, unsigned mask, int n)
+{
+	NSAutoreleasePool *arp = [NSAutoreleasePool new];
+	NSUInteger len = [s length];
+	NSRange r = {0, 0};
+	double t = now();
+	int i;
+
+	for (i = 0; i < n; i++)
+		r = [s rangeOfString:needle options:mask range:(NSRange){0, len}];
+	t = now() - t;
+
+	printf("  %2u %-8s %10.3f ms %10.1f MB/s  found at %lu\n", mask, name,
+			t * 1000.0 / n, (double)len * n / t / 1000000.0,
+			(unsigned long)r.location);
+	[arp release];
+}
+
+int
+main(int argc, char **argv)
+{
+	NSAutoreleasePool *arp = [NSAutoreleasePool new];
+	NSUInteger size = (argc > 1) ? strtoul(argv[1], NULL, 10) : 1 << 20;
+	int rounds = (argc > 2) ? atoi(argv[2]) : 20;
+	const char *words[] = { "the ", "needless ", "Need ", "eel ", "dle ",
+							"of ", "text ", "needlework " };
+	const char *match = "needle in a haystack";
+	unichar *u = malloc(size * sizeof(unichar));
+	char *c = malloc(size + 1);
+	NSString *cs, *us, *ws, *needle;
+	NSUInteger i = 0, mid = size / 2;
+	unsigned int seed = 1, mask;
+
+	while (i < size)					// near misses, never the match
+		{
+		const char *w = words[(seed = seed * 1103515245 + 12345) >> 16 & 7];
+
+		while (*w && i < size)
+			c[i++] = *w++;
+		}
+	memcpy(c + mid, match, strlen(match));
+	c[size] = '\0';
+	for (i = 0; i < size; i++)
+		u[i] = (unichar)(unsigned char)c[i];
+
+	cs = [NSString stringWithCString:c];
+	us = [NSString stringWithCharacters:u length:size];
+	ws = [[[_Wrap alloc] initWithString:cs] autorelease];
+	needle = [NSString stringWithCString:match];
+
+	printf("stringbench: %lu bytes, %d rounds, needle at %lu\n",
+			(unsigned long)size, rounds, (unsigned long)mid);
+
+	for (mask = 0; mask < 16; mask++)
+		{
+		bench("cstring", cs, needle, mask, rounds);
+		bench("unichar", us, needle, mask, rounds);
+		bench("old", ws, needle, mask, (mask & NSLiteralSearch) ? rounds : 1);
+		}
+	needle = [NSString stringWithCString:"hay"];		// first character scan
+	printf("short needle\n");
+	for (mask = NSLiteralSearch; mask < 16; mask += 4)
+		{
+		bench("cstring", cs, needle, mask, rounds);
+		bench("unichar", us, needle, mask, rounds);
+		bench("old", ws, needle, mask, rounds);
+		}
+
+	free(u);
+	free(c);
+	[arp release];
+	printf("stringbench complete\n");
+
+	exit (0);
+}
@@ -0,0 +1,191 @@
+/*
+   timerbench.m
+
+   Measure NSRunLoop timer overhead with 10k active timers: the cost of a
+   run loop pass that fires nothing, of scheduling and invalidating a
+   timer, and of a pass while timers are firing.  The per pass scan of
+   the timer array done by the run loop this replaced is reproduced below
+   as linear_pass() for comparison.
+
+   usage:  timerbench [timers] [passes]
+*/
+
+#include <stdio.h>
+#include <sys/time.h>
+#include <Foundation/NSRunLoop.h>
+#include <Foundation/NSTimer.h>
+#include <Foundation/NSArray.h>
+#include <Foundation/NSDate.h>
+#include <Foundation/NSAutoreleasePool.h>
+
+
+static unsigned long fires = 0;
+
+
+@interface Target : NSObject
+@end
+
+@implementation Target
+- (void) tick:(NSTimer *)t			{ fires++; }
+@end
+
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* ****************************************************************************
+
+	linear_pass -- timer scan of the array based run loop
+
+** ***************************************************************************/
+
+static NSTimer *
+linear_pass(NSMutableArray *timers)
+{
+	NSTimeInterval minTime = 0;
+	NSTimer *nearest = nil;
+	int i = [timers count];
+
+	while (i-- > 0)
+		{
+		NSTimer *t = [timers objectAtIndex:i];
+
+		if (!t->_is_valid)
+			[timers removeObjectAtIndex: i];
+		else
+			{
+			NSTimeInterval tu = [[t fireDate] timeIntervalSinceNow];
+
+			if (tu <= 0)
+				{
+				[t fire];
+				i = [timers count];
+				nearest = nil;
+				minTime = 0;
+				}
+			else if ((tu < minTime || minTime == 0))
+				{
+				minTime = tu;
+				nearest = t;
+		}	}	}
+
+	return nearest;
+}
+
+/* ****************************************************************************
+
+	Benchmark driver
+
+** ***************************************************************************/
+
+int
+main(int argc, char **argv)
+{
+	NSAutoreleasePool *arp = [NSAutoreleasePool new];
+	NSRunLoop *rl = [NSRunLoop currentRunLoop];
+	NSString *idle = @"TimerBenchIdleMode";
+	NSString *busy = @"TimerBenchBusyMode";
+	NSUInteger count = (argc > 1) ? strtoul(argv[1], NULL, 10) : 10000;
+	NSUInteger passes = (argc > 2) ? strtoul(argv[2], NULL, 10) : 1000;
+	NSMutableArray *timers = [NSMutableArray arrayWithCapacity: count];
+	Target *target = [Target new];
+	NSUInteger i;
+	double t, end;
+
+	printf("timerbench: %lu timers, %lu passes\n",
+			(unsigned long)count, (unsigned long)passes);
+
+	for (i = 0; i < count; i++)				// spread over 100 - 1100 secs
+		{
+		NSTimer *tm = [NSTimer timerWithTimeInterval: 100.0 + (i * 7919) % 1000
+							   target: target
+							   selector: @selector(tick:)
+							   userInfo: nil
+							   repeats: YES];
+		[rl addTimer:tm forMode:idle];
+		[timers addObject: tm];
+		}
+
+	t = now();
+	for (i = 0; i < passes; i++)
+		{
+		NSAutoreleasePool *pool = [NSAutoreleasePool new];
+
+		[rl limitDateForMode: idle];
+		[pool release];
+		}
+	printf("  %-8s %-22s %10.2f us\n", "heap", "idle pass",
+			(now() - t) * 1000000.0 / passes);
+
+	t = now();
+	for (i = 0; i < passes; i++)
+		{
+		NSAutoreleasePool *pool = [NSAutoreleasePool new];
+
+		linear_pass(timers);
+		[pool release];
+		}
+	printf("  %-8s %-22s %10.2f us\n", "linear", "idle pass",
+			(now() - t) * 1000000.0 / passes);
+
+	t = now();
+	for (i = 0; i < passes; i++)
+		{
+		NSTimer *tm = [NSTimer timerWithTimeInterval: 50.0 + i % 100
+							   target: target
+							   selector: @selector(tick:)
+							   userInfo: nil
+							   repeats: NO];
+		[rl addTimer:tm forMode:idle];
+		[tm invalidate];
+		[rl limitDateForMode: idle];
+		}
+	printf("  %-8s %-22s %10.2f us\n", "heap", "add + cancel + pass",
+			(now() - t) * 1000000.0 / passes);
+
+	for (i = 0; i < count; i++)				// now make them all fire every
+		[[timers objectAtIndex: i] invalidate];	// 10 - 100 ms
+	[rl limitDateForMode: idle];
+	[timers removeAllObjects];
+
+	for (i = 0; i < count; i++)
+		{
+		NSTimer *tm = [NSTimer timerWithTimeInterval: 0.01 + (i % 10) * 0.01
+							   target: target
+							   selector: @selector(tick:)
+							   userInfo: nil
+							   repeats: YES];
+		[rl addTimer:tm forMode:busy];
+		[timers addObject: tm];
+		}
+
+	fires = 0;
+	end = now() + 1.0;
+	for (i = 0, t = now(); now() < end; i++)
+		{
+		NSAutoreleasePool *pool = [NSAutoreleasePool new];
+
+		[rl runMode:busy beforeDate:[NSDate dateWithTimeIntervalSinceNow: 0.01]];
+		[pool release];
+		}
+	t = now() - t;
+	printf("  %-8s %-22s %10.2f us  (%lu fires/s)\n", "heap", "firing pass",
+			t * 1000000.0 / i, (unsigned long)(fires / t));
+
+	for (i = 0; i < count; i++)
+		[[timers objectAtIndex: i] invalidate];
+	[rl limitDateForMode: busy];
+
+	[target release];
+	[arp release];
+	printf("timerbench complete\n");
+
+	exit (0);
+}
@@ -0,0 +1,432 @@
+/*
+   urlbench.m
+
+   NSURLConnection requests per second against a local HTTP/1.1 server
+   stand-in run in a child process.  Small resources are fetched one after
+   another from the same host, first with "Connection: close" so that each
+   request opens a new TCP connection, then with the keep-alive default so
+   that the idle connection pool serves them over one socket, and last as
+   chunked transfer encoded bodies over a kept alive connection.  Uploads
+   are then timed with a larger request body, sent from an NSData with a
+   Content-Length and from a file stream as chunks.  The number of progress
+   callbacks per upload shows how often the socket's buffer filled up.
+
+   usage:  urlbench [requests] [body size] [upload size]
+*/
+
+#include <Foundation/NSObject.h>
+#include <Foundation/NSURL.h>
+#include <Foundation/NSData.h>
+#include <Foundation/NSDate.h>
+#include <Foundation/NSString.h>
+#include <Foundation/NSRunLoop.h>
+#include <Foundation/NSStream.h>
+#include <Foundation/NSAutoreleasePool.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MAX_CLIENTS  64
+
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* ****************************************************************************
+
+	server -- HTTP/1.1 stand-in run in a child process
+
+** ***************************************************************************/
+
+enum { HEADER, BODY, CHUNK_SIZE, CHUNK_DATA, CHUNK_END, TRAILER };
+
+typedef struct {
+	int fd;
+	int length;
+	int state;
+	long remaining;								// body or chunk bytes
+	int close;
+	int chunked;								// respond with chunks
+	char buf[4096];
+} Client;
+
+static void
+writeAll(int fd, const char *b, int length)
+{
+	int n;
+
+	for (; length > 0; b += n, length -= n)
+		if ((n = write(fd, b, length)) <= 0)
+			return;
+}
+
+static int
+respond(Client *c, const char *body, int size)		// NO if conn is closed
+{
+	char h[256];
+	int i, n;
+
+	if (c->chunked)
+		{
+		n = sprintf(h, "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n"
+					   "Transfer-Encoding: chunked\r\nConnection: %s\r\n\r\n",
+					   c->close ? "close" : "keep-alive");
+		writeAll(c->fd, h, n);
+		for (i = 0; i < size; i += 1024)
+			{
+			int l = (size - i < 1024) ? size - i : 1024;
+
+			n = sprintf(h, "%x\r\n", l);
+			writeAll(c->fd, h, n);
+			writeAll(c->fd, body + i, l);
+			writeAll(c->fd, "\r\n", 2);
+			}
+		writeAll(c->fd, "0\r\n\r\n", 5);
+		}
+	else
+		{
+		n = sprintf(h, "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n"
+					   "Content-Length: %d\r\nConnection: %s\r\n\r\n",
+					   size, c->close ? "close" : "keep-alive");
+		writeAll(c->fd, h, n);
+		writeAll(c->fd, body, size);
+		}
+
+	c->state = HEADER;
+
+	return !c->close;
+}
+
+static void
+consume(Client *c, int n)
+{
+	memmove(c->buf, c->buf + n, c->length - n);
+	c->length -= n;
+	c->buf[c->length] = '\0';
+}
+
+static int
+request(Client *c, const char *body, int size)		// parse and discard the
+{													// request, NO if closed
+	char *e, *l;
+	int n;
+
+	for (;;)
+		switch (c->state)
+			{
+			case HEADER:
+				if (!(e = strstr(c->buf, "\r\n\r\n")))
+					return 1;
+				*e = '\0';
+				c->close = (strstr(c->buf, "Connection: close") != NULL);
+				c->chunked = (strncmp(c->buf, "GET /chunked", 12) == 0);
+				c->remaining = 0;
+				if ((l = strstr(c->buf, "Content-Length: ")))
+					c->remaining = atol(l + 16);
+				c->state = (strstr(c->buf, "Transfer-Encoding: chunked"))
+						 ? CHUNK_SIZE : BODY;
+				consume(c, (e + 4) - c->buf);
+				break;
+
+			case BODY:
+			case CHUNK_DATA:
+				n = (c->length < c->remaining) ? c->length : c->remaining;
+				consume(c, n);
+				if ((c->remaining -= n) > 0)
+					return 1;
+				if (c->state == CHUNK_DATA)
+					c->state = CHUNK_END;
+				else if (!respond(c, body, size))
+					return 0;
+				break;
+
+			case CHUNK_SIZE:
+			case CHUNK_END:
+			case TRAILER:
+				if (!(e = strstr(c->buf, "\r\n")))
+					return 1;
+				n = (e == c->buf);						// an empty line
+				if (c->state == CHUNK_SIZE)
+					{
+					c->remaining = strtol(c->buf, NULL, 16);
+					c->state = (c->remaining) ? CHUNK_DATA : TRAILER;
+					}
+				else if (c->state == CHUNK_END)
+					c->state = CHUNK_SIZE;
+				consume(c, (e + 2) - c->buf);
+				if (c->state == TRAILER && n && !respond(c, body, size))
+					return 0;
+				break;
+			}
+}
+
+static void
+server(int ld, int size)
+{
+	struct pollfd fds[MAX_CLIENTS + 1];
+	Client *clients = calloc(MAX_CLIENTS, sizeof(Client));
+	char *body = malloc(size);
+	int i, n, count = 0;
+
+	memset(body, 'x', size);
+	for (;;)
+		{
+		fds[0].fd = ld;
+		fds[0].events = POLLIN;
+		for (i = 0; i < count; i++)
+			{
+			fds[i + 1].fd = clients[i].fd;
+			fds[i + 1].events = POLLIN;
+			}
+		if (poll(fds, count + 1, -1) < 0)
+			continue;
+
+		for (i = count - 1; i >= 0; i--)
+			if (fds[i + 1].revents)
+				{
+				Client *c = &clients[i];
+				int open = 1;
+
+				n = read(c->fd, c->buf + c->length, sizeof(c->buf) - 1 - c->length);
+				if (n > 0)
+					{
+					c->length += n;
+					c->buf[c->length] = '\0';
+					open = request(c, body, size);
+					}
+				if (n <= 0 || !open)
+					{
+					close(c->fd);
+					clients[i] = clients[--count];
+				}	}
+
+		if ((fds[0].revents & POLLIN) && count < MAX_CLIENTS)
+			if ((clients[count].fd = accept(ld, NULL, NULL)) >= 0)
+				{
+				clients[count].length = 0;
+				clients[count++].state = HEADER;
+				}
+		}
+}
+
+/* ****************************************************************************
+
+	client
+
+** ***************************************************************************/
+
+@interface Fetcher : NSObject
+{
+@public
+	NSUInteger _bytes;
+	NSInteger _written;							// request body progress
+	int _callbacks;
+	BOOL _done;
+	BOOL _failed;
+}
+@end
+
+@implementation Fetcher
+
+- (void) connection:(NSURLConnection *)c didReceiveResponse:(NSURLResponse *)r
+{
+	_bytes = 0;
+}
+
+- (void) connection:(NSURLConnection *)c didReceiveData:(NSData *)data
+{
+	_bytes += [data length];
+}
+
+- (void) connection:(NSURLConnection *)c
+		 didSendBodyData:(NSInteger)bytesWritten
+		 totalBytesWritten:(NSInteger)totalBytesWritten
+		 totalBytesExpectedToWrite:(NSInteger)totalBytesExpectedToWrite
+{
+	_written = totalBytesWritten;
+	_callbacks++;
+}
+
+- (void) connection:(NSURLConnection *)c didFailWithError:(NSError *)error
+{
+	_done = _failed = YES;
+}
+
+- (void) connectionDidFinishLoading:(NSURLConnection *)c
+{
+	_done = YES;
+}
+
+@end
+
+
+static void
+bench(const char *name, NSString *url, BOOL reuse, int requests, int size)
+{
+	NSRunLoop *rl = [NSRunLoop currentRunLoop];
+	NSMutableURLRequest *rq;
+	Fetcher *f = [Fetcher new];
+	int i, errors = 0;
+	double t;
+
+	rq = [NSMutableURLRequest requestWithURL: [NSURL URLWithString: url]];
+	if (!reuse)
+		[rq setValue: @"close" forHTTPHeaderField: @"Connection"];
+
+	t = now();
+	for (i = 0; i < requests; i++)
+		{
+		NSAutoreleasePool *pool = [NSAutoreleasePool new];
+		NSURLConnection *c;
+
+		f->_done = f->_failed = NO;
+		c = [[NSURLConnection alloc] initWithRequest: rq delegate: f];
+		while (!f->_done)
+			[rl runMode: NSDefaultRunLoopMode
+				beforeDate: [NSDate dateWithTimeIntervalSinceNow: 1.0]];
+		if (f->_failed || f->_bytes != (NSUInteger)size)
+			errors++;
+		[c release];
+		[pool release];
+		}
+	t = now() - t;
+
+	printf("  %-20s %10.0f requests/s  %8.1f us/request\n", name,
+			requests / t, t * 1000000.0 / requests);
+	if (errors)
+		printf("  %-20s %d requests failed or were short\n", name, errors);
+	[f release];
+}
+
+static void
+upload(const char *name, NSString *url, NSData *body, NSString *path,
+	   int requests, int size)
+{
+	NSRunLoop *rl = [NSRunLoop currentRunLoop];
+	NSMutableURLRequest *rq;
+	Fetcher *f = [Fetcher new];
+	int i, callbacks = 0, errors = 0;
+	double t;
+
+	rq = [NSMutableURLRequest requestWithURL: [NSURL URLWithString: url]];
+	[rq setHTTPMethod: @"POST"];
+	[rq setValue: @"application/octet-stream" forHTTPHeaderField: @"Content-Type"];
+
+	t = now();
+	for (i = 0; i < requests; i++)
+		{
+		NSAutoreleasePool *pool = [NSAutoreleasePool new];
+		NSURLConnection *c;
+
+		if (path)								// length unknown, chunked
+			[rq setHTTPBodyStream: [NSInputStream inputStreamWithFileAtPath:path]];
+		else
+			[rq setHTTPBody: body];
+		f->_done = f->_failed = NO;
+		f->_written = f->_callbacks = 0;
+		c = [[NSURLConnection alloc] initWithRequest: rq delegate: f];
+		while (!f->_done)
+			[rl runMode: NSDefaultRunLoopMode
+				beforeDate: [NSDate dateWithTimeIntervalSinceNow: 1.0]];
+		if (f->_failed || f->_written != size)
+			errors++;
+		callbacks += f->_callbacks;
+		[c release];
+		[pool release];
+		}
+	t = now() - t;
+
+	printf("  %-20s %10.1f MB/s  %8.1f progress callbacks/request\n", name,
+			(double)size * requests / t / 1000000.0, (double)callbacks / requests);
+	if (errors)
+		printf("  %-20s %d uploads failed or were short\n", name, errors);
+	[f release];
+}
+
+/* ****************************************************************************
+
+	Benchmark driver
+
+** ***************************************************************************/
+
+int
+main(int argc, char **argv)
+{
+	NSAutoreleasePool *arp;
+	int requests = (argc > 1) ? atoi(argv[1]) : 2000;
+	int size = (argc > 2) ? atoi(argv[2]) : 2048;
+	int usize = (argc > 3) ? atoi(argv[3]) : 4 << 20;
+	struct sockaddr_in sa;
+	socklen_t len = sizeof(sa);
+	NSString *url, *path;
+	NSMutableData *body;
+	int ld, status;
+	pid_t pid;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = inet_addr("127.0.0.1");
+	if ((ld = socket(AF_INET, SOCK_STREAM, 0)) < 0
+			|| bind(ld, (struct sockaddr *)&sa, sizeof(sa)) < 0
+			|| listen(ld, 128) < 0
+			|| getsockname(ld, (struct sockaddr *)&sa, &len) < 0)
+		{
+		perror("urlbench: listen");
+		exit (1);
+		}
+
+	if ((pid = fork()) == 0)
+		server(ld, size);
+	if (pid < 0)
+		{
+		perror("urlbench: fork");
+		exit (1);
+		}
+	close(ld);
+
+	arp = [NSAutoreleasePool new];
+	printf("urlbench: %d requests per test, %d byte bodies\n", requests, size);
+
+	url = [NSString stringWithFormat: @"http://127.0.0.1:%d/small",
+										ntohs(sa.sin_port)];
+	bench("connection: close", url, NO, requests, size);
+	bench("keep-alive", url, YES, requests, size);
+
+	url = [NSString stringWithFormat: @"http://127.0.0.1:%d/chunked",
+										ntohs(sa.sin_port)];
+	bench("keep-alive chunked", url, YES, requests, size);
+
+	printf("urlbench: %d byte uploads\n", usize);
+	body = [NSMutableData dataWithLength: usize];
+	memset([body mutableBytes], 'x', usize);
+	path = [NSString stringWithFormat: @"/tmp/urlbench.%d", getpid()];
+	[body writeToFile: path atomically: NO];
+	url = [NSString stringWithFormat: @"http://127.0.0.1:%d/small",
+										ntohs(sa.sin_port)];
+	upload("upload data", url, body, nil, MAX(requests / 20, 1), usize);
+	upload("upload stream", url, nil, path, MAX(requests / 20, 1), usize);
+	unlink([path cString]);
+
+	kill(pid, SIGTERM);
+	waitpid(pid, &status, 0);
+	[arp release];
+	printf("urlbench complete\n");
+
+	exit (0);
+}
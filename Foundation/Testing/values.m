@@ -3,6 +3,7 @@
 */
 
 #include <stdio.h>
+#include <string.h>
 
 #include <Foundation/NSValue.h>
 #include <Foundation/NSException.h>
@@ -148,6 +149,25 @@ int main()
 	printf("Bool cache test 4 %s\n", ([c boolValue] == 1) ? "PASS" : "FAIL");
 	}
 
+	{
+	NSNumber *a = [NSNumber numberWithInt:42];
+	NSNumber *b = [[NSNumber alloc] initWithInt:42];
+	NSNumber *c = [NSNumber numberWithLong:42];
+	NSNumber *d = [NSNumber numberWithUnsignedChar:200];
+	NSNumber *e = [NSNumber numberWithShort:-16];
+
+	printf("Small int cache test 1 %s\n", (a == b) ? "PASS" : "FAIL");
+	printf("Small int cache test 2 %s\n", (a != c
+			&& strcmp([c objCType], @encode(long)) == 0) ? "PASS" : "FAIL");
+	printf("Small int cache test 3 %s\n", ([d intValue] == 200
+			&& [d unsignedCharValue] == 200) ? "PASS" : "FAIL");
+	printf("Small int cache test 4 %s\n", ([e intValue] == -16
+			&& [e longLongValue] == -16) ? "PASS" : "FAIL");
+	printf("Small int cache test 5 %s\n", ([NSNumber numberWithInt:100000]
+			!= [NSNumber numberWithInt:100000]) ? "PASS" : "FAIL");
+	[b release];
+	}
+
 	[arp release];
 	printf("values test complete\n");
 	exit(0);